@@ -21,6 +21,8 @@
 #include "per/adc.h"
 #include "per/uart.h"
 #include "hid/midi.h"
+#include "hid/midi_router.h"
+#include "hid/midi_ump.h"
 #include "hid/encoder.h"
 #include "hid/switch.h"
 #include "hid/switch3.h"
@@ -39,6 +41,8 @@
 #include "hid/disp/oled_display.h"
 #include "hid/disp/graphics_common.h"
 #include "hid/wavplayer.h"
+#include "hid/wav_streamer.h"
+#include "hid/wav_catalog.h"
 #include "hid/led.h"
 #include "hid/rgb_led.h"
 #include "dev/sr_595.h"
@@ -61,14 +65,23 @@
 #include "ui/AbstractMenu.h"
 #include "ui/FullScreenItemMenu.h"
 #include "util/scopedirqblocker.h"
+#include "util/AudioGraph.h"
 #include "util/CpuLoadMeter.h"
+#include "util/AudioCallbackMonitor.h"
+#include "util/AudioEventQueue.h"
 #include "util/FIFO.h"
 #include "util/FixedCapStr.h"
 #include "util/MappedValue.h"
 #include "util/PersistentStorage.h"
+#include "util/Profiler.h"
+#include "util/Resampler.h"
+#include "util/SpscQueue.h"
 #include "util/Stack.h"
+#include "util/TripleBuffer.h"
 #include "util/VoctCalibration.h"
+#include "util/VoiceAllocator.h"
 #include "util/WaveTableLoader.h"
 #include "util/WavWriter.h"
+#include "util/WavRecorder.h"
 #endif
 #endif
@@ -1,5 +1,8 @@
-// TODO: make this adjustable
-#define SYSEX_BUFFER_LEN 128
+#pragma once
+#ifndef DSY_MIDI_EVENT_H
+#define DSY_MIDI_EVENT_H
+
+#include "hid/midi_sysex.h"
 
 namespace daisy
 {
@@ -17,7 +20,7 @@ namespace daisy
 /** Parsed from the Status Byte, these are the common Midi Messages that can be handled. \n
 At this time only 3-byte messages are correctly parsed into MidiEvents.
 */
-enum MidiMessageType
+enum MidiMessageType : uint8_t
 {
     NoteOff,               /**< & */
     NoteOn,                /**< & */
@@ -32,7 +35,7 @@ enum MidiMessageType
     MessageLast,           /**< & */
 };
 
-enum SystemCommonType
+enum SystemCommonType : uint8_t
 {
     SystemExclusive,     /**< & */
     MTCQuarterFrame,     /**< & */
@@ -45,7 +48,7 @@ enum SystemCommonType
     SystemCommonLast,    /**< & */
 };
 
-enum SystemRealTimeType
+enum SystemRealTimeType : uint8_t
 {
     TimingClock,        /**< & */
     SRTUndefined0,      /**< & */
@@ -58,7 +61,7 @@ enum SystemRealTimeType
     SystemRealTimeLast, /**< & */
 };
 
-enum ChannelModeType
+enum ChannelModeType : uint8_t
 {
     AllSoundOff,         /**< & */
     ResetAllControllers, /**< & */
@@ -142,13 +145,15 @@ struct ChannelModeEvent
     ChannelModeType event_type; /**< & */
     int16_t         value;      /**< & */
 };
-/** Struct containing sysex data.
-Can be made from MidiEvent
+/** Struct containing sysex data, or part of it for long messages.
+Can be made from MidiEvent and the MidiSysExArena that holds the data
 */
 struct SystemExclusiveEvent
 {
-    int     length;
-    uint8_t data[SYSEX_BUFFER_LEN]; /**< & */
+    int            length; /**< & */
+    const uint8_t* data;   /**< nullptr if the data was lost */
+    bool           begin;  /**< first part of the message */
+    bool           end;    /**< last part of the message */
 };
 /** Struct containing QuarterFrame data.
 Can be made from MidiEvent
@@ -235,18 +240,19 @@ struct PolyModeOnEvent
 
 
 /** Simple MidiEvent with message type, channel, and data[2] members.
+The data of SysEx messages is stored in a MidiSysExArena, the event only
+holds a handle to it. This keeps the event at 8 bytes.
 */
 struct MidiEvent
 {
     // Newer ish.
-    MidiMessageType    type;                         /**< & */
-    int                channel;                      /**< & */
-    uint8_t            data[2];                      /**< & */
-    uint8_t            sysex_data[SYSEX_BUFFER_LEN]; /**< & */
-    uint8_t            sysex_message_len;
-    SystemCommonType   sc_type;
-    SystemRealTimeType srt_type;
-    ChannelModeType    cm_type;
+    MidiMessageType    type;        /**< & */
+    uint8_t            channel;     /**< & */
+    uint8_t            data[2];     /**< & */
+    SystemCommonType   sc_type;     /**< & */
+    SystemRealTimeType srt_type;    /**< & */
+    ChannelModeType    cm_type;     /**< & */
+    uint8_t            sysex_chunk; /**< handle in the MidiSysExArena */
 
     /** Returns the data within the MidiEvent as a NoteOffEvent struct */
     NoteOffEvent AsNoteOff()
@@ -326,17 +332,20 @@ struct MidiEvent
         return m;
     }
 
-    SystemExclusiveEvent AsSystemExclusive()
+    /** Returns the data within the MidiEvent as a SystemExclusiveEvent
+     *  struct. The data stays valid until the chunk is released.
+     *  \param arena the arena the parser stored the data in
+     */
+    SystemExclusiveEvent AsSystemExclusive(const MidiSysExArena& arena) const
     {
-        SystemExclusiveEvent m;
-        m.length = sysex_message_len;
-        for(int i = 0; i < SYSEX_BUFFER_LEN; i++)
+        SystemExclusiveEvent         m     = {0, nullptr, false, true};
+        const MidiSysExArena::Chunk* chunk = arena.Get(sysex_chunk);
+        if(chunk != nullptr)
         {
-            m.data[i] = 0;
-            if(i < m.length)
-            {
-                m.data[i] = sysex_data[i];
-            }
+            m.length = chunk->size;
+            m.data   = chunk->data;
+            m.begin  = chunk->flags & MidiSysExArena::FLAG_BEGIN;
+            m.end    = chunk->flags & MidiSysExArena::FLAG_END;
         }
         return m;
     }
@@ -413,7 +422,11 @@ struct MidiEvent
     }
 };
 
+static_assert(sizeof(MidiEvent) <= 8, "MidiEvent should stay small");
+
 /** @} */ // End midi_events
 
 /** @} */ // End midi
 } //namespace daisy
+
+#endif
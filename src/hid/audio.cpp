@@ -1,4 +1,6 @@
 #include "hid/audio.h"
+#include "hid/audio_convert.h"
+#include "sys/system.h"
 
 namespace daisy
 {
@@ -11,16 +13,28 @@ namespace daisy
 // these buffers will always be present, and usable.
 //
 static const size_t kAudioMaxBufferSize = 1024;
-static const size_t kAudioMaxChannels   = 4;
+static const size_t kAudioMaxSai        = 2;
+static const size_t kAudioMaxSlots      = 16;
+static const size_t kAudioMaxChannels   = kAudioMaxSai * kAudioMaxSlots;
 
 // Static Global Buffers
 // 8kB in SRAM1, non-cached memory
 // 1k samples in, 1k samples out, 4 bytes per sample.
-// One buffer per 2 channels (Interleaved on hardware)
+// One buffer per SAI, holding all slots interleaved (as on hardware).
+// The more slots per frame, the smaller the maximum block size.
 static int32_t DMA_BUFFER_MEM_SECTION
-    dsy_audio_rx_buffer[kAudioMaxChannels / 2][kAudioMaxBufferSize];
+    dsy_audio_rx_buffer[kAudioMaxSai][kAudioMaxBufferSize];
 static int32_t DMA_BUFFER_MEM_SECTION
-    dsy_audio_tx_buffer[kAudioMaxChannels / 2][kAudioMaxBufferSize];
+    dsy_audio_tx_buffer[kAudioMaxSai][kAudioMaxBufferSize];
+
+// Float buffers handed to the float callbacks.
+// 8kB in regular memory, one half of a DMA buffer per SAI. Each channel
+// gets one block of these.
+// These are reused for every block instead of being placed on the stack
+// of the audio interrupt, and are aligned to the 32 byte cache lines.
+static const size_t kAudioMaxFloatSize = kAudioMaxSai * kAudioMaxBufferSize / 2;
+alignas(32) static float dsy_audio_float_in[kAudioMaxFloatSize];
+alignas(32) static float dsy_audio_float_out[kAudioMaxFloatSize];
 
 // ================================================================
 // Private Implementation Definition
@@ -35,24 +49,44 @@ class AudioHandle::Impl
     AudioHandle::Result DeInit();
     AudioHandle::Result Start(AudioHandle::AudioCallback callback);
     AudioHandle::Result Start(AudioHandle::InterleavingAudioCallback callback);
+    AudioHandle::Result Start(AudioHandle::NativeAudioCallback callback);
     AudioHandle::Result Stop();
     AudioHandle::Result ChangeCallback(AudioHandle::AudioCallback callback);
     AudioHandle::Result
     ChangeCallback(AudioHandle::InterleavingAudioCallback callback);
+    AudioHandle::Result ChangeCallback(AudioHandle::NativeAudioCallback callback);
 
     inline size_t GetChannels() const
     {
         if(sai1_.IsInitialized() && sai2_.IsInitialized())
-            return 4;
+            return 2 * GetSlots();
         else if(sai1_.IsInitialized() || sai2_.IsInitialized())
-            return 2;
+            return GetSlots();
         else
             return 0;
     }
 
+    /** Number of channels on each SAI, 2 for I2S, more for TDM */
+    inline size_t GetSlots() const
+    {
+        return sai1_.IsInitialized() ? sai1_.GetConfig().GetNumSlots() : 2;
+    }
+
+    /** Number of samples in the DMA buffer of each SAI */
+    inline size_t GetDmaBufferSize() const
+    {
+        return config_.blocksize * GetSlots() * 2;
+    }
+
+    /** Largest block size for which both halves of the DMA buffer fit */
+    inline size_t GetMaxBlockSize() const
+    {
+        return kAudioMaxBufferSize / 2 / GetSlots();
+    }
+
     AudioHandle::Result SetBlockSize(size_t size)
     {
-        size_t maxSize    = kAudioMaxBufferSize / 4;
+        size_t maxSize    = GetMaxBlockSize();
         config_.blocksize = size <= maxSize ? size : maxSize;
         return size <= maxSize ? AudioHandle::Result::OK
                                : AudioHandle::Result::ERR;
@@ -82,18 +116,66 @@ class AudioHandle::Impl
 
     AudioHandle::Result SetSampleRate(SaiHandle::Config::SampleRate sampelrate);
 
+    /** Picks the conversion kernels matching the current bit depth and
+     ** channel count. Called whenever the callback changes, so that the
+     ** audio interrupt doesn't have to check the format per sample.
+     */
+    void SelectKernels()
+    {
+        kernels_ = GetAudioConversionKernels(
+            sai1_.GetConfig().bit_depth, GetChannels(), GetSlots());
+    }
+
     // Internal Callback
     static void InternalCallback(int32_t* in, int32_t* out, size_t size);
 
-    void *callback_, *interleaved_callback_;
+    /** (Re)starts the callback timing measurements and the sample clock */
+    void InitMonitor()
+    {
+        monitor_.Init(GetSampleRate(), config_.blocksize);
+        InitSampleClock();
+    }
+
+    /** Restarts the sample clock at 0 */
+    void InitSampleClock()
+    {
+        const uint32_t tick_freq = System::GetTickFreq();
+        samples_per_tick_
+            = tick_freq > 0 ? GetSampleRate() / float(tick_freq) : 0.f;
+        sample_clock_      = 0;
+        next_sample_clock_ = 0;
+        block_start_tick_  = System::GetTick();
+    }
+
+    uint32_t GetSampleTime() const
+    {
+        // retry if the callback started while reading
+        uint32_t clock, tick;
+        do
+        {
+            clock = sample_clock_;
+            tick  = block_start_tick_;
+        } while(clock != sample_clock_);
+        return clock + uint32_t((System::GetTick() - tick) * samples_per_tick_);
+    }
+
+    void *callback_, *interleaved_callback_, *native_callback_;
 
     // Data
-    AudioHandle::Config config_;
-    SaiHandle           sai1_, sai2_;
-    int32_t*            buff_rx_[2];
-    int32_t*            buff_tx_[2];
-    float               postgain_recip_;
-    float               output_adjust_;
+    AudioHandle::Config    config_;
+    SaiHandle              sai1_, sai2_;
+    int32_t*               buff_rx_[2];
+    int32_t*               buff_tx_[2];
+    float                  postgain_recip_;
+    float                  output_adjust_;
+    AudioConversionKernels kernels_;
+    AudioCallbackMonitor   monitor_;
+
+    // Sample clock at the start of the current block, and of the next one
+    volatile uint32_t sample_clock_;
+    uint32_t          next_sample_clock_;
+    volatile uint32_t block_start_tick_;
+    float             samples_per_tick_;
 };
 
 // ================================================================
@@ -110,6 +192,8 @@ AudioHandle::Result AudioHandle::Impl::Init(const AudioHandle::Config config,
                                             SaiHandle                 sai)
 {
     config_ = config;
+    // Forget the second SAI of a previous 4 channel configuration
+    sai2_ = SaiHandle();
 
     /** Precompute input level adjustment */
     if(config_.postgain > 0.f)
@@ -129,6 +213,8 @@ AudioHandle::Result AudioHandle::Impl::Init(const AudioHandle::Config config,
     {
         return Result::ERR;
     }
+    if(config_.blocksize > GetMaxBlockSize())
+        return Result::ERR;
     buff_rx_[0] = dsy_audio_rx_buffer[0];
     buff_tx_[0] = dsy_audio_tx_buffer[0];
     return Result::OK;
@@ -138,7 +224,12 @@ AudioHandle::Result AudioHandle::Impl::Init(const AudioHandle::Config config,
                                             SaiHandle                 sai1,
                                             SaiHandle                 sai2)
 {
-    this->Init(config, sai1);
+    const AudioHandle::Result res = this->Init(config, sai1);
+    if(res != Result::OK)
+        return res;
+    // Both SAIs must use the same frame layout
+    if(sai2.IsInitialized() && sai2.GetConfig().GetNumSlots() != GetSlots())
+        return Result::ERR;
     sai2_       = sai2;
     buff_rx_[1] = dsy_audio_rx_buffer[1];
     buff_tx_[1] = dsy_audio_tx_buffer[1];
@@ -169,32 +260,59 @@ AudioHandle::Result AudioHandle::Impl::DeInit()
 AudioHandle::Result
 AudioHandle::Impl::Start(AudioHandle::AudioCallback callback)
 {
+    SelectKernels();
+    InitMonitor();
     // Get instance of object
     if(sai2_.IsInitialized())
     {
         // Start stream with no callback. Data will be filled externally.
         sai2_.StartDma(
-            buff_rx_[1], buff_tx_[1], config_.blocksize * 2 * 2, nullptr);
+            buff_rx_[1], buff_tx_[1], GetDmaBufferSize(), nullptr);
     }
     sai1_.StartDma(buff_rx_[0],
                    buff_tx_[0],
-                   config_.blocksize * 2 * 2,
+                   GetDmaBufferSize(),
                    audio_handle.InternalCallback);
     callback_             = (void*)callback;
     interleaved_callback_ = nullptr;
+    native_callback_      = nullptr;
     return Result::OK;
 }
 
 AudioHandle::Result
 AudioHandle::Impl::Start(AudioHandle::InterleavingAudioCallback callback)
 {
+    SelectKernels();
+    InitMonitor();
     // Get instance of object
     sai1_.StartDma(buff_rx_[0],
                    buff_tx_[0],
-                   config_.blocksize * 2 * 2,
+                   GetDmaBufferSize(),
                    audio_handle.InternalCallback);
     interleaved_callback_ = (void*)callback;
     callback_             = nullptr;
+    native_callback_      = nullptr;
+    return Result::OK;
+}
+
+AudioHandle::Result
+AudioHandle::Impl::Start(AudioHandle::NativeAudioCallback callback)
+{
+    SelectKernels();
+    InitMonitor();
+    if(sai2_.IsInitialized())
+    {
+        // Start stream with no callback. Data will be filled externally.
+        sai2_.StartDma(
+            buff_rx_[1], buff_tx_[1], GetDmaBufferSize(), nullptr);
+    }
+    sai1_.StartDma(buff_rx_[0],
+                   buff_tx_[0],
+                   GetDmaBufferSize(),
+                   audio_handle.InternalCallback);
+    native_callback_      = (void*)callback;
+    callback_             = nullptr;
+    interleaved_callback_ = nullptr;
     return Result::OK;
 }
 
@@ -212,8 +330,10 @@ AudioHandle::Impl::ChangeCallback(AudioHandle::AudioCallback callback)
 {
     if(callback != nullptr)
     {
+        SelectKernels();
         callback_             = (void*)callback;
         interleaved_callback_ = nullptr;
+        native_callback_      = nullptr;
         return Result::OK;
     }
     else
@@ -227,8 +347,27 @@ AudioHandle::Result AudioHandle::Impl::ChangeCallback(
 {
     if(callback != nullptr)
     {
+        SelectKernels();
         interleaved_callback_ = (void*)callback;
         callback_             = nullptr;
+        native_callback_      = nullptr;
+        return Result::OK;
+    }
+    else
+    {
+        return Result::ERR;
+    }
+}
+
+AudioHandle::Result
+AudioHandle::Impl::ChangeCallback(AudioHandle::NativeAudioCallback callback)
+{
+    if(callback != nullptr)
+    {
+        SelectKernels();
+        native_callback_      = (void*)callback;
+        callback_             = nullptr;
+        interleaved_callback_ = nullptr;
         return Result::OK;
     }
     else
@@ -266,219 +405,74 @@ AudioHandle::Impl::SetSampleRate(SaiHandle::Config::SampleRate samplerate)
     return Result::OK;
 }
 
-// This turned into a very large function due to the bit-depth conversions..
-// I didn't want to do a conditional conversion in a single loop because it seemed
-// far less efficient, so this is where I landed.
-//
-// Using function pointers for the x2f and f2x functions would have been ideal, but
-// wasn't possible due to the different parameter/return types for each function.
+// The sample format conversion is done by the kernels selected in
+// SelectKernels(), which are specialized for the bit depth and channel count.
 void AudioHandle::Impl::InternalCallback(int32_t* in, int32_t* out, size_t size)
 {
     // Convert from sai format to float, and call user callback
-    size_t                      chns;
-    SaiHandle::Config::BitDepth bd;
-    bd   = audio_handle.sai1_.GetConfig().bit_depth;
-    chns = audio_handle.GetChannels();
+    const AudioConversionKernels& kernels = audio_handle.kernels_;
+    const size_t                  chns    = kernels.channels;
     if(chns == 0)
         return;
-    // Handle Interleaved / Non Interleaved separate
+    const size_t frames = size / kernels.slots;
+    audio_handle.monitor_.OnCallbackStart();
+    audio_handle.block_start_tick_ = System::GetTick();
+    audio_handle.sample_clock_     = audio_handle.next_sample_clock_;
+    audio_handle.next_sample_clock_ += frames;
+    // offset needed for 2nd audio codec.
+    const bool   has_sai2 = chns > kernels.slots;
+    const size_t offset   = has_sai2 ? audio_handle.sai2_.GetOffset() : 0;
+    // Handle Interleaved / Non Interleaved / Native separate
     if(audio_handle.interleaved_callback_)
     {
         InterleavingAudioCallback cb
             = (InterleavingAudioCallback)audio_handle.interleaved_callback_;
-        float fin[size];
-        float fout[size];
-        // There _must_ be a more elegant way to do this....
-        // Convert from int to float
-        switch(bd)
-        {
-            case SaiHandle::Config::BitDepth::SAI_16BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[i] = s162f(in[i]) * audio_handle.postgain_recip_;
-                    fin[i + 1]
-                        = s162f(in[i + 1]) * audio_handle.postgain_recip_;
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_24BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[i] = s242f(in[i]) * audio_handle.postgain_recip_;
-                    fin[i + 1]
-                        = s242f(in[i + 1]) * audio_handle.postgain_recip_;
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_32BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[i] = s322f(in[i]) * audio_handle.postgain_recip_;
-                    fin[i + 1]
-                        = s322f(in[i + 1]) * audio_handle.postgain_recip_;
-                }
-                break;
-            default: break;
-        }
+        float* fin  = dsy_audio_float_in;
+        float* fout = dsy_audio_float_out;
+        kernels.to_float(in, fin, size, audio_handle.postgain_recip_);
         cb(fin, fout, size);
-        switch(bd)
-        {
-            case SaiHandle::Config::BitDepth::SAI_16BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i] = f2s16(fout[i] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s16(fout[i + 1] * audio_handle.output_adjust_);
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_24BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i] = f2s24(fout[i] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s24(fout[i + 1] * audio_handle.output_adjust_);
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_32BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i] = f2s32(fout[i] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s32(fout[i + 1] * audio_handle.output_adjust_);
-                }
-                break;
-            default: break;
-        }
+        kernels.from_float(fout, out, size, audio_handle.output_adjust_);
     }
     else if(audio_handle.callback_)
     {
         AudioCallback cb = (AudioCallback)audio_handle.callback_;
-        // offset needed for 2nd audio codec.
-        size_t offset    = audio_handle.sai2_.GetOffset();
-        size_t buff_size = chns > 2 ? size * 2 : size;
-        float  finbuff[buff_size], foutbuff[buff_size];
-        float* fin[chns];
-        float* fout[chns];
-        fin[0]  = finbuff;
-        fin[1]  = finbuff + (buff_size / chns);
-        fout[0] = foutbuff;
-        fout[1] = foutbuff + (buff_size / chns);
-        if(chns > 2)
+        float*        fin[kAudioMaxChannels];
+        float*        fout[kAudioMaxChannels];
+        // Callbacks written for 4 channels keep working with 2 channels
+        const size_t num_ptrs = chns > 4 ? chns : 4;
+        for(size_t i = 0; i < num_ptrs; i++)
         {
-            fin[2]  = fin[1] + (buff_size / chns);
-            fin[3]  = fin[2] + (buff_size / chns);
-            fout[2] = fout[1] + (buff_size / chns);
-            fout[3] = fout[2] + (buff_size / chns);
+            fin[i]  = dsy_audio_float_in + i * frames;
+            fout[i] = dsy_audio_float_out + i * frames;
         }
-        // Deinterleave and scale
-        switch(bd)
+        const int32_t* rx[kAudioMaxSai] = {in, nullptr};
+        int32_t*       tx[kAudioMaxSai] = {out, nullptr};
+        if(has_sai2)
         {
-            case SaiHandle::Config::BitDepth::SAI_16BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[0][i / 2] = s162f(in[i]) * audio_handle.postgain_recip_;
-                    fin[1][i / 2]
-                        = s162f(in[i + 1]) * audio_handle.postgain_recip_;
-                    if(chns > 2)
-                    {
-                        fin[2][i / 2]
-                            = s162f(audio_handle.buff_rx_[1][offset + i])
-                              * audio_handle.postgain_recip_;
-                        fin[3][i / 2]
-                            = s162f(audio_handle.buff_rx_[1][offset + i + 1])
-                              * audio_handle.postgain_recip_;
-                    }
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_24BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[0][i / 2] = s242f(in[i]) * audio_handle.postgain_recip_;
-                    fin[1][i / 2]
-                        = s242f(in[i + 1]) * audio_handle.postgain_recip_;
-                    if(chns > 2)
-                    {
-                        fin[2][i / 2]
-                            = s242f(audio_handle.buff_rx_[1][offset + i])
-                              * audio_handle.postgain_recip_;
-                        fin[3][i / 2]
-                            = s242f(audio_handle.buff_rx_[1][offset + i + 1])
-                              * audio_handle.postgain_recip_;
-                    }
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_32BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    fin[0][i / 2] = s322f(in[i]) * audio_handle.postgain_recip_;
-                    fin[1][i / 2]
-                        = s322f(in[i + 1]) * audio_handle.postgain_recip_;
-                    if(chns > 2)
-                    {
-                        fin[2][i / 2]
-                            = s322f(audio_handle.buff_rx_[1][offset + i])
-                              * audio_handle.postgain_recip_;
-                        fin[3][i / 2]
-                            = s322f(audio_handle.buff_rx_[1][offset + i + 1])
-                              * audio_handle.postgain_recip_;
-                    }
-                }
-                break;
-            default: break;
+            rx[1] = audio_handle.buff_rx_[1] + offset;
+            tx[1] = audio_handle.buff_tx_[1] + offset;
         }
-        cb(fin, fout, size / 2);
+        // Deinterleave and scale
+        kernels.deinterleave(rx, fin, frames, audio_handle.postgain_recip_);
+        cb(fin, fout, frames);
         // Reinterleave and scale
-        switch(bd)
+        kernels.interleave(fout, tx, frames, audio_handle.output_adjust_);
+    }
+    else if(audio_handle.native_callback_)
+    {
+        NativeAudioCallback cb
+            = (NativeAudioCallback)audio_handle.native_callback_;
+        // Hand out the DMA buffer halves directly
+        const int32_t* rx[kAudioMaxSai] = {in, nullptr};
+        int32_t*       tx[kAudioMaxSai] = {out, nullptr};
+        if(has_sai2)
         {
-            case SaiHandle::Config::BitDepth::SAI_16BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i]
-                        = f2s16(fout[0][i / 2] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s16(fout[1][i / 2] * audio_handle.output_adjust_);
-                    if(chns > 2)
-                    {
-                        audio_handle.buff_tx_[1][offset + i] = f2s16(
-                            fout[2][i / 2] * audio_handle.output_adjust_);
-                        audio_handle.buff_tx_[1][offset + i + 1] = f2s16(
-                            fout[3][i / 2] * audio_handle.output_adjust_);
-                    }
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_24BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i]
-                        = f2s24(fout[0][i / 2] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s24(fout[1][i / 2] * audio_handle.output_adjust_);
-                    if(chns > 2)
-                    {
-                        audio_handle.buff_tx_[1][offset + i] = f2s24(
-                            fout[2][i / 2] * audio_handle.output_adjust_);
-                        audio_handle.buff_tx_[1][offset + i + 1] = f2s24(
-                            fout[3][i / 2] * audio_handle.output_adjust_);
-                    }
-                }
-                break;
-            case SaiHandle::Config::BitDepth::SAI_32BIT:
-                for(size_t i = 0; i < size; i += 2)
-                {
-                    out[i]
-                        = f2s32(fout[0][i / 2] * audio_handle.output_adjust_);
-                    out[i + 1]
-                        = f2s32(fout[1][i / 2] * audio_handle.output_adjust_);
-                    if(chns > 2)
-                    {
-                        audio_handle.buff_tx_[1][offset + i] = f2s32(
-                            fout[2][i / 2] * audio_handle.output_adjust_);
-                        audio_handle.buff_tx_[1][offset + i + 1] = f2s32(
-                            fout[3][i / 2] * audio_handle.output_adjust_);
-                    }
-                }
-                break;
-            default: break;
+            rx[1] = audio_handle.buff_rx_[1] + offset;
+            tx[1] = audio_handle.buff_tx_[1] + offset;
         }
+        cb(rx, tx, frames);
     }
+    audio_handle.monitor_.OnCallbackEnd();
 }
 
 // ================================================================
@@ -541,6 +535,11 @@ AudioHandle::Result AudioHandle::Start(InterleavingAudioCallback callback)
     return pimpl_->Start(callback);
 }
 
+AudioHandle::Result AudioHandle::Start(NativeAudioCallback callback)
+{
+    return pimpl_->Start(callback);
+}
+
 AudioHandle::Result AudioHandle::Stop()
 {
     return pimpl_->Stop();
@@ -557,6 +556,26 @@ AudioHandle::ChangeCallback(InterleavingAudioCallback callback)
     return pimpl_->ChangeCallback(callback);
 }
 
+AudioHandle::Result AudioHandle::ChangeCallback(NativeAudioCallback callback)
+{
+    return pimpl_->ChangeCallback(callback);
+}
+
+AudioCallbackMonitor& AudioHandle::GetCallbackMonitor()
+{
+    return pimpl_->monitor_;
+}
+
+uint32_t AudioHandle::GetSampleClock() const
+{
+    return pimpl_->sample_clock_;
+}
+
+uint32_t AudioHandle::GetSampleTime() const
+{
+    return pimpl_->GetSampleTime();
+}
+
 AudioHandle::Result AudioHandle::SetPostGain(float val)
 {
     return pimpl_->SetPostGain(val);
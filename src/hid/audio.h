@@ -2,6 +2,7 @@
 #define DSY_AUDIO_H /**< & */
 
 #include "per/sai.h"
+#include "util/AudioCallbackMonitor.h"
 
 namespace daisy
 {
@@ -92,16 +93,45 @@ class AudioHandle
                                               InterleavingOutputBuffer out,
                                               size_t                   size);
 
+    /** Native input buffers
+     ** One stream per SAI, each holding the raw samples of all its slots
+     ** interleaved, e.g. { L0, R0, L1, R1, . . . LN, RN } for I2S, in the
+     ** format configured for the SAI (e.g. right-justified 24-bit).
+     ** const so that the user can't modify the input
+     */
+    typedef const int32_t* const* NativeInputBuffer;
+
+    /** Native output buffers
+     ** Laid out the same way as the NativeInputBuffer
+     */
+    typedef int32_t* const* NativeOutputBuffer;
+
+    /** Native Audio Callback
+     ** The buffers point directly into the halves of the DMA buffers, so no
+     ** conversion or copying takes place, and the postgain and output
+     ** compensation are not applied. size is the number of frames, each
+     ** stream contains size * slots samples (2 slots for I2S).
+     */
+    typedef void (*NativeAudioCallback)(NativeInputBuffer  in,
+                                        NativeOutputBuffer out,
+                                        size_t             size);
+
     AudioHandle() : pimpl_(nullptr) {}
     ~AudioHandle() {}
 
     AudioHandle(const AudioHandle& other) = default;
     AudioHandle& operator=(const AudioHandle& other) = default;
 
-    /** Initializes audio to run using a single SAI configured in Stereo I2S mode. */
+    /** Initializes audio to run using a single SAI configured in Stereo I2S
+     ** or TDM mode.
+     ** The maximum block size is 256 for I2S, and halves with each doubling
+     ** of the TDM slots (32 for TDM_16).
+     */
     Result Init(const Config& config, SaiHandle sai);
 
-    /** Initializes audio to run using two SAI, each configured in Stereo I2S mode. */
+    /** Initializes audio to run using two SAI, each configured in Stereo I2S
+     ** mode, or both in the same TDM mode.
+     */
     Result Init(const Config& config, SaiHandle sai1, SaiHandle sai2);
 
     /** Stops and deinitializes audio. */
@@ -112,10 +142,10 @@ class AudioHandle
 
     /** Returns the number of channels of audio.  
      **
-     ** When using a single SAI this returns 2, when using two SAI it returns 4
+     ** This is the number of slots per frame of the SAI (2 for I2S, or 4, 8
+     ** or 16 for TDM), times the number of SAIs. Channels of the first SAI
+     ** come first.
      ** If no SAI is initialized this returns 0
-     **
-     ** Eventually when we add non-standard I2S for each SAI this will be work differently
      */
     size_t GetChannels() const;
 
@@ -144,14 +174,25 @@ class AudioHandle
      ** Then calculate val as: val = 1 / (vout / vin); */
     Result SetOutputCompensation(float val);
 
-    /** Starts the Audio using the non-interleaving callback. */
+    /** Starts the Audio using the non-interleaving callback. 
+     ** The buffers passed to the callback are taken from a static pool and
+     ** are the same for every callback, so no stack space is used for them.
+     */
     Result Start(AudioCallback callback);
 
     /** Starts the Audio using the interleaving callback. 
-     ** For now only two channels are supported via this method. 
+     ** Only the channels of the first SAI are supported via this method,
+     ** i.e. two channels for I2S, or all slots for TDM. 
+     ** The buffers passed to the callback are taken from a static pool and
+     ** are the same for every callback, so no stack space is used for them.
      */
     Result Start(InterleavingAudioCallback callback);
 
+    /** Starts the Audio using the native callback, which operates directly
+     ** on the DMA buffers without any conversion to float.
+     */
+    Result Start(NativeAudioCallback callback);
+
     /** Stop the Audio*/
     Result Stop();
 
@@ -161,6 +202,28 @@ class AudioHandle
     /** Immediatley changes the audio callback to the interleaving callback passed in. */
     Result ChangeCallback(InterleavingAudioCallback callback);
 
+    /** Immediatley changes the audio callback to the native callback passed in. */
+    Result ChangeCallback(NativeAudioCallback callback);
+
+    /** Returns the timing statistics of the audio callback.
+     ** These are restarted with each call to Start().
+     ** For dropouts detected by the DMA itself, see SaiHandle::GetNumDmaOverruns()
+     */
+    AudioCallbackMonitor& GetCallbackMonitor();
+
+    /** Returns the sample clock: the number of frames since Start() up to
+     ** the first frame of the most recent block. Within the audio callback,
+     ** this is the time of the first frame of the block being processed.
+     ** Wraps around after 2^32 frames.
+     */
+    uint32_t GetSampleClock() const;
+
+    /** Returns the current time on the sample clock, interpolated between
+     ** callbacks with the system tick. Use this to timestamp events when
+     ** they are captured, see AudioEventQueue. Safe to call from interrupts.
+     */
+    uint32_t GetSampleTime() const;
+
 
     class Impl;
 
@@ -0,0 +1,288 @@
+#pragma once
+#ifndef DSY_AUDIO_CONVERT_H
+#define DSY_AUDIO_CONVERT_H
+
+#include "per/sai.h"
+
+namespace daisy
+{
+/** @brief Sample format conversion kernels used by the AudioHandle
+ *  @ingroup audio
+ *  @details The SAI delivers samples as interleaved int32_t words,
+ *           one stream per SAI data line, with two channels per frame for
+ *           I2S or more for TDM. These kernels convert between
+ *           that layout and the float buffers handed to the audio callback.
+ *
+ *           Each kernel is specialized at compile time for one bit depth
+ *           and channel count, so the per-sample loops contain no branches.
+ *           The matching set of kernels is looked up once via
+ *           GetAudioConversionKernels() and stored, rather than switching
+ *           on the format inside the audio interrupt.
+ *
+ *           The results are identical to the s162f/s242f/s322f and
+ *           f2s16/f2s24/f2s32 helpers in daisy_core.h.
+ */
+
+/** Signed 16-bit samples, right justified in a 32-bit word */
+struct AudioFormatS16
+{
+    /** Number of valid bits in the sample */
+    static constexpr int kBits = 16;
+
+    /** Sign-corrected integer value of a raw sample */
+    static FORCE_INLINE int32_t Decode(int32_t x) { return (int16_t)x; }
+
+    /** Converts a float that already includes gain to a raw sample */
+    static FORCE_INLINE int32_t Encode(float x) { return f2s16(x); }
+};
+
+/** Signed 24-bit samples, right justified in a 32-bit word */
+struct AudioFormatS24
+{
+    /** Number of valid bits in the sample */
+    static constexpr int kBits = 24;
+
+    /** Sign-corrected integer value of a raw sample */
+    static FORCE_INLINE int32_t Decode(int32_t x)
+    {
+        return (x ^ S24SIGN) - S24SIGN;
+    }
+
+    /** Converts a float that already includes gain to a raw sample */
+    static FORCE_INLINE int32_t Encode(float x) { return f2s24(x); }
+};
+
+/** Signed 32-bit samples */
+struct AudioFormatS32
+{
+    /** Number of valid bits in the sample */
+    static constexpr int kBits = 32;
+
+    /** Sign-corrected integer value of a raw sample */
+    static FORCE_INLINE int32_t Decode(int32_t x) { return x; }
+
+    /** Converts a float that already includes gain to a raw sample */
+    static FORCE_INLINE int32_t Encode(float x) { return f2s32(x); }
+};
+
+/** Converts a single raw sample to a float in the range -1..1,
+ *  and applies gain.
+ *
+ *  On the Cortex-M7 the sample is shifted to the top of the word and converted
+ *  with a single fixed-point VCVT, which does the int -> float conversion and
+ *  the scaling in one instruction. Since all scale factors are powers of two
+ *  the result is bit-identical to the portable version.
+ */
+template <typename Format>
+FORCE_INLINE float AudioSampleToFloat(int32_t x, float gain)
+{
+#if !defined(UNIT_TEST) && defined(__ARM_FP)
+    const uint32_t bits = (uint32_t)x << (32 - Format::kBits);
+    float          f;
+    asm("vmov %0, %1\n\tvcvt.f32.s32 %0, %0, #31" : "=t"(f) : "r"(bits));
+    return f * gain;
+#else
+    // scale * gain is exact, as the scale is a power of two.
+    return (float)Format::Decode(x)
+           * (gain * (1.f / (float)(1UL << (Format::kBits - 1))));
+#endif
+}
+
+/** Converts an interleaved stream of raw samples to floats, keeping the
+ *  interleaving.
+ *  @param in   raw samples
+ *  @param out  destination, at least size floats long
+ *  @param size total number of samples (not frames)
+ *  @param gain gain applied after conversion
+ */
+template <typename Format>
+void AudioInterleavedToFloat(const int32_t* in,
+                             float*         out,
+                             size_t         size,
+                             float          gain)
+{
+    for(size_t i = 0; i < size; i += 2)
+    {
+        out[i]     = AudioSampleToFloat<Format>(in[i], gain);
+        out[i + 1] = AudioSampleToFloat<Format>(in[i + 1], gain);
+    }
+}
+
+/** Converts interleaved floats back to raw samples, keeping the interleaving.
+ *  @param in   float samples
+ *  @param out  destination, at least size samples long
+ *  @param size total number of samples (not frames)
+ *  @param gain gain applied before conversion
+ */
+template <typename Format>
+void AudioFloatToInterleaved(const float* in,
+                             int32_t*     out,
+                             size_t       size,
+                             float        gain)
+{
+    for(size_t i = 0; i < size; i += 2)
+    {
+        out[i]     = Format::Encode(in[i] * gain);
+        out[i + 1] = Format::Encode(in[i + 1] * gain);
+    }
+}
+
+/** De-interleaves one or more streams into separate float channels.
+ *  Each stream holds kSlots channels interleaved (2 for I2S, more for TDM),
+ *  and channel n is taken from slot n % kSlots of stream n / kSlots.
+ *  @param in     one interleaved stream per kSlots channels
+ *  @param out    kChannels destination buffers, at least frames floats long
+ *  @param frames number of frames (samples per channel)
+ *  @param gain   gain applied after conversion
+ */
+template <typename Format, size_t kChannels, size_t kSlots = 2>
+void AudioDeinterleaveToFloat(const int32_t* const* in,
+                              float* const*         out,
+                              size_t                frames,
+                              float                 gain)
+{
+    static_assert(kSlots > 0 && kChannels % kSlots == 0,
+                  "Channels must fill all slots of each stream");
+    for(size_t s = 0; s < kChannels / kSlots; s++)
+    {
+        const int32_t* src = in[s];
+        float* const*  dst = out + s * kSlots;
+        for(size_t i = 0; i < frames; i++)
+        {
+            for(size_t slot = 0; slot < kSlots; slot++)
+                dst[slot][i] = AudioSampleToFloat<Format>(src[slot], gain);
+            src += kSlots;
+        }
+    }
+}
+
+/** Interleaves separate float channels into one or more streams,
+ *  the reverse of AudioDeinterleaveToFloat().
+ *  @param in     kChannels source buffers, at least frames floats long
+ *  @param out    one interleaved stream per kSlots channels
+ *  @param frames number of frames (samples per channel)
+ *  @param gain   gain applied before conversion
+ */
+template <typename Format, size_t kChannels, size_t kSlots = 2>
+void AudioInterleaveFromFloat(const float* const* in,
+                              int32_t* const*     out,
+                              size_t              frames,
+                              float               gain)
+{
+    static_assert(kSlots > 0 && kChannels % kSlots == 0,
+                  "Channels must fill all slots of each stream");
+    for(size_t s = 0; s < kChannels / kSlots; s++)
+    {
+        const float* const* src = in + s * kSlots;
+        int32_t*            dst = out[s];
+        for(size_t i = 0; i < frames; i++)
+        {
+            for(size_t slot = 0; slot < kSlots; slot++)
+                dst[slot] = Format::Encode(src[slot][i] * gain);
+            dst += kSlots;
+        }
+    }
+}
+
+/** @brief Set of conversion kernels for one bit depth and channel count.
+ *  @ingroup audio
+ *  All members are nullptr if no matching kernels exist.
+ */
+struct AudioConversionKernels
+{
+    /** Interleaved raw -> float, see AudioInterleavedToFloat() */
+    void (*to_float)(const int32_t* in, float* out, size_t size, float gain);
+
+    /** Interleaved float -> raw, see AudioFloatToInterleaved() */
+    void (*from_float)(const float* in, int32_t* out, size_t size, float gain);
+
+    /** Raw streams -> float channels, see AudioDeinterleaveToFloat() */
+    void (*deinterleave)(const int32_t* const* in,
+                         float* const*         out,
+                         size_t                frames,
+                         float                 gain);
+
+    /** Float channels -> raw streams, see AudioInterleaveFromFloat() */
+    void (*interleave)(const float* const* in,
+                       int32_t* const*     out,
+                       size_t              frames,
+                       float               gain);
+
+    /** Number of channels the (de)interleave kernels handle */
+    size_t channels;
+
+    /** Number of channels interleaved in each stream */
+    size_t slots;
+};
+
+/** @cond HIDDEN_FROM_DOC */
+template <typename Format, size_t kChannels, size_t kSlots>
+constexpr AudioConversionKernels MakeAudioConversionKernels()
+{
+    return {&AudioInterleavedToFloat<Format>,
+            &AudioFloatToInterleaved<Format>,
+            &AudioDeinterleaveToFloat<Format, kChannels, kSlots>,
+            &AudioInterleaveFromFloat<Format, kChannels, kSlots>,
+            kChannels,
+            kSlots};
+}
+
+/** Kernels for one or two streams of kSlots channels each */
+template <typename Format, size_t kSlots>
+AudioConversionKernels SelectAudioConversionKernels(size_t channels)
+{
+    switch(channels / kSlots)
+    {
+        case 1: return MakeAudioConversionKernels<Format, kSlots, kSlots>();
+        case 2: return MakeAudioConversionKernels<Format, kSlots * 2, kSlots>();
+        default: return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    }
+}
+
+template <typename Format>
+AudioConversionKernels SelectAudioConversionKernels(size_t channels,
+                                                    size_t slots)
+{
+    if(slots == 0 || channels % slots != 0)
+        return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    switch(slots)
+    {
+        case 2: return SelectAudioConversionKernels<Format, 2>(channels);
+        case 4: return SelectAudioConversionKernels<Format, 4>(channels);
+        case 8: return SelectAudioConversionKernels<Format, 8>(channels);
+        case 16: return SelectAudioConversionKernels<Format, 16>(channels);
+        default: return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    }
+}
+/** @endcond */
+
+/** Returns the conversion kernels for a bit depth and channel count.
+ *  This is meant to be called once whenever the audio format changes,
+ *  not from within the audio callback.
+ *  @param bit_depth bit depth of the SAI
+ *  @param channels  total number of channels, slots or 2 * slots
+ *  @param slots     channels per stream: 2 for I2S, 4, 8 or 16 for TDM
+ */
+inline AudioConversionKernels
+GetAudioConversionKernels(SaiHandle::Config::BitDepth bit_depth,
+                          size_t                      channels,
+                          size_t                      slots = 2)
+{
+    switch(bit_depth)
+    {
+        case SaiHandle::Config::BitDepth::SAI_16BIT:
+            return SelectAudioConversionKernels<AudioFormatS16>(channels,
+                                                                slots);
+        case SaiHandle::Config::BitDepth::SAI_24BIT:
+            return SelectAudioConversionKernels<AudioFormatS24>(channels,
+                                                                slots);
+        case SaiHandle::Config::BitDepth::SAI_32BIT:
+            return SelectAudioConversionKernels<AudioFormatS32>(channels,
+                                                                slots);
+        default: return {nullptr, nullptr, nullptr, nullptr, 0, 0};
+    }
+}
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,409 @@
+#pragma once
+#ifndef DSY_AUDIO_SIMULATOR_H
+#define DSY_AUDIO_SIMULATOR_H
+
+#ifndef UNIT_TEST
+#error "The AudioSimulator is only available in host builds with UNIT_TEST"
+#else
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "hid/audio.h"
+#include "hid/audio_convert.h"
+#include "util/wav_format.h"
+
+namespace daisy
+{
+/** @brief Offline audio engine for host builds
+ *  @ingroup audio
+ *  @details Runs the real AudioHandle with the host SaiHandle backend.
+ *           Input samples are quantized to the SAI bit depth and placed in
+ *           the DMA receive buffers, the AudioHandle is triggered just like
+ *           by the DMA interrupts, and the transmit buffers are converted
+ *           back to float. Block size, channel count, bit depth and the
+ *           postgain/output_compensation scaling therefore behave exactly as
+ *           on the hardware - only much faster than real time.
+ *
+ *           Usage:
+ *           \code{.cpp}
+ *           AudioSimulator sim;
+ *           sim.Init(AudioSimulator::Config());
+ *           sim.GetAudioHandle().Start(MyCallback);
+ *           sim.ProcessWavFile("in.wav", "out.wav");
+ *           \endcode
+ *
+ *           As the AudioHandle is a singleton, only one AudioSimulator
+ *           can be active at a time. Like the other host mocks, this relies
+ *           on the System tick mock and must be used from within a test.
+ */
+class AudioSimulator
+{
+  public:
+    struct Config
+    {
+        /** Settings passed on to the AudioHandle */
+        AudioHandle::Config audio;
+
+        /** Bit depth of the simulated codec(s) */
+        SaiHandle::Config::BitDepth bit_depth;
+
+        /** Channels per SAI, STEREO for I2S or one of the TDM modes */
+        SaiHandle::Config::FrameSlots slots;
+
+        /** Number of channels, the number of slots for one SAI, or twice
+         *  that for two SAIs */
+        size_t channels;
+
+        Config()
+        : bit_depth(SaiHandle::Config::BitDepth::SAI_24BIT),
+          slots(SaiHandle::Config::FrameSlots::STEREO),
+          channels(2)
+        {
+        }
+    };
+
+    enum class Result
+    {
+        OK,
+        ERR,
+    };
+
+    AudioSimulator() {}
+    ~AudioSimulator() {}
+
+    /** Initializes the simulated SAIs and the AudioHandle. Start the audio
+     *  with GetAudioHandle().Start() afterwards, as the firmware would.
+     */
+    Result Init(const Config& config)
+    {
+        SaiHandle::Config sai_cfg;
+        sai_cfg.slots      = config.slots;
+        const size_t slots = sai_cfg.GetNumSlots();
+        if(config.channels != slots && config.channels != 2 * slots)
+            return Result::ERR;
+        config_ = config;
+        slots_  = slots;
+
+        sai_cfg.periph    = SaiHandle::Config::Peripheral::SAI_1;
+        sai_cfg.sr        = config.audio.samplerate;
+        sai_cfg.bit_depth = config.bit_depth;
+        sai_cfg.a_sync    = SaiHandle::Config::Sync::MASTER;
+        sai_cfg.b_sync    = SaiHandle::Config::Sync::SLAVE;
+        sai_cfg.a_dir     = SaiHandle::Config::Direction::TRANSMIT;
+        sai_cfg.b_dir     = SaiHandle::Config::Direction::RECEIVE;
+        if(sai_[0].Init(sai_cfg) != SaiHandle::Result::OK)
+            return Result::ERR;
+        if(config.channels > slots)
+        {
+            sai_cfg.periph = SaiHandle::Config::Peripheral::SAI_2;
+            if(sai_[1].Init(sai_cfg) != SaiHandle::Result::OK)
+                return Result::ERR;
+        }
+
+        const auto res = config.channels > slots
+                             ? audio_.Init(config.audio, sai_[0], sai_[1])
+                             : audio_.Init(config.audio, sai_[0]);
+        if(res != AudioHandle::Result::OK)
+            return Result::ERR;
+
+        half_ = 0;
+        ResetStats();
+        return Result::OK;
+    }
+
+    /** Returns the simulated AudioHandle */
+    AudioHandle& GetAudioHandle() { return audio_; }
+
+    /** Returns the number of channels, including all TDM slots */
+    size_t GetChannels() const { return config_.channels; }
+
+    /** Returns the block size in frames */
+    size_t GetBlockSize() const { return audio_.GetConfig().blocksize; }
+
+    /** Returns the sample rate in Hz */
+    float GetSampleRate() { return audio_.GetSampleRate(); }
+
+    /** Runs audio through the callback.
+     *  Both buffers are interleaved with GetChannels() channels per frame.
+     *  A trailing partial block is padded with silence, and its extra
+     *  output is discarded.
+     *  @param in     input samples, frames * GetChannels() long
+     *  @param out    output samples, frames * GetChannels() long
+     *  @param frames number of frames to process
+     */
+    void Process(const float* in, float* out, size_t frames)
+    {
+        const size_t chns  = config_.channels;
+        const size_t slots = slots_;
+        const size_t block = GetBlockSize();
+        const auto   start = std::chrono::steady_clock::now();
+        for(size_t pos = 0; pos < frames; pos += block)
+        {
+            const size_t n = frames - pos < block ? frames - pos : block;
+            for(size_t s = 0; s < chns / slots; s++)
+            {
+                int32_t* rx = sai_[s].GetRxBufferForUnitTest()
+                              + half_ * block * slots;
+                for(size_t i = 0; i < block; i++)
+                {
+                    for(size_t c = 0; c < slots; c++)
+                    {
+                        const size_t idx = (pos + i) * chns + s * slots + c;
+                        rx[i * slots + c] = Encode(i < n ? in[idx] : 0.f);
+                    }
+                }
+            }
+
+            // The second SAI has no callback of its own, it only provides
+            // the offset the AudioHandle reads its buffers at.
+            if(chns > slots)
+                sai_[1].SimulateDmaTransferForUnitTest(half_);
+            sai_[0].SimulateDmaTransferForUnitTest(half_);
+
+            for(size_t s = 0; s < chns / slots; s++)
+            {
+                const int32_t* tx = sai_[s].GetTxBufferForUnitTest()
+                                    + half_ * block * slots;
+                for(size_t i = 0; i < n; i++)
+                    for(size_t c = 0; c < slots; c++)
+                        out[(pos + i) * chns + s * slots + c]
+                            = Decode(tx[i * slots + c]);
+            }
+
+            half_ ^= 1;
+            num_blocks_++;
+        }
+        num_frames_ += frames;
+        elapsed_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    }
+
+    /** Runs a generated signal through the callback and returns the output.
+     *  @param signal called as signal(frame, channel) for every input sample
+     *  @param frames number of frames to process
+     *  @return interleaved output, frames * GetChannels() long
+     */
+    template <typename SignalFunction>
+    std::vector<float> ProcessSignal(SignalFunction signal, size_t frames)
+    {
+        const size_t       chns = config_.channels;
+        std::vector<float> in(frames * chns), out(frames * chns);
+        for(size_t i = 0; i < frames; i++)
+            for(size_t c = 0; c < chns; c++)
+                in[i * chns + c] = signal(i, c);
+        Process(in.data(), out.data(), frames);
+        return out;
+    }
+
+    /** Runs a WAV file through the callback and writes the output to
+     *  another WAV file, as 32-bit float at the simulated sample rate.
+     *  File channels beyond GetChannels() are ignored, missing ones are
+     *  silent. The sample rate of the input file is not converted.
+     */
+    Result ProcessWavFile(const char* in_path, const char* out_path)
+    {
+        std::vector<float> file;
+        size_t             file_chns;
+        uint32_t           file_sr;
+        if(!ReadWavFile(in_path, file, file_chns, file_sr))
+            return Result::ERR;
+
+        const size_t       chns   = config_.channels;
+        const size_t       frames = file.size() / file_chns;
+        std::vector<float> in(frames * chns, 0.f), out(frames * chns);
+        for(size_t i = 0; i < frames; i++)
+            for(size_t c = 0; c < chns && c < file_chns; c++)
+                in[i * chns + c] = file[i * file_chns + c];
+        Process(in.data(), out.data(), frames);
+
+        return WriteWavFile(out_path,
+                            out.data(),
+                            frames,
+                            chns,
+                            (uint32_t)GetSampleRate())
+                   ? Result::OK
+                   : Result::ERR;
+    }
+
+    /** Returns the number of blocks processed since Init() or ResetStats() */
+    size_t GetNumBlocks() const { return num_blocks_; }
+
+    /** Returns the number of frames processed since Init() or ResetStats() */
+    size_t GetNumFrames() const { return num_frames_; }
+
+    /** Returns the wall clock time spent in Process() in seconds */
+    double GetElapsedSeconds() const { return elapsed_ns_ * 1e-9; }
+
+    /** Returns how many times faster than real time the audio was processed */
+    double GetRealtimeFactor()
+    {
+        const double audio_seconds = num_frames_ / (double)GetSampleRate();
+        return elapsed_ns_ > 0 ? audio_seconds / GetElapsedSeconds() : 0.0;
+    }
+
+    /** Resets the block count and timing statistics */
+    void ResetStats()
+    {
+        num_blocks_ = 0;
+        num_frames_ = 0;
+        elapsed_ns_ = 0;
+    }
+
+    /** Reads a PCM (16, 24 or 32-bit) or 32-bit float WAV file.
+     *  @param path       file to read
+     *  @param samples    receives the interleaved samples in the range -1..1
+     *  @param channels   receives the number of channels
+     *  @param samplerate receives the sample rate in Hz
+     *  @return false if the file couldn't be read or has another format
+     */
+    static bool ReadWavFile(const char*         path,
+                            std::vector<float>& samples,
+                            size_t&             channels,
+                            uint32_t&           samplerate)
+    {
+        FILE* f = fopen(path, "rb");
+        if(f == nullptr)
+            return false;
+
+        uint32_t riff[3];
+        bool     ok = fread(riff, 4, 3, f) == 3 && riff[0] == kWavFileChunkId
+                  && riff[2] == kWavFileWaveId;
+        uint16_t format = 0, bits = 0, chns = 0;
+        uint32_t sr       = 0;
+        bool     has_data = false;
+        std::vector<uint8_t> data;
+        while(ok && !has_data)
+        {
+            uint32_t chunk[2];
+            if(fread(chunk, 4, 2, f) != 2)
+                break;
+            std::vector<uint8_t> body(chunk[1]);
+            if(fread(body.data(), 1, chunk[1], f) != chunk[1])
+                break;
+            if(chunk[1] & 1) // chunks are padded to even sizes
+                fseek(f, 1, SEEK_CUR);
+
+            if(chunk[0] == kWavFileSubChunk1Id && chunk[1] >= 16)
+            {
+                memcpy(&format, &body[0], 2);
+                memcpy(&chns, &body[2], 2);
+                memcpy(&sr, &body[4], 4);
+                memcpy(&bits, &body[14], 2);
+                // the actual format of extensible files is in the sub format
+                if(format == WAVE_FORMAT_EXTENSIBLE && chunk[1] >= 26)
+                    memcpy(&format, &body[24], 2);
+            }
+            else if(chunk[0] == kWavFileSubChunk2Id)
+            {
+                data.swap(body);
+                has_data = true;
+            }
+        }
+        fclose(f);
+
+        const bool is_pcm = format == WAVE_FORMAT_PCM
+                            && (bits == 16 || bits == 24 || bits == 32);
+        const bool is_float = format == WAVE_FORMAT_IEEE_FLOAT && bits == 32;
+        if(!ok || !has_data || chns == 0 || !(is_pcm || is_float))
+            return false;
+
+        const size_t bytes = bits / 8;
+        samples.resize(data.size() / bytes / chns * chns);
+        for(size_t i = 0; i < samples.size(); i++)
+        {
+            const uint8_t* p = &data[i * bytes];
+            if(is_float)
+            {
+                memcpy(&samples[i], p, 4);
+                continue;
+            }
+            // left align the sample in a 32-bit word
+            uint32_t word = 0;
+            for(size_t b = 0; b < bytes; b++)
+                word |= uint32_t(p[b]) << (32 - bits + b * 8);
+            samples[i] = s322f((int32_t)word);
+        }
+        channels   = chns;
+        samplerate = sr;
+        return true;
+    }
+
+    /** Writes interleaved samples to a 32-bit float WAV file.
+     *  @return false if the file couldn't be written
+     */
+    static bool WriteWavFile(const char*  path,
+                             const float* samples,
+                             size_t       frames,
+                             size_t       channels,
+                             uint32_t     samplerate)
+    {
+        FILE* f = fopen(path, "wb");
+        if(f == nullptr)
+            return false;
+
+        const uint32_t    data_size = frames * channels * sizeof(float);
+        WAV_FormatTypeDef header;
+        header.ChunkId       = kWavFileChunkId;
+        header.FileSize      = sizeof(header) - 8 + data_size;
+        header.FileFormat    = kWavFileWaveId;
+        header.SubChunk1ID   = kWavFileSubChunk1Id;
+        header.SubChunk1Size = 16;
+        header.AudioFormat   = WAVE_FORMAT_IEEE_FLOAT;
+        header.NbrChannels   = channels;
+        header.SampleRate    = samplerate;
+        header.ByteRate      = samplerate * channels * sizeof(float);
+        header.BlockAlign    = channels * sizeof(float);
+        header.BitPerSample  = 32;
+        header.SubChunk2ID   = kWavFileSubChunk2Id;
+        header.SubCHunk2Size = data_size;
+
+        const bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+                        && fwrite(samples, sizeof(float), frames * channels, f)
+                               == frames * channels;
+        return fclose(f) == 0 && ok;
+    }
+
+  private:
+    /** Quantizes a sample like the codec's ADC, as a right justified word */
+    int32_t Encode(float x) const
+    {
+        switch(config_.bit_depth)
+        {
+            case SaiHandle::Config::BitDepth::SAI_16BIT:
+                return AudioFormatS16::Encode(x) & 0xffff;
+            case SaiHandle::Config::BitDepth::SAI_24BIT:
+                return AudioFormatS24::Encode(x) & 0xffffff;
+            default: return AudioFormatS32::Encode(x);
+        }
+    }
+
+    /** Converts a transmitted word to float, as the codec's DAC */
+    float Decode(int32_t x) const
+    {
+        switch(config_.bit_depth)
+        {
+            case SaiHandle::Config::BitDepth::SAI_16BIT:
+                return AudioSampleToFloat<AudioFormatS16>(x & 0xffff, 1.f);
+            case SaiHandle::Config::BitDepth::SAI_24BIT:
+                return AudioSampleToFloat<AudioFormatS24>(x & 0xffffff, 1.f);
+            default: return AudioSampleToFloat<AudioFormatS32>(x, 1.f);
+        }
+    }
+
+    Config      config_;
+    size_t      slots_;
+    SaiHandle   sai_[2];
+    AudioHandle audio_;
+    size_t      half_;
+    size_t      num_blocks_;
+    size_t      num_frames_;
+    int64_t     elapsed_ns_;
+};
+
+} // namespace daisy
+
+#endif // ifndef UNIT_TEST
+#endif
@@ -2,13 +2,16 @@
 #ifndef DSY_MIDI_H
 #define DSY_MIDI_H
 
+#include <atomic>
 #include <stdint.h>
 #include <stdlib.h>
 #include <algorithm>
 #include "per/uart.h"
 #include "util/ringbuffer.h"
-#include "util/FIFO.h"
+#include "util/SpscQueue.h"
+#include "hid/midi_clock.h"
 #include "hid/midi_parser.h"
+#include "hid/midi_tx_queue.h"
 #include "hid/usb_midi.h"
 #include "sys/dma.h"
 #include "sys/system.h"
@@ -28,6 +31,8 @@ class MidiUartTransport
                                         size_t   size,
                                         void*    context);
 
+    typedef void (*TxCompleteCallback)(void* context);
+
     MidiUartTransport() {}
     ~MidiUartTransport() {}
 
@@ -55,6 +60,19 @@ class MidiUartTransport
          */
         size_t rx_buffer_size;
 
+        /** Pointer to buffer for DMA UART tx transfers with TxDma().
+         *
+         *  @details Like rx_buffer, this defaults to a shared buffer in
+         *           DMA_BUFFER_MEM_SECTION that can only be used for a single
+         *           UART peripheral.
+         */
+        uint8_t* tx_buffer;
+
+        /** Size in bytes of tx_buffer, the maximum size of one TxDma()
+         *  transfer. By default 64 bytes, about 20ms at the MIDI baudrate.
+         */
+        size_t tx_buffer_size;
+
         Config();
     };
 
@@ -77,6 +95,8 @@ class MidiUartTransport
 
         rx_buffer      = config.rx_buffer;
         rx_buffer_size = config.rx_buffer_size;
+        tx_buffer      = config.tx_buffer;
+        tx_buffer_size = config.tx_buffer_size;
 
         /** zero the buffer to ensure emptiness regardless of source memory */
         std::fill(rx_buffer, rx_buffer + rx_buffer_size, 0);
@@ -102,15 +122,58 @@ class MidiUartTransport
     /** @brief This is a no-op for UART transport - Rx is via DMA callback with circular buffer */
     inline void FlushRx() {}
 
+    /** @brief This is a no-op for UART transport - Tx() sends right away */
+    inline void FlushTx() {}
+
     /** @brief sends the buffer of bytes out of the UART peripheral */
     inline void Tx(uint8_t* buff, size_t size) { uart_.PollTx(buff, size); }
 
+    /** @brief returns the DMA buffer to fill for TxDma() */
+    inline uint8_t* GetTxBuffer() { return tx_buffer; }
+
+    /** @brief returns the size of the DMA tx buffer */
+    inline size_t GetTxBufferSize() const { return tx_buffer_size; }
+
+    /** @brief sends the first size bytes of the DMA tx buffer in the
+     *         background, without blocking.
+     *  @param size     number of bytes, up to GetTxBufferSize()
+     *  @param callback called from an interrupt when the transfer is done
+     *  @param context  passed to the callback
+     *  @return false if the transfer couldn't be started
+     */
+    inline bool TxDma(size_t size, TxCompleteCallback callback, void* context)
+    {
+        tx_callback_ = callback;
+        tx_context_  = context;
+        dsy_dma_clear_cache_for_buffer(tx_buffer, size);
+        return uart_.DmaTransmit(tx_buffer,
+                                 size,
+                                 nullptr,
+                                 MidiUartTransport::txCallback,
+                                 this)
+               == UartHandler::Result::OK;
+    }
+
   private:
     UartHandler         uart_;
     uint8_t*            rx_buffer;
     size_t              rx_buffer_size;
+    uint8_t*            tx_buffer;
+    size_t              tx_buffer_size;
     void*               parse_context_;
     MidiRxParseCallback parse_callback_;
+    void*               tx_context_;
+    TxCompleteCallback  tx_callback_;
+
+    /** Static callback for the end of a TxDma() transfer */
+    static void txCallback(void* context, UartHandler::Result res)
+    {
+        (void)res;
+        MidiUartTransport* transport
+            = reinterpret_cast<MidiUartTransport*>(context);
+        if(transport->tx_callback_)
+            transport->tx_callback_(transport->tx_context_);
+    }
 
     /** Static callback for Uart MIDI that occurs when
          *  new data is available from the peripheral.
@@ -143,7 +206,9 @@ class MidiUartTransport
 /**
     @brief Simple MIDI Handler \n
     Parses bytes from an input into valid MidiEvents. \n
-    The MidiEvents fill a FIFO queue that the user can pop messages from.
+    The MidiEvents fill a lock-free queue that the user can pop messages from.
+    The data of SysEx messages is kept in a MidiSysExArena, see
+    GetSysExArena().
     @author shensley
     @date March 2020
     @ingroup midi
@@ -152,12 +217,17 @@ template <typename Transport>
 class MidiHandler
 {
   public:
-    MidiHandler() {}
+    MidiHandler() : clock_tracker_(nullptr) {}
     ~MidiHandler() {}
 
     struct Config
     {
         typename Transport::Config transport_config;
+
+        /** Leave out repeated status bytes in QueueMessage() */
+        bool tx_running_status;
+
+        Config() : tx_running_status(true) {}
     };
 
     /** Initializes the MidiHandler
@@ -167,7 +237,11 @@ class MidiHandler
     {
         config_ = config;
         transport_.Init(config_.transport_config);
-        parser_.Init();
+        sysex_arena_.Init(sysex_chunks_, kNumSysExChunks);
+        parser_.Init(&sysex_arena_);
+        popped_sysex_ = MidiSysExArena::kInvalidHandle;
+        tx_queue_.Init(config_.tx_running_status);
+        tx_busy_.store(false);
     }
 
     /** Starts listening on the selected input mode(s).
@@ -177,9 +251,12 @@ class MidiHandler
         transport_.StartRx(MidiHandler::ParseCallback, this);
     }
 
-    /** Start listening */
+    /** Start listening, and send the messages the transport held back.
+     * Call this regularly from the main loop. */
     void Listen()
     {
+        transport_.FlushTx();
+
         // In case of UART Error, (particularly
         //  overrun error), UART disables itself.
         // Flush the buff, and restart.
@@ -194,24 +271,84 @@ class MidiHandler
     /** Checks if there are unhandled messages in the queue
     \return True if there are events to be handled, else false.
      */
-    bool HasEvents() const { return event_q_.GetNumElements() > 0; }
+    bool HasEvents() const { return !event_q_.IsEmpty(); }
 
 
-    /** Pops the oldest unhandled MidiEvent from the internal queue
+    /** Pops the oldest unhandled MidiEvent from the internal queue.
+    The SysEx data of the previously popped event is released.
     \return The event to be handled
      */
-    MidiEvent PopEvent() { return event_q_.PopFront(); }
+    MidiEvent PopEvent()
+    {
+        sysex_arena_.Release(popped_sysex_);
+        popped_sysex_   = MidiSysExArena::kInvalidHandle;
+        MidiEvent event = MidiEvent();
+        if(event_q_.Pop(event) && event.type == SystemCommon
+           && event.sc_type == SystemExclusive)
+            popped_sysex_ = event.sysex_chunk;
+        return event;
+    }
+
+    /** Returns the storage of the SysEx data, for
+    MidiEvent::AsSystemExclusive(). The data of a popped event stays valid
+    until the next call to PopEvent().
+    Messages longer than SYSEX_BUFFER_LEN are split into several events,
+    which have to be popped in time to receive all of the data.
+     */
+    const MidiSysExArena& GetSysExArena() const { return sysex_arena_; }
 
     /** SendMessage
-    Send raw bytes as message
+    Send raw bytes as message. This blocks until the bytes are sent,
+    see QueueMessage() for sending in the background.
     */
     void SendMessage(uint8_t* bytes, size_t size)
     {
+        tx_queue_.ResetRunningStatus();
         transport_.Tx(bytes, size);
     }
 
+    /** Queues raw bytes, one or more complete messages, to be sent in the
+    background without blocking. Transfers are chained from the transfer
+    complete interrupt, each one sends as many queued bytes as fit into the
+    transport's tx buffer. Repeated status bytes are left out (running
+    status), unless disabled in the Config.
+
+    \note Needs a transport with DMA transmit, like MidiUartTransport.
+           Call this from one context only, and don't mix it with
+           SendMessage() while bytes are still queued.
+    \return false if the queue is full, the message is dropped then
+    */
+    bool QueueMessage(const uint8_t* bytes, size_t size)
+    {
+        const bool queued = tx_queue_.Write(bytes, size);
+        StartTx();
+        return queued;
+    }
+
+    /** Queues a realtime byte (e.g. 0xF8 clock), which is sent ahead of
+    the bytes queued by QueueMessage(). This can be called from another
+    context than QueueMessage(), e.g. the audio callback.
+    \return false if the realtime queue is full
+    */
+    bool QueueRealtime(uint8_t byte)
+    {
+        const bool queued = tx_queue_.WriteRealtime(byte);
+        StartTx();
+        return queued;
+    }
+
+    /** Returns true while queued bytes are waiting or being sent */
+    bool IsSending() const
+    {
+        return tx_busy_.load() || !tx_queue_.IsEmpty();
+    }
+
+    /** Returns the number of messages and realtime bytes that were dropped
+    because the queue was full */
+    uint32_t GetNumTxDropped() const { return tx_queue_.GetNumDropped(); }
+
     /** Feed in bytes to parser state machine from an external source.
-        Populates internal FIFO queue with MIDI Messages.
+        Populates internal event queue with MIDI Messages.
 
         \note  Normally application code won't need to use this method directly.
         \param byte MIDI byte to be parsed
@@ -221,24 +358,93 @@ class MidiHandler
         MidiEvent event;
         if(parser_.Parse(byte, &event))
         {
-            event_q_.PushBack(event);
+            EventSink sink = {*this, System::GetUs()};
+            sink.Push(event);
         }
     }
 
+    /** Feed in a buffer of bytes from an external source, like Parse().
+        \param bytes MIDI bytes to be parsed
+        \param size number of bytes
+    */
+    void ParseBuffer(const uint8_t* bytes, size_t size)
+    {
+        EventSink sink = {*this, System::GetUs()};
+        parser_.ParseBuffer(bytes, size, sink);
+    }
+
+    /** Passes clock, transport and song position events to a clock
+        tracker as they are parsed, timestamped with System::GetUs(). This
+        happens in the receive callback, so the timestamps don't depend on
+        when the events are popped. The events are still queued as well.
+        \param tracker the tracker, or nullptr to stop
+    */
+    void SetClockTracker(MidiClockTracker* tracker)
+    {
+        clock_tracker_ = tracker;
+    }
+
   private:
-    Config               config_;
-    Transport            transport_;
-    MidiParser           parser_;
-    FIFO<MidiEvent, 256> event_q_;
+    static constexpr size_t kNumSysExChunks = 8;
+
+    Config                    config_;
+    Transport                 transport_;
+    MidiParser                parser_;
+    SpscQueue<MidiEvent, 256> event_q_;
+    MidiSysExArena::Chunk     sysex_chunks_[kNumSysExChunks];
+    MidiSysExArena            sysex_arena_;
+    uint8_t                   popped_sysex_;
+    MidiTxQueue<256, 16>      tx_queue_;
+    std::atomic<bool>         tx_busy_;
+    MidiClockTracker*         clock_tracker_;
+
+    /** Queues parsed events, and passes them to the clock tracker */
+    struct EventSink
+    {
+        MidiHandler& handler;
+        uint32_t     time_us;
 
-    static void ParseCallback(uint8_t* data, size_t size, void* context)
+        void Push(const MidiEvent& event)
+        {
+            handler.event_q_.Push(event);
+            if(handler.clock_tracker_ != nullptr)
+                handler.clock_tracker_->ProcessEvent(event, time_us);
+        }
+    };
+
+    /** Starts the next transfer, unless one is running. Both the sending
+     *  contexts and the transfer complete callback call this, whoever sets
+     *  tx_busy_ owns the transport until the transfer is done.
+     */
+    void StartTx()
     {
-        MidiHandler* handler = reinterpret_cast<MidiHandler*>(context);
-        for(size_t i = 0; i < size; i++)
+        while(!tx_queue_.IsEmpty())
         {
-            handler->Parse(data[i]);
+            bool idle = false;
+            if(!tx_busy_.compare_exchange_strong(idle, true))
+                return;
+            const size_t size = tx_queue_.Read(transport_.GetTxBuffer(),
+                                               transport_.GetTxBufferSize());
+            if(size > 0 && transport_.TxDma(size, TxCompleteCallback, this))
+                return;
+            // nothing left, or the transfer failed and the bytes are lost.
+            // Check again, in case bytes were queued in the meantime.
+            tx_busy_.store(false);
         }
     }
+
+    static void TxCompleteCallback(void* context)
+    {
+        MidiHandler* handler = reinterpret_cast<MidiHandler*>(context);
+        handler->tx_busy_.store(false);
+        handler->StartTx();
+    }
+
+    static void ParseCallback(uint8_t* data, size_t size, void* context)
+    {
+        MidiHandler* handler = reinterpret_cast<MidiHandler*>(context);
+        handler->ParseBuffer(data, size);
+    }
 };
 
 /**
@@ -0,0 +1,293 @@
+#pragma once
+#ifndef DSY_MIDI_CLOCK_H
+#define DSY_MIDI_CLOCK_H
+
+#include <math.h>
+#include <stdint.h>
+#include "hid/MidiEvent.h"
+#include "util/TripleBuffer.h"
+
+namespace daisy
+{
+/** @brief   Follows an incoming MIDI clock
+ *  @details Estimates the tempo and the song position from timestamped
+ *           MIDI clock bytes (24 per quarter note), and handles Start,
+ *           Stop, Continue and Song Position Pointer messages.
+ *
+ *           Clock bytes arrive with jitter, especially over USB. The tick
+ *           times are smoothed with a second order tracking filter (an
+ *           alpha-beta filter, i.e. a PLL). While locking on, its gains
+ *           follow the schedule that makes it equal to a least squares fit
+ *           through all ticks so far. After lock_ticks ticks the gains stay
+ *           fixed, which gives a smoothing over about that many ticks.
+ *           Large tempo changes and dropouts restart the lock.
+ *
+ *           Events are processed in one context, e.g. the MIDI receive
+ *           callback (see MidiHandler::SetClockTracker()). The estimate is
+ *           published to one other context, e.g. the audio callback, which
+ *           reads it without locking. Times are in microseconds, from
+ *           System::GetUs().
+ *
+ *           @code
+ *           // audio callback
+ *           const uint32_t now = System::GetUs();
+ *           const float    pos = clock.GetTickPosition(now);
+ *           const float    inc = clock.GetTicksPerSecond(now) / samplerate;
+ *           for(size_t i = 0; i < size; i++)
+ *               lfo_phase[i] = (pos + i * inc) / 24.f; // in beats
+ *           @endcode
+ *  @ingroup midi
+ */
+class MidiClockTracker
+{
+  public:
+    /** Number of clock ticks per quarter note */
+    static constexpr uint32_t kTicksPerBeat = 24;
+
+    struct Config
+    {
+        /** Number of ticks the tempo is averaged over, once locked */
+        uint32_t lock_ticks;
+        /** Without a tick for this long, the clock is considered lost */
+        uint32_t timeout_us;
+
+        Config() : lock_ticks(24), timeout_us(500000) {}
+    };
+
+    MidiClockTracker() { Init(); }
+
+    void Init(const Config& config = Config())
+    {
+        config_       = config;
+        num_ticks_    = 0;
+        num_outliers_ = 0;
+        last_tick_    = 0;
+        offset_us_    = 0.f;
+        period_us_    = 0.f;
+        position_     = 0;
+        running_      = false;
+        has_tick_     = false;
+        if(config_.lock_ticks < 2)
+            config_.lock_ticks = 2;
+
+        State s = {0, 0.f, 0.f, 0, false, false};
+        state_.Init(s);
+    }
+
+    // ======== event side ========
+
+    /** Handles clock, transport and song position events, ignores others
+     *  @param event   a parsed event
+     *  @param time_us time the event was received
+     */
+    void ProcessEvent(const MidiEvent& event, uint32_t time_us)
+    {
+        if(event.type == SystemRealTime)
+        {
+            switch(event.srt_type)
+            {
+                case TimingClock: Tick(time_us); break;
+                case SystemRealTimeType::Start: Start(); break;
+                case SystemRealTimeType::Continue: Continue(); break;
+                case SystemRealTimeType::Stop: Stop(); break;
+                default: break;
+            }
+        }
+        else if(event.type == SystemCommon
+                && event.sc_type == SongPositionPointer)
+        {
+            SetSongPosition(uint16_t(event.data[1] << 7) | event.data[0]);
+        }
+    }
+
+    /** Handles a clock tick (0xF8) received at time_us */
+    void Tick(uint32_t time_us)
+    {
+        const uint32_t interval = time_us - last_tick_;
+        const float    residual = float(interval) - offset_us_ - period_us_;
+        last_tick_              = time_us;
+        if(interval > config_.timeout_us)
+            num_ticks_ = 0;
+
+        if(num_ticks_ == 0)
+        {
+            // first tick, nothing to compare with yet
+            offset_us_    = 0.f;
+            num_outliers_ = 0;
+        }
+        else if(num_ticks_ > 2 && 2.f * fabsf(residual) > period_us_)
+        {
+            // A late or missing tick, or a tempo change if it happens a
+            // few times in a row. The estimate continues from this tick
+            // without learning from it.
+            offset_us_ = 0.f;
+            if(++num_outliers_ >= kMaxOutliers)
+                num_ticks_ = 0;
+        }
+        else
+        {
+            const float n = float(num_ticks_ + 1 < config_.lock_ticks
+                                      ? num_ticks_ + 1
+                                      : config_.lock_ticks);
+            const float alpha = 2.f * (2.f * n - 1.f) / (n * (n + 1.f));
+            const float beta  = 6.f / (n * (n + 1.f));
+            // the estimated tick time is kept relative to the received one
+            offset_us_    = (alpha - 1.f) * residual;
+            period_us_    = period_us_ + beta * residual;
+            num_outliers_ = 0;
+        }
+        num_ticks_++;
+
+        if(running_)
+        {
+            // the first tick after Start/Continue/SPP is at position_
+            position_ += has_tick_ ? 1 : 0;
+            has_tick_ = true;
+        }
+        Publish();
+    }
+
+    /** Handles a Start message: the next tick is at position 0 */
+    void Start()
+    {
+        position_ = 0;
+        running_  = true;
+        has_tick_ = false;
+        Publish();
+    }
+
+    /** Handles a Continue message: the next tick is one after the last */
+    void Continue()
+    {
+        if(has_tick_)
+            position_++;
+        running_  = true;
+        has_tick_ = false;
+        Publish();
+    }
+
+    /** Handles a Stop message: the position stays at the last tick */
+    void Stop()
+    {
+        running_ = false;
+        Publish();
+    }
+
+    /** Handles a Song Position Pointer message
+     *  @param sixteenths position in 16th notes (6 ticks each)
+     */
+    void SetSongPosition(uint16_t sixteenths)
+    {
+        position_ = uint32_t(sixteenths) * 6;
+        has_tick_ = false;
+        Publish();
+    }
+
+    // ======== reader side ========
+
+    /** Returns true between Start/Continue and Stop */
+    bool IsRunning() { return state_.Read().running; }
+
+    /** Returns true if there's a tempo estimate at time now_us, i.e. the
+     *  last tick is no older than Config::timeout_us
+     */
+    bool IsLocked(uint32_t now_us) { return GetPeriod(now_us) > 0.f; }
+
+    /** Returns the tempo in quarter notes per minute at time now_us, or 0
+     *  if unknown
+     */
+    float GetBpm(uint32_t now_us)
+    {
+        const float period = GetPeriod(now_us);
+        return period > 0.f ? 60e6f / (period * kTicksPerBeat) : 0.f;
+    }
+
+    /** Returns the number of ticks per second at time now_us, or 0 if
+     *  unknown
+     */
+    float GetTicksPerSecond(uint32_t now_us)
+    {
+        const float period = GetPeriod(now_us);
+        return period > 0.f ? 1e6f / period : 0.f;
+    }
+
+    /** Returns the song position in ticks at time now_us, including the
+     *  fraction since the last tick. The position doesn't advance more
+     *  than one tick past the last received one, and it stays put while
+     *  stopped or before the first tick after Start/Continue.
+     */
+    float GetTickPosition(uint32_t now_us)
+    {
+        const State& s = state_.Read();
+        if(!s.has_tick)
+            return float(s.position);
+        float frac = 0.f;
+        if(s.running && s.period_us > 0.f)
+        {
+            frac = (float(int32_t(now_us - s.tick_us)) - s.offset_us)
+                   / s.period_us;
+            frac = frac < 0.f ? 0.f : (frac > 1.f ? 1.f : frac);
+        }
+        return float(s.position) + frac;
+    }
+
+    /** Returns the position within the current quarter note, 0 to 1 */
+    float GetBeatPhase(uint32_t now_us)
+    {
+        const float beats = GetTickPosition(now_us) / kTicksPerBeat;
+        return beats - floorf(beats);
+    }
+
+  private:
+    /** Number of large errors in a row that restart the lock */
+    static constexpr uint32_t kMaxOutliers = 3;
+
+    /** Snapshot for the reader */
+    struct State
+    {
+        uint32_t tick_us;   // received time of the last tick
+        float    offset_us; // estimated minus received time
+        float    period_us; // 0 if unknown
+        uint32_t position;  // of the last tick, or the next if !has_tick
+        bool     running;
+        bool     has_tick; // a tick arrived since Start/Continue/SPP
+    };
+
+    /** Tick period from the snapshot, 0 if unknown or timed out. The
+     *  event side only sees a timeout when the next tick arrives.
+     */
+    float GetPeriod(uint32_t now_us)
+    {
+        const State& s = state_.Read();
+        if(int32_t(now_us - s.tick_us) > int32_t(config_.timeout_us))
+            return 0.f;
+        return s.period_us;
+    }
+
+    void Publish()
+    {
+        State& s    = state_.GetWriteBuffer();
+        s.tick_us   = last_tick_;
+        s.offset_us = offset_us_;
+        s.period_us = num_ticks_ > 1 ? period_us_ : 0.f;
+        s.position  = position_;
+        s.running   = running_;
+        s.has_tick  = has_tick_;
+        state_.Publish();
+    }
+
+    Config              config_;
+    uint32_t            num_ticks_;
+    uint32_t            num_outliers_;
+    uint32_t            last_tick_;
+    float               offset_us_;
+    float               period_us_;
+    uint32_t            position_;
+    bool                running_;
+    bool                has_tick_;
+    TripleBuffer<State> state_;
+};
+
+} // namespace daisy
+
+#endif
@@ -2,6 +2,22 @@
 
 using namespace daisy;
 
+constexpr uint8_t MidiSysExArena::kInvalidHandle;
+constexpr size_t  MidiSysExArena::kMaxChunks;
+
+const uint8_t MidiParser::kDataBytes[MessageLast] = {
+    2, // NoteOff
+    2, // NoteOn
+    2, // PolyphonicKeyPressure
+    2, // ControlChange
+    1, // ProgramChange
+    1, // ChannelPressure
+    2, // PitchBend
+    0, // SystemCommon
+    0, // SystemRealTime
+    2, // ChannelMode
+};
+
 bool MidiParser::Parse(uint8_t byte, MidiEvent* event_out)
 {
     // reset parser when status byte is received
@@ -37,8 +53,8 @@ bool MidiParser::Parse(uint8_t byte, MidiEvent* event_out)
                         //sysex
                         if(incoming_message_.sc_type == SystemExclusive)
                         {
-                            pstate_                             = ParserSysEx;
-                            incoming_message_.sysex_message_len = 0;
+                            pstate_ = ParserSysEx;
+                            OpenSysEx();
                         }
                         //short circuit
                         else if(incoming_message_.sc_type > SongSelect)
@@ -167,18 +183,21 @@ bool MidiParser::Parse(uint8_t byte, MidiEvent* event_out)
             if(byte == 0xf7)
             {
                 pstate_ = ParserEmpty;
+                CommitSysEx(MidiSysExArena::FLAG_END);
                 if(event_out != nullptr)
                 {
                     *event_out = incoming_message_;
                 }
                 did_parse = true;
             }
-            else if(incoming_message_.sysex_message_len < SYSEX_BUFFER_LEN)
+            // a full chunk is passed on before the next one is started
+            else if(AppendSysEx(byte))
             {
-                incoming_message_
-                    .sysex_data[incoming_message_.sysex_message_len]
-                    = byte;
-                incoming_message_.sysex_message_len++;
+                if(event_out != nullptr)
+                {
+                    *event_out = incoming_message_;
+                }
+                did_parse = true;
             }
             break;
         default: break;
@@ -189,6 +208,36 @@ bool MidiParser::Parse(uint8_t byte, MidiEvent* event_out)
 
 void MidiParser::Reset()
 {
-    pstate_                = ParserEmpty;
+    if(sysex_arena_ != nullptr)
+        sysex_arena_->Abort();
+    pstate_ = ParserEmpty;
+    // the system common type decides about single byte running status
+    incoming_message_      = MidiEvent();
     incoming_message_.type = MessageLast;
 }
+
+void MidiParser::OpenSysEx()
+{
+    sysex_begin_ = true;
+    sysex_lost_  = sysex_arena_ == nullptr || !sysex_arena_->Open();
+}
+
+bool MidiParser::AppendSysEx(uint8_t byte)
+{
+    if(sysex_lost_ || sysex_arena_->Append(byte))
+        return false;
+    // the chunk is full, pass it on and continue in the next one
+    CommitSysEx(0);
+    sysex_lost_ = !sysex_arena_->Open() || !sysex_arena_->Append(byte);
+    return true;
+}
+
+void MidiParser::CommitSysEx(uint8_t flags)
+{
+    if(sysex_begin_)
+        flags |= MidiSysExArena::FLAG_BEGIN;
+    sysex_begin_ = false;
+    incoming_message_.sysex_chunk
+        = sysex_lost_ ? MidiSysExArena::kInvalidHandle
+                      : sysex_arena_->Commit(flags);
+}
@@ -9,16 +9,28 @@
 namespace daisy
 {
 /** @brief   Utility class for parsing raw byte streams into MIDI messages
- *  @details Implemented as a state machine designed to parse one byte at a time
+ *  @details Implemented as a state machine designed to parse one byte at a
+ *           time. ParseBuffer() parses whole buffers, with a fast path for
+ *           complete channel messages.
  *  @ingroup midi
  */
 class MidiParser
 {
   public:
-    MidiParser(){};
+    MidiParser() : sysex_arena_(nullptr){};
     ~MidiParser() {}
 
-    inline void Init() { Reset(); }
+    /**
+     * @brief Initializes the parser
+     *
+     * @param sysex_arena Storage for the data of SysEx messages. Without it,
+     *                    SysEx events are still parsed, but hold no data.
+     */
+    inline void Init(MidiSysExArena *sysex_arena = nullptr)
+    {
+        sysex_arena_ = sysex_arena;
+        Reset();
+    }
 
     /**
      * @brief Parse one MIDI byte. If the byte completes a parsed event,
@@ -26,6 +38,10 @@ class MidiParser
      *        Otherwise, status is preserved in anticipation of the next sequential
      *        byte. Return value indicates if a new event was parsed or not.
      *
+     *        SysEx data is written to the SysEx arena. Each time a chunk is
+     *        full (and at the end of the message), a SysEx event with the
+     *        chunk's handle is parsed.
+     *
      * @param byte      Raw MIDI byte to parse
      * @param event_out Pointer to output event object, value assigned on parse success
      * @return true     If a new event was parsed
@@ -33,12 +49,114 @@ class MidiParser
      */
     bool Parse(uint8_t byte, MidiEvent *event_out);
 
+    /**
+     * @brief Parse a buffer of MIDI bytes, passing each parsed event to
+     *        sink.Push(const MidiEvent&), e.g. an SpscQueue<MidiEvent, N>.
+     *        The results are the same as calling Parse() for each byte.
+     *
+     *        Complete channel messages, with or without running status, are
+     *        decoded as a whole using a table of message lengths, and the
+     *        events are passed to the sink without an intermediate copy.
+     *        Everything else (system messages, messages split between two
+     *        buffers) goes through Parse().
+     *
+     * @param data Raw MIDI bytes
+     * @param size Number of bytes
+     * @param sink Destination of the parsed events
+     */
+    template <typename Sink>
+    void ParseBuffer(const uint8_t *data, size_t size, Sink &sink)
+    {
+        const uint8_t *const end = data + size;
+        MidiEvent            event;
+        while(data < end)
+        {
+            const size_t len
+                = pstate_ == ParserEmpty ? ParseMessage(data, end - data) : 0;
+            if(len > 0)
+            {
+                sink.Push(incoming_message_);
+                data += len;
+            }
+            else if(Parse(*data++, &event))
+            {
+                sink.Push(event);
+            }
+        }
+    }
+
     /**
      * @brief Reset parser to default state
      */
     void Reset();
 
   private:
+    /** Decodes a complete channel message at data from the idle state.
+     *  @return the number of bytes used, or 0 if the message has to go
+     *          through Parse()
+     */
+    size_t ParseMessage(const uint8_t *data, size_t size)
+    {
+        // After these, Parse() treats every running status message as
+        // having one data byte.
+        if(incoming_message_.sc_type == MTCQuarterFrame
+           || incoming_message_.sc_type == SongSelect)
+            return 0;
+
+        const bool      has_status = data[0] & kStatusByteMask;
+        MidiMessageType type       = running_status_;
+        if(has_status)
+            type = static_cast<MidiMessageType>((data[0] & kMessageMask) >> 4);
+        // system messages have 0 in the table
+        if(type >= MessageLast || kDataBytes[type] == 0)
+            return 0;
+
+        const size_t pos = has_status ? 1 : 0;
+        const size_t len = pos + kDataBytes[type];
+        if(size < len || ((data[pos] | data[len - 1]) & kStatusByteMask))
+            return 0;
+
+        if(has_status)
+        {
+            incoming_message_.channel = data[0] & kChannelMask;
+            running_status_           = type;
+        }
+        incoming_message_.type    = type;
+        incoming_message_.data[0] = data[pos];
+        if(len - pos == 2)
+        {
+            // Channel Mode Messages (reserved Control Changes), only
+            // detected after a status byte
+            if(has_status && type == ControlChange && data[pos] > 119)
+            {
+                incoming_message_.type    = ChannelMode;
+                running_status_           = ChannelMode;
+                incoming_message_.cm_type
+                    = static_cast<ChannelModeType>(data[pos] - 120);
+            }
+            incoming_message_.data[1] = data[pos + 1];
+            // velocity 0 NoteOns are NoteOffs
+            if(running_status_ == NoteOn && data[pos + 1] == 0)
+                incoming_message_.type = NoteOff;
+        }
+        return len;
+    }
+
+    /** Starts the data of a SysEx message */
+    void OpenSysEx();
+
+    /** Adds a SysEx data byte.
+     *  @return true if a full chunk was committed to incoming_message_
+     */
+    bool AppendSysEx(uint8_t byte);
+
+    /** Commits the current chunk to incoming_message_ */
+    void CommitSysEx(uint8_t flags);
+
+    /** Number of data bytes for each channel message type, 0 for messages
+     *  that aren't handled by ParseMessage() */
+    static const uint8_t kDataBytes[MessageLast];
+
     enum ParserState
     {
         ParserEmpty,
@@ -50,6 +168,9 @@ class MidiParser
     ParserState     pstate_;
     MidiEvent       incoming_message_;
     MidiMessageType running_status_;
+    MidiSysExArena *sysex_arena_;
+    bool            sysex_begin_;
+    bool            sysex_lost_;
 
     // Masks to check for message type, and byte content
     const uint8_t kStatusByteMask     = 0x80;
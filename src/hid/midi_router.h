@@ -0,0 +1,779 @@
+#pragma once
+#ifndef DSY_MIDI_ROUTER_H
+#define DSY_MIDI_ROUTER_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+#include <tuple>
+#include <utility>
+#include "hid/midi_parser.h"
+#include "hid/midi_tx_queue.h"
+#include "sys/system.h"
+#include "util/SpscQueue.h"
+
+namespace daisy
+{
+/** @brief   Selects MIDI events by message type and channel
+ *  @details All events pass by default. Clear bits to block events, e.g.
+ *           `filter.realtime &= ~(1 << TimingClock);` to block clock.
+ *  @ingroup midi
+ */
+struct MidiFilter
+{
+    /** bit n lets MidiMessageType n pass */
+    uint16_t types;
+    /** bit n lets channel n (0-15) pass, for channel messages */
+    uint16_t channels;
+    /** bit n lets SystemRealTimeType n pass, for SystemRealTime events */
+    uint16_t realtime;
+
+    MidiFilter() : types(0xffff), channels(0xffff), realtime(0xffff) {}
+
+    /** Returns true if the event passes the filter */
+    bool Passes(const MidiEvent& event) const
+    {
+        if(((types >> event.type) & 1) == 0)
+            return false;
+        if(event.type < SystemCommon || event.type == ChannelMode)
+            return (channels >> event.channel) & 1;
+        if(event.type == SystemRealTime)
+            return (realtime >> event.srt_type) & 1;
+        return true;
+    }
+};
+
+/** A MIDI event received by a MidiRouter
+ *  @ingroup midi
+ */
+struct RoutedMidiEvent
+{
+    MidiEvent event;   /**< & */
+    uint32_t  time_us; /**< System::GetUs() when it was received */
+    uint8_t   port;    /**< index of the transport it came from */
+};
+
+/** True if a MIDI transport can send in the background with TxDma(), like
+ *  MidiUartTransport.
+ *  @ingroup midi
+ */
+template <typename Transport, typename = void>
+struct MidiTransportHasTxDma : std::false_type
+{
+};
+
+template <typename Transport>
+struct MidiTransportHasTxDma<Transport, decltype(void(&Transport::TxDma))>
+: std::true_type
+{
+};
+
+/** @brief   Receiving and sending side of one MidiRouter port
+ *  @details The part of a port that doesn't depend on the transport. The
+ *           transport's receive callback parses into the port's event
+ *           queue, and the router reads from there.
+ *  @ingroup midi
+ */
+class MidiRouterPortBase
+{
+  public:
+    MidiRouterPortBase() {}
+    virtual ~MidiRouterPortBase() {}
+
+    /** Starts receiving, or restarts after an error */
+    virtual void Listen() = 0;
+
+    /** Sends one or more complete messages, see MidiRouter::QueueMessage()
+     *  @return false if they were dropped
+     */
+    virtual bool Send(const uint8_t* bytes, size_t size) = 0;
+
+    /** Sends a realtime byte, see MidiRouter::QueueRealtime(). Without
+     *  DMA transmit, this isn't safe to call during Send().
+     */
+    virtual bool SendRealtime(uint8_t byte) = 0;
+
+    /** Parses received bytes, called from the receive callback */
+    void ParseBuffer(const uint8_t* bytes, size_t size)
+    {
+        EventSink sink = {*this, System::GetUs()};
+        parser_.ParseBuffer(bytes, size, sink);
+    }
+
+    /** Returns the oldest received event, or nullptr */
+    const RoutedMidiEvent* Peek() { return event_q_.Peek(); }
+
+    /** Removes the oldest received event. The SysEx data of an event stays
+     *  valid until ReleaseSysEx().
+     */
+    void Pop()
+    {
+        RoutedMidiEvent event;
+        if(event_q_.Pop(event) && event.event.type == SystemCommon
+           && event.event.sc_type == SystemExclusive)
+            popped_sysex_ = event.event.sysex_chunk;
+    }
+
+    /** Releases the SysEx data of the events popped so far */
+    void ReleaseSysEx()
+    {
+        sysex_arena_.Release(popped_sysex_);
+        popped_sysex_ = MidiSysExArena::kInvalidHandle;
+    }
+
+    const MidiSysExArena& GetSysExArena() const { return sysex_arena_; }
+
+    /** Writes the bytes of an event to dst, which holds at least
+     *  SYSEX_BUFFER_LEN + 2 bytes.
+     *  @return the number of bytes, 0 if the event can't be sent
+     */
+    size_t ToBytes(const MidiEvent& event, uint8_t* dst) const
+    {
+        static const uint8_t kSystemCommonBytes[] = {0, 2, 3, 2, 0, 0, 1, 0};
+        switch(event.type)
+        {
+            case SystemRealTime: dst[0] = 0xF8 + event.srt_type; return 1;
+            case SystemCommon:
+                if(event.sc_type == SystemExclusive)
+                    return SysExToBytes(event, dst);
+                dst[0] = 0xF0 + event.sc_type;
+                dst[1] = event.data[0];
+                dst[2] = event.data[1];
+                return event.sc_type < SystemCommonLast
+                           ? kSystemCommonBytes[event.sc_type]
+                           : 0;
+            default:
+            {
+                const MidiMessageType type
+                    = event.type == ChannelMode ? ControlChange : event.type;
+                dst[0] = 0x80 | (type << 4) | event.channel;
+                dst[1] = event.data[0];
+                dst[2] = event.data[1];
+                return (type == ProgramChange || type == ChannelPressure)
+                           ? 2
+                           : 3;
+            }
+        }
+    }
+
+    /** Returns the number of received events that didn't fit into the
+     *  queue, and of messages that couldn't be sent */
+    uint32_t GetNumDropped() const
+    {
+        return num_rx_dropped_ + tx_queue_.GetNumDropped();
+    }
+
+  protected:
+    void InitBase(uint8_t index)
+    {
+        index_ = index;
+        sysex_arena_.Init(sysex_chunks_, kNumSysExChunks);
+        parser_.Init(&sysex_arena_);
+        popped_sysex_   = MidiSysExArena::kInvalidHandle;
+        num_rx_dropped_ = 0;
+        event_q_.Clear();
+        tx_queue_.Init(true);
+        tx_busy_.store(false);
+    }
+
+    static constexpr size_t kNumSysExChunks = 4;
+
+    uint8_t                         index_;
+    MidiParser                      parser_;
+    SpscQueue<RoutedMidiEvent, 128> event_q_;
+    MidiSysExArena::Chunk           sysex_chunks_[kNumSysExChunks];
+    MidiSysExArena                  sysex_arena_;
+    uint8_t                         popped_sysex_;
+    volatile uint32_t               num_rx_dropped_;
+    MidiTxQueue<256, 16>            tx_queue_;
+    std::atomic<bool>               tx_busy_;
+
+  private:
+    /** Adds the port and time to the parsed events */
+    struct EventSink
+    {
+        MidiRouterPortBase& port;
+        uint32_t            time_us;
+
+        void Push(const MidiEvent& event)
+        {
+            RoutedMidiEvent routed = {event, time_us, port.index_};
+            if(!port.event_q_.Push(routed))
+                port.num_rx_dropped_ = port.num_rx_dropped_ + 1;
+        }
+    };
+
+    size_t SysExToBytes(const MidiEvent& event, uint8_t* dst) const
+    {
+        const SystemExclusiveEvent sysex
+            = event.AsSystemExclusive(sysex_arena_);
+        if(sysex.data == nullptr)
+            return 0;
+        size_t size = 0;
+        if(sysex.begin)
+            dst[size++] = 0xF0;
+        for(int i = 0; i < sysex.length; i++)
+            dst[size++] = sysex.data[i];
+        if(sysex.end)
+            dst[size++] = 0xF7;
+        return size;
+    }
+
+    MidiRouterPortBase(const MidiRouterPortBase&) = delete;
+    MidiRouterPortBase& operator=(const MidiRouterPortBase&) = delete;
+};
+
+/** @brief   A MidiRouter port with its transport
+ *  @ingroup midi
+ */
+template <typename Transport>
+class MidiRouterPort : public MidiRouterPortBase
+{
+  public:
+    MidiRouterPort() : started_(false) {}
+
+    void Init(const typename Transport::Config& config, uint8_t index)
+    {
+        InitBase(index);
+        transport_.Init(config);
+    }
+
+    void Listen() override
+    {
+        transport_.FlushTx();
+        // like MidiHandler::Listen(), the UART disables itself on errors
+        if(!started_ || !transport_.RxActive())
+        {
+            started_ = true;
+            parser_.Reset();
+            transport_.FlushRx();
+            transport_.StartRx(ParseCallback, this);
+        }
+    }
+
+    bool Send(const uint8_t* bytes, size_t size) override
+    {
+        return Send(bytes, size, MidiTransportHasTxDma<Transport>());
+    }
+
+    bool SendRealtime(uint8_t byte) override
+    {
+        return SendRealtime(byte, MidiTransportHasTxDma<Transport>());
+    }
+
+    Transport& GetTransport() { return transport_; }
+
+  private:
+    bool Send(const uint8_t* bytes, size_t size, std::true_type)
+    {
+        const bool queued = tx_queue_.Write(bytes, size);
+        StartTx();
+        return queued;
+    }
+
+    bool SendRealtime(uint8_t byte, std::true_type)
+    {
+        const bool queued = tx_queue_.WriteRealtime(byte);
+        StartTx();
+        return queued;
+    }
+
+    /** Without DMA, the transport sends right away */
+    bool Send(const uint8_t* bytes, size_t size, std::false_type)
+    {
+        transport_.Tx(const_cast<uint8_t*>(bytes), size);
+        return true;
+    }
+
+    bool SendRealtime(uint8_t byte, std::false_type)
+    {
+        transport_.Tx(&byte, 1);
+        return true;
+    }
+
+    /** Same as MidiHandler::StartTx() */
+    void StartTx()
+    {
+        while(!tx_queue_.IsEmpty())
+        {
+            bool idle = false;
+            if(!tx_busy_.compare_exchange_strong(idle, true))
+                return;
+            const size_t size = tx_queue_.Read(transport_.GetTxBuffer(),
+                                               transport_.GetTxBufferSize());
+            if(size > 0 && transport_.TxDma(size, TxCompleteCallback, this))
+                return;
+            tx_busy_.store(false);
+        }
+    }
+
+    static void TxCompleteCallback(void* context)
+    {
+        MidiRouterPort* port = reinterpret_cast<MidiRouterPort*>(context);
+        port->tx_busy_.store(false);
+        port->StartTx();
+    }
+
+    static void ParseCallback(uint8_t* data, size_t size, void* context)
+    {
+        MidiRouterPort* port = reinterpret_cast<MidiRouterPort*>(context);
+        port->ParseBuffer(data, size);
+    }
+
+    Transport transport_;
+    bool      started_;
+};
+
+/**
+    @brief Receives MIDI from several transports as one stream of events,
+    with MIDI thru between them. \n
+    Each transport is a port, numbered in the order of the template
+    arguments. Every port parses in its own receive callback into its own
+    wait-free queue, and PopEvent() merges the queues in the order the
+    events were received, tagged with the port they came from.
+
+    Thru routes forward the events of one port to another, selected with
+    a MidiFilter. An input filter per port selects the events PopEvent()
+    returns. The filters are applied to the events in place, in the port
+    queues, and events that don't pass are never copied out.
+
+    Thru is forwarded when PopEvent() reaches the event, so the main loop
+    should pop all events regularly (even with all input filters closed).
+    On transports with DMA transmit (MidiUartTransport), forwarded messages
+    are queued with running status and sent in the background, so the main
+    loop never waits for the slow UART. Other transports send right away.
+
+    SysEx is forwarded a chunk at a time. While a port's SysEx is being
+    forwarded to a destination, the thru messages of other ports for that
+    destination are held back until its end has been sent, as their status
+    bytes would cut it short. Realtime messages still pass, and PopEvent()
+    returns all events as usual. If the SysEx doesn't go on for
+    kSysExTimeoutUs while messages wait, e.g. because the cable was pulled,
+    it's ended with 0xF7 and the rest of it isn't forwarded.
+
+    @code
+    MidiRouter<MidiUartTransport, MidiUsbTransport> midi;
+    midi.Init(uart_config, usb_config);
+    midi.AddThru(1, 0); // USB to DIN
+    midi.StartReceive();
+    ...
+    midi.Listen();
+    RoutedMidiEvent msg;
+    while(midi.PopEvent(msg))
+        HandleEvent(msg.event, msg.port);
+    @endcode
+    @ingroup midi
+*/
+template <typename... Transports>
+class MidiRouter
+{
+  private:
+    using PortTuple = std::tuple<MidiRouterPort<Transports>...>;
+
+  public:
+    /** Number of ports */
+    static constexpr size_t kNumPorts = sizeof...(Transports);
+
+    /** Maximum number of thru routes */
+    static constexpr size_t kMaxRoutes = 8;
+
+    /** Bytes of thru messages per destination that can wait for the end of
+     *  a SysEx */
+    static constexpr size_t kHeldBytes = 256;
+
+    /** Time without SysEx data after which the SysEx being forwarded to a
+     *  destination is ended, if messages wait for it */
+    static constexpr uint32_t kSysExTimeoutUs = 300000;
+
+    static_assert(kNumPorts > 0 && kNumPorts < 256, "1 to 255 transports");
+
+    MidiRouter() : num_routes_(0), popped_port_(0) {}
+
+    /** Initializes the transports
+     *  \param configs one config per transport, in the same order
+     */
+    void Init(const typename Transports::Config&... configs)
+    {
+        Init(std::index_sequence_for<Transports...>(), configs...);
+        num_routes_  = 0;
+        popped_port_ = 0;
+        for(size_t i = 0; i < kNumPorts; i++)
+        {
+            input_filters_[i]    = MidiFilter();
+            thru_[i].sysex_src   = kNoPort;
+            thru_[i].cut_src     = kNoPort;
+            thru_[i].sysex_us    = 0;
+            thru_[i].held_size   = 0;
+            thru_[i].num_dropped = 0;
+        }
+    }
+
+    /** Starts listening on all ports */
+    void StartReceive() { Listen(); }
+
+    /** Restarts ports that stopped listening, e.g. after a UART error.
+     *  Call this regularly from the main loop.
+     */
+    void Listen()
+    {
+        for(size_t i = 0; i < kNumPorts; i++)
+            ports_[i]->Listen();
+    }
+
+    /** Forwards the events received on one port to another
+     *  \param src    receiving port
+     *  \param dst    sending port
+     *  \param filter events to forward, all by default
+     *  \return false if there's no room for another route, or a port
+     *          doesn't exist
+     */
+    bool AddThru(uint8_t           src,
+                 uint8_t           dst,
+                 const MidiFilter& filter = MidiFilter())
+    {
+        if(num_routes_ >= kMaxRoutes || src >= kNumPorts || dst >= kNumPorts)
+            return false;
+        routes_[num_routes_].src    = src;
+        routes_[num_routes_].dst    = dst;
+        routes_[num_routes_].filter = filter;
+        num_routes_++;
+        return true;
+    }
+
+    /** Removes all thru routes. A SysEx that was being forwarded is ended,
+     *  and the messages that waited for it are sent.
+     */
+    void ClearThru()
+    {
+        num_routes_ = 0;
+        for(size_t i = 0; i < kNumPorts; i++)
+            if(thru_[i].sysex_src != kNoPort)
+                CutSysEx(i);
+    }
+
+    /** Selects the events of a port that PopEvent() returns */
+    void SetInputFilter(uint8_t port, const MidiFilter& filter)
+    {
+        if(port < kNumPorts)
+            input_filters_[port] = filter;
+    }
+
+    /** Pops the oldest event of all ports that passes its port's input
+        filter, and forwards thru the events on the way. The SysEx data of
+        the previously popped event is released.
+        \param event the popped event
+        \return false if no events are left
+    */
+    bool PopEvent(RoutedMidiEvent& event)
+    {
+        ports_[popped_port_]->ReleaseSysEx();
+        CheckSysExTimeouts();
+        for(;;)
+        {
+            const size_t port = FindOldest();
+            if(port >= kNumPorts)
+                return false;
+            const RoutedMidiEvent* next = ports_[port]->Peek();
+            Thru(*next);
+            const bool passes = input_filters_[port].Passes(next->event);
+            if(passes)
+                event = *next;
+            ports_[port]->Pop();
+            if(passes)
+            {
+                popped_port_ = port;
+                return true;
+            }
+            ports_[port]->ReleaseSysEx();
+        }
+    }
+
+    /** Returns the storage of the SysEx data of a port's events, for
+        MidiEvent::AsSystemExclusive(). The data of a popped event stays
+        valid until the next call to PopEvent().
+    */
+    const MidiSysExArena& GetSysExArena(uint8_t port) const
+    {
+        return ports_[port < kNumPorts ? port : 0]->GetSysExArena();
+    }
+
+    /** Sends raw bytes, one or more complete messages, on a port. Like
+        MidiHandler::QueueMessage(), this doesn't block on transports with
+        DMA transmit. Call this from the same context as PopEvent().
+        \return false if the message was dropped
+    */
+    bool QueueMessage(uint8_t port, const uint8_t* bytes, size_t size)
+    {
+        return port < kNumPorts && ports_[port]->Send(bytes, size);
+    }
+
+    /** Sends a realtime byte (e.g. 0xF8 clock) on a port, ahead of the
+        queued messages. On transports with DMA transmit, like
+        MidiHandler::QueueRealtime(), this can be called from another
+        context than PopEvent(). Thru doesn't use this lane. Transports
+        without it (MidiUsbTransport) send right away, through the same
+        buffers as thru, so call this from the same context as PopEvent()
+        for those ports.
+        \return false if the byte was dropped
+    */
+    bool QueueRealtime(uint8_t port, uint8_t byte)
+    {
+        return port < kNumPorts && ports_[port]->SendRealtime(byte);
+    }
+
+    /** Returns the number of events of a port that were dropped, because
+        the receive or send queue was full, or there was no room for thru
+        messages to wait for a SysEx */
+    uint32_t GetNumDropped(uint8_t port) const
+    {
+        return port < kNumPorts
+                   ? ports_[port]->GetNumDropped() + thru_[port].num_dropped
+                   : 0;
+    }
+
+    /** Feeds in bytes as if a port received them, see
+        MidiHandler::ParseBuffer()
+    */
+    void ParseBuffer(uint8_t port, const uint8_t* bytes, size_t size)
+    {
+        if(port < kNumPorts)
+            ports_[port]->ParseBuffer(bytes, size);
+    }
+
+    /** Returns the port with the transport at index I, e.g. for
+        GetPort<0>().GetTransport() */
+    template <size_t I>
+    typename std::tuple_element<I, PortTuple>::type& GetPort()
+    {
+        return std::get<I>(port_storage_);
+    }
+
+  private:
+    static constexpr uint8_t kNoPort = 0xff;
+
+    /** What a thru message is, for the SysEx tracking */
+    enum ThruFlags : uint8_t
+    {
+        kThruRealtime = 1,
+        kThruSysEx    = 2,
+        kThruBegin    = 4,
+        kThruEnd      = 8,
+    };
+
+    struct Route
+    {
+        uint8_t    src;
+        uint8_t    dst;
+        MidiFilter filter;
+    };
+
+    /** Thru state of a destination port. The held messages are records of
+     *  source port, flags, size and bytes, in the order they came in.
+     */
+    struct ThruDestination
+    {
+        uint8_t  sysex_src; // port of the SysEx being forwarded, or kNoPort
+        uint8_t  cut_src;   // port of the SysEx that was ended, or kNoPort
+        uint32_t sysex_us;  // when the SysEx was last forwarded
+        size_t   held_size;
+        uint32_t num_dropped;
+        uint8_t  held[kHeldBytes];
+    };
+
+    template <size_t... I>
+    void Init(std::index_sequence<I...>,
+              const typename Transports::Config&... configs)
+    {
+        MidiRouterPortBase* ports[] = {&std::get<I>(port_storage_)...};
+        for(size_t i = 0; i < kNumPorts; i++)
+            ports_[i] = ports[i];
+        // Init() of each port, with its config and index
+        int unused[] = {(std::get<I>(port_storage_).Init(configs, I), 0)...};
+        (void)unused;
+    }
+
+    /** Returns the port with the oldest event, or kNumPorts */
+    size_t FindOldest()
+    {
+        size_t   oldest = kNumPorts;
+        uint32_t time   = 0;
+        for(size_t i = 0; i < kNumPorts; i++)
+        {
+            const RoutedMidiEvent* event = ports_[i]->Peek();
+            if(event != nullptr
+               && (oldest == kNumPorts || int32_t(event->time_us - time) < 0))
+            {
+                oldest = i;
+                time   = event->time_us;
+            }
+        }
+        return oldest;
+    }
+
+    void Thru(const RoutedMidiEvent& event)
+    {
+        const MidiEvent& e     = event.event;
+        uint8_t          flags = 0;
+        if(e.type == SystemRealTime)
+        {
+            flags = kThruRealtime;
+        }
+        else if(e.type == SystemCommon && e.sc_type == SystemExclusive)
+        {
+            const SystemExclusiveEvent sysex
+                = e.AsSystemExclusive(ports_[event.port]->GetSysExArena());
+            flags = kThruSysEx | (sysex.begin ? kThruBegin : 0)
+                    | (sysex.end ? kThruEnd : 0);
+        }
+
+        uint8_t bytes[SYSEX_BUFFER_LEN + 2];
+        size_t  size = 0;
+        for(size_t i = 0; i < num_routes_; i++)
+        {
+            const Route& route = routes_[i];
+            if(route.src != event.port || !route.filter.Passes(e))
+                continue;
+            if(size == 0)
+                size = ports_[event.port]->ToBytes(e, bytes);
+            if(size == 0)
+                continue;
+            ThruDestination& dst = thru_[route.dst];
+            if(flags == kThruRealtime)
+                ports_[route.dst]->Send(bytes, size);
+            else if(dst.sysex_src != kNoPort && dst.sysex_src != event.port)
+                Hold(dst, event.port, flags, bytes, size);
+            else if(SendThru(route.dst, event.port, flags, bytes, size))
+                FlushHeld(route.dst);
+        }
+    }
+
+    /** Sends a thru message that doesn't have to wait, and tracks the
+     *  SysEx it belongs to. Any message but realtime ends a SysEx.
+     *  \return true if the destination has no open SysEx after it
+     */
+    bool SendThru(size_t         dst,
+                  uint8_t        src,
+                  uint8_t        flags,
+                  const uint8_t* bytes,
+                  size_t         size)
+    {
+        ThruDestination& d = thru_[dst];
+        if(d.cut_src == src)
+        {
+            // the rest of the SysEx that was ended
+            if((flags & kThruSysEx) && !(flags & kThruBegin))
+            {
+                if(flags & kThruEnd)
+                    d.cut_src = kNoPort;
+                return d.sysex_src == kNoPort;
+            }
+            d.cut_src = kNoPort;
+        }
+        ports_[dst]->Send(bytes, size);
+        const bool open = (flags & kThruSysEx) && !(flags & kThruEnd);
+        d.sysex_src     = open ? src : kNoPort;
+        d.sysex_us      = System::GetUs();
+        return !open;
+    }
+
+    /** Keeps a thru message until the SysEx of another port has ended */
+    void Hold(ThruDestination& d,
+              uint8_t          src,
+              uint8_t          flags,
+              const uint8_t*   bytes,
+              size_t           size)
+    {
+        if(d.held_size + 3 + size > kHeldBytes)
+        {
+            d.num_dropped++;
+            return;
+        }
+        d.held[d.held_size]     = src;
+        d.held[d.held_size + 1] = flags;
+        d.held[d.held_size + 2] = uint8_t(size);
+        memcpy(&d.held[d.held_size + 3], bytes, size);
+        d.held_size += 3 + size;
+    }
+
+    /** Sends the held messages that don't have to wait anymore. They may
+     *  open a SysEx themselves, which the messages of the other ports
+     *  wait for. The order of the messages of each port is kept.
+     */
+    void FlushHeld(size_t dst)
+    {
+        ThruDestination& d        = thru_[dst];
+        bool             progress = true;
+        while(progress && d.held_size > 0)
+        {
+            progress = false;
+            bool   waiting[kNumPorts] = {};
+            size_t read = 0, write = 0;
+            while(read < d.held_size)
+            {
+                const uint8_t src    = d.held[read];
+                const size_t  record = 3 + d.held[read + 2];
+                if(!waiting[src]
+                   && (d.sysex_src == kNoPort || d.sysex_src == src))
+                {
+                    SendThru(dst,
+                             src,
+                             d.held[read + 1],
+                             &d.held[read + 3],
+                             d.held[read + 2]);
+                    progress = true;
+                }
+                else
+                {
+                    waiting[src] = true;
+                    memmove(&d.held[write], &d.held[read], record);
+                    write += record;
+                }
+                read += record;
+            }
+            d.held_size = write;
+        }
+    }
+
+    /** Ends the SysEx being forwarded to a destination, so that the held
+     *  messages can go. The rest of it is dropped.
+     */
+    void CutSysEx(size_t dst)
+    {
+        static const uint8_t kEnd = 0xF7;
+        ThruDestination&     d    = thru_[dst];
+        ports_[dst]->Send(&kEnd, 1);
+        d.cut_src   = d.sysex_src;
+        d.sysex_src = kNoPort;
+        FlushHeld(dst);
+    }
+
+    /** Ends the SysEx of a destination that messages wait for, when its
+     *  port has sent nothing for kSysExTimeoutUs
+     */
+    void CheckSysExTimeouts()
+    {
+        const uint32_t now = System::GetUs();
+        for(size_t i = 0; i < kNumPorts; i++)
+        {
+            const ThruDestination& d = thru_[i];
+            if(d.held_size > 0 && d.sysex_src != kNoPort
+               && ports_[d.sysex_src]->Peek() == nullptr
+               && now - d.sysex_us >= kSysExTimeoutUs)
+                CutSysEx(i);
+        }
+    }
+
+    PortTuple           port_storage_;
+    MidiRouterPortBase* ports_[kNumPorts];
+    MidiFilter          input_filters_[kNumPorts];
+    Route               routes_[kMaxRoutes];
+    ThruDestination     thru_[kNumPorts];
+    size_t              num_routes_;
+    size_t              popped_port_;
+};
+
+} // namespace daisy
+
+#endif
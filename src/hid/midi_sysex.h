@@ -0,0 +1,190 @@
+#pragma once
+#ifndef DSY_MIDI_SYSEX_H
+#define DSY_MIDI_SYSEX_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Maximum number of SysEx data bytes in one chunk (and one MidiEvent) */
+#define SYSEX_BUFFER_LEN 128
+
+namespace daisy
+{
+/** @brief   Storage for SysEx data, outside of the MidiEvents
+ *  @details MidiEvents are kept small by storing the data of SysEx messages
+ *           in a pool of fixed size chunks. The parser fills the chunks, and
+ *           each SysEx MidiEvent refers to one of them with a one byte handle.
+ *           Messages longer than SYSEX_BUFFER_LEN are streamed as several
+ *           chunks (and events), so there's no limit on the message length
+ *           as long as the chunks are released in time.
+ *
+ *           Like the SpscQueue, the pool is wait-free for one producer (the
+ *           parser) and one consumer (the code that handles the events).
+ *           Chunks are released in the order they were filled.
+ *  @ingroup midi
+ */
+class MidiSysExArena
+{
+  public:
+    /** Chunk flags */
+    enum Flags : uint8_t
+    {
+        /** the chunk starts a message (follows the 0xF0) */
+        FLAG_BEGIN = 0x01,
+        /** the chunk ends a message (followed by the 0xF7) */
+        FLAG_END = 0x02,
+    };
+
+    /** Data bytes of (part of) a SysEx message */
+    struct Chunk
+    {
+        uint8_t data[SYSEX_BUFFER_LEN];
+        uint8_t size;
+        uint8_t flags;
+    };
+
+    /** Handle of a SysEx event whose data was lost, because all chunks
+     *  were in use */
+    static constexpr uint8_t kInvalidHandle = 0xff;
+
+    /** Largest supported number of chunks */
+    static constexpr size_t kMaxChunks = 64;
+
+    MidiSysExArena() : chunks_(nullptr), mask_(0), open_(false)
+    {
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+    }
+
+    /** Initializes the arena with a pool of chunks.
+     *  @param chunks     storage for the chunks
+     *  @param num_chunks number of chunks, a power of two up to kMaxChunks
+     *  @return false if num_chunks is not supported
+     */
+    bool Init(Chunk* chunks, size_t num_chunks)
+    {
+        if(num_chunks == 0 || num_chunks > kMaxChunks
+           || (num_chunks & (num_chunks - 1)) != 0)
+            return false;
+        chunks_ = chunks;
+        mask_   = uint32_t(num_chunks - 1);
+        open_   = false;
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_release);
+        return true;
+    }
+
+    // ======== producer side ========
+
+    /** Starts filling the next free chunk.
+     *  @return false if all chunks are in use
+     */
+    bool Open()
+    {
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        if(chunks_ == nullptr
+           || head - tail_.load(std::memory_order_acquire) > mask_)
+            return false;
+        chunks_[head & mask_].size = 0;
+        open_                      = true;
+        return true;
+    }
+
+    /** Returns true if a chunk is being filled */
+    bool IsOpen() const { return open_; }
+
+    /** Adds a byte to the open chunk.
+     *  @return false if there's no open chunk or it's full
+     */
+    bool Append(uint8_t byte)
+    {
+        if(!open_)
+            return false;
+        Chunk& c = chunks_[head_.load(std::memory_order_relaxed) & mask_];
+        if(c.size >= SYSEX_BUFFER_LEN)
+            return false;
+        c.data[c.size++] = byte;
+        return true;
+    }
+
+    /** Passes the open chunk to the consumer.
+     *  @param flags combination of Flags
+     *  @return the handle of the chunk, or kInvalidHandle if none was open
+     */
+    uint8_t Commit(uint8_t flags)
+    {
+        if(!open_)
+            return kInvalidHandle;
+        const uint32_t head         = head_.load(std::memory_order_relaxed);
+        chunks_[head & mask_].flags = flags;
+        open_                       = false;
+        head_.store(head + 1, std::memory_order_release);
+        return ToHandle(head);
+    }
+
+    /** Discards the open chunk */
+    void Abort() { open_ = false; }
+
+    // ======== consumer side ========
+
+    /** Returns the chunk of a handle, or nullptr if the handle is invalid
+     *  or the chunk has already been released.
+     */
+    const Chunk* Get(uint8_t handle) const
+    {
+        uint32_t index;
+        if(!FindIndex(handle, index))
+            return nullptr;
+        return &chunks_[index & mask_];
+    }
+
+    /** Releases a chunk, and all chunks filled before it */
+    void Release(uint8_t handle)
+    {
+        uint32_t index;
+        if(FindIndex(handle, index))
+            tail_.store(index + 1, std::memory_order_release);
+    }
+
+    /** Returns the number of chunks that haven't been released */
+    size_t GetNumUsed() const
+    {
+        return head_.load(std::memory_order_acquire)
+               - tail_.load(std::memory_order_acquire);
+    }
+
+  private:
+    // Handles are the low bits of the free running chunk index, which
+    // leaves room for kInvalidHandle.
+    static constexpr uint8_t kHandleMask = 0x7f;
+
+    static uint8_t ToHandle(uint32_t index)
+    {
+        return uint8_t(index & kHandleMask);
+    }
+
+    bool FindIndex(uint8_t handle, uint32_t& index) const
+    {
+        if(handle > kHandleMask || chunks_ == nullptr)
+            return false;
+        const uint32_t tail   = tail_.load(std::memory_order_relaxed);
+        const uint32_t head   = head_.load(std::memory_order_acquire);
+        const uint32_t offset = (handle - ToHandle(tail)) & kHandleMask;
+        index                 = tail + offset;
+        return offset < head - tail;
+    }
+
+    Chunk*                chunks_;
+    uint32_t              mask_;
+    bool                  open_;
+    std::atomic<uint32_t> head_;
+    std::atomic<uint32_t> tail_;
+
+    MidiSysExArena(const MidiSysExArena&) = delete;
+    MidiSysExArena& operator=(const MidiSysExArena&) = delete;
+};
+
+} // namespace daisy
+
+#endif
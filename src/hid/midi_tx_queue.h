@@ -0,0 +1,154 @@
+#pragma once
+#ifndef DSY_MIDI_TX_QUEUE_H
+#define DSY_MIDI_TX_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "util/SpscQueue.h"
+
+namespace daisy
+{
+/** @brief   Queue of outgoing MIDI bytes, with running status
+ *  @details Messages are written to the queue as a whole, or not at all,
+ *           and read in batches by the code that sends them in the
+ *           background (see MidiHandler::QueueMessage()).
+ *
+ *           Repeated status bytes of channel messages are left out
+ *           (running status), which saves a third of the bandwidth for
+ *           dense streams of notes or controllers on one channel.
+ *
+ *           Realtime bytes (e.g. clock) can be written to a separate,
+ *           small lane that is read first. MIDI allows realtime bytes
+ *           anywhere in the stream, even within messages, so they don't
+ *           have to wait for the other queued bytes.
+ *
+ *           Each lane is an SpscQueue: Write() and WriteRealtime() may be
+ *           called from two different contexts, Read() from a third.
+ *  @tparam  kSize         size of the message lane, a power of two
+ *  @tparam  kRealtimeSize size of the realtime lane, a power of two
+ *  @ingroup midi
+ */
+template <size_t kSize = 256, size_t kRealtimeSize = 16>
+class MidiTxQueue
+{
+  public:
+    MidiTxQueue() { Init(); }
+
+    /** Initializes the queue
+     *  @param use_running_status leave out repeated status bytes
+     */
+    void Init(bool use_running_status = true)
+    {
+        use_running_status_   = use_running_status;
+        running_status_       = 0;
+        num_dropped_          = 0;
+        num_dropped_realtime_ = 0;
+        queue_.Clear();
+        realtime_.Clear();
+    }
+
+    /** Adds raw MIDI bytes, one or more complete messages.
+     *  @return false if there's not enough room. Nothing is added then.
+     */
+    bool Write(const uint8_t* bytes, size_t size)
+    {
+        // count the bytes first, so a message is never sent partially
+        uint8_t status = running_status_;
+        size_t  needed = 0;
+        for(size_t i = 0; i < size; i++)
+            needed += IsRepeatedStatus(bytes[i], status) ? 0 : 1;
+        if(needed > kSize - queue_.GetNumElements())
+        {
+            num_dropped_ = num_dropped_ + 1;
+            return false;
+        }
+
+        for(size_t i = 0; i < size; i++)
+            if(!IsRepeatedStatus(bytes[i], running_status_))
+                queue_.Push(bytes[i]);
+        return true;
+    }
+
+    /** Adds a realtime byte (0xF8 - 0xFF) to the realtime lane.
+     *  @return false if the lane is full
+     */
+    bool WriteRealtime(uint8_t byte)
+    {
+        if(!realtime_.Push(byte))
+        {
+            num_dropped_realtime_ = num_dropped_realtime_ + 1;
+            return false;
+        }
+        return true;
+    }
+
+    /** Sends the next status byte, even if it repeats the last one. Call
+     *  this from the context that calls Write(), e.g. once a second, so
+     *  receivers that missed the last status byte can pick up the stream.
+     */
+    void ResetRunningStatus() { running_status_ = 0; }
+
+    /** Removes the next bytes from the queue, realtime bytes first.
+     *  @param dst      destination
+     *  @param max_size maximum number of bytes
+     *  @return the number of bytes written to dst
+     */
+    size_t Read(uint8_t* dst, size_t max_size)
+    {
+        size_t n = 0;
+        while(n < max_size && realtime_.Pop(dst[n]))
+            n++;
+        while(n < max_size && queue_.Pop(dst[n]))
+            n++;
+        return n;
+    }
+
+    /** Returns true if there's nothing to read */
+    bool IsEmpty() const { return realtime_.IsEmpty() && queue_.IsEmpty(); }
+
+    /** Returns the number of bytes waiting to be read */
+    size_t GetNumPending() const
+    {
+        return realtime_.GetNumElements() + queue_.GetNumElements();
+    }
+
+    /** Returns the number of messages and realtime bytes that didn't fit */
+    uint32_t GetNumDropped() const
+    {
+        return num_dropped_ + num_dropped_realtime_;
+    }
+
+  private:
+    /** Tracks the running status of the bytes, returns true if the byte
+     *  can be left out */
+    bool IsRepeatedStatus(uint8_t byte, uint8_t& status) const
+    {
+        // data bytes, and realtime bytes which don't affect running status
+        if(byte < 0x80 || byte >= 0xF8)
+            return false;
+        // system common messages cancel running status
+        if(byte >= 0xF0)
+        {
+            status = 0;
+            return false;
+        }
+        if(use_running_status_ && byte == status)
+            return true;
+        status = byte;
+        return false;
+    }
+
+    SpscQueue<uint8_t, kSize>         queue_;
+    SpscQueue<uint8_t, kRealtimeSize> realtime_;
+    bool                              use_running_status_;
+    uint8_t                           running_status_;
+    volatile uint32_t                 num_dropped_;          // Write()
+    volatile uint32_t                 num_dropped_realtime_; // WriteRealtime()
+
+    MidiTxQueue(const MidiTxQueue&) = delete;
+    MidiTxQueue& operator=(const MidiTxQueue&) = delete;
+};
+
+} // namespace daisy
+
+#endif
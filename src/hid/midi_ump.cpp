@@ -0,0 +1,343 @@
+#include "midi_ump.h"
+
+using namespace daisy;
+
+constexpr size_t UmpTranslator::kMaxMidiEvents;
+
+namespace
+{
+/** Fills in a channel message, like MidiParser does for its bytes */
+size_t SetChannelEvent(MidiEvent      *event,
+                       MidiMessageType type,
+                       uint8_t         channel,
+                       uint8_t         d0,
+                       uint8_t         d1)
+{
+    *event         = MidiEvent();
+    event->type    = type;
+    event->channel = channel;
+    event->data[0] = d0 & 0x7f;
+    event->data[1] = d1 & 0x7f;
+    // Channel Mode Messages (reserved Control Changes)
+    if(type == ControlChange && event->data[0] > 119)
+    {
+        event->type    = ChannelMode;
+        event->cm_type = static_cast<ChannelModeType>(event->data[0] - 120);
+    }
+    // velocity 0 NoteOns are NoteOffs
+    if(type == NoteOn && event->data[1] == 0)
+        event->type = NoteOff;
+    return 1;
+}
+
+} // namespace
+
+void UmpTranslator::Init(const Config &config)
+{
+    config_ = config;
+    for(ChannelState &ch : channels_)
+    {
+        ch.param[0]   = 127;
+        ch.param[1]   = 127;
+        ch.bank[0]    = 0;
+        ch.bank[1]    = 0;
+        ch.data_msb   = 0;
+        ch.nrpn       = false;
+        ch.bank_valid = false;
+    }
+    sysex_parser_.Init(config.sysex_arena);
+    sysex_open_ = false;
+}
+
+uint32_t
+UmpTranslator::Upscale(uint32_t value, uint8_t src_bits, uint8_t dst_bits)
+{
+    const uint8_t  scale_bits = dst_bits - src_bits;
+    const uint32_t center     = 1u << (src_bits - 1);
+    uint32_t       result     = value << scale_bits;
+    if(value <= center)
+        return result;
+    // above the center, the bits below the MSB are repeated to fill the
+    // new lower bits
+    const uint8_t repeat_bits = src_bits - 1;
+    uint32_t      repeat      = value & (center - 1);
+    if(scale_bits > repeat_bits)
+        repeat <<= scale_bits - repeat_bits;
+    else
+        repeat >>= repeat_bits - scale_bits;
+    while(repeat != 0)
+    {
+        result |= repeat;
+        repeat >>= repeat_bits;
+    }
+    return result;
+}
+
+size_t UmpTranslator::Translate(const UmpEvent &ump, MidiEvent *events)
+{
+    const uint32_t word    = ump.words[0];
+    const uint8_t  status  = ump.GetStatus();
+    const uint8_t  channel = ump.GetChannel();
+    const uint8_t  d0      = (word >> 8) & 0x7f;
+    const uint8_t  d1      = word & 0x7f;
+    // note off to pitch bend, like the MIDI 1.0 status
+    const MidiMessageType type
+        = static_cast<MidiMessageType>((status >> 4) & 0x07);
+    switch(ump.GetMessageType())
+    {
+        case UmpMessageType::System:
+            *events = MidiEvent();
+            if(status >= 0xf8)
+            {
+                events->type     = SystemRealTime;
+                events->srt_type = static_cast<SystemRealTimeType>(status & 7);
+            }
+            else if(status > 0xf0)
+            {
+                events->type    = SystemCommon;
+                events->sc_type = static_cast<SystemCommonType>(status & 7);
+                events->data[0] = d0;
+                events->data[1] = d1;
+            }
+            else
+            {
+                return 0;
+            }
+            return 1;
+
+        case UmpMessageType::Midi1ChannelVoice:
+            if(status < 0x80 || status >= 0xf0)
+                return 0;
+            return SetChannelEvent(events, type, channel, d0, d1);
+
+        case UmpMessageType::Data64: return TranslateSysEx(ump, events);
+
+        case UmpMessageType::Midi2ChannelVoice: break;
+
+        default: return 0;
+    }
+
+    const uint32_t value = ump.words[1];
+    switch(ump.GetMidi2Status())
+    {
+        case Midi2Status::NoteOff:
+        case Midi2Status::NoteOn:
+        {
+            // a MIDI 2.0 note on can have velocity 0, MIDI 1.0 uses 1
+            uint8_t velocity = Downscale(value >> 16, 16, 7);
+            if(velocity == 0 && ump.GetMidi2Status() == Midi2Status::NoteOn)
+                velocity = 1;
+            return SetChannelEvent(events, type, channel, d0, velocity);
+        }
+        case Midi2Status::PolyPressure:
+            return SetChannelEvent(events,
+                                   PolyphonicKeyPressure,
+                                   channel,
+                                   d0,
+                                   Downscale(value, 32, 7));
+        case Midi2Status::ControlChange:
+            return SetChannelEvent(
+                events, ControlChange, channel, d0, Downscale(value, 32, 7));
+        case Midi2Status::ChannelPressure:
+            return SetChannelEvent(
+                events, ChannelPressure, channel, Downscale(value, 32, 7), 0);
+        case Midi2Status::PitchBend:
+        {
+            const uint32_t bend = Downscale(value, 32, 14);
+            return SetChannelEvent(
+                events, PitchBend, channel, bend & 0x7f, bend >> 7);
+        }
+        case Midi2Status::ProgramChange:
+        {
+            size_t num = 0;
+            if(word & 0x01)
+            {
+                num += SetChannelEvent(
+                    events + num, ControlChange, channel, 0, value >> 8);
+                num += SetChannelEvent(
+                    events + num, ControlChange, channel, 32, value);
+            }
+            num += SetChannelEvent(
+                events + num, ProgramChange, channel, value >> 24, 0);
+            return num;
+        }
+        case Midi2Status::RegisteredController:
+        case Midi2Status::AssignableController:
+        {
+            const bool nrpn
+                = ump.GetMidi2Status() == Midi2Status::AssignableController;
+            const uint32_t data = Downscale(value, 32, 14);
+            size_t         num  = 0;
+            num += SetChannelEvent(
+                events + num, ControlChange, channel, nrpn ? 99 : 101, d0);
+            num += SetChannelEvent(
+                events + num, ControlChange, channel, nrpn ? 98 : 100, d1);
+            num += SetChannelEvent(
+                events + num, ControlChange, channel, 6, data >> 7);
+            num += SetChannelEvent(
+                events + num, ControlChange, channel, 38, data);
+            return num;
+        }
+        default: return 0;
+    }
+}
+
+size_t UmpTranslator::TranslateSysEx(const UmpEvent &ump, MidiEvent *events)
+{
+    // The bytes go through a MidiParser, which streams them into the
+    // arena. At most one chunk fills up in a packet, plus the end.
+    const UmpSysExEvent sysex = ump.AsSysEx();
+    const bool          start = sysex.status == UmpSysExStatus::Complete
+                       || sysex.status == UmpSysExStatus::Start;
+    const bool end = sysex.status == UmpSysExStatus::Complete
+                     || sysex.status == UmpSysExStatus::End;
+    size_t num = 0;
+    if(start)
+    {
+        // drops a message that didn't end
+        sysex_parser_.Reset();
+        sysex_parser_.Parse(0xf0, nullptr);
+        sysex_open_ = true;
+    }
+    else if(!sysex_open_)
+    {
+        // the rest of a message whose start was lost, which the parser
+        // would take for running status
+        return 0;
+    }
+    for(uint8_t i = 0; i < sysex.size; i++)
+        num += sysex_parser_.Parse(sysex.data[i] & 0x7f, events + num);
+    if(end)
+    {
+        num += sysex_parser_.Parse(0xf7, events + num);
+        sysex_open_ = false;
+    }
+    return num;
+}
+
+bool UmpTranslator::Translate(const MidiEvent &event, UmpEvent *ump)
+{
+    const uint8_t group = config_.group;
+    const uint8_t d0    = event.data[0] & 0x7f;
+    const uint8_t d1    = event.data[1] & 0x7f;
+    switch(event.type)
+    {
+        case SystemRealTime:
+            *ump = UmpEvent::MakeSystem(group, 0xf8 | event.srt_type);
+            return true;
+        case SystemCommon:
+            switch(event.sc_type)
+            {
+                case MTCQuarterFrame:
+                case SongSelect:
+                    *ump = UmpEvent::MakeSystem(
+                        group, 0xf0 | event.sc_type, d0);
+                    return true;
+                case SongPositionPointer:
+                    *ump = UmpEvent::MakeSystem(
+                        group, 0xf0 | event.sc_type, d0, d1);
+                    return true;
+                case TuneRequest:
+                    *ump = UmpEvent::MakeSystem(group, 0xf0 | event.sc_type);
+                    return true;
+                default: return false;
+            }
+        case ControlChange:
+        case ChannelMode:
+            if(config_.protocol == Protocol::MIDI2)
+                return TranslateControlChange(event, ump);
+            break;
+        default:
+            if(event.type >= MessageLast)
+                return false;
+            break;
+    }
+
+    // Channel Mode Messages are Control Changes
+    const uint8_t type   = event.type == ChannelMode ? ControlChange
+                                                     : event.type;
+    const uint8_t status = uint8_t((type | 0x08) << 4) | (event.channel & 0x0f);
+    if(config_.protocol == Protocol::MIDI1)
+    {
+        const bool one_byte = type == ProgramChange || type == ChannelPressure;
+        *ump = UmpEvent::MakeMidi1(group, status, d0, one_byte ? 0 : d1);
+        return true;
+    }
+
+    const ChannelState &ch = channels_[event.channel & 0x0f];
+    switch(type)
+    {
+        case NoteOff:
+        case NoteOn:
+            *ump = UmpEvent::MakeMidi2(
+                group, status, d0, 0, Upscale(d1, 7, 16) << 16);
+            return true;
+        case PolyphonicKeyPressure:
+            *ump = UmpEvent::MakeMidi2(
+                group, status, d0, 0, Upscale(d1, 7, 32));
+            return true;
+        case ProgramChange:
+            *ump = UmpEvent::MakeMidi2(group,
+                                       status,
+                                       0,
+                                       ch.bank_valid,
+                                       uint32_t(d0) << 24
+                                           | uint32_t(ch.bank[0]) << 8
+                                           | ch.bank[1]);
+            return true;
+        case ChannelPressure:
+            *ump = UmpEvent::MakeMidi2(group, status, 0, 0, Upscale(d0, 7, 32));
+            return true;
+        case PitchBend:
+            *ump = UmpEvent::MakeMidi2(
+                group, status, 0, 0, Upscale(d1 << 7 | d0, 14, 32));
+            return true;
+        default: return false;
+    }
+}
+
+bool UmpTranslator::TranslateControlChange(const MidiEvent &event,
+                                           UmpEvent        *ump)
+{
+    const uint8_t channel = event.channel & 0x0f;
+    const uint8_t number  = event.data[0] & 0x7f;
+    const uint8_t value   = event.data[1] & 0x7f;
+    ChannelState &ch      = channels_[channel];
+    uint8_t       lsb     = 0;
+    switch(number)
+    {
+        case 0:
+        case 32:
+            ch.bank[number == 32] = value;
+            ch.bank_valid         = true;
+            return false;
+        case 99:
+        case 98:
+        case 101:
+        case 100:
+            ch.nrpn                       = number < 100;
+            ch.param[(number & 0x01) == 0] = value;
+            return false;
+        case 38: lsb = value; break;
+        case 6: ch.data_msb = value; break;
+        default:
+            *ump = UmpEvent::MakeMidi2(config_.group,
+                                       0xb0 | channel,
+                                       number,
+                                       0,
+                                       Upscale(value, 7, 32));
+            return true;
+    }
+
+    // data entry, without a parameter it's dropped
+    if(ch.param[0] == 127 && ch.param[1] == 127)
+        return false;
+    const Midi2Status status = ch.nrpn ? Midi2Status::AssignableController
+                                       : Midi2Status::RegisteredController;
+    *ump = UmpEvent::MakeMidi2(config_.group,
+                               uint8_t(uint8_t(status) << 4 | channel),
+                               ch.param[0],
+                               ch.param[1],
+                               Upscale(ch.data_msb << 7 | lsb, 14, 32));
+    return true;
+}
@@ -0,0 +1,570 @@
+#pragma once
+#ifndef DSY_MIDI_UMP_H
+#define DSY_MIDI_UMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hid/MidiEvent.h"
+#include "hid/midi_parser.h"
+
+namespace daisy
+{
+/** @addtogroup midi
+ *  @{
+ */
+
+/** @defgroup midi_ump MIDI_UMP
+ *  @brief MIDI 2.0 Universal MIDI Packets
+ *  @{
+ */
+
+/** Message type of a Universal MIDI Packet, the upper 4 bits of its first
+ *  word. The message type gives the size of the packet.
+ */
+enum class UmpMessageType : uint8_t
+{
+    Utility           = 0x0, /**< NOOP, jitter reduction timestamps */
+    System            = 0x1, /**< system common and realtime */
+    Midi1ChannelVoice = 0x2, /**< MIDI 1.0 channel voice messages */
+    Data64            = 0x3, /**< SysEx with 7 bit data */
+    Midi2ChannelVoice = 0x4, /**< MIDI 2.0 channel voice messages */
+    Data128           = 0x5, /**< SysEx with 8 bit data, mixed data sets */
+    FlexData          = 0xD, /**< & */
+    Stream            = 0xF, /**< & */
+};
+
+/** Status of MIDI 2.0 channel voice messages, the upper 4 bits of the
+ *  status byte. Note off to pitch bend are the same as in MIDI 1.0.
+ */
+enum class Midi2Status : uint8_t
+{
+    RegisteredPerNoteController  = 0x0, /**< & */
+    AssignablePerNoteController  = 0x1, /**< & */
+    RegisteredController         = 0x2, /**< RPN */
+    AssignableController         = 0x3, /**< NRPN */
+    RelativeRegisteredController = 0x4, /**< & */
+    RelativeAssignableController = 0x5, /**< & */
+    PerNotePitchBend             = 0x6, /**< & */
+    NoteOff                      = 0x8, /**< & */
+    NoteOn                       = 0x9, /**< & */
+    PolyPressure                 = 0xA, /**< & */
+    ControlChange                = 0xB, /**< & */
+    ProgramChange                = 0xC, /**< & */
+    ChannelPressure              = 0xD, /**< & */
+    PitchBend                    = 0xE, /**< & */
+    PerNoteManagement            = 0xF, /**< & */
+};
+
+/** Position of a SysEx packet (Data64) in its message */
+enum class UmpSysExStatus : uint8_t
+{
+    Complete = 0x0, /**< the whole message in one packet */
+    Start    = 0x1, /**< & */
+    Continue = 0x2, /**< & */
+    End      = 0x3, /**< & */
+};
+
+/** MIDI 2.0 note on or off. Can be made from UmpEvent */
+struct Midi2NoteEvent
+{
+    uint8_t  channel;        /**< & */
+    uint8_t  note;           /**< & */
+    uint16_t velocity;       /**< & */
+    uint8_t  attribute_type; /**< 0 for none, 3 for pitch 7.9 */
+    uint16_t attribute;      /**< & */
+};
+
+/** MIDI 2.0 control change, registered (RPN) or assignable (NRPN)
+ *  controller, or per note controller. Can be made from UmpEvent
+ */
+struct Midi2ControllerEvent
+{
+    uint8_t  channel; /**< & */
+    uint8_t  note;    /**< per note controllers only */
+    uint8_t  bank;    /**< RPN/NRPN only, the MSB of the parameter */
+    uint8_t  index;   /**< controller number, or the LSB of the parameter */
+    uint32_t value;   /**< signed for the relative controllers */
+};
+
+/** MIDI 2.0 poly or channel pressure. Can be made from UmpEvent */
+struct Midi2PressureEvent
+{
+    uint8_t  channel; /**< & */
+    uint8_t  note;    /**< poly pressure only */
+    uint32_t value;   /**< & */
+};
+
+/** MIDI 2.0 pitch bend or per note pitch bend, centered at 0x80000000.
+ *  Can be made from UmpEvent
+ */
+struct Midi2PitchBendEvent
+{
+    uint8_t  channel; /**< & */
+    uint8_t  note;    /**< per note pitch bend only */
+    uint32_t value;   /**< & */
+};
+
+/** MIDI 2.0 program change, with the bank. Can be made from UmpEvent */
+struct Midi2ProgramChangeEvent
+{
+    uint8_t  channel;    /**< & */
+    uint8_t  program;    /**< & */
+    bool     bank_valid; /**< & */
+    uint16_t bank;       /**< 14 bits, MSB and LSB */
+};
+
+/** Up to 6 bytes of a SysEx message (without 0xF0 and 0xF7).
+ *  Can be made from UmpEvent
+ */
+struct UmpSysExEvent
+{
+    UmpSysExStatus status;  /**< & */
+    uint8_t        size;    /**< & */
+    uint8_t        data[6]; /**< & */
+};
+
+/** A Universal MIDI Packet of 1 to 4 32 bit words, unused words are 0.
+ *  Holds any type of message, the As*() functions decode them and the
+ *  Make*() functions build them.
+ */
+struct UmpEvent
+{
+    uint32_t words[4]; /**< & */
+
+    /** Returns the number of words of the packet that starts with a word */
+    static size_t GetNumWords(uint32_t first_word)
+    {
+        // 2 bits per message type, the number of words - 1
+        return 1 + ((0xfe950d40u >> ((first_word >> 28) * 2)) & 0x3);
+    }
+
+    size_t         GetNumWords() const { return GetNumWords(words[0]); }
+    UmpMessageType GetMessageType() const
+    {
+        return static_cast<UmpMessageType>(words[0] >> 28);
+    }
+    uint8_t GetGroup() const { return (words[0] >> 24) & 0x0f; }
+
+    /** Returns the status byte of system and channel voice messages */
+    uint8_t GetStatus() const { return (words[0] >> 16) & 0xff; }
+
+    /** Returns the channel of channel voice messages */
+    uint8_t GetChannel() const { return (words[0] >> 16) & 0x0f; }
+
+    /** Returns the status of MIDI 2.0 channel voice messages */
+    Midi2Status GetMidi2Status() const
+    {
+        return static_cast<Midi2Status>((words[0] >> 20) & 0x0f);
+    }
+
+    /** Returns the data of a MIDI 2.0 note on or off */
+    Midi2NoteEvent AsNote() const
+    {
+        Midi2NoteEvent m;
+        m.channel        = GetChannel();
+        m.note           = (words[0] >> 8) & 0x7f;
+        m.attribute_type = words[0] & 0xff;
+        m.velocity       = words[1] >> 16;
+        m.attribute      = words[1] & 0xffff;
+        return m;
+    }
+
+    /** Returns the data of a MIDI 2.0 control change, RPN/NRPN (also
+     *  relative) or per note controller */
+    Midi2ControllerEvent AsController() const
+    {
+        const Midi2Status status = GetMidi2Status();
+        const bool        cc     = status == Midi2Status::ControlChange;
+        const bool rpn = status >= Midi2Status::RegisteredController
+                         && status <= Midi2Status::RelativeAssignableController;
+        Midi2ControllerEvent m;
+        m.channel = GetChannel();
+        m.note    = cc || rpn ? 0 : (words[0] >> 8) & 0x7f;
+        m.bank    = rpn ? (words[0] >> 8) & 0x7f : 0;
+        m.index   = cc ? (words[0] >> 8) & 0x7f : words[0] & 0xff;
+        m.value   = words[1];
+        return m;
+    }
+
+    /** Returns the data of a MIDI 2.0 poly or channel pressure */
+    Midi2PressureEvent AsPressure() const
+    {
+        Midi2PressureEvent m;
+        m.channel = GetChannel();
+        m.note    = (words[0] >> 8) & 0x7f;
+        m.value   = words[1];
+        return m;
+    }
+
+    /** Returns the data of a MIDI 2.0 pitch bend or per note pitch bend */
+    Midi2PitchBendEvent AsPitchBend() const
+    {
+        Midi2PitchBendEvent m;
+        m.channel = GetChannel();
+        m.note    = (words[0] >> 8) & 0x7f;
+        m.value   = words[1];
+        return m;
+    }
+
+    /** Returns the data of a MIDI 2.0 program change */
+    Midi2ProgramChangeEvent AsProgramChange() const
+    {
+        Midi2ProgramChangeEvent m;
+        m.channel    = GetChannel();
+        m.bank_valid = words[0] & 0x01;
+        m.program    = (words[1] >> 24) & 0x7f;
+        m.bank       = ((words[1] >> 1) & 0x3f80) | (words[1] & 0x7f);
+        return m;
+    }
+
+    /** Returns the data of a SysEx packet (Data64) */
+    UmpSysExEvent AsSysEx() const
+    {
+        UmpSysExEvent m;
+        m.status = static_cast<UmpSysExStatus>((words[0] >> 20) & 0x0f);
+        m.size   = (words[0] >> 16) & 0x0f;
+        if(m.size > 6)
+            m.size = 6;
+        m.data[0] = words[0] >> 8;
+        m.data[1] = words[0];
+        m.data[2] = words[1] >> 24;
+        m.data[3] = words[1] >> 16;
+        m.data[4] = words[1] >> 8;
+        m.data[5] = words[1];
+        return m;
+    }
+
+    /** Makes a system common or realtime message */
+    static UmpEvent
+    MakeSystem(uint8_t group, uint8_t status, uint8_t d0 = 0, uint8_t d1 = 0)
+    {
+        return MakeWord(UmpMessageType::System, group, status, d0, d1);
+    }
+
+    /** Makes a MIDI 1.0 channel voice message
+     *  \param status status byte, with the channel
+     */
+    static UmpEvent
+    MakeMidi1(uint8_t group, uint8_t status, uint8_t d0, uint8_t d1 = 0)
+    {
+        return MakeWord(
+            UmpMessageType::Midi1ChannelVoice, group, status, d0, d1);
+    }
+
+    /** Makes a MIDI 2.0 channel voice message
+     *  \param status status byte, with the channel
+     *  \param index  note, controller number or bank, depending on status
+     *  \param index2 attribute type, per note controller, or the LSB of
+     *                the parameter
+     *  \param value  the second word
+     */
+    static UmpEvent MakeMidi2(uint8_t  group,
+                              uint8_t  status,
+                              uint8_t  index,
+                              uint8_t  index2,
+                              uint32_t value)
+    {
+        UmpEvent ump = MakeWord(
+            UmpMessageType::Midi2ChannelVoice, group, status, index, index2);
+        ump.words[1] = value;
+        return ump;
+    }
+
+    /** Makes a SysEx packet (Data64) with up to 6 bytes */
+    static UmpEvent MakeSysEx(uint8_t        group,
+                              UmpSysExStatus status,
+                              const uint8_t* data,
+                              size_t         size)
+    {
+        uint8_t bytes[6] = {};
+        for(size_t i = 0; i < size && i < 6; i++)
+            bytes[i] = data[i];
+        UmpEvent ump = MakeWord(UmpMessageType::Data64,
+                                group,
+                                uint8_t(uint8_t(status) << 4 | size),
+                                bytes[0],
+                                bytes[1]);
+        ump.words[1] = uint32_t(bytes[2]) << 24 | uint32_t(bytes[3]) << 16
+                       | uint32_t(bytes[4]) << 8 | bytes[5];
+        return ump;
+    }
+
+  private:
+    static UmpEvent MakeWord(UmpMessageType type,
+                             uint8_t        group,
+                             uint8_t        b1,
+                             uint8_t        b2,
+                             uint8_t        b3)
+    {
+        UmpEvent ump = UmpEvent();
+        ump.words[0] = uint32_t(type) << 28 | uint32_t(group & 0x0f) << 24
+                       | uint32_t(b1) << 16 | uint32_t(b2) << 8 | b3;
+        return ump;
+    }
+};
+
+static_assert(sizeof(UmpEvent) == 16, "UmpEvent is one 128 bit packet");
+
+/** @brief   Assembles Universal MIDI Packets from a stream of 32 bit words
+ *  @details The first word of a packet gives its size, so packets are
+ *           assembled a word at a time, without the per byte state machine
+ *           of the MidiParser. ParseBuffer() copies the packets that are
+ *           complete in the buffer as a whole.
+ *
+ *           ParseBytes() takes the bytes received by a byte oriented
+ *           transport, with the words in little endian order (like USB
+ *           MIDI 2.0).
+ *  @ingroup midi
+ */
+class UmpParser
+{
+  public:
+    UmpParser() { Reset(); }
+
+    /**
+     * @brief Parse one word. If the word completes a packet, it's assigned
+     *        to the dereferenced output pointer.
+     *
+     * @param word      next word of the stream
+     * @param event_out Pointer to output event object, value assigned on
+     *                  parse success
+     * @return true     If a packet was completed
+     */
+    bool Parse(uint32_t word, UmpEvent *event_out)
+    {
+        if(num_words_ == 0)
+        {
+            packet_ = UmpEvent();
+            size_   = UmpEvent::GetNumWords(word);
+        }
+        packet_.words[num_words_++] = word;
+        if(num_words_ < size_)
+            return false;
+        num_words_ = 0;
+        if(event_out != nullptr)
+            *event_out = packet_;
+        return true;
+    }
+
+    /**
+     * @brief Parse a buffer of words, passing each packet to
+     *        sink.Push(const UmpEvent&). The results are the same as
+     *        calling Parse() for each word.
+     *
+     * @param words UMP words
+     * @param size  Number of words
+     * @param sink  Destination of the packets
+     */
+    template <typename Sink>
+    void ParseBuffer(const uint32_t *words, size_t size, Sink &sink)
+    {
+        const uint32_t *const end = words + size;
+        UmpEvent              event;
+        while(words < end)
+        {
+            const size_t len = UmpEvent::GetNumWords(*words);
+            if(num_words_ == 0 && size_t(end - words) >= len)
+            {
+                event = UmpEvent();
+                for(size_t i = 0; i < len; i++)
+                    event.words[i] = words[i];
+                sink.Push(event);
+                words += len;
+            }
+            else if(Parse(*words++, &event))
+            {
+                sink.Push(event);
+            }
+        }
+    }
+
+    /**
+     * @brief Parse a buffer of bytes, the words in little endian order.
+     *        Words may be split between buffers.
+     *
+     * @param data Raw bytes
+     * @param size Number of bytes
+     * @param sink Destination of the packets
+     */
+    template <typename Sink>
+    void ParseBytes(const uint8_t *data, size_t size, Sink &sink)
+    {
+        UmpEvent event;
+        for(size_t i = 0; i < size; i++)
+        {
+            word_ |= uint32_t(data[i]) << (8 * num_bytes_);
+            if(++num_bytes_ < 4)
+                continue;
+            if(Parse(word_, &event))
+                sink.Push(event);
+            word_      = 0;
+            num_bytes_ = 0;
+        }
+    }
+
+    /** Drops an incomplete packet */
+    void Reset()
+    {
+        num_words_ = 0;
+        size_      = 0;
+        word_      = 0;
+        num_bytes_ = 0;
+    }
+
+  private:
+    UmpEvent packet_;
+    size_t   num_words_;
+    size_t   size_;
+    uint32_t word_;
+    uint8_t  num_bytes_;
+};
+
+/** @brief   Translates between Universal MIDI Packets and MidiEvents
+ *  @details Translation follows the MIDI 2.0 specification.
+ *
+ *           To MidiEvents: MIDI 1.0 channel voice and system messages are
+ *           copied. MIDI 2.0 channel voice messages are scaled down to 7
+ *           (or 14) bits. An RPN/NRPN becomes CC 101/100 (99/98), 6 and
+ *           38, a program change with a bank becomes CC 0 and 32 and the
+ *           program change. SysEx packets are collected in a
+ *           MidiSysExArena, like by the MidiParser. Per note and relative
+ *           controllers, per note pitch bend and management, and the
+ *           other message types have no MIDI 1.0 version and are dropped.
+ *           The group is dropped, too.
+ *
+ *           From MidiEvents: as MIDI 1.0 channel voice messages in UMP,
+ *           or scaled up to MIDI 2.0 channel voice messages. For MIDI 2.0,
+ *           the RPN/NRPN and bank select CCs are collected per channel.
+ *           Data entry (CC 6 and 38) becomes a single RPN/NRPN message with
+ *           the 14 bit value, and the bank is sent with the program change.
+ *  @ingroup midi
+ */
+class UmpTranslator
+{
+  public:
+    /** Protocol of the channel voice messages made from MidiEvents */
+    enum class Protocol : uint8_t
+    {
+        MIDI1,
+        MIDI2,
+    };
+
+    struct Config
+    {
+        Protocol protocol;
+        /** group of the packets made from MidiEvents */
+        uint8_t group;
+        /** Storage for the data of SysEx messages made from UMP. Only
+         *  used by the translator, the arena has one producer. */
+        MidiSysExArena *sysex_arena;
+
+        Config() : protocol(Protocol::MIDI2), group(0), sysex_arena(nullptr)
+        {
+        }
+    };
+
+    UmpTranslator() {}
+
+    /** Initializes the translator, and clears the per channel state */
+    void Init(const Config &config);
+
+    /** Translates a packet to 0 to 4 MidiEvents, each is passed to
+     *  sink.Push(const MidiEvent&), e.g. an SpscQueue<MidiEvent, N>.
+     */
+    template <typename Sink>
+    void ToMidiEvents(const UmpEvent &ump, Sink &sink)
+    {
+        MidiEvent    events[kMaxMidiEvents];
+        const size_t num = Translate(ump, events);
+        for(size_t i = 0; i < num; i++)
+            sink.Push(events[i]);
+    }
+
+    /** Translates a MidiEvent to 0 or more packets, each is passed to
+     *  sink.Push(const UmpEvent&). SysEx events need the arena that holds
+     *  their data, they become one packet per 6 bytes.
+     */
+    template <typename Sink>
+    void FromMidiEvent(const MidiEvent      &event,
+                       Sink                 &sink,
+                       const MidiSysExArena *arena = nullptr)
+    {
+        if(event.type == SystemCommon && event.sc_type == SystemExclusive)
+        {
+            if(arena == nullptr)
+                return;
+            const SystemExclusiveEvent sysex = event.AsSystemExclusive(*arena);
+            if(sysex.data == nullptr)
+                return;
+            // also one packet for a message without data
+            int pos = 0;
+            do
+            {
+                const int  size  = sysex.length - pos < 6 ? sysex.length - pos
+                                                          : 6;
+                const bool first = sysex.begin && pos == 0;
+                const bool last  = sysex.end && pos + size == sysex.length;
+                const UmpSysExStatus status
+                    = first ? (last ? UmpSysExStatus::Complete
+                                    : UmpSysExStatus::Start)
+                            : (last ? UmpSysExStatus::End
+                                    : UmpSysExStatus::Continue);
+                sink.Push(UmpEvent::MakeSysEx(
+                    config_.group, status, sysex.data + pos, size));
+                pos += size;
+            } while(pos < sysex.length);
+            return;
+        }
+        UmpEvent ump;
+        if(Translate(event, &ump))
+            sink.Push(ump);
+    }
+
+    /** Scales a value up with the min-center-max method of the MIDI 2.0
+     *  specification: 0, the center and the maximum are kept, and scaling
+     *  down with Downscale() returns the original value.
+     */
+    static uint32_t Upscale(uint32_t value, uint8_t src_bits, uint8_t dst_bits);
+
+    /** Scales a value down by dropping the lower bits */
+    static uint32_t
+    Downscale(uint32_t value, uint8_t src_bits, uint8_t dst_bits)
+    {
+        return value >> (src_bits - dst_bits);
+    }
+
+  private:
+    static constexpr size_t kMaxMidiEvents = 4;
+
+    /** @return the number of events */
+    size_t Translate(const UmpEvent &ump, MidiEvent *events);
+
+    size_t TranslateSysEx(const UmpEvent &ump, MidiEvent *events);
+
+    /** @return false if the event doesn't make a packet (by itself) */
+    bool Translate(const MidiEvent &event, UmpEvent *ump);
+
+    bool TranslateControlChange(const MidiEvent &event, UmpEvent *ump);
+
+    /** RPN/NRPN and bank select of a channel, in MIDI 2.0 mode */
+    struct ChannelState
+    {
+        uint8_t param[2]; // MSB and LSB, 127 for none
+        uint8_t bank[2];
+        uint8_t data_msb;
+        bool    nrpn;
+        bool    bank_valid;
+    };
+
+    Config       config_;
+    ChannelState channels_[16];
+    MidiParser   sysex_parser_;
+    bool         sysex_open_;
+};
+
+/** @} */ // End midi_ump
+
+/** @} */ // End midi
+} // namespace daisy
+
+#endif
@@ -29,14 +29,16 @@ class MidiUsbTransport
         Periph periph;
 
         /**
-         * When sending MIDI messages immediately back-to-back in user code,
-         * sometimes the USB CDC driver is still "busy".
+         * Messages are collected into a buffer of up to 64 bytes (16
+         * messages), which is sent while the next one is filled. Only when
+         * both buffers are full, Tx waits for the USB CDC driver.
          *
          * This option configures the number of times to retry a Tx after
          * delaying for 100 microseconds (default = 3 retries).
          *
          * If you set this to zero, Tx will not retry so the attempt will block
-         * for slightly less time, but transmit can fail if the Tx state is busy.
+         * for slightly less time, but messages are lost if both buffers are
+         * full.
          */
         uint8_t tx_retry_count;
 
@@ -48,8 +50,17 @@ class MidiUsbTransport
     void StartRx(MidiRxParseCallback callback, void* context);
     bool RxActive();
     void FlushRx();
+    /** Sends one or more messages, running status is allowed. The
+     *  messages are sent when the USB is idle, or with the next call to
+     *  Tx() or FlushTx(). This only waits if there's no room left.
+     */
     void Tx(uint8_t* buffer, size_t size);
 
+    /** Sends the messages left over by Tx(), if the USB is idle. Call this
+     *  regularly, MidiHandler::Listen() does.
+     */
+    void FlushTx();
+
     class Impl;
 
     MidiUsbTransport() : pimpl_(nullptr) {}
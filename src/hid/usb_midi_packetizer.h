@@ -0,0 +1,240 @@
+#pragma once
+#ifndef DSY_USB_MIDI_PACKETIZER_H
+#define DSY_USB_MIDI_PACKETIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace daisy
+{
+/** @brief   Converts between MIDI bytes and USB-MIDI event packets
+ *  @details USB-MIDI sends MIDI in 4 byte event packets: a header with the
+ *           cable number and a code index number (CIN), followed by the
+ *           1 to 3 bytes of one message (or a part of a SysEx message).
+ *
+ *           Outgoing bytes are packetized into one of two buffers of
+ *           kMaxTransferSize bytes, while the other one is being sent. So
+ *           messages written during a frame are sent together in one full
+ *           size USB packet, and writing never waits for the previous
+ *           transfer. The bytes don't have to be split into messages, and
+ *           may use running status (e.g. from a MidiTxQueue).
+ *
+ *           Received packets are unpacked in place, in the endpoint buffer.
+ *
+ *           This doesn't depend on the USB driver, the transfers are
+ *           started by a TransmitFunction.
+ *  @ingroup midi
+ */
+class UsbMidiPacketizer
+{
+  public:
+    /** Size of one event packet */
+    static constexpr size_t kEventSize = 4;
+
+    /** Size of a full speed bulk packet, the size of a transfer */
+    static constexpr size_t kMaxTransferSize = 64;
+
+    /** Starts sending a transfer
+     *  @return false if the previous transfer is still running
+     */
+    typedef bool (*TransmitFunction)(uint8_t* buff, size_t size, void* context);
+
+    UsbMidiPacketizer() : transmit_(nullptr), context_(nullptr) { Reset(); }
+
+    /** Initializes the packetizer
+     *  @param transmit starts sending the buffer. The buffer is not touched
+     *                  again until the next transfer has been started.
+     *  @param context  passed to transmit
+     *  @param cable    cable number of the outgoing packets
+     */
+    void Init(TransmitFunction transmit, void* context, uint8_t cable = 0)
+    {
+        transmit_ = transmit;
+        context_  = context;
+        cable_    = uint8_t(cable << 4);
+        Reset();
+    }
+
+    /** Clears the buffers and the encoder state */
+    void Reset()
+    {
+        fill_        = 0;
+        fill_size_   = 0;
+        status_      = 0;
+        num_pending_ = 0;
+        num_data_    = 0;
+        sysex_       = false;
+    }
+
+    /** Packetizes MIDI bytes into the buffer that's being filled. Stops
+     *  when it is full, Flush() it to continue.
+     *  @return the number of bytes used
+     */
+    size_t Write(const uint8_t* bytes, size_t size)
+    {
+        size_t i = 0;
+        // any byte could complete a packet
+        while(i < size && fill_size_ + kEventSize <= kMaxTransferSize)
+            Encode(bytes[i++]);
+        return i;
+    }
+
+    /** Starts sending the packets written so far, if the previous
+     *  transfer is done
+     *  @return false if there are packets left in the buffer
+     */
+    bool Flush()
+    {
+        if(fill_size_ == 0)
+            return true;
+        if(transmit_ == nullptr
+           || !transmit_(buffers_[fill_], fill_size_, context_))
+            return false;
+        fill_ ^= 1;
+        fill_size_ = 0;
+        return true;
+    }
+
+    /** Returns the number of bytes waiting in the buffer being filled */
+    size_t GetNumPending() const { return fill_size_; }
+
+    /** Unpacks received event packets in place, the MIDI bytes are moved
+     *  to the start of the buffer. Packets with a reserved CIN are skipped.
+     *  @param buffer received packets
+     *  @param size   size in bytes
+     *  @return the number of MIDI bytes
+     */
+    static size_t Unpack(uint8_t* buffer, size_t size)
+    {
+        // MIDI bytes per CIN, see the USB MIDI spec 1.0
+        static const uint8_t kCinSize[16]
+            = {0, 0, 2, 3, 3, 1, 2, 3, 3, 3, 3, 3, 2, 2, 3, 1};
+        size_t out = 0;
+        for(size_t i = 0; i + kEventSize <= size; i += kEventSize)
+        {
+            // the read position stays ahead of the write position
+            const uint8_t n = kCinSize[buffer[i] & 0x0f];
+            for(uint8_t j = 0; j < n; j++)
+                buffer[out++] = buffer[i + 1 + j];
+        }
+        return out;
+    }
+
+  private:
+    /** Adds a byte, and the packet it completes to the buffer */
+    void Encode(uint8_t byte)
+    {
+        if(byte >= 0xF8)
+        {
+            // realtime, allowed anywhere
+            Emit(0x0F, byte, 0, 0);
+        }
+        else if(byte == 0xF0)
+        {
+            sysex_       = true;
+            status_      = 0;
+            pending_[0]  = byte;
+            num_pending_ = 1;
+        }
+        else if(byte == 0xF7)
+        {
+            if(sysex_)
+            {
+                pending_[num_pending_++] = byte;
+                // CIN 5, 6 or 7: SysEx ends with 1, 2 or 3 bytes
+                Emit(0x04 + num_pending_,
+                     pending_[0],
+                     num_pending_ > 1 ? pending_[1] : 0,
+                     num_pending_ > 2 ? pending_[2] : 0);
+            }
+            sysex_       = false;
+            num_pending_ = 0;
+        }
+        else if(byte & 0x80)
+        {
+            // a status byte ends SysEx and running status
+            sysex_       = false;
+            status_      = byte < 0xF0 ? byte : 0;
+            pending_[0]  = byte;
+            num_pending_ = 1;
+            num_data_    = GetNumDataBytes(byte);
+            if(byte == 0xF6)
+                Emit(0x05, byte, 0, 0);
+            if(num_data_ == 0)
+                num_pending_ = 0;
+        }
+        else if(sysex_)
+        {
+            pending_[num_pending_++] = byte;
+            if(num_pending_ == 3)
+            {
+                Emit(0x04, pending_[0], pending_[1], pending_[2]);
+                num_pending_ = 0;
+            }
+        }
+        else
+        {
+            if(num_pending_ == 0)
+            {
+                // running status, or a stray data byte
+                if(status_ == 0)
+                    return;
+                pending_[0]  = status_;
+                num_pending_ = 1;
+                num_data_    = GetNumDataBytes(status_);
+            }
+            pending_[num_pending_++] = byte;
+            if(num_pending_ > num_data_)
+            {
+                const uint8_t status = pending_[0];
+                // channel messages use the upper nibble as CIN, system
+                // common messages 2 or 3 for the message size
+                const uint8_t cin
+                    = status < 0xF0 ? status >> 4 : uint8_t(num_pending_);
+                Emit(cin,
+                     status,
+                     pending_[1],
+                     num_pending_ > 2 ? pending_[2] : 0);
+                num_pending_ = 0;
+            }
+        }
+    }
+
+    static uint8_t GetNumDataBytes(uint8_t status)
+    {
+        switch(status & 0xF0)
+        {
+            case 0xC0:
+            case 0xD0: return 1;
+            case 0xF0:
+                return status == 0xF2 ? 2 : (status == 0xF1 || status == 0xF3);
+            default: return 2;
+        }
+    }
+
+    void Emit(uint8_t cin, uint8_t b0, uint8_t b1, uint8_t b2)
+    {
+        uint8_t* dst = buffers_[fill_] + fill_size_;
+        dst[0]       = cable_ | cin;
+        dst[1]       = b0;
+        dst[2]       = b1;
+        dst[3]       = b2;
+        fill_size_ += kEventSize;
+    }
+
+    TransmitFunction transmit_;
+    void*            context_;
+    uint8_t          cable_;
+    uint8_t          buffers_[2][kMaxTransferSize];
+    uint8_t          fill_;      // index of the buffer being filled
+    size_t           fill_size_; // bytes in it
+    uint8_t          status_;    // running status
+    uint8_t          pending_[3];
+    uint8_t          num_pending_;
+    uint8_t          num_data_; // data bytes of the pending message
+    bool             sysex_;
+};
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <cstring>
+#include "hid/wav_catalog.h"
+
+using namespace daisy;
+
+namespace
+{
+const uint32_t kHashSeed  = 2166136261u;
+const uint32_t kHashPrime = 16777619u;
+
+/** FNV-1a */
+uint32_t Hash(uint32_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for(size_t i = 0; i < size; i++)
+        hash = (hash ^ bytes[i]) * kHashPrime;
+    return hash;
+}
+
+char ToLower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/** Compares like strcmp, ignoring the case of ASCII letters like FAT */
+int CompareNames(const char* a, const char* b)
+{
+    while(*a != 0 && ToLower(*a) == ToLower(*b))
+    {
+        a++;
+        b++;
+    }
+    return static_cast<uint8_t>(ToLower(*a))
+           - static_cast<uint8_t>(ToLower(*b));
+}
+
+bool IsWavFile(const FILINFO& info)
+{
+    if(info.fattrib & (AM_HID | AM_DIR))
+        return false;
+    const size_t len = strlen(info.fname);
+    return len > 4 && CompareNames(info.fname + len - 4, ".wav") == 0;
+}
+
+/** Adds what identifies the version of a file to a directory hash */
+uint32_t HashFile(uint32_t hash, const FILINFO& info)
+{
+    const uint32_t size = info.fsize;
+    hash                = Hash(hash, info.fname, strlen(info.fname) + 1);
+    hash                = Hash(hash, &size, sizeof(size));
+    hash                = Hash(hash, &info.fdate, sizeof(info.fdate));
+    return Hash(hash, &info.ftime, sizeof(info.ftime));
+}
+
+} // namespace
+
+WavCatalog::Result WavCatalog::Init(const Config& config)
+{
+    config_ = config;
+    loaded_ = false;
+    header_ = nullptr;
+    if(config.buffer == nullptr || config.buffer_size < sizeof(Header))
+        return Result::ERR_FULL;
+
+    // listing the directory is cheap, compared to opening all the files
+    uint32_t dir_hash = kHashSeed;
+    if(f_opendir(&dir_, config_.dir) != FR_OK)
+        return Result::ERR_DIR;
+    while(f_readdir(&dir_, &info_) == FR_OK && info_.fname[0] != 0)
+    {
+        if(IsWavFile(info_))
+            dir_hash = HashFile(dir_hash, info_);
+    }
+    f_closedir(&dir_);
+
+    if(LoadIndex(dir_hash))
+    {
+        loaded_ = true;
+        return Result::OK;
+    }
+    return Scan();
+}
+
+WavCatalog::Result WavCatalog::Rescan()
+{
+    loaded_ = false;
+    if(config_.buffer == nullptr || config_.buffer_size < sizeof(Header))
+        return Result::ERR_FULL;
+    return Scan();
+}
+
+const WavCatalogEntry* WavCatalog::Find(const char* name) const
+{
+    size_t lo = 0, hi = GetNumEntries();
+    while(lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int    cmp = CompareNames(GetName(entries_[mid]), name);
+        if(cmp == 0)
+            return &entries_[mid];
+        if(cmp < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return nullptr;
+}
+
+bool WavCatalog::GetPath(const WavCatalogEntry& entry,
+                         char*                  path,
+                         size_t                 size) const
+{
+    return MakePath(GetName(entry), path, size);
+}
+
+size_t WavCatalog::GetIndexSize() const
+{
+    if(header_ == nullptr)
+        return 0;
+    return sizeof(Header) + header_->num_entries * sizeof(WavCatalogEntry)
+           + header_->names_size;
+}
+
+void WavCatalog::SetPointers()
+{
+    header_  = static_cast<Header*>(config_.buffer);
+    entries_ = reinterpret_cast<WavCatalogEntry*>(header_ + 1);
+    names_   = reinterpret_cast<const char*>(entries_ + header_->num_entries);
+}
+
+bool WavCatalog::LoadIndex(uint32_t dir_hash)
+{
+    char path[_MAX_LFN + 1];
+    if(!MakePath(config_.index_name, path, sizeof(path))
+       || f_open(&file_, path, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+        return false;
+
+    // the whole index in one read
+    const FSIZE_t size       = f_size(&file_);
+    UINT          bytes_read = 0;
+    const bool    ok = size >= sizeof(Header) && size <= config_.buffer_size
+                    && f_read(&file_, config_.buffer, size, &bytes_read)
+                           == FR_OK
+                    && bytes_read == size;
+    f_close(&file_);
+    if(!ok)
+        return false;
+
+    const Header* header = static_cast<const Header*>(config_.buffer);
+    if(header->magic != kMagic || header->version != kVersion
+       || header->entry_size != sizeof(WavCatalogEntry)
+       || header->dir_hash != dir_hash
+       || header->num_entries > size / sizeof(WavCatalogEntry))
+        return false;
+    SetPointers();
+    if(GetIndexSize() != size
+       || Hash(kHashSeed, entries_, size - sizeof(Header)) != header->checksum)
+    {
+        header_ = nullptr;
+        return false;
+    }
+    return true;
+}
+
+WavCatalog::Result WavCatalog::Scan()
+{
+    // The entries are added from the start of the buffer, and the names
+    // from its end. The names are moved behind the entries at the end.
+    uint8_t* const base      = static_cast<uint8_t*>(config_.buffer);
+    uint8_t* const names_end = base + config_.buffer_size;
+    uint8_t*       names     = names_end;
+    header_                  = static_cast<Header*>(config_.buffer);
+    entries_                 = reinterpret_cast<WavCatalogEntry*>(header_ + 1);
+    header_->num_entries     = 0;
+    header_->names_size      = 0;
+    names_                   = reinterpret_cast<const char*>(entries_);
+
+    if(f_opendir(&dir_, config_.dir) != FR_OK)
+        return Result::ERR_DIR;
+    Result   result      = Result::OK;
+    uint32_t dir_hash    = kHashSeed;
+    size_t   num_entries = 0;
+    while(f_readdir(&dir_, &info_) == FR_OK && info_.fname[0] != 0)
+    {
+        if(!IsWavFile(info_))
+            continue;
+        dir_hash = HashFile(dir_hash, info_);
+
+        const size_t   name_size = strlen(info_.fname) + 1;
+        const uint8_t* end
+            = reinterpret_cast<uint8_t*>(entries_ + num_entries + 1);
+        if(result == Result::ERR_FULL || names - end < ptrdiff_t(name_size))
+        {
+            result = Result::ERR_FULL;
+            continue;
+        }
+        WavCatalogEntry& entry = entries_[num_entries];
+        if(!ParseFile(info_.fname, &entry))
+            continue;
+        names -= name_size;
+        memcpy(names, info_.fname, name_size);
+        entry.name = names - base;
+        num_entries++;
+    }
+    f_closedir(&dir_);
+
+    const size_t names_size = names_end - names;
+    memmove(entries_ + num_entries, names, names_size);
+    for(size_t i = 0; i < num_entries; i++)
+        entries_[i].name -= names - base;
+
+    header_->magic       = kMagic;
+    header_->version     = kVersion;
+    header_->entry_size  = sizeof(WavCatalogEntry);
+    header_->num_entries = num_entries;
+    header_->names_size  = names_size;
+    header_->dir_hash    = dir_hash;
+    SetPointers();
+    const char* sorted_names = names_;
+    std::sort(entries_,
+              entries_ + num_entries,
+              [sorted_names](const WavCatalogEntry& a,
+                             const WavCatalogEntry& b) {
+                  return CompareNames(sorted_names + a.name,
+                                      sorted_names + b.name)
+                         < 0;
+              });
+    header_->checksum
+        = Hash(kHashSeed, entries_, GetIndexSize() - sizeof(Header));
+
+    if(result == Result::OK && !WriteIndex())
+        result = Result::ERR_WRITE;
+    return result;
+}
+
+bool WavCatalog::WriteIndex()
+{
+    char path[_MAX_LFN + 1];
+    if(!MakePath(config_.index_name, path, sizeof(path))
+       || f_open(&file_, path, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK)
+        return false;
+    const UINT size          = GetIndexSize();
+    UINT       bytes_written = 0;
+    const bool ok = f_write(&file_, config_.buffer, size, &bytes_written)
+                        == FR_OK
+                    && bytes_written == size;
+    return f_close(&file_) == FR_OK && ok;
+}
+
+bool WavCatalog::ParseFile(const char* name, WavCatalogEntry* entry)
+{
+    char path[_MAX_LFN + 1];
+    if(!MakePath(name, path, sizeof(path))
+       || f_open(&file_, path, FA_OPEN_EXISTING | FA_READ) != FR_OK)
+        return false;
+
+    FIL* file = &file_;
+    auto read = [file](uint32_t offset, void* dst, uint32_t size) {
+        UINT bytes_read = 0;
+        return f_lseek(file, offset) == FR_OK
+               && f_read(file, dst, size, &bytes_read) == FR_OK
+               && bytes_read == size;
+    };
+    const uint32_t file_size = f_size(file);
+    WavFormatInfo  format;
+    WavLoopInfo    loop;
+    const bool     ok = ParseWavFile(read, file_size, &format, &loop);
+    f_close(&file_);
+    if(!ok)
+        return false;
+
+    // a truncated file only has the data up to its end
+    if(format.data_offset > file_size)
+        format.data_size = 0;
+    else if(format.data_size > file_size - format.data_offset)
+        format.data_size = file_size - format.data_offset;
+    entry->data_offset   = format.data_offset;
+    entry->data_size     = format.data_size;
+    entry->samplerate    = format.samplerate;
+    entry->channels      = format.channels;
+    entry->block_align   = format.block_align;
+    entry->sample_format = format.sample_format;
+    entry->has_loop      = loop.valid;
+    entry->loop_type     = loop.type;
+    entry->root_note     = loop.root_note;
+    entry->loop_start    = loop.start;
+    entry->loop_end      = loop.end;
+    return true;
+}
+
+bool WavCatalog::MakePath(const char* name, char* path, size_t size) const
+{
+    const size_t dir_len  = strlen(config_.dir);
+    const size_t name_len = strlen(name);
+    const bool   slash    = dir_len > 0 && config_.dir[dir_len - 1] != '/'
+                       && config_.dir[dir_len - 1] != ':';
+    if(dir_len + slash + name_len + 1 > size)
+        return false;
+    memcpy(path, config_.dir, dir_len);
+    if(slash)
+        path[dir_len] = '/';
+    memcpy(path + dir_len + slash, name, name_len + 1);
+    return true;
+}
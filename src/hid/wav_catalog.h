@@ -0,0 +1,182 @@
+#pragma once
+#ifndef DSY_WAV_CATALOG_H
+#define DSY_WAV_CATALOG_H
+#include <stddef.h>
+#include <stdint.h>
+#include "util/wav_format.h"
+#include "ff.h"
+
+namespace daisy
+{
+/** A WAV file in a WavCatalog, as it's stored in the index file */
+struct WavCatalogEntry
+{
+    uint32_t        name;          /**< offset in the name table */
+    uint32_t        data_offset;   /**< of the sample data in the file */
+    uint32_t        data_size;     /**< in bytes */
+    uint32_t        samplerate;    /**< & */
+    uint32_t        loop_start;    /**< first frame of the loop */
+    uint32_t        loop_end;      /**< last frame of the loop */
+    uint16_t        channels;      /**< & */
+    uint16_t        block_align;   /**< bytes per frame */
+    WavSampleFormat sample_format; /**< & */
+    uint8_t         loop_type;     /**< 0: forward, 1: ping-pong, 2: reverse */
+    uint8_t         root_note;     /**< MIDI note of the unpitched sample */
+    uint8_t         has_loop;      /**< 1 if loop_start/loop_end are set */
+
+    /** \return the format, e.g. for WavStreamer::Open() */
+    WavFormatInfo GetFormat() const
+    {
+        WavFormatInfo info;
+        info.sample_format = sample_format;
+        info.channels      = channels;
+        info.samplerate    = samplerate;
+        info.block_align   = block_align;
+        info.data_offset   = data_offset;
+        info.data_size     = data_size;
+        return info;
+    }
+
+    /** \return length of the sample data in frames */
+    uint32_t GetNumFrames() const { return data_size / block_align; }
+};
+
+/** @brief   Index of the WAV files in a directory, kept on the SD Card
+ *  @details Scanning a directory means opening every file and reading its
+ *           chunks, so it gets slower with every file. The catalog does
+ *           this once, and writes what it found to an index file in the
+ *           directory: the format, sample data position and length, and
+ *           loop points of each file. On later boots the directory is only
+ *           listed (which doesn't open any files) and the index is loaded
+ *           with one read, if it's still valid.
+ *
+ *           The index is validated with the names, sizes and modification
+ *           timestamps of the WAV files in the directory entries. FAT
+ *           doesn't update the timestamp of a directory itself when its
+ *           files change, so that can't be used on its own.
+ *
+ *           The entries are sorted by name (ignoring case, like FAT does),
+ *           and Find() is a binary search.
+ *
+ *           The index is kept in a buffer given in the Config, laid out
+ *           the same as the file: a header, the entries and the names.
+ *           Each file takes sizeof(WavCatalogEntry) + its name length + 1
+ *           bytes, about 60 bytes with 20 character names. For thousands
+ *           of files the buffer can be in the SDRAM. It has to be in a
+ *           memory the SDMMC can reach (not the DTCM).
+ */
+class WavCatalog
+{
+  public:
+    /** Return values */
+    enum class Result
+    {
+        OK,
+        ERR_DIR,
+        ERR_FULL,
+        ERR_WRITE,
+    };
+
+    struct Config
+    {
+        /** directory of the files, e.g. "/" or "/samples" */
+        const char* dir;
+        /** name of the index file in the directory */
+        const char* index_name;
+        /** memory for the index */
+        void* buffer;
+        /** size of buffer in bytes */
+        size_t buffer_size;
+
+        Config()
+        : dir("/"), index_name("WAVINDEX.BIN"), buffer(nullptr), buffer_size(0)
+        {
+        }
+    };
+
+    WavCatalog() {}
+    ~WavCatalog() {}
+
+    /** Loads the index of a directory, or scans the directory and writes a
+     *  new index if there's none or it's out of date.
+     *  \return OK if the catalog is complete. ERR_FULL if the buffer is too
+     *          small for all files, the catalog has the files that fit but
+     *          no index is written. ERR_WRITE if the index couldn't be
+     *          written, the catalog is complete but the next Init() scans.
+     */
+    Result Init(const Config& config);
+
+    /** Scans the directory and writes a new index, even if it's valid */
+    Result Rescan();
+
+    /** \return true if the last Init() loaded the index, false if it
+     *          scanned the directory
+     */
+    bool WasLoaded() const { return loaded_; }
+
+    /** \return number of WAV files in the catalog */
+    size_t GetNumEntries() const { return header_ ? header_->num_entries : 0; }
+
+    /** \return an entry, in the order of the names */
+    const WavCatalogEntry& GetEntry(size_t index) const
+    {
+        return entries_[index];
+    }
+
+    /** \return file name of an entry */
+    const char* GetName(const WavCatalogEntry& entry) const
+    {
+        return names_ + entry.name;
+    }
+
+    /** Looks up a file by name, ignoring case
+     *  \return the entry, or nullptr if there's no such file
+     */
+    const WavCatalogEntry* Find(const char* name) const;
+
+    /** Writes the path of an entry, i.e. the directory and its name
+     *  \return false if it doesn't fit in size characters
+     */
+    bool GetPath(const WavCatalogEntry& entry, char* path, size_t size) const;
+
+    /** \return the size of the index in bytes */
+    size_t GetIndexSize() const;
+
+  private:
+    /** Start of the index file */
+    struct Header
+    {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t entry_size;
+        uint32_t num_entries;
+        uint32_t names_size;
+        /** hash of the names, sizes and timestamps of the WAV files */
+        uint32_t dir_hash;
+        /** hash of the entries and names, against partly written files */
+        uint32_t checksum;
+    };
+
+    static const uint32_t kMagic   = 0x54414357; // "WCAT"
+    static const uint16_t kVersion = 1;
+
+    bool   LoadIndex(uint32_t dir_hash);
+    Result Scan();
+    bool   WriteIndex();
+    bool   ParseFile(const char* name, WavCatalogEntry* entry);
+    bool   MakePath(const char* name, char* path, size_t size) const;
+    void   SetPointers();
+
+    Config           config_;
+    Header*          header_  = nullptr;
+    WavCatalogEntry* entries_ = nullptr;
+    const char*      names_   = nullptr;
+    bool             loaded_  = false;
+    FIL              file_;
+    DIR              dir_;
+    FILINFO          info_;
+};
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,483 @@
+#pragma once
+#ifndef DSY_WAV_STREAMER_H
+#define DSY_WAV_STREAMER_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include "util/wav_format.h"
+#include "sys/fatfs.h"
+
+namespace daisy
+{
+/** @brief   Streams several WAV files from an SD Card at once
+ *  @details Every voice reads its file into a ring buffer of raw sample
+ *           data. Prepare() is called from the main loop, and reads ahead:
+ *           each read goes to the voice with the fewest buffered frames,
+ *           i.e. the one closest to running out. Reads are cut to end on
+ *           sector boundaries, so FatFS can transfer whole sectors straight
+ *           into the buffers.
+ *
+ *           Stream() is called from the audio callback. It decodes the
+ *           playing voices (mono or multichannel, 16, 24 or 32-bit PCM or
+ *           float) and mixes them into a block of non-interleaved buffers.
+ *           A voice that runs out of data outputs silence for the rest of
+ *           the block, and counts an underrun.
+ *
+ *           Memory use is about kNumVoices * kBufferBytes. The object has
+ *           to be in a memory the SDMMC can reach (e.g. the default AXI
+ *           SRAM, not the DTCM). At 48kHz, 16kB per voice buffer 85ms of
+ *           16-bit stereo.
+ *
+ *  To use:
+ *  1. Mount the SD Card with FatFSInterface.
+ *  2. Create a WavStreamer<8> and Init() it.
+ *  3. Open() files for the voices, and start them with Play().
+ *  4. Call Stream() from the audio callback, and Prepare() from the main
+ *     loop.
+ *
+ *  @tparam kNumVoices   number of files that can be open at once
+ *  @tparam kBufferBytes ring buffer size of each voice
+ */
+template <size_t kNumVoices, size_t kBufferBytes = 16384>
+class WavStreamer
+{
+  public:
+    /** Return values of the file functions */
+    enum class Result
+    {
+        OK,
+        ERR_FILE,
+        ERR_FORMAT,
+        ERR_VOICE,
+    };
+
+    struct Config
+    {
+        /** number of output buffers of Stream() */
+        size_t num_outputs;
+        /** largest read from a file, in bytes, should be a multiple of 512 */
+        size_t read_size;
+        /** most reads in a Prepare() call, to bound its run time */
+        size_t max_reads;
+        /** link maps for fast seeks in the files, e.g. from
+         *  FatFSInterface::GetLinkMapPool(), or nullptr
+         */
+        FatFSLinkMapPool* link_maps;
+
+        Config()
+        : num_outputs(2),
+          read_size(4096),
+          max_reads(kNumVoices),
+          link_maps(nullptr)
+        {
+        }
+    };
+
+    /** Statistics of a voice, for tuning the buffer sizes */
+    struct Stats
+    {
+        /** Stream() calls that ran out of data */
+        uint32_t underruns;
+        /** fewest buffered frames seen by Stream() */
+        uint32_t min_frames;
+        /** reads from the file */
+        uint32_t reads;
+        /** bytes read from the file */
+        uint32_t bytes_read;
+    };
+
+    WavStreamer() {}
+    ~WavStreamer() {}
+
+    /** Initializes the streamer, with all voices closed */
+    void Init(const Config& config = Config())
+    {
+        config_ = config;
+        for(Voice& v : voices_)
+        {
+            v.open = false;
+            v.playing.store(false);
+        }
+    }
+
+    /** Opens a file for a voice, and fills its buffer from the start of the
+     *  sample data. A file that was open for the voice is closed first.
+     *  \param voice index of the voice
+     *  \param path of the file
+     */
+    Result Open(size_t voice, const char* path)
+    {
+        if(voice >= kNumVoices)
+            return Result::ERR_VOICE;
+        Close(voice);
+        Voice& v = voices_[voice];
+        if(OpenFile(v, path) != FR_OK)
+            return Result::ERR_FILE;
+        v.open = true;
+
+        // the header is parsed from the ring buffer, before it's filled
+        const UINT header_size
+            = config_.read_size < kBufferBytes ? config_.read_size
+                                               : kBufferBytes;
+        UINT bytes_read = 0;
+        if(f_read(&v.file, v.buffer, header_size, &bytes_read) != FR_OK
+           || !ParseWavHeader(v.buffer, bytes_read, &v.format))
+        {
+            Close(voice);
+            return Result::ERR_FORMAT;
+        }
+        return Start(voice);
+    }
+
+    /** Opens a file with a known format for a voice, e.g. from a WavCatalog,
+     *  without reading its header.
+     *  \param voice index of the voice
+     *  \param path of the file
+     *  \param format of the file
+     */
+    Result Open(size_t voice, const char* path, const WavFormatInfo& format)
+    {
+        if(voice >= kNumVoices)
+            return Result::ERR_VOICE;
+        Close(voice);
+        Voice& v = voices_[voice];
+        if(OpenFile(v, path) != FR_OK)
+            return Result::ERR_FILE;
+        v.open   = true;
+        v.format = format;
+        return Start(voice);
+    }
+
+    /** Stops a voice, and closes its file */
+    void Close(size_t voice)
+    {
+        if(voice >= kNumVoices || !voices_[voice].open)
+            return;
+        Voice& v = voices_[voice];
+        v.playing.store(false);
+        if(config_.link_maps != nullptr)
+            config_.link_maps->Close(&v.file);
+        else
+            f_close(&v.file);
+        v.open = false;
+    }
+
+    /** Goes back to the start of the sample data of a voice, and fills its
+     *  buffer. The voice keeps playing if it did.
+     */
+    Result Restart(size_t voice) { return Seek(voice, 0); }
+
+    /** Jumps to a frame of a voice, e.g. for slicing, and fills its buffer
+     *  from there. The voice keeps playing if it did. This reads from the
+     *  file, so it's for the main loop. With Config::link_maps the seek
+     *  takes the same time anywhere in the file.
+     *  \param voice index of the voice
+     *  \param frame position in the sample data
+     */
+    Result Seek(size_t voice, uint32_t frame)
+    {
+        if(voice >= kNumVoices || !voices_[voice].open)
+            return Result::ERR_VOICE;
+        Voice&         v       = voices_[voice];
+        const bool     playing = v.playing.exchange(false);
+        const uint32_t frames
+            = (v.data_end - v.format.data_offset) / v.format.block_align;
+        v.file_pos = v.format.data_offset
+                     + (frame < frames ? frame : frames) * v.format.block_align;
+        v.write_pos = 0;
+        v.read_pos  = 0;
+        v.fill.store(0);
+        v.done.store(false);
+        v.stats.underruns  = 0;
+        v.stats.min_frames = v.capacity / v.format.block_align;
+        v.stats.reads      = 0;
+        v.stats.bytes_read = 0;
+        if(SeekFile(v, v.file_pos) != FR_OK)
+            return Result::ERR_FILE;
+        while(Read(v) > 0) {}
+        v.playing.store(playing);
+        return Result::OK;
+    }
+
+    /** Starts playing a voice from where it is */
+    void Play(size_t voice)
+    {
+        if(voice < kNumVoices && voices_[voice].open)
+            voices_[voice].playing.store(true);
+    }
+
+    /** Pauses a voice */
+    void Stop(size_t voice)
+    {
+        if(voice < kNumVoices)
+            voices_[voice].playing.store(false);
+    }
+
+    /** \return true while a voice plays, until it's stopped or its file
+     *          ended
+     */
+    bool IsPlaying(size_t voice) const
+    {
+        return voice < kNumVoices && voices_[voice].playing.load();
+    }
+
+    /** Sets a voice to start over at the end of its file */
+    void SetLooping(size_t voice, bool looping)
+    {
+        if(voice < kNumVoices)
+            voices_[voice].looping = looping;
+    }
+
+    /** Sets the gain a voice is mixed with */
+    void SetGain(size_t voice, float gain)
+    {
+        if(voice < kNumVoices)
+            voices_[voice].gain = gain;
+    }
+
+    /** \return the format of the file of an open voice */
+    const WavFormatInfo& GetFormat(size_t voice) const
+    {
+        return voices_[voice].format;
+    }
+
+    /** \return number of frames in the buffer of a voice */
+    size_t GetBufferedFrames(size_t voice) const
+    {
+        const Voice& v = voices_[voice];
+        return v.open ? v.fill.load() / v.format.block_align : 0;
+    }
+
+    /** \return the statistics of a voice since it was (re)started */
+    const Stats& GetStats(size_t voice) const { return voices_[voice].stats; }
+
+    /** Reads ahead for the voices, to be called from the main loop. Every
+     *  read goes to the voice with the fewest buffered frames that has room
+     *  for it, until no voice has room or Config::max_reads were made.
+     *  \return number of bytes read
+     */
+    size_t Prepare()
+    {
+        size_t total = 0;
+        for(size_t n = 0; n < config_.max_reads; n++)
+        {
+            Voice*   next        = nullptr;
+            uint32_t next_frames = UINT32_MAX;
+            for(Voice& v : voices_)
+            {
+                if(!v.open || v.done.load())
+                    continue;
+                if(v.file_pos >= v.data_end && !v.looping)
+                {
+                    v.done.store(true);
+                    continue;
+                }
+                const uint32_t fill   = v.fill.load(std::memory_order_acquire);
+                const uint32_t frames = fill / v.format.block_align;
+                if(frames < next_frames && HasRoom(v, fill))
+                {
+                    next        = &v;
+                    next_frames = frames;
+                }
+            }
+            if(next == nullptr)
+                break;
+            total += Read(*next);
+        }
+        return total;
+    }
+
+    /** Mixes the playing voices into the output buffers, to be called from
+     *  the audio callback.
+     *  \param out Config::num_outputs buffers, which are overwritten
+     *  \param frames number of frames to stream
+     */
+    void Stream(float** out, size_t frames)
+    {
+        for(size_t c = 0; c < config_.num_outputs; c++)
+            for(size_t i = 0; i < frames; i++)
+                out[c][i] = 0.f;
+        for(Voice& v : voices_)
+            if(v.playing.load(std::memory_order_relaxed))
+                Mix(v, out, frames);
+    }
+
+  private:
+    struct Voice
+    {
+        FIL           file;
+        WavFormatInfo format;
+        /** bytes of the ring in use, a multiple of the frame size */
+        uint32_t capacity;
+        /** position of the next read in the file */
+        uint32_t file_pos;
+        /** end of the whole frames of the sample data in the file */
+        uint32_t data_end;
+        /** ring positions of the main loop and the audio callback */
+        uint32_t              write_pos, read_pos;
+        std::atomic<uint32_t> fill;
+        /** set when all data is in the buffer */
+        std::atomic<bool> done;
+        std::atomic<bool> playing;
+        bool              open, looping;
+        float             gain;
+        Stats             stats;
+        uint8_t           buffer[kBufferBytes];
+    };
+
+    static constexpr uint32_t kSectorSize = 512;
+
+    FRESULT OpenFile(Voice& v, const char* path)
+    {
+        const BYTE mode = FA_OPEN_EXISTING | FA_READ;
+        return config_.link_maps != nullptr
+                   ? config_.link_maps->Open(&v.file, path, mode)
+                   : f_open(&v.file, path, mode);
+    }
+
+    FRESULT SeekFile(Voice& v, FSIZE_t position)
+    {
+        return config_.link_maps != nullptr
+                   ? config_.link_maps->Seek(&v.file, position)
+                   : f_lseek(&v.file, position);
+    }
+
+    /** Sets up a voice with an open file and its format */
+    Result Start(size_t voice)
+    {
+        Voice&         v     = voices_[voice];
+        const uint32_t frame = v.format.block_align;
+        if(v.format.sample_format == WavSampleFormat::INVALID || frame == 0
+           || frame > kBufferBytes)
+        {
+            Close(voice);
+            return Result::ERR_FORMAT;
+        }
+        v.looping = false;
+        v.gain    = 1.f;
+
+        // frames never wrap around the end of the ring
+        const uint32_t file_size = f_size(&v.file);
+        uint32_t       data_size = v.format.data_size;
+        if(v.format.data_offset > file_size)
+            data_size = 0;
+        else if(data_size > file_size - v.format.data_offset)
+            data_size = file_size - v.format.data_offset;
+        v.capacity = kBufferBytes / frame * frame;
+        v.data_end = v.format.data_offset + data_size / frame * frame;
+        return Restart(voice);
+    }
+
+    bool HasRoom(const Voice& v, uint32_t fill) const
+    {
+        // the last read of a file may be shorter, and a read size as large
+        // as the ring would wait for it to run empty
+        uint32_t size = config_.read_size;
+        if(size > v.capacity / 2)
+            size = v.capacity / 2;
+        if(!v.looping && v.data_end - v.file_pos < size)
+            size = v.data_end - v.file_pos;
+        return v.capacity - fill >= size;
+    }
+
+    /** Reads into the free space of the ring, up to its end.
+     *  \return number of bytes read
+     */
+    size_t Read(Voice& v)
+    {
+        if(v.file_pos >= v.data_end)
+        {
+            if(!v.looping || v.data_end == v.format.data_offset)
+            {
+                v.done.store(true);
+                return 0;
+            }
+            v.file_pos = v.format.data_offset;
+            if(SeekFile(v, v.file_pos) != FR_OK)
+            {
+                v.done.store(true);
+                return 0;
+            }
+        }
+        const uint32_t fill = v.fill.load(std::memory_order_acquire);
+        uint32_t       size = v.capacity - fill;
+        if(size > v.capacity - v.write_pos)
+            size = v.capacity - v.write_pos;
+        if(size > config_.read_size)
+            size = config_.read_size;
+        if(size > v.data_end - v.file_pos)
+            size = v.data_end - v.file_pos;
+        // ends on a sector, so that the next read starts on one
+        const uint32_t end = (v.file_pos + size) & ~(kSectorSize - 1);
+        if(v.file_pos + size < v.data_end && end > v.file_pos)
+            size = end - v.file_pos;
+        if(size == 0)
+            return 0;
+
+        UINT bytes_read = 0;
+        if(f_read(&v.file, v.buffer + v.write_pos, size, &bytes_read) != FR_OK
+           || bytes_read == 0)
+        {
+            // treated like the end of the file
+            v.data_end = v.file_pos;
+            v.done.store(true);
+            return 0;
+        }
+        v.file_pos += bytes_read;
+        v.write_pos += bytes_read;
+        if(v.write_pos == v.capacity)
+            v.write_pos = 0;
+        v.stats.reads++;
+        v.stats.bytes_read += bytes_read;
+        v.fill.fetch_add(bytes_read, std::memory_order_release);
+        return bytes_read;
+    }
+
+    void Mix(Voice& v, float** out, size_t frames)
+    {
+        // done is read first, so that the fill includes the last read
+        const bool     done      = v.done.load(std::memory_order_acquire);
+        const uint32_t frame     = v.format.block_align;
+        const uint32_t available = v.fill.load(std::memory_order_acquire)
+                                   / frame;
+        if(available < v.stats.min_frames)
+            v.stats.min_frames = available;
+        const size_t num = available < frames ? available : frames;
+
+        // up to the end of the ring, then from its start
+        for(size_t pos = 0; pos < num;)
+        {
+            size_t span = (v.capacity - v.read_pos) / frame;
+            if(span > num - pos)
+                span = num - pos;
+            MixWavFrames(v.format.sample_format,
+                         v.buffer + v.read_pos,
+                         v.format.channels,
+                         span,
+                         out,
+                         config_.num_outputs,
+                         pos,
+                         v.gain);
+            v.read_pos += span * frame;
+            if(v.read_pos == v.capacity)
+                v.read_pos = 0;
+            pos += span;
+        }
+        v.fill.fetch_sub(num * frame, std::memory_order_release);
+
+        if(num < frames)
+        {
+            if(done)
+                v.playing.store(false);
+            else
+                v.stats.underruns++;
+        }
+    }
+
+    Config config_;
+    Voice  voices_[kNumVoices];
+};
+
+} // namespace daisy
+
+#endif
@@ -76,6 +76,14 @@ class WavPlayer
     /** \return currently selected file.*/
     inline size_t GetCurrentFile() const { return file_sel_; }
 
+    /** \return sample rate of the currently selected file in Hz, e.g. to
+     *  convert it to the audio rate with a Resampler.
+     */
+    inline uint32_t GetSampleRate() const
+    {
+        return file_info_[file_sel_].raw_data.SampleRate;
+    }
+
   private:
     enum BufferState
     {
@@ -1,12 +1,15 @@
 #include "per/sai.h"
 #include "daisy_core.h"
+#ifndef UNIT_TEST // for unit tests, a dummy implementation is provided below
 extern "C"
 {
 #include "util/hal_map.h"
 }
+#endif // ifndef UNIT_TEST
 
 namespace daisy
 {
+#ifndef UNIT_TEST
 class SaiHandle::Impl
 {
   public:
@@ -43,6 +46,9 @@ class SaiHandle::Impl
     /** Offset stored for weird inter-SAI stuff.*/
     size_t dma_offset;
 
+    /** Number of times the next DMA half completed while the callback was running */
+    volatile uint32_t dma_overruns_;
+
     /** Callback that dispatches user callback from Cplt and HalfCplt DMA Callbacks */
     void InternalCallback(size_t offset);
 
@@ -171,11 +177,22 @@ SaiHandle::Result SaiHandle::Impl::Init(const SaiHandle::Config& config)
             break;
         default: break;
     }
+    // TDM uses the DSP protocol, with all slots active.
+    const uint32_t num_slots = config.GetNumSlots();
+    if(num_slots > 2)
+        protocol = SAI_PCM_SHORT;
+    // The master clock divider requires frames of up to 256 bits.
+    // Longer frames run the master clock at the bit clock rate.
+    const uint32_t slot_bits
+        = config.bit_depth == Config::BitDepth::SAI_16BIT ? 16 : 32;
+    const uint32_t no_divider = num_slots * slot_bits > 256
+                                    ? SAI_MASTERDIVIDER_DISABLE
+                                    : SAI_MASTERDIVIDER_ENABLE;
 
     // Generic Inits that we don't have API control over.
     // A
     sai_a_handle_.Init.OutputDrive    = SAI_OUTPUTDRIVE_DISABLE;
-    sai_a_handle_.Init.NoDivider      = SAI_MASTERDIVIDER_ENABLE;
+    sai_a_handle_.Init.NoDivider      = no_divider;
     sai_a_handle_.Init.FIFOThreshold  = SAI_FIFOTHRESHOLD_EMPTY;
     sai_a_handle_.Init.SynchroExt     = SAI_SYNCEXT_DISABLE;
     sai_a_handle_.Init.MonoStereoMode = SAI_STEREOMODE;
@@ -183,19 +200,19 @@ SaiHandle::Result SaiHandle::Impl::Init(const SaiHandle::Config& config)
     sai_a_handle_.Init.TriState       = SAI_OUTPUT_NOTRELEASED;
     // B
     sai_b_handle_.Init.OutputDrive    = SAI_OUTPUTDRIVE_DISABLE;
-    sai_b_handle_.Init.NoDivider      = SAI_MASTERDIVIDER_ENABLE;
+    sai_b_handle_.Init.NoDivider      = no_divider;
     sai_b_handle_.Init.FIFOThreshold  = SAI_FIFOTHRESHOLD_EMPTY;
     sai_b_handle_.Init.SynchroExt     = SAI_SYNCEXT_DISABLE;
     sai_b_handle_.Init.MonoStereoMode = SAI_STEREOMODE;
     sai_b_handle_.Init.CompandingMode = SAI_NOCOMPANDING;
     sai_b_handle_.Init.TriState       = SAI_OUTPUT_NOTRELEASED;
-    if(HAL_SAI_InitProtocol(&sai_a_handle_, protocol, bd, 2) != HAL_OK)
+    if(HAL_SAI_InitProtocol(&sai_a_handle_, protocol, bd, num_slots) != HAL_OK)
     {
         Error_Handler();
         return Result::ERR;
     }
 
-    if(HAL_SAI_InitProtocol(&sai_b_handle_, protocol, bd, 2) != HAL_OK)
+    if(HAL_SAI_InitProtocol(&sai_b_handle_, protocol, bd, num_slots) != HAL_OK)
     {
         Error_Handler();
         return Result::ERR;
@@ -298,7 +315,19 @@ void SaiHandle::Impl::InternalCallback(size_t offset)
     in  = buff_rx_ + offset;
     out = buff_tx_ + offset;
     if(callback_)
+    {
         callback_(in, out, buff_size_ / 2);
+        // If the DMA has already completed the other half of the buffer,
+        // the callback didn't finish in time.
+        DMA_HandleTypeDef* hdma = config_.a_dir == Config::Direction::RECEIVE
+                                      ? &sai_a_dma_handle_
+                                      : &sai_b_dma_handle_;
+        const uint32_t     flag = offset == 0
+                                      ? __HAL_DMA_GET_TC_FLAG_INDEX(hdma)
+                                      : __HAL_DMA_GET_HT_FLAG_INDEX(hdma);
+        if(__HAL_DMA_GET_FLAG(hdma, flag))
+            dma_overruns_++;
+    }
 }
 
 SaiHandle::Result
@@ -307,10 +336,11 @@ SaiHandle::Impl::StartDmaTransfer(int32_t*                       buffer_rx,
                                   size_t                         size,
                                   SaiHandle::CallbackFunctionPtr callback)
 {
-    buff_rx_   = buffer_rx;
-    buff_tx_   = buffer_tx;
-    buff_size_ = size;
-    callback_  = callback;
+    buff_rx_      = buffer_rx;
+    buff_tx_      = buffer_tx;
+    buff_size_    = size;
+    callback_     = callback;
+    dma_overruns_ = 0;
 
     // This assumes there will be one master and one slave
     if(config_.a_sync == Config::Sync::SLAVE)
@@ -355,8 +385,8 @@ float SaiHandle::Impl::GetSampleRate()
 }
 size_t SaiHandle::Impl::GetBlockSize()
 {
-    // Buffer handled in halves, 2 samples per frame (1 per channel)
-    return buff_size_ / 2 / 2;
+    // Buffer handled in halves, one sample per slot in each frame
+    return buff_size_ / 2 / config_.GetNumSlots();
 }
 float SaiHandle::Impl::GetBlockRate()
 {
@@ -536,6 +566,95 @@ extern "C" void HAL_SAI_RxCpltCallback(SAI_HandleTypeDef* hsai)
     }
 }
 
+#else // ifndef UNIT_TEST
+
+/** Host implementation without any hardware behind it. Nothing is
+ ** transferred on its own - SimulateDmaTransferForUnitTest() takes the place
+ ** of the DMA half/complete interrupts and calls the callback for one half
+ ** of the buffers passed to StartDma().
+ */
+class SaiHandle::Impl
+{
+  public:
+    SaiHandle::Result Init(const SaiHandle::Config& config)
+    {
+        if(int(config.periph) >= 2)
+            return Result::ERR;
+        config_     = config;
+        buff_rx_    = nullptr;
+        buff_tx_    = nullptr;
+        buff_size_  = 0;
+        callback_   = nullptr;
+        dma_offset  = 0;
+        is_running_ = false;
+        return Result::OK;
+    }
+    SaiHandle::Result DeInit()
+    {
+        is_running_ = false;
+        return Result::OK;
+    }
+    const SaiHandle::Config& GetConfig() const { return config_; }
+
+    SaiHandle::Result StartDmaTransfer(int32_t*                       buffer_rx,
+                                       int32_t*                       buffer_tx,
+                                       size_t                         size,
+                                       SaiHandle::CallbackFunctionPtr callback)
+    {
+        buff_rx_      = buffer_rx;
+        buff_tx_      = buffer_tx;
+        buff_size_    = size;
+        callback_     = callback;
+        dma_offset    = 0;
+        dma_overruns_ = 0;
+        is_running_   = true;
+        return Result::OK;
+    }
+    SaiHandle::Result StopDmaTransfer()
+    {
+        is_running_ = false;
+        return Result::OK;
+    }
+
+    float GetSampleRate()
+    {
+        switch(config_.sr)
+        {
+            case Config::SampleRate::SAI_8KHZ: return 8000.f;
+            case Config::SampleRate::SAI_16KHZ: return 16000.f;
+            case Config::SampleRate::SAI_32KHZ: return 32000.f;
+            case Config::SampleRate::SAI_48KHZ: return 48000.f;
+            case Config::SampleRate::SAI_96KHZ: return 96000.f;
+            default: return 48000.f;
+        }
+    }
+    size_t GetBlockSize() { return buff_size_ / 2 / config_.GetNumSlots(); }
+    float  GetBlockRate() { return GetSampleRate() / GetBlockSize(); }
+
+    void SimulateDmaTransfer(size_t half)
+    {
+        if(!is_running_)
+            return;
+        dma_offset = half == 0 ? 0 : buff_size_ / 2;
+        if(callback_)
+            callback_(
+                buff_rx_ + dma_offset, buff_tx_ + dma_offset, buff_size_ / 2);
+    }
+
+    SaiHandle::Config config_;
+
+    int32_t *                      buff_rx_, *buff_tx_;
+    size_t                         buff_size_;
+    SaiHandle::CallbackFunctionPtr callback_;
+    size_t                         dma_offset;
+    uint32_t                       dma_overruns_;
+    bool                           is_running_;
+};
+
+static SaiHandle::Impl sai_handles[2];
+
+#endif // ifndef UNIT_TEST
+
 // ================================================================
 // SaiHandle -> SaiHandle::Pimpl
 // ================================================================
@@ -587,5 +706,32 @@ size_t SaiHandle::GetOffset() const
     return pimpl_->dma_offset;
 }
 
+uint32_t SaiHandle::GetNumDmaOverruns() const
+{
+    return pimpl_->dma_overruns_;
+}
+
+#ifdef UNIT_TEST
+void SaiHandle::SimulateDmaTransferForUnitTest(size_t half)
+{
+    pimpl_->SimulateDmaTransfer(half);
+}
+
+int32_t* SaiHandle::GetRxBufferForUnitTest() const
+{
+    return pimpl_->buff_rx_;
+}
+
+int32_t* SaiHandle::GetTxBufferForUnitTest() const
+{
+    return pimpl_->buff_tx_;
+}
+
+size_t SaiHandle::GetBufferSizeForUnitTest() const
+{
+    return pimpl_->buff_size_;
+}
+#endif // ifdef UNIT_TEST
+
 
 } // namespace daisy
@@ -87,6 +87,21 @@ class SaiHandle
             RECEIVE,
         };
 
+        /** Number of channels (slots) per frame on each data line.
+         ** STEREO is regular I2S. The TDM settings use the DSP protocol
+         ** (one bit clock long frame sync at the start of the frame),
+         ** which is what most multichannel codecs expect.
+         ** With 32-bit slots, TDM_16 needs a bit clock of 512 * fs, so the
+         ** master clock output runs at the bit clock rate in that case.
+         */
+        enum class FrameSlots
+        {
+            STEREO,
+            TDM_4,
+            TDM_8,
+            TDM_16,
+        };
+
         Peripheral periph;
         struct
         {
@@ -96,6 +111,19 @@ class SaiHandle
         BitDepth   bit_depth;
         Sync       a_sync, b_sync;
         Direction  a_dir, b_dir;
+        FrameSlots slots = FrameSlots::STEREO;
+
+        /** Returns the number of slots per frame on each data line */
+        size_t GetNumSlots() const
+        {
+            switch(slots)
+            {
+                case FrameSlots::TDM_4: return 4;
+                case FrameSlots::TDM_8: return 8;
+                case FrameSlots::TDM_16: return 16;
+                default: return 2;
+            }
+        }
     };
 
     /** Return values for SAI functions */
@@ -153,6 +181,30 @@ class SaiHandle
     /** Returns the current offset within the SAI buffer, will be either 0 or size/2 */
     size_t GetOffset() const;
 
+    /** Returns the number of times the DMA completed the next half of the
+     ** buffer before the callback for the previous half had returned.
+     ** Each of these is an audible dropout. Reset by StartDma.
+     */
+    uint32_t GetNumDmaOverruns() const;
+
+#ifdef UNIT_TEST
+    /** Host builds only: stands in for the DMA interrupts. Calls the
+     ** callback for one half of the buffers passed to StartDma(), like the
+     ** hardware does once that half has been transferred.
+     ** \param half 0 for the first half, 1 for the second half
+     */
+    void SimulateDmaTransferForUnitTest(size_t half);
+
+    /** Host builds only: returns the receive buffer passed to StartDma() */
+    int32_t* GetRxBufferForUnitTest() const;
+
+    /** Host builds only: returns the transmit buffer passed to StartDma() */
+    int32_t* GetTxBufferForUnitTest() const;
+
+    /** Host builds only: returns the buffer size passed to StartDma() */
+    size_t GetBufferSizeForUnitTest() const;
+#endif // ifdef UNIT_TEST
+
     inline bool IsInitialized() const
     {
         return pimpl_ == nullptr ? false : true;
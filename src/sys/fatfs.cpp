@@ -10,6 +10,7 @@ FatFSInterface::Result FatFSInterface::Init(const FatFSInterface::Config& cfg)
 {
     Result ret = Result::ERR_NO_MEDIA_SELECTED;
     cfg_       = cfg;
+    link_maps_.Init(cfg_.link_map_pool, cfg_.link_map_pool_size);
     if(cfg_.media & Config::MEDIA_SD)
         ret = FATFS_LinkDriver(&SD_Driver, path_[0]) == FR_OK
                   ? Result::OK
@@ -5,6 +5,97 @@
 
 namespace daisy
 {
+/** @brief   Fast seek link maps of open files, from a fixed pool of memory
+ *  @details A normal f_lseek() follows the FAT cluster chain from the start
+ *           of the file, so its time grows with the seek position and can
+ *           take milliseconds in large files. FatFS can instead look up
+ *           the cluster in a link map of the file's fragments (the CLMT),
+ *           which takes the same time anywhere in the file.
+ *
+ *           The pool builds the link map of a file when it's opened, in a
+ *           part of the memory it was given, and frees it again when the
+ *           file is closed. A map takes 2 words per fragment of the file
+ *           plus 2, so a file that was written in one piece takes 4 words.
+ *           If the pool is out of memory, the file works with normal
+ *           seeks.
+ *
+ *           A file with a link map can't grow, so this is for reading, or
+ *           for writing within the size of the file.
+ */
+class FatFSLinkMapPool
+{
+  public:
+    /** Time taken by the seeks */
+    struct SeekStats
+    {
+        uint32_t count;    /**< number of seeks */
+        uint32_t max_us;   /**< longest seek */
+        uint64_t total_us; /**< time of all seeks */
+
+        /** \return the average time of a seek */
+        uint32_t GetAverageUs() const
+        {
+            return count > 0 ? uint32_t(total_us / count) : 0;
+        }
+    };
+
+    /** Most files with a link map at once */
+    static constexpr size_t kMaxFiles = 16;
+
+    FatFSLinkMapPool() {}
+
+    /** Sets the memory of the pool, all maps are freed
+     *  \param pool memory, which has to stay valid
+     *  \param num_words size of pool
+     */
+    void Init(DWORD* pool, size_t num_words);
+
+    /** Opens a file for random access, with a link map if there's room
+     *  \return the result of f_open()
+     */
+    FRESULT Open(FIL* file, const TCHAR* path, BYTE mode = FA_READ);
+
+    /** Builds the link map of a file that's already open
+     *  \return FR_NOT_ENOUGH_CORE if there isn't enough memory left, the
+     *          file is used without a map
+     */
+    FRESULT Attach(FIL* file);
+
+    /** Frees the link map of a file, it keeps working with normal seeks */
+    void Release(FIL* file);
+
+    /** Frees the link map of a file and closes it */
+    FRESULT Close(FIL* file);
+
+    /** Seeks in a file like f_lseek(), and adds the time to the stats */
+    FRESULT Seek(FIL* file, FSIZE_t position);
+
+    /** \return true if a file has a link map */
+    bool HasLinkMap(const FIL* file) const;
+
+    /** \return number of words not used by link maps */
+    size_t GetFreeWords() const;
+
+    /** \return the time taken by Seek() */
+    const SeekStats& GetSeekStats() const { return stats_; }
+
+    /** Clears the seek statistics */
+    void ResetSeekStats() { stats_ = SeekStats(); }
+
+  private:
+    struct Slot
+    {
+        FIL*   file;
+        size_t offset;
+        size_t size;
+    };
+
+    DWORD*    pool_      = nullptr;
+    size_t    num_words_ = 0;
+    Slot      slots_[kMaxFiles];
+    SeekStats stats_ = SeekStats();
+};
+
 /** @brief Daisy FatFS Driver Interface
  *  @details Specifies the desired media (SD Card, USB, etc.) to be mountable with FatFS
  *           within a given application. Once initialization is called, the standard
@@ -59,6 +150,14 @@ class FatFSInterface
         };
 
         uint8_t media;
+
+        /** Memory for the link maps of files opened with
+         *  OpenRandomAccess(), can be nullptr to seek normally.
+         */
+        DWORD* link_map_pool = nullptr;
+
+        /** Size of link_map_pool in words */
+        size_t link_map_pool_size = 0;
     };
 
     FatFSInterface() {}
@@ -95,11 +194,40 @@ class FatFSInterface
     /** Returns reference to filesystem object for the USB volume. */
     FATFS& GetUSBFileSystem() { return fs_[1]; }
 
+    /** Opens a file for random access. Seeks take the same time anywhere in
+     *  the file, if there's room for its link map in
+     *  Config::link_map_pool.
+     *  \return the result of f_open()
+     */
+    FRESULT OpenRandomAccess(FIL* file, const TCHAR* path, BYTE mode = FA_READ)
+    {
+        return link_maps_.Open(file, path, mode);
+    }
+
+    /** Closes a file that was opened with OpenRandomAccess() */
+    FRESULT CloseRandomAccess(FIL* file) { return link_maps_.Close(file); }
+
+    /** Seeks in a file, and adds the time to the seek statistics */
+    FRESULT Seek(FIL* file, FSIZE_t position)
+    {
+        return link_maps_.Seek(file, position);
+    }
+
+    /** Returns the time taken by Seek() */
+    const FatFSLinkMapPool::SeekStats& GetSeekStats() const
+    {
+        return link_maps_.GetSeekStats();
+    }
+
+    /** Returns the link maps, e.g. for WavStreamer::Config */
+    FatFSLinkMapPool& GetLinkMapPool() { return link_maps_; }
+
   private:
-    Config cfg_;
-    FATFS  fs_[_VOLUMES];
-    char   path_[_VOLUMES][4];
-    bool   initialized_;
+    Config           cfg_;
+    FatFSLinkMapPool link_maps_;
+    FATFS            fs_[_VOLUMES];
+    char             path_[_VOLUMES][4];
+    bool             initialized_;
 };
 
 } // namespace daisy
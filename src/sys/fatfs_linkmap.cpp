@@ -0,0 +1,135 @@
+#include "sys/fatfs.h"
+#include "sys/system.h"
+
+using namespace daisy;
+
+constexpr size_t FatFSLinkMapPool::kMaxFiles;
+
+void FatFSLinkMapPool::Init(DWORD* pool, size_t num_words)
+{
+    pool_      = pool;
+    num_words_ = pool != nullptr ? num_words : 0;
+    for(Slot& slot : slots_)
+        slot.file = nullptr;
+    stats_ = SeekStats();
+}
+
+FRESULT FatFSLinkMapPool::Open(FIL* file, const TCHAR* path, BYTE mode)
+{
+    const FRESULT result = f_open(file, path, mode);
+    if(result == FR_OK)
+        Attach(file);
+    return result;
+}
+
+FRESULT FatFSLinkMapPool::Attach(FIL* file)
+{
+    Release(file);
+    Slot* free_slot = nullptr;
+    for(Slot& slot : slots_)
+    {
+        if(slot.file == nullptr)
+        {
+            free_slot = &slot;
+            break;
+        }
+    }
+
+    // The map is built in the largest free gap, as its size isn't known
+    // before, and then shrunk to what it takes. Gaps start at the start of
+    // the pool, or at the end of a map.
+    size_t gap_offset = 0, gap_size = 0;
+    for(size_t i = 0; i <= kMaxFiles; i++)
+    {
+        if(i < kMaxFiles && slots_[i].file == nullptr)
+            continue;
+        const size_t start
+            = i < kMaxFiles ? slots_[i].offset + slots_[i].size : 0;
+        size_t end = num_words_;
+        for(const Slot& slot : slots_)
+        {
+            if(slot.file == nullptr)
+                continue;
+            if(slot.offset <= start && slot.offset + slot.size > start)
+                end = start;
+            else if(slot.offset > start && slot.offset < end)
+                end = slot.offset;
+        }
+        if(end > start && end - start > gap_size)
+        {
+            gap_offset = start;
+            gap_size   = end - start;
+        }
+    }
+    // a table for one fragment takes 4 words
+    if(free_slot == nullptr || gap_size < 4)
+        return FR_NOT_ENOUGH_CORE;
+
+    DWORD* table = pool_ + gap_offset;
+    table[0]     = gap_size;
+    file->cltbl  = table;
+    const FRESULT result = f_lseek(file, CREATE_LINKMAP);
+    if(result != FR_OK)
+    {
+        file->cltbl = nullptr;
+        return result;
+    }
+    free_slot->file   = file;
+    free_slot->offset = gap_offset;
+    free_slot->size   = table[0];
+    return FR_OK;
+}
+
+void FatFSLinkMapPool::Release(FIL* file)
+{
+    for(Slot& slot : slots_)
+    {
+        if(slot.file == file)
+        {
+            slot.file   = nullptr;
+            file->cltbl = nullptr;
+        }
+    }
+}
+
+FRESULT FatFSLinkMapPool::Close(FIL* file)
+{
+    Release(file);
+    return f_close(file);
+}
+
+FRESULT FatFSLinkMapPool::Seek(FIL* file, FSIZE_t position)
+{
+    const uint32_t start  = System::GetUs();
+    const FRESULT  result = f_lseek(file, position);
+    const uint32_t time   = System::GetUs() - start;
+    stats_.count++;
+    stats_.total_us += time;
+    if(time > stats_.max_us)
+        stats_.max_us = time;
+    return result;
+}
+
+bool FatFSLinkMapPool::HasLinkMap(const FIL* file) const
+{
+    // free slots have file == nullptr
+    if(file == nullptr)
+        return false;
+    for(const Slot& slot : slots_)
+    {
+        if(slot.file == file)
+            return true;
+    }
+    return false;
+}
+
+size_t FatFSLinkMapPool::GetFreeWords() const
+{
+    size_t used = 0;
+    for(const Slot& slot : slots_)
+    {
+        if(slot.file != nullptr)
+            used += slot.size;
+    }
+    return num_words_ - used;
+}
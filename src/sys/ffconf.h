@@ -68,7 +68,7 @@
     1 /**< This option switches fast seek feature. (0:Disable or 1:Enable) */
 
 #define _USE_EXPAND \
-    0 /**< This option switches f_expand function. (0:Disable or 1:Enable) */
+    1 /**< This option switches f_expand function. (0:Disable or 1:Enable) */
 
 #define _USE_CHMOD \
     0 /**< This option switches attribute manipulation functions, f_chmod() and f_utime().
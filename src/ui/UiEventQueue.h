@@ -1,7 +1,6 @@
 #pragma once
 #include <stdint.h>
-#include "../util/FIFO.h"
-#include "../util/scopedirqblocker.h"
+#include "../util/SpscQueue.h"
 
 namespace daisy
 {
@@ -11,8 +10,8 @@ namespace daisy
  * 
  * A queue that holds user interface events such as button presses or encoder turns.
  * The queue can be filled from hardware drivers and read from a UI object.
- * Access to the queue is protected by a ScopedIrqBlocker - that means it's safe to add
- * events from interrupt handlers.
+ * The queue is lock-free and never disables interrupts. Events can be added from
+ * one context (e.g. the main loop or an interrupt handler) and read from another.
  */
 class UiEventQueue
 {
@@ -123,8 +122,7 @@ class UiEventQueue
         e.asButtonPressed.id = buttonID;
         e.asButtonPressed.numSuccessivePresses = numSuccessivePresses;
         e.asButtonPressed.isRetriggering       = isRetriggering;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(e);
+        events_.Push(e);
     }
 
     /** Adds a Event::EventType::buttonReleased event to the queue. */
@@ -133,8 +131,7 @@ class UiEventQueue
         Event m;
         m.type                = Event::EventType::buttonReleased;
         m.asButtonReleased.id = buttonID;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(m);
+        events_.Push(m);
     }
 
     /** Adds a Event::EventType::encoderTurned event to the queue. */
@@ -147,8 +144,7 @@ class UiEventQueue
         e.asEncoderTurned.id          = encoderID;
         e.asEncoderTurned.increments  = increments;
         e.asEncoderTurned.stepsPerRev = stepsPerRev;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(e);
+        events_.Push(e);
     }
 
     /** Adds a Event::EventType::encoderActivityChanged event to the queue. */
@@ -160,8 +156,7 @@ class UiEventQueue
         e.asEncoderActivityChanged.newActivityType
             = isActive ? Event::ActivityType::active
                        : Event::ActivityType::inactive;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(e);
+        events_.Push(e);
     }
 
     /** Adds a Event::EventType::potMoved event to the queue. */
@@ -171,8 +166,7 @@ class UiEventQueue
         e.type                   = Event::EventType::potMoved;
         e.asPotMoved.id          = potId;
         e.asPotMoved.newPosition = newPosition;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(e);
+        events_.Push(e);
     }
 
     /** Adds a Event::EventType::potActivityChanged event to the queue. */
@@ -184,35 +178,23 @@ class UiEventQueue
         e.asPotActivityChanged.newActivityType
             = isActive ? Event::ActivityType::active
                        : Event::ActivityType::inactive;
-        ScopedIrqBlocker sIrqBl;
-        events_.PushBack(e);
+        events_.Push(e);
     }
 
     /** Removes and returns an event from the queue. */
     Event GetAndRemoveNextEvent()
     {
-        ScopedIrqBlocker sIrqBl;
-        if(events_.IsEmpty())
-        {
-            Event m;
-            m.type = Event::EventType::invalid;
-            return m;
-        }
-        else
-        {
-            return events_.PopFront();
-        }
+        Event e;
+        if(!events_.Pop(e))
+            e.type = Event::EventType::invalid;
+        return e;
     }
 
     /** Returns true, if the queue is empty. */
-    bool IsQueueEmpty()
-    {
-        ScopedIrqBlocker sIrqBl;
-        return events_.IsEmpty();
-    }
+    bool IsQueueEmpty() { return events_.IsEmpty(); }
 
   private:
-    FIFO<Event, 256> events_;
+    SpscQueue<Event, 256> events_;
 };
 
 } // namespace daisy
\ No newline at end of file
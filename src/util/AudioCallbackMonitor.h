@@ -0,0 +1,169 @@
+#pragma once
+
+#include "sys/system.h"
+
+namespace daisy
+{
+/** @brief Audio callback timing instrumentation
+ *  @addtogroup utility
+ *
+ *  Records when each audio callback starts and how long it runs, to find
+ *  callbacks that start late or miss their deadline - the usual cause of
+ *  clicks under load. While CpuLoadMeter reports the average and peak load,
+ *  this keeps histograms of the callback duration and of the jitter in the
+ *  time between consecutive callbacks.
+ *
+ *  The AudioHandle contains one of these, which is updated for every block
+ *  (see AudioHandle::GetCallbackMonitor()). To use it on your own, call
+ *  `OnCallbackStart()` at the beginning and `OnCallbackEnd()` at the end of
+ *  the callback.
+ *
+ *  All values are only written from the audio callback, and can be read from
+ *  the main loop at any time without disabling interrupts.
+ */
+class AudioCallbackMonitor
+{
+  public:
+    /** Number of bins in each histogram */
+    static constexpr size_t kNumBins = 16;
+
+    AudioCallbackMonitor()
+    {
+        ClearStats();
+        resetRequested_ = false;
+    }
+
+    /** Initializes the monitor for a particular sample rate and block size.
+     *  @param sampleRateInHz     The sample rate in Hz
+     *  @param blockSizeInSamples The block size in samples
+     */
+    void Init(float sampleRateInHz, int blockSizeInSamples)
+    {
+        const auto secPerBlock = float(blockSizeInSamples) / sampleRateInHz;
+        ticksPerBlock_ = uint32_t(float(System::GetTickFreq()) * secPerBlock);
+        if(ticksPerBlock_ == 0)
+            ticksPerBlock_ = 1;
+        ClearStats();
+        resetRequested_ = false;
+    }
+
+    /** Call this at the beginning of the audio callback */
+    void OnCallbackStart()
+    {
+        const uint32_t now = System::GetTick();
+        if(resetRequested_)
+        {
+            ClearStats();
+            resetRequested_ = false;
+        }
+
+        if(numCallbacks_ > 0)
+        {
+            const uint32_t interval = now - lastStartTicks_;
+            const uint32_t jitter   = interval > ticksPerBlock_
+                                        ? interval - ticksPerBlock_
+                                        : ticksPerBlock_ - interval;
+            if(jitter > maxJitterTicks_)
+                maxJitterTicks_ = jitter;
+            // A callback that starts more than half a block late has
+            // (at least partially) missed its DMA half.
+            if(interval > ticksPerBlock_ + ticksPerBlock_ / 2)
+                numLateCallbacks_++;
+            // jitter bins span 0..50% of a block
+            jitterHistogram_[GetBin(jitter * 2)]++;
+        }
+        lastStartTicks_ = now;
+        numCallbacks_++;
+    }
+
+    /** Call this at the end of the audio callback */
+    void OnCallbackEnd()
+    {
+        const uint32_t duration = System::GetTick() - lastStartTicks_;
+        if(duration > maxDurationTicks_)
+            maxDurationTicks_ = duration;
+        // The next DMA half has completed before this callback returned.
+        if(duration > ticksPerBlock_)
+            numMissedDeadlines_++;
+        // duration bins span 0..100% of a block
+        durationHistogram_[GetBin(duration)]++;
+    }
+
+    /** Returns the number of callbacks since the last reset */
+    uint32_t GetNumCallbacks() const { return numCallbacks_; }
+
+    /** Returns the number of callbacks that ran longer than one block */
+    uint32_t GetNumMissedDeadlines() const { return numMissedDeadlines_; }
+
+    /** Returns the number of callbacks that started more than half a block
+     *  later than expected */
+    uint32_t GetNumLateCallbacks() const { return numLateCallbacks_; }
+
+    /** Returns the longest callback duration in ticks */
+    uint32_t GetMaxDurationTicks() const { return maxDurationTicks_; }
+
+    /** Returns the largest deviation from the expected callback interval
+     *  in ticks */
+    uint32_t GetMaxJitterTicks() const { return maxJitterTicks_; }
+
+    /** Returns the expected number of ticks between two callbacks */
+    uint32_t GetTicksPerBlock() const { return ticksPerBlock_; }
+
+    /** Returns a bin of the callback duration histogram.
+     *  Bin i counts callbacks that took i/kNumBins to (i+1)/kNumBins of a
+     *  block. The last bin also counts all longer callbacks.
+     */
+    uint32_t GetDurationHistogram(size_t bin) const
+    {
+        return bin < kNumBins ? durationHistogram_[bin] : 0;
+    }
+
+    /** Returns a bin of the callback jitter histogram.
+     *  Bin i counts callbacks whose interval deviated by i/(2*kNumBins) to
+     *  (i+1)/(2*kNumBins) of a block from the expected interval. The last
+     *  bin also counts all larger deviations.
+     */
+    uint32_t GetJitterHistogram(size_t bin) const
+    {
+        return bin < kNumBins ? jitterHistogram_[bin] : 0;
+    }
+
+    /** Resets all readings. To avoid locking, the readings are cleared at the
+     *  start of the next callback.
+     */
+    void Reset() { resetRequested_ = true; }
+
+  private:
+    size_t GetBin(uint32_t ticks) const
+    {
+        const uint64_t bin = uint64_t(ticks) * kNumBins / ticksPerBlock_;
+        return bin < kNumBins ? size_t(bin) : kNumBins - 1;
+    }
+
+    void ClearStats()
+    {
+        numCallbacks_       = 0;
+        numMissedDeadlines_ = 0;
+        numLateCallbacks_   = 0;
+        maxDurationTicks_   = 0;
+        maxJitterTicks_     = 0;
+        lastStartTicks_     = 0;
+        for(size_t i = 0; i < kNumBins; i++)
+            durationHistogram_[i] = jitterHistogram_[i] = 0;
+    }
+
+    uint32_t          ticksPerBlock_ = 1;
+    uint32_t          lastStartTicks_;
+    volatile uint32_t numCallbacks_;
+    volatile uint32_t numMissedDeadlines_;
+    volatile uint32_t numLateCallbacks_;
+    volatile uint32_t maxDurationTicks_;
+    volatile uint32_t maxJitterTicks_;
+    volatile uint32_t durationHistogram_[kNumBins];
+    volatile uint32_t jitterHistogram_[kNumBins];
+    volatile bool     resetRequested_;
+
+    AudioCallbackMonitor(const AudioCallbackMonitor&) = delete;
+    AudioCallbackMonitor& operator=(const AudioCallbackMonitor&) = delete;
+};
+} // namespace daisy
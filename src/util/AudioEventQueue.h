@@ -0,0 +1,216 @@
+#pragma once
+#ifndef DSY_AUDIO_EVENT_QUEUE_H
+#define DSY_AUDIO_EVENT_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace daisy
+{
+/** @brief Sample accurate event scheduling for the audio callback
+ *  @addtogroup utility
+ *
+ *  Events (MIDI, gates, UI, ...) are stamped with the time on the sample
+ *  clock when they are captured, usually from AudioHandle::GetSampleTime().
+ *  At the start of each audio callback, the events due in that block are
+ *  collected into a list sorted by time, with the sample offset of each
+ *  event within the block.
+ *
+ *  Every event is delayed by a fixed latency (usually one block), so an
+ *  event captured while block n was playing is rendered in block n + 1 at
+ *  the same position. This keeps the timing exact to the sample, instead of
+ *  jittering by up to one block.
+ *
+ *  ProcessSubBlocks() splits the block at the event positions, to render
+ *  the audio in between with the state changes applied at the right sample.
+ *
+ *  @code
+ *  AudioEventQueue<NoteEvent, 32> events;
+ *
+ *  // main loop or interrupt
+ *  events.Push(note, audio.GetSampleTime());
+ *
+ *  // audio callback
+ *  events.PrepareBlock(audio.GetSampleClock(), size);
+ *  events.ProcessSubBlocks(
+ *      [&](const NoteEvent& e) { synth.Handle(e); },
+ *      [&](size_t offset, size_t len) { synth.Render(out, offset, len); });
+ *  @endcode
+ *
+ *  Push() may be used from one context (e.g. the main loop), everything
+ *  else from the audio callback. Both sides are lock free.
+ *
+ *  @tparam T         the event type
+ *  @tparam kCapacity maximum number of events waiting to be rendered
+ */
+template <typename T, size_t kCapacity>
+class AudioEventQueue
+{
+  public:
+    /** An event and its time on the sample clock */
+    struct TimedEvent
+    {
+        uint32_t time;
+        T        data;
+    };
+
+    AudioEventQueue() { Init(0); }
+
+    /** Initializes the queue and removes all events.
+     *  @param latency Delay in samples from an event's timestamp until it is
+     *                 rendered, usually the audio block size.
+     */
+    void Init(size_t latency)
+    {
+        latency_     = latency;
+        block_start_ = 0;
+        block_size_  = 0;
+        num_pending_ = 0;
+        num_block_   = 0;
+        num_dropped_ = 0;
+        write_.store(0, std::memory_order_relaxed);
+        read_.store(0, std::memory_order_relaxed);
+    }
+
+    /** Adds an event. Events can be pushed in any order.
+     *  @param data the event
+     *  @param time the time on the sample clock the event happened at
+     *  @return false if the queue is full and the event was dropped
+     */
+    bool Push(const T& data, uint32_t time)
+    {
+        const size_t w = write_.load(std::memory_order_relaxed);
+        if(Distance(read_.load(std::memory_order_acquire), w) >= kCapacity)
+        {
+            num_dropped_ = num_dropped_ + 1;
+            return false;
+        }
+        queue_[w % kCapacity].time = time;
+        queue_[w % kCapacity].data = data;
+        write_.store(Next(w), std::memory_order_release);
+        return true;
+    }
+
+    /** Returns the number of events dropped because the queue was full */
+    uint32_t GetNumDropped() const { return num_dropped_; }
+
+    /** Collects the events due in the next block. Call this at the start of
+     *  the audio callback. The events of the previous block are removed.
+     *  @param block_start time on the sample clock of the first sample of
+     *                     the block, see AudioHandle::GetSampleClock()
+     *  @param size        block size in samples
+     *  @return the number of events in this block
+     */
+    size_t PrepareBlock(uint32_t block_start, size_t size)
+    {
+        // remove the events of the previous block
+        for(size_t i = num_block_; i < num_pending_; i++)
+            pending_[i - num_block_] = pending_[i];
+        num_pending_ -= num_block_;
+        num_block_ = 0;
+
+        // sort the new events into the pending list. Events that don't fit
+        // are left in the queue for the next block.
+        size_t       r = read_.load(std::memory_order_relaxed);
+        const size_t w = write_.load(std::memory_order_acquire);
+        for(; r != w && num_pending_ < kCapacity; r = Next(r))
+        {
+            const TimedEvent& e = queue_[r % kCapacity];
+            size_t            i = num_pending_++;
+            // equal times stay in the order they were pushed
+            while(i > 0 && IsBefore(e.time, pending_[i - 1].time))
+            {
+                pending_[i] = pending_[i - 1];
+                i--;
+            }
+            pending_[i] = e;
+        }
+        read_.store(r, std::memory_order_release);
+
+        block_start_ = block_start;
+        while(num_block_ < num_pending_
+              && GetDelay(pending_[num_block_].time) < int32_t(size))
+            num_block_++;
+        block_size_ = size;
+        return num_block_;
+    }
+
+    /** Returns the number of events in the current block */
+    size_t GetNumEvents() const { return num_block_; }
+
+    /** Returns an event of the current block, sorted by time */
+    const T& GetEvent(size_t idx) const { return pending_[idx].data; }
+
+    /** Returns the position of an event within the current block.
+     *  Events that arrived too late to be rendered at their exact time are
+     *  placed at the start of the block.
+     */
+    size_t GetOffset(size_t idx) const
+    {
+        const int32_t delay = GetDelay(pending_[idx].time);
+        return delay > 0 ? size_t(delay) : 0;
+    }
+
+    /** Returns the number of events waiting for this or later blocks */
+    size_t GetNumPending() const { return num_pending_; }
+
+    /** Splits the current block at the events' positions.
+     *  For each section between two event positions, render(offset, length)
+     *  is called, and at each position on_event(event) is called for all
+     *  events there - before rendering the following section.
+     *  @param on_event called as on_event(const T&)
+     *  @param render   called as render(size_t offset, size_t length)
+     */
+    template <typename EventFunction, typename RenderFunction>
+    void ProcessSubBlocks(EventFunction on_event, RenderFunction render) const
+    {
+        size_t pos = 0;
+        for(size_t i = 0; i < num_block_; i++)
+        {
+            const size_t offset = GetOffset(i);
+            if(offset > pos)
+            {
+                render(pos, offset - pos);
+                pos = offset;
+            }
+            on_event(pending_[i].data);
+        }
+        if(block_size_ > pos)
+            render(pos, block_size_ - pos);
+    }
+
+  private:
+    // The queue indices count modulo 2 * kCapacity, so that a full queue
+    // can be told apart from an empty one.
+    static size_t Next(size_t idx) { return (idx + 1) % (2 * kCapacity); }
+    static size_t Distance(size_t from, size_t to)
+    {
+        return (to + 2 * kCapacity - from) % (2 * kCapacity);
+    }
+
+    /** Wraparound safe comparison of sample clock times */
+    static bool IsBefore(uint32_t a, uint32_t b) { return int32_t(a - b) < 0; }
+
+    /** Samples from the start of the current block to an event */
+    int32_t GetDelay(uint32_t time) const
+    {
+        return int32_t(time + uint32_t(latency_) - block_start_);
+    }
+
+    TimedEvent          queue_[kCapacity];
+    std::atomic<size_t> write_;
+    std::atomic<size_t> read_;
+    volatile uint32_t   num_dropped_;
+
+    TimedEvent pending_[kCapacity];
+    size_t     num_pending_;
+    size_t     num_block_;
+    size_t     block_size_;
+    size_t     latency_;
+    uint32_t   block_start_;
+};
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,473 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "sys/system.h"
+
+namespace daisy
+{
+/** @brief A processing stage in an AudioGraph
+ *  @ingroup audio
+ *
+ *  Derive from this class to create your own processing nodes.
+ *  Process() is called once per block from the audio callback.
+ */
+class AudioGraphNode
+{
+  public:
+    virtual ~AudioGraphNode() {}
+
+    /** Returns the number of input ports of this node */
+    virtual size_t GetNumInputs() const = 0;
+
+    /** Returns the number of output ports of this node */
+    virtual size_t GetNumOutputs() const = 0;
+
+    /** Processes one block of audio.
+     *  Unconnected inputs read silence, unconnected outputs are discarded.
+     *  An output buffer never aliases an input buffer of the same node.
+     *  @param in   GetNumInputs() input buffers of size samples each
+     *  @param out  GetNumOutputs() output buffers of size samples each
+     *  @param size number of samples in each buffer
+     */
+    virtual void
+    Process(const float* const* in, float* const* out, size_t size) = 0;
+};
+
+/** @brief A static, allocation-free audio processing graph
+ *  @ingroup audio
+ *
+ *  Nodes are added and connected once at initialization, then Compile() sorts
+ *  them into processing order and assigns the intermediate buffers.
+ *  Buffers are shared between connections whose lifetimes don't overlap, so a
+ *  graph of many nodes only needs a handful of scratch buffers.
+ *
+ *  Call Process() from your non-interleaving audio callback:
+ *
+ *      AudioGraph<8, 4> graph;
+ *
+ *      void AudioCallback(AudioHandle::InputBuffer  in,
+ *                         AudioHandle::OutputBuffer out,
+ *                         size_t                    size)
+ *      {
+ *          graph.Process(in, out, size);
+ *      }
+ *
+ *  The time spent in each node is measured with System::GetTick() and can be
+ *  read with GetNodeTicks() and GetNodeMaxTicks().
+ *
+ *  @tparam kMaxNodes     maximum number of nodes in the graph
+ *  @tparam kNumBuffers   number of scratch buffers available for connections
+ *                        between nodes
+ *  @tparam kMaxBlockSize size of each scratch buffer. Larger blocks are
+ *                        processed in multiple passes.
+ */
+template <size_t kMaxNodes, size_t kNumBuffers, size_t kMaxBlockSize = 48>
+class AudioGraph
+{
+  public:
+    /** Maximum number of input or output ports per node */
+    static constexpr size_t kMaxPorts = 4;
+    /** Maximum number of audio channels going in and out of the graph */
+    static constexpr size_t kMaxChannels = 4;
+
+    /** Return values for AudioGraph functions */
+    enum class Result
+    {
+        OK,
+        /** The node or port does not exist */
+        ERR_INVALID,
+        /** The port is already connected */
+        ERR_CONNECTED,
+        /** The graph contains a feedback loop */
+        ERR_CYCLE,
+        /** The graph needs more than kNumBuffers scratch buffers */
+        ERR_BUFFERS,
+    };
+
+    AudioGraph() { Init(2); }
+
+    /** Removes all nodes and connections.
+     *  @param num_channels number of channels the audio callback provides
+     */
+    void Init(size_t num_channels)
+    {
+        num_channels_ = num_channels < kMaxChannels ? num_channels
+                                                    : kMaxChannels;
+        num_nodes_    = 0;
+        compiled_     = false;
+        for(size_t c = 0; c < kMaxChannels; c++)
+            output_src_[c] = Port{kUnconnected, 0};
+        memset(zero_, 0, sizeof(zero_));
+        for(size_t b = 0; b < kNumBuffers; b++)
+            slots_[kSlotScratch + b] = scratch_[b];
+        slots_[kSlotZero]    = zero_;
+        slots_[kSlotDiscard] = discard_;
+    }
+
+    /** Adds a node to the graph.
+     *  @return the id of the node, or -1 if the graph is full or the node
+     *          has too many ports.
+     */
+    int AddNode(AudioGraphNode& node)
+    {
+        if(num_nodes_ >= kMaxNodes || node.GetNumInputs() > kMaxPorts
+           || node.GetNumOutputs() > kMaxPorts)
+            return -1;
+        Node& n = nodes_[num_nodes_];
+        n.node  = &node;
+        for(size_t p = 0; p < kMaxPorts; p++)
+            n.src[p] = Port{kUnconnected, 0};
+        n.ticks     = 0;
+        n.max_ticks = 0;
+        compiled_   = false;
+        return (int)num_nodes_++;
+    }
+
+    /** Connects an output of one node to the input of another.
+     *  Each input can only be connected once, outputs can be connected to
+     *  any number of inputs.
+     */
+    Result Connect(int src, size_t src_port, int dst, size_t dst_port)
+    {
+        if(!IsValidNode(src) || src_port >= nodes_[src].node->GetNumOutputs())
+            return Result::ERR_INVALID;
+        return ConnectInput(Port{(int16_t)src, (uint8_t)src_port},
+                            dst,
+                            dst_port);
+    }
+
+    /** Connects a channel of the audio callback input to a node input. */
+    Result ConnectInput(size_t channel, int dst, size_t dst_port)
+    {
+        if(channel >= num_channels_)
+            return Result::ERR_INVALID;
+        return ConnectInput(Port{kGraphInput, (uint8_t)channel},
+                            dst,
+                            dst_port);
+    }
+
+    /** Connects a node output to a channel of the audio callback output.
+     *  Unconnected channels are filled with silence.
+     */
+    Result ConnectOutput(int src, size_t src_port, size_t channel)
+    {
+        if(!IsValidNode(src) || src_port >= nodes_[src].node->GetNumOutputs()
+           || channel >= num_channels_)
+            return Result::ERR_INVALID;
+        if(output_src_[channel].node != kUnconnected)
+            return Result::ERR_CONNECTED;
+        output_src_[channel] = Port{(int16_t)src, (uint8_t)src_port};
+        compiled_            = false;
+        return Result::OK;
+    }
+
+    /** Sorts the nodes into processing order and assigns buffers.
+     *  Must be called after the last change to the graph, and before
+     *  Process().
+     */
+    Result Compile()
+    {
+        compiled_       = false;
+        Result sort_res = SortNodes();
+        if(sort_res != Result::OK)
+            return sort_res;
+
+        // Find the position in the processing order at which each node
+        // output is read for the last time.
+        size_t last_use[kMaxNodes][kMaxPorts];
+        for(size_t i = 0; i < num_nodes_; i++)
+            for(size_t p = 0; p < kMaxPorts; p++)
+                last_use[i][p] = kNoUse;
+        for(size_t pos = 0; pos < num_nodes_; pos++)
+        {
+            const Node& n = nodes_[order_[pos]];
+            for(size_t p = 0; p < n.node->GetNumInputs(); p++)
+                if(n.src[p].node >= 0)
+                    last_use[n.src[p].node][n.src[p].port] = pos;
+        }
+
+        // Outputs feeding the audio output are written there directly.
+        // A second channel fed by the same output is copied from the first
+        // at the end of the block.
+        bool direct[kMaxNodes][kMaxPorts] = {};
+        for(size_t i = 0; i < num_nodes_; i++)
+        {
+            for(size_t p = 0; p < kMaxPorts; p++)
+            {
+                nodes_[i].in[p]  = kSlotZero;
+                nodes_[i].out[p] = kSlotDiscard;
+            }
+        }
+        for(size_t c = 0; c < num_channels_; c++)
+        {
+            const Port& o = output_src_[c];
+            if(o.node >= 0 && !direct[o.node][o.port])
+            {
+                direct[o.node][o.port]     = true;
+                nodes_[o.node].out[o.port] = kSlotOutput + c;
+            }
+        }
+
+        // Assign scratch buffers in processing order, reusing those whose
+        // value has been read for the last time.
+        uint8_t free_slots[kNumBuffers];
+        size_t  num_free = kNumBuffers;
+        for(size_t b = 0; b < kNumBuffers; b++)
+            free_slots[b] = kSlotScratch + kNumBuffers - 1 - b;
+        num_buffers_used_ = 0;
+
+        for(size_t pos = 0; pos < num_nodes_; pos++)
+        {
+            const size_t idx = order_[pos];
+            Node&        n   = nodes_[idx];
+            for(size_t p = 0; p < n.node->GetNumOutputs(); p++)
+            {
+                if(direct[idx][p] || last_use[idx][p] == kNoUse)
+                    continue;
+                if(num_free == 0)
+                    return Result::ERR_BUFFERS;
+                n.out[p]          = free_slots[--num_free];
+                const size_t used = kNumBuffers - num_free;
+                if(used > num_buffers_used_)
+                    num_buffers_used_ = used;
+            }
+            for(size_t p = 0; p < n.node->GetNumInputs(); p++)
+            {
+                const Port& s = n.src[p];
+                if(s.node == kUnconnected)
+                    n.in[p] = kSlotZero;
+                else if(s.node == kGraphInput)
+                    n.in[p] = kSlotInput + s.port;
+                else
+                {
+                    n.in[p] = nodes_[s.node].out[s.port];
+                    // release the buffer once, after its last reader
+                    if(last_use[s.node][s.port] == pos
+                       && n.in[p] >= kSlotScratch)
+                    {
+                        free_slots[num_free++]   = n.in[p];
+                        last_use[s.node][s.port] = kReleased;
+                    }
+                }
+            }
+        }
+
+        for(size_t c = 0; c < num_channels_; c++)
+        {
+            const Port& o = output_src_[c];
+            output_slot_[c]
+                = o.node < 0 ? kSlotZero : nodes_[o.node].out[o.port];
+        }
+        compiled_ = true;
+        return Result::OK;
+    }
+
+    /** Processes one block through all nodes.
+     *  Does nothing but clear the output if the graph isn't compiled.
+     *  The signature matches AudioHandle::AudioCallback.
+     */
+    void Process(const float* const* in, float** out, size_t size)
+    {
+        // the ticks of the sub-blocks add up
+        for(size_t i = 0; i < num_nodes_; i++)
+            nodes_[i].ticks = 0;
+        size_t done = 0;
+        while(done < size)
+        {
+            const size_t n
+                = size - done < kMaxBlockSize ? size - done : kMaxBlockSize;
+            ProcessBlock(in, out, done, n);
+            done += n;
+        }
+        for(size_t i = 0; i < num_nodes_; i++)
+            if(nodes_[i].ticks > nodes_[i].max_ticks)
+                nodes_[i].max_ticks = nodes_[i].ticks;
+    }
+
+    /** Returns the number of nodes in the graph */
+    size_t GetNumNodes() const { return num_nodes_; }
+
+    /** Returns the number of scratch buffers needed by the compiled graph */
+    size_t GetNumBuffersUsed() const { return num_buffers_used_; }
+
+    /** Returns the id of the node at a position in the processing order */
+    int GetNodeAtPosition(size_t pos) const
+    {
+        return pos < num_nodes_ ? (int)order_[pos] : -1;
+    }
+
+    /** Returns the ticks spent in a node during the last call to Process() */
+    uint32_t GetNodeTicks(int node) const
+    {
+        return IsValidNode(node) ? nodes_[node].ticks : 0;
+    }
+
+    /** Returns the most ticks spent in a node during a call to Process()
+     *  since the last call to ResetNodeTicks().
+     */
+    uint32_t GetNodeMaxTicks(int node) const
+    {
+        return IsValidNode(node) ? nodes_[node].max_ticks : 0;
+    }
+
+    /** Returns the id of the node with the highest maximum tick count,
+     *  or -1 if the graph is empty.
+     */
+    int GetMostExpensiveNode() const
+    {
+        int result = -1;
+        for(size_t i = 0; i < num_nodes_; i++)
+            if(result < 0 || nodes_[i].max_ticks > nodes_[result].max_ticks)
+                result = (int)i;
+        return result;
+    }
+
+    /** Resets the tick measurements of all nodes */
+    void ResetNodeTicks()
+    {
+        for(size_t i = 0; i < num_nodes_; i++)
+            nodes_[i].ticks = nodes_[i].max_ticks = 0;
+    }
+
+  private:
+    static constexpr int16_t kUnconnected = -1;
+    static constexpr int16_t kGraphInput  = -2;
+    static constexpr size_t  kNoUse       = SIZE_MAX;
+    static constexpr size_t  kReleased    = SIZE_MAX - 1;
+
+    static constexpr uint8_t kSlotZero    = 0;
+    static constexpr uint8_t kSlotDiscard = 1;
+    static constexpr uint8_t kSlotInput   = 2;
+    static constexpr uint8_t kSlotOutput  = kSlotInput + kMaxChannels;
+    static constexpr uint8_t kSlotScratch = kSlotOutput + kMaxChannels;
+    static constexpr size_t  kNumSlots    = kSlotScratch + kNumBuffers;
+
+    static_assert(kNumBuffers > 0, "At least one buffer is required");
+    static_assert(kNumSlots <= UINT8_MAX, "Too many buffers");
+
+    struct Port
+    {
+        int16_t node;
+        uint8_t port;
+    };
+
+    struct Node
+    {
+        AudioGraphNode* node;
+        Port            src[kMaxPorts];
+        uint8_t         in[kMaxPorts];
+        uint8_t         out[kMaxPorts];
+        uint32_t        ticks;
+        uint32_t        max_ticks;
+    };
+
+    bool IsValidNode(int node) const
+    {
+        return node >= 0 && (size_t)node < num_nodes_;
+    }
+
+    Result ConnectInput(Port src, int dst, size_t dst_port)
+    {
+        if(!IsValidNode(dst) || dst_port >= nodes_[dst].node->GetNumInputs())
+            return Result::ERR_INVALID;
+        if(nodes_[dst].src[dst_port].node != kUnconnected)
+            return Result::ERR_CONNECTED;
+        nodes_[dst].src[dst_port] = src;
+        compiled_                 = false;
+        return Result::OK;
+    }
+
+    /** Topological sort (Kahn's algorithm). Nodes without dependencies keep
+     *  the order in which they were added.
+     */
+    Result SortNodes()
+    {
+        size_t pending[kMaxNodes];
+        for(size_t i = 0; i < num_nodes_; i++)
+        {
+            pending[i] = 0;
+            for(size_t p = 0; p < nodes_[i].node->GetNumInputs(); p++)
+                if(nodes_[i].src[p].node >= 0)
+                    pending[i]++;
+        }
+        size_t num_sorted        = 0;
+        bool   sorted[kMaxNodes] = {};
+        while(num_sorted < num_nodes_)
+        {
+            bool progress = false;
+            for(size_t i = 0; i < num_nodes_; i++)
+            {
+                if(sorted[i] || pending[i] > 0)
+                    continue;
+                sorted[i]            = true;
+                order_[num_sorted++] = i;
+                progress             = true;
+                // all inputs fed by this node are now satisfied
+                for(size_t j = 0; j < num_nodes_; j++)
+                    for(size_t p = 0; p < nodes_[j].node->GetNumInputs(); p++)
+                        if(nodes_[j].src[p].node == (int16_t)i)
+                            pending[j]--;
+            }
+            if(!progress)
+                return Result::ERR_CYCLE;
+        }
+        return Result::OK;
+    }
+
+    void
+    ProcessBlock(const float* const* in, float** out, size_t offset, size_t size)
+    {
+        if(!compiled_)
+        {
+            for(size_t c = 0; c < num_channels_; c++)
+                memset(out[c] + offset, 0, size * sizeof(float));
+            return;
+        }
+        for(size_t c = 0; c < num_channels_; c++)
+        {
+            // inputs are never written to by the nodes
+            slots_[kSlotInput + c]  = const_cast<float*>(in[c]) + offset;
+            slots_[kSlotOutput + c] = out[c] + offset;
+        }
+
+        const float* node_in[kMaxPorts];
+        float*       node_out[kMaxPorts];
+        for(size_t pos = 0; pos < num_nodes_; pos++)
+        {
+            Node& n = nodes_[order_[pos]];
+            for(size_t p = 0; p < kMaxPorts; p++)
+            {
+                node_in[p]  = slots_[n.in[p]];
+                node_out[p] = slots_[n.out[p]];
+            }
+            const uint32_t start = System::GetTick();
+            n.node->Process(node_in, node_out, size);
+            n.ticks += System::GetTick() - start;
+        }
+
+        for(size_t c = 0; c < num_channels_; c++)
+        {
+            if(output_slot_[c] != kSlotOutput + c)
+                memcpy(out[c] + offset,
+                       slots_[output_slot_[c]],
+                       size * sizeof(float));
+        }
+    }
+
+    Node    nodes_[kMaxNodes];
+    size_t  order_[kMaxNodes];
+    size_t  num_nodes_;
+    size_t  num_channels_;
+    size_t  num_buffers_used_;
+    bool    compiled_;
+    Port    output_src_[kMaxChannels];
+    uint8_t output_slot_[kMaxChannels];
+    float*  slots_[kNumSlots];
+    float   zero_[kMaxBlockSize];
+    float   discard_[kMaxBlockSize];
+    float   scratch_[kNumBuffers][kMaxBlockSize];
+};
+
+} // namespace daisy
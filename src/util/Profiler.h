@@ -0,0 +1,321 @@
+#pragma once
+#ifndef DSY_PROFILER_H
+#define DSY_PROFILER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "sys/system.h"
+#ifndef UNIT_TEST
+#include "stm32h7xx_hal.h"
+#endif
+
+namespace daisy
+{
+/** @brief Named, nestable timing zones for finding hot spots
+ *  @addtogroup utility
+ *
+ *  While the CpuLoadMeter tells you that the audio callback takes too long,
+ *  the Profiler tells you which part of it does. Each zone accumulates the
+ *  number of calls and the min/avg/max duration of its scope. Zones can be
+ *  nested - besides the total time, each zone also tracks its "self" time,
+ *  i.e. the time not spent in nested zones.
+ *
+ *  Zones are registered once by name and then timed with a Scope object
+ *  that ends the measurement when it goes out of scope:
+ *
+ *  @code
+ *  Profiler<8> profiler;
+ *  size_t      zone_osc, zone_filter;
+ *
+ *  // setup
+ *  profiler.Init(Profiler<8>::Clock::CPU_CYCLES);
+ *  zone_osc    = profiler.AddZone("osc");
+ *  zone_filter = profiler.AddZone("filter");
+ *
+ *  // audio callback
+ *  {
+ *      Profiler<8>::Scope scope(profiler, zone_osc);
+ *      osc.Process(...);
+ *  }
+ *
+ *  // main loop, once in a while
+ *  profiler.Dump<Logger<>>();
+ *  @endcode
+ *
+ *  The zones are stored in a fixed size registry, nothing is allocated.
+ *  Zone names must be string literals (or otherwise stay valid).
+ *  Zones should only be timed from one context (usually the audio callback),
+ *  the statistics can be read from anywhere.
+ *
+ *  @tparam kMaxZones maximum number of zones
+ *  @tparam kMaxDepth maximum nesting depth. Deeper scopes are not timed.
+ */
+template <size_t kMaxZones, size_t kMaxDepth = 8>
+class Profiler
+{
+  public:
+    /** Time base for the measurements */
+    enum class Clock
+    {
+        /** System::GetTick() */
+        SYSTEM_TICK,
+        /** DWT cycle counter of the Cortex-M7, counts CPU clock cycles.
+         *  Unit tests use System::GetTick() instead.
+         */
+        CPU_CYCLES,
+    };
+
+    /** Readings of a zone, all times in ticks of the selected clock */
+    struct ZoneStats
+    {
+        const char* name;
+        uint32_t    count;
+        uint32_t    min_ticks;
+        uint32_t    max_ticks;
+        uint32_t    avg_ticks;
+        /** average time not spent in nested zones */
+        uint32_t avg_self_ticks;
+    };
+
+    /** Returned by AddZone() when the registry is full */
+    static constexpr size_t kInvalidZone = kMaxZones;
+
+    /** Times a zone from construction to destruction */
+    class Scope
+    {
+      public:
+        Scope(Profiler& profiler, size_t zone) : profiler_(profiler)
+        {
+            profiler_.Begin(zone);
+        }
+        ~Scope() { profiler_.End(); }
+
+      private:
+        Profiler& profiler_;
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+    };
+
+    Profiler() { Init(); }
+
+    /** Initializes the profiler and removes all zones.
+     *  @param clock the time base for the measurements
+     */
+    void Init(Clock clock = Clock::SYSTEM_TICK)
+    {
+        clock_ = clock;
+#ifndef UNIT_TEST
+        if(clock_ == Clock::CPU_CYCLES)
+        {
+            CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+            DWT->LAR = 0xC5ACCE55; // unlock the DWT registers on the M7
+            DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        }
+#endif
+        num_zones_       = 0;
+        depth_           = 0;
+        num_overflows_   = 0;
+        reset_requested_ = false;
+    }
+
+    /** Registers a zone, or returns the existing zone with the same name.
+     *  Call this before the zones are timed, not from the audio callback.
+     *  @param name name of the zone, e.g. "reverb"
+     *  @return the zone id, or kInvalidZone if there's no more room
+     */
+    size_t AddZone(const char* name)
+    {
+        const size_t existing = FindZone(name);
+        if(existing != kInvalidZone || num_zones_ >= kMaxZones)
+            return existing;
+        zones_[num_zones_].name = name;
+        ClearZone(zones_[num_zones_]);
+        return num_zones_++;
+    }
+
+    /** Returns the id of a zone, or kInvalidZone if it doesn't exist */
+    size_t FindZone(const char* name) const
+    {
+        for(size_t i = 0; i < num_zones_; i++)
+            if(zones_[i].name == name || strcmp(zones_[i].name, name) == 0)
+                return i;
+        return kInvalidZone;
+    }
+
+    /** Starts timing a zone. Each Begin() must be followed by an End(),
+     *  use a Scope to do this automatically.
+     */
+    void Begin(size_t zone)
+    {
+        if(depth_ == 0 && reset_requested_)
+        {
+            for(size_t i = 0; i < num_zones_; i++)
+                ClearZone(zones_[i]);
+            num_overflows_   = 0;
+            reset_requested_ = false;
+        }
+        if(depth_ < kMaxDepth)
+        {
+            Frame& f      = stack_[depth_];
+            f.zone        = zone;
+            f.child_ticks = 0;
+            f.start       = Now();
+        }
+        else
+        {
+            num_overflows_ = num_overflows_ + 1;
+        }
+        depth_++;
+    }
+
+    /** Stops timing the zone started by the last Begin() */
+    void End()
+    {
+        const uint32_t now = Now();
+        if(depth_ == 0)
+            return;
+        depth_--;
+        if(depth_ >= kMaxDepth)
+            return;
+
+        const Frame&   f       = stack_[depth_];
+        const uint32_t elapsed = now - f.start;
+        if(depth_ > 0)
+            stack_[depth_ - 1].child_ticks += elapsed;
+        if(f.zone >= num_zones_)
+            return;
+
+        Zone& z = zones_[f.zone];
+        if(z.count == 0 || elapsed < z.min_ticks)
+            z.min_ticks = elapsed;
+        if(elapsed > z.max_ticks)
+            z.max_ticks = elapsed;
+        z.total_ticks += elapsed;
+        z.self_ticks += elapsed - f.child_ticks;
+        z.count++;
+    }
+
+    /** Returns the number of registered zones */
+    size_t GetNumZones() const { return num_zones_; }
+
+    /** Returns the readings of a zone */
+    ZoneStats GetStats(size_t zone) const
+    {
+        ZoneStats s = {nullptr, 0, 0, 0, 0, 0};
+        if(zone >= num_zones_)
+            return s;
+        const Zone& z    = zones_[zone];
+        s.name           = z.name;
+        s.count          = z.count;
+        s.min_ticks      = z.min_ticks;
+        s.max_ticks      = z.max_ticks;
+        s.avg_ticks      = z.count > 0 ? uint32_t(z.total_ticks / z.count) : 0;
+        s.avg_self_ticks = z.count > 0 ? uint32_t(z.self_ticks / z.count) : 0;
+        return s;
+    }
+
+    /** Returns the number of scopes that were nested too deep to be timed */
+    uint32_t GetNumOverflows() const { return num_overflows_; }
+
+    /** Returns the frequency of the selected clock in Hz */
+    uint32_t GetTickFreq() const
+    {
+#ifndef UNIT_TEST
+        if(clock_ == Clock::CPU_CYCLES)
+            return System::GetSysClkFreq();
+#endif
+        return System::GetTickFreq();
+    }
+
+    /** Resets all readings. To avoid locking, the readings are cleared when
+     *  the next top level zone begins.
+     */
+    void Reset() { reset_requested_ = true; }
+
+    /** Prints a table of all zones, with times in microseconds.
+     *  @tparam LoggerType a Logger, or any class with a static
+     *                     PrintLine(const char* format, ...)
+     */
+    template <typename LoggerType>
+    void Dump() const
+    {
+        LoggerType::PrintLine("zone              count   min_us   avg_us   "
+                              "max_us  self_us");
+        for(size_t i = 0; i < num_zones_; i++)
+        {
+            const ZoneStats s = GetStats(i);
+            LoggerType::PrintLine("%-16s %6lu %8lu %8lu %8lu %8lu",
+                                  s.name,
+                                  (unsigned long)s.count,
+                                  (unsigned long)TicksToUs(s.min_ticks),
+                                  (unsigned long)TicksToUs(s.avg_ticks),
+                                  (unsigned long)TicksToUs(s.max_ticks),
+                                  (unsigned long)TicksToUs(s.avg_self_ticks));
+        }
+        if(num_overflows_ > 0)
+            LoggerType::PrintLine("%lu scopes nested too deep",
+                                  (unsigned long)num_overflows_);
+    }
+
+  private:
+    struct Zone
+    {
+        const char*       name;
+        volatile uint32_t count;
+        volatile uint32_t min_ticks;
+        volatile uint32_t max_ticks;
+        uint64_t          total_ticks;
+        uint64_t          self_ticks;
+    };
+
+    struct Frame
+    {
+        size_t   zone;
+        uint32_t start;
+        uint32_t child_ticks;
+    };
+
+    uint32_t Now() const
+    {
+#ifndef UNIT_TEST
+        if(clock_ == Clock::CPU_CYCLES)
+            return DWT->CYCCNT;
+#endif
+        return System::GetTick();
+    }
+
+    uint32_t TicksToUs(uint32_t ticks) const
+    {
+        const uint32_t freq = GetTickFreq();
+        return freq > 0 ? uint32_t(uint64_t(ticks) * 1000000 / freq) : 0;
+    }
+
+    static void ClearZone(Zone& z)
+    {
+        z.count       = 0;
+        z.min_ticks   = 0;
+        z.max_ticks   = 0;
+        z.total_ticks = 0;
+        z.self_ticks  = 0;
+    }
+
+    Zone              zones_[kMaxZones];
+    size_t            num_zones_;
+    Frame             stack_[kMaxDepth];
+    size_t            depth_;
+    Clock             clock_;
+    volatile uint32_t num_overflows_;
+    volatile bool     reset_requested_;
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+};
+
+template <size_t kMaxZones, size_t kMaxDepth>
+constexpr size_t Profiler<kMaxZones, kMaxDepth>::kInvalidZone;
+
+} // namespace daisy
+
+#endif
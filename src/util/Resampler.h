@@ -0,0 +1,269 @@
+#pragma once
+#ifndef DSY_RESAMPLER_H
+#define DSY_RESAMPLER_H
+
+#include <cmath>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace daisy
+{
+/** @brief Streaming polyphase sample rate converter
+ *  @addtogroup utility
+ *
+ *  Converts between two sample rates with a ratio of out_rate / in_rate =
+ *  L / M, e.g. 160 / 147 for 44.1kHz to 48kHz or 2 / 1 for 48kHz to 96kHz.
+ *  The input is (conceptually) upsampled by L, lowpass filtered and
+ *  downsampled by M. Only the L filter phases that are actually needed are
+ *  evaluated, so each output sample costs kTaps multiply-adds per channel.
+ *
+ *  The coefficient table (kMaxPhases * kTaps floats) is calculated by Init()
+ *  from a Kaiser windowed sinc, all memory is fixed at compile time. For the
+ *  defaults that's 20kB, so a global instance can be placed in SDRAM with
+ *  DSY_SDRAM_BSS if needed. Init() fails if the reduced ratio needs more
+ *  than kMaxPhases phases.
+ *
+ *  Input and output are non-interleaved like the AudioHandle buffers. There
+ *  are two ways to stream the data:
+ *  - Process() converts a block of input into as many output frames as fit
+ *    into the output buffer, e.g. when decoding a file.
+ *  - Render() fills an output block of fixed size and pulls input frames
+ *    from a function as needed, e.g. in the audio callback:
+ *
+ *  @code
+ *  Resampler<1> resampler; // DSY_SDRAM_BSS
+ *  resampler.Init(player.GetSampleRate(), 48000);
+ *
+ *  // audio callback
+ *  resampler.Render(out, size, [](float* frame) {
+ *      frame[0] = s162f(player.Stream());
+ *  });
+ *  @endcode
+ *
+ *  @tparam kChannels  number of channels
+ *  @tparam kTaps      filter taps per phase, i.e. per output sample
+ *  @tparam kMaxPhases maximum interpolation factor L after reducing the ratio
+ */
+template <size_t kChannels, size_t kTaps = 32, size_t kMaxPhases = 160>
+class Resampler
+{
+  public:
+    enum class Result
+    {
+        OK,
+        ERR,
+    };
+
+    /** Number of input and output frames of a Process() call */
+    struct FrameCount
+    {
+        size_t in;
+        size_t out;
+    };
+
+    Resampler() : phases_(1), step_(1) { Reset(); }
+
+    /** Initializes the converter and calculates the filter coefficients.
+     *  @param in_rate   input sample rate in Hz
+     *  @param out_rate  output sample rate in Hz
+     *  @param bandwidth passband edge as a fraction of the lower Nyquist
+     *                   frequency of the two rates. Lower values give a wider
+     *                   transition band and less aliasing.
+     *  @return ERR if a rate is zero or the ratio needs too many phases
+     */
+    Result Init(uint32_t in_rate, uint32_t out_rate, float bandwidth = 0.9f)
+    {
+        if(in_rate == 0 || out_rate == 0)
+            return Result::ERR;
+        const uint32_t d = Gcd(in_rate, out_rate);
+        if(out_rate / d > kMaxPhases)
+            return Result::ERR;
+        phases_ = out_rate / d;
+        step_   = in_rate / d;
+        CalculateCoefficients(bandwidth);
+        Reset();
+        return Result::OK;
+    }
+
+    /** Clears the filter history without changing the ratio */
+    void Reset()
+    {
+        for(size_t ch = 0; ch < kChannels; ch++)
+            for(size_t i = 0; i < 2 * kTaps; i++)
+                history_[ch][i] = 0.f;
+        write_pos_ = 0;
+        phase_     = 0;
+        needed_    = 1;
+    }
+
+    /** Converts input frames until either all input is used or the output
+     *  buffer is full. Input that wasn't used has to be passed again with
+     *  the next call.
+     *  @param in       input buffers, one per channel
+     *  @param in_size  number of input frames
+     *  @param out      output buffers, one per channel
+     *  @param out_size space in the output buffers, in frames
+     *  @return number of input frames used and output frames written
+     */
+    FrameCount Process(const float* const* in,
+                       size_t              in_size,
+                       float* const*       out,
+                       size_t              out_size)
+    {
+        FrameCount count = {0, 0};
+        while(count.out < out_size)
+        {
+            for(; needed_ > 0 && count.in < in_size; needed_--, count.in++)
+                Write([&](size_t ch) { return in[ch][count.in]; });
+            if(needed_ > 0)
+                break;
+            Read(out, count.out++);
+        }
+        return count;
+    }
+
+    /** Fills an output block, pulling as many input frames as needed.
+     *  @param out   output buffers, one per channel
+     *  @param size  number of frames to write
+     *  @param input called as input(float* frame) for each input frame and
+     *               has to write kChannels samples to frame
+     */
+    template <typename InputFunction>
+    void Render(float* const* out, size_t size, InputFunction input)
+    {
+        float frame[kChannels];
+        for(size_t i = 0; i < size; i++)
+        {
+            for(; needed_ > 0; needed_--)
+            {
+                input(frame);
+                Write([&](size_t ch) { return frame[ch]; });
+            }
+            Read(out, i);
+        }
+    }
+
+    /** Returns the maximum number of output frames that in_size input frames
+     *  can produce, to size the output buffer for Process().
+     */
+    size_t GetMaxOutputSize(size_t in_size) const
+    {
+        return (in_size * phases_ + step_ - 1) / step_ + 1;
+    }
+
+    /** Returns the interpolation factor L of the reduced ratio L / M */
+    uint32_t GetUpFactor() const { return phases_; }
+
+    /** Returns the decimation factor M of the reduced ratio L / M */
+    uint32_t GetDownFactor() const { return step_; }
+
+    /** Returns the delay of the filter in input frames */
+    float GetLatency() const
+    {
+        return float(kTaps * phases_ - 1) / (2.f * phases_);
+    }
+
+  private:
+    /** Adds one input frame to the history. The history of each channel is
+     *  stored twice, so the newest kTaps samples are always contiguous. */
+    template <typename GetSample>
+    void Write(GetSample sample)
+    {
+        for(size_t ch = 0; ch < kChannels; ch++)
+        {
+            const float x                    = sample(ch);
+            history_[ch][write_pos_]         = x;
+            history_[ch][write_pos_ + kTaps] = x;
+        }
+        write_pos_ = write_pos_ + 1 < kTaps ? write_pos_ + 1 : 0;
+    }
+
+    /** Calculates one output frame and advances to the next phase */
+    void Read(float* const* out, size_t idx)
+    {
+        const float* coeffs = coeffs_[phase_];
+        for(size_t ch = 0; ch < kChannels; ch++)
+        {
+            const float* x   = &history_[ch][write_pos_];
+            float        acc = 0.f;
+            for(size_t i = 0; i < kTaps; i++)
+                acc += x[i] * coeffs[i];
+            out[ch][idx] = acc;
+        }
+        phase_ += step_;
+        while(phase_ >= phases_)
+        {
+            phase_ -= phases_;
+            needed_++;
+        }
+    }
+
+    void CalculateCoefficients(float bandwidth)
+    {
+        // The prototype lowpass runs at L times the input rate, with its
+        // cutoff at the lower of the two Nyquist frequencies.
+        const size_t len    = kTaps * phases_;
+        const double center = (len - 1) * 0.5;
+        const double ratio  = phases_ < step_ ? double(phases_) / step_ : 1.0;
+        const double cutoff = bandwidth * ratio / phases_; // * Nyquist
+        const double beta   = 8.0;
+        const double norm   = BesselI0(beta);
+        const double pi     = 3.14159265358979323846;
+
+        for(size_t p = 0; p < phases_; p++)
+        {
+            double sum = 0.0;
+            for(size_t j = 0; j < kTaps; j++)
+            {
+                // phase p, tap j uses input frame n - j, which sits at
+                // position kTaps - 1 - j of the history window
+                const double t = (p + j * phases_) - center;
+                const double r = t / (center > 0 ? center : 1);
+                const double a = r * r < 1.0 ? std::sqrt(1.0 - r * r) : 0.0;
+                const double w = BesselI0(beta * a) / norm;
+                const double x = pi * cutoff * t;
+                const double h = (t == 0.0 ? 1.0 : std::sin(x) / x) * w;
+                coeffs_[p][kTaps - 1 - j] = float(h);
+                sum += h;
+            }
+            // unity DC gain for each phase, so there's no ripple at the
+            // phase rate
+            for(size_t j = 0; j < kTaps; j++)
+                coeffs_[p][j] = float(coeffs_[p][j] / sum);
+        }
+    }
+
+    static double BesselI0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for(int k = 1; k < 32; k++)
+        {
+            term *= (x * 0.5 / k) * (x * 0.5 / k);
+            sum += term;
+        }
+        return sum;
+    }
+
+    static uint32_t Gcd(uint32_t a, uint32_t b)
+    {
+        while(b != 0)
+        {
+            const uint32_t t = a % b;
+            a                = b;
+            b                = t;
+        }
+        return a;
+    }
+
+    float    coeffs_[kMaxPhases][kTaps];
+    float    history_[kChannels][2 * kTaps];
+    size_t   write_pos_;
+    uint32_t phases_;
+    uint32_t step_;
+    uint32_t phase_;
+    uint32_t needed_;
+};
+
+} // namespace daisy
+
+#endif
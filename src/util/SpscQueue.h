@@ -0,0 +1,160 @@
+#pragma once
+#ifndef DSY_SPSC_QUEUE_H
+#define DSY_SPSC_QUEUE_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace daisy
+{
+/** @brief Wait-free single producer, single consumer queue
+ *  @addtogroup utility
+ *
+ *  A fixed size queue for passing data from one context to another, e.g.
+ *  from an interrupt handler to the main loop, without disabling interrupts.
+ *  Neither side ever waits for the other: Push() fails if the queue is full
+ *  and Pop() fails if it is empty.
+ *
+ *  Exactly one context may call the producer functions (Push()) and exactly
+ *  one context the consumer functions (Pop(), Peek(), Clear()). The two may
+ *  be the same. The status functions can be called from either side.
+ *
+ *  The head and tail indices run freely and are masked with kCapacity - 1,
+ *  so kCapacity must be a power of two and the queue holds all kCapacity
+ *  elements. Each side keeps its index, together with a cached copy of the
+ *  other side's index, on its own cache line. That way the two contexts
+ *  don't invalidate each other's cache lines with every element, and the
+ *  other side's index is only loaded when the cached copy says the queue
+ *  is full (or empty).
+ *
+ *  @tparam T         the element type, copied in and out of the queue
+ *  @tparam kCapacity number of elements, must be a power of two
+ */
+template <typename T, size_t kCapacity>
+class SpscQueue
+{
+    static_assert(kCapacity > 0 && (kCapacity & (kCapacity - 1)) == 0,
+                  "kCapacity must be a power of two");
+
+  public:
+    /** Size of a cache line; 32 bytes on the Cortex-M7 */
+#ifdef UNIT_TEST
+    static constexpr size_t kCacheLineSize = 64;
+#else
+    static constexpr size_t kCacheLineSize = 32;
+#endif
+
+    SpscQueue()
+    {
+        head_.store(0, std::memory_order_relaxed);
+        tail_.store(0, std::memory_order_relaxed);
+        head_cache_ = 0;
+        tail_cache_ = 0;
+    }
+
+    /** Adds an element to the queue. Producer side.
+     *  @return false if the queue is full
+     */
+    bool Push(const T& element)
+    {
+        const uint32_t head = head_.load(std::memory_order_relaxed);
+        if(head - tail_cache_ >= kCapacity)
+        {
+            tail_cache_ = tail_.load(std::memory_order_acquire);
+            if(head - tail_cache_ >= kCapacity)
+                return false;
+        }
+        buffer_[head & kMask] = element;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Removes the oldest element. Consumer side.
+     *  @param element receives the element
+     *  @return false if the queue is empty
+     */
+    bool Pop(T& element)
+    {
+        const uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail == head_cache_)
+        {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if(tail == head_cache_)
+                return false;
+        }
+        element = buffer_[tail & kMask];
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Returns the oldest element without removing it. Consumer side.
+     *  @return a pointer to the element, or nullptr if the queue is empty
+     */
+    const T* Peek()
+    {
+        const uint32_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail == head_cache_)
+        {
+            head_cache_ = head_.load(std::memory_order_acquire);
+            if(tail == head_cache_)
+                return nullptr;
+        }
+        return &buffer_[tail & kMask];
+    }
+
+    /** Removes all elements. Consumer side. */
+    void Clear()
+    {
+        head_cache_ = head_.load(std::memory_order_acquire);
+        tail_.store(head_cache_, std::memory_order_release);
+    }
+
+    /** Returns true if the queue is empty. From the producer side, the queue
+     *  may already be empty when this returns false.
+     */
+    bool IsEmpty() const { return GetNumElements() == 0; }
+
+    /** Returns true if the queue is full. From the consumer side, the queue
+     *  may not be full anymore when this returns true.
+     */
+    bool IsFull() const { return GetNumElements() >= kCapacity; }
+
+    /** Returns the number of elements in the queue */
+    size_t GetNumElements() const
+    {
+        const uint32_t tail = tail_.load(std::memory_order_acquire);
+        const uint32_t head = head_.load(std::memory_order_acquire);
+        return head - tail;
+    }
+
+    /** Returns the maximum number of elements in the queue */
+    static constexpr size_t GetCapacity() { return kCapacity; }
+
+  private:
+    static constexpr uint32_t kMask = kCapacity - 1;
+
+    // The padding keeps the producer and consumer indices on separate
+    // cache lines. alignas() would do the same, but over-aligned types
+    // can't be allocated with new before C++17.
+    static constexpr size_t kPadding = kCacheLineSize - 2 * sizeof(uint32_t);
+
+    // producer
+    std::atomic<uint32_t> head_;
+    uint32_t              tail_cache_;
+    uint8_t               pad0_[kPadding];
+
+    // consumer
+    std::atomic<uint32_t> tail_;
+    uint32_t              head_cache_;
+    uint8_t               pad1_[kPadding];
+
+    T buffer_[kCapacity];
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+};
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,125 @@
+#pragma once
+#ifndef DSY_TRIPLE_BUFFER_H
+#define DSY_TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <stdint.h>
+
+namespace daisy
+{
+/** @brief Lock-free exchange of whole values between two contexts
+ *  @addtogroup utility
+ *
+ *  Publishes snapshots of a value (e.g. a struct of all parameters
+ *  computed in the main loop) to another context (e.g. the audio callback)
+ *  without blocking either side and without disabling interrupts. The reader
+ *  always sees a complete snapshot - never a mix of two.
+ *
+ *  There are three copies of the value: one the writer fills, one the
+ *  reader uses, and one holding the most recent snapshot in between. Both
+ *  sides swap their copy with the middle one in a single atomic operation.
+ *  If the writer publishes faster than the reader updates, intermediate
+ *  snapshots are skipped.
+ *
+ *  @code
+ *  TripleBuffer<Params> params;
+ *
+ *  // main loop
+ *  Params& p = params.GetWriteBuffer();
+ *  p.cutoff  = cutoff_knob.Process();
+ *  p.gain    = gain_knob.Process();
+ *  params.Publish();
+ *
+ *  // audio callback
+ *  const Params& p = params.Read();
+ *  @endcode
+ *
+ *  There must be only one writer and one reader context.
+ *
+ *  @tparam T the value type, which must be copy assignable
+ */
+template <typename T>
+class TripleBuffer
+{
+  public:
+    TripleBuffer() { Reset(); }
+
+    /** Sets all copies to a value, and discards any unread snapshot */
+    void Init(const T& value)
+    {
+        for(auto& buffer : buffers_)
+            buffer = value;
+        Reset();
+    }
+
+    /** Returns the copy the writer fills. This contains an older snapshot,
+     *  so all members must be set before calling Publish().
+     */
+    T& GetWriteBuffer() { return buffers_[back_]; }
+
+    /** Makes the contents of the write buffer available to the reader */
+    void Publish()
+    {
+        const uint8_t prev = state_.exchange(back_ | kNewData,
+                                             std::memory_order_acq_rel);
+        back_              = prev & kIndexMask;
+    }
+
+    /** Copies a value to the write buffer and publishes it */
+    void Write(const T& value)
+    {
+        GetWriteBuffer() = value;
+        Publish();
+    }
+
+    /** Fetches the most recent snapshot, if one was published since the
+     *  last update.
+     *  @return true if the read buffer changed
+     */
+    bool Update()
+    {
+        if((state_.load(std::memory_order_relaxed) & kNewData) == 0)
+            return false;
+        const uint8_t prev = state_.exchange(front_, std::memory_order_acq_rel);
+        front_             = prev & kIndexMask;
+        return true;
+    }
+
+    /** Returns the current snapshot, without checking for a newer one */
+    const T& GetReadBuffer() const { return buffers_[front_]; }
+
+    /** Fetches and returns the most recent snapshot */
+    const T& Read()
+    {
+        Update();
+        return GetReadBuffer();
+    }
+
+    /** Returns true if a snapshot was published that wasn't read yet */
+    bool HasNewData() const
+    {
+        return (state_.load(std::memory_order_relaxed) & kNewData) != 0;
+    }
+
+  private:
+    static constexpr uint8_t kIndexMask = 0x03;
+    static constexpr uint8_t kNewData   = 0x04;
+
+    void Reset()
+    {
+        front_ = 0;
+        back_  = 1;
+        state_.store(2, std::memory_order_release);
+    }
+
+    T buffers_[3];
+
+    /** Index of the middle copy, and the kNewData flag */
+    std::atomic<uint8_t> state_;
+    uint8_t              front_; // only used by the reader
+    uint8_t              back_;  // only used by the writer
+};
+
+} // namespace daisy
+
+#endif
@@ -0,0 +1,476 @@
+#pragma once
+#ifndef DSY_VOICE_ALLOCATOR_H
+#define DSY_VOICE_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "hid/MidiEvent.h"
+
+namespace daisy
+{
+/** @brief Assigns MIDI notes to the voices of a polyphonic synth
+ *  @addtogroup utility
+ *
+ *  Notes are started and released through two callbacks. Free voices are
+ *  reused in the order they were released, so a voice has as much time as
+ *  possible for its release phase. Without free voices, a voice is stolen
+ *  according to the StealPolicy. Notes released while the sustain pedal
+ *  (CC 64) is down are held until it is lifted.
+ *
+ *  All voices are kept in intrusive lists (free voices, used voices by
+ *  age, used voices by level, sustained voices) and notes are found through
+ *  a table per channel and note, so note on and note off take constant
+ *  time, independent of the number of voices. Lifting the pedal releases
+ *  the sustained voices one by one.
+ *
+ *  With MPE, every note has its own channel, and the notes of the master
+ *  channel's sustain pedal and All Notes Off apply to all channels.
+ *  GetChannelVoice() finds the voice for the per-note pitch bend, pressure
+ *  and timbre messages.
+ *
+ *  @code
+ *  VoiceAllocator<16>::Config config;
+ *  config.start   = [](size_t v, const VoiceAllocator<16>::Voice& n,
+ *                      bool stolen, void*) { voices[v].Trigger(n.note); };
+ *  config.release = [](size_t v, const VoiceAllocator<16>::Voice&, void*) {
+ *                       voices[v].Release(); };
+ *  allocator.Init(config);
+ *  ...
+ *  while(midi.HasEvents())
+ *      allocator.ProcessEvent(midi.PopEvent());
+ *  @endcode
+ *
+ *  @tparam kNumVoices number of voices, up to 254
+ */
+template <size_t kNumVoices>
+class VoiceAllocator
+{
+    static_assert(kNumVoices > 0 && kNumVoices < 255, "1 to 254 voices");
+
+  public:
+    /** Selects the voice that's taken when all voices are in use */
+    enum class StealPolicy : uint8_t
+    {
+        /** the voice started first */
+        OLDEST,
+        /** a voice with the lowest level (see SetLevel()), in steps of 4:
+         *  levels 0-3, 4-7 and so on count as the same. Of those, the one
+         *  whose note on or last SetLevel() call came first. */
+        QUIETEST,
+        /** like OLDEST, but a note that's still sounding (also in its
+         *  release phase) is always restarted on its own voice */
+        SAME_NOTE,
+    };
+
+    enum class State : uint8_t
+    {
+        /** not playing, or in its release phase */
+        FREE,
+        /** the key is down */
+        HELD,
+        /** the key is up, the sustain pedal is down */
+        SUSTAINED,
+    };
+
+    /** The note of a voice */
+    struct Voice
+    {
+        uint8_t note;
+        uint8_t channel;
+        uint8_t velocity;
+        uint8_t level; /**< velocity, or set with SetLevel() */
+        State   state;
+    };
+
+    /** Called when a voice starts a note
+     *  @param voice   index of the voice
+     *  @param note    the new note
+     *  @param stolen  true if the voice was playing another note
+     *  @param context Config::context
+     */
+    typedef void (*StartCallback)(size_t       voice,
+                                  const Voice& note,
+                                  bool         stolen,
+                                  void*        context);
+
+    /** Called when the note of a voice is released */
+    typedef void (*ReleaseCallback)(size_t       voice,
+                                    const Voice& note,
+                                    void*        context);
+
+    struct Config
+    {
+        StealPolicy     steal_policy;
+        bool            mpe;
+        uint8_t         mpe_master_channel; /**< 0 for the lower zone */
+        StartCallback   start;
+        ReleaseCallback release;
+        void*           context;
+
+        Config()
+        : steal_policy(StealPolicy::OLDEST),
+          mpe(false),
+          mpe_master_channel(0),
+          start(nullptr),
+          release(nullptr),
+          context(nullptr)
+        {
+        }
+    };
+
+    /** Returned for notes without a voice */
+    static constexpr int kNoVoice = -1;
+
+    VoiceAllocator() { Init(Config()); }
+
+    /** Initializes the allocator, all voices are free */
+    void Init(const Config& config)
+    {
+        config_ = config;
+        free_   = List();
+        used_   = List();
+        held_   = List();
+        for(size_t b = 0; b < kNumLevels; b++)
+            levels_[b] = List();
+        level_mask_ = 0;
+        sustain_    = 0;
+        num_used_   = 0;
+        for(size_t v = 0; v < kNumVoices; v++)
+        {
+            Voice& voice   = voices_[v];
+            voice.note     = 0;
+            voice.channel  = 0;
+            voice.velocity = 0;
+            voice.level    = 0;
+            voice.state    = State::FREE;
+            PushBack(free_, age_links_, uint8_t(v));
+        }
+        for(size_t i = 0; i < kNumKeys; i++)
+            key_voice_[i] = kNone;
+        for(size_t c = 0; c < kNumChannels; c++)
+            channel_voice_[c] = kNone;
+    }
+
+    /** Handles NoteOn, NoteOff, sustain (CC 64), All Notes Off and All
+     *  Sound Off, ignores other events */
+    void ProcessEvent(MidiEvent event)
+    {
+        switch(event.type)
+        {
+            // the enumerators are hidden by the member functions
+            case MidiMessageType::NoteOn: NoteOn(event.AsNoteOn()); break;
+            case MidiMessageType::NoteOff: NoteOff(event.AsNoteOff()); break;
+            case MidiMessageType::ControlChange:
+                ControlChange(event.AsControlChange());
+                break;
+            case ChannelMode:
+                if(event.cm_type == AllNotesOff || event.cm_type == AllSoundOff)
+                    ReleaseAll(event.channel);
+                break;
+            default: break;
+        }
+    }
+
+    /** Starts a note, velocity 0 releases it
+     *  @return the voice, or kNoVoice
+     */
+    int NoteOn(const NoteOnEvent& event)
+    {
+        return NoteOn(event.channel, event.note, event.velocity);
+    }
+
+    int NoteOn(uint8_t channel, uint8_t note, uint8_t velocity)
+    {
+        if(velocity == 0)
+            return NoteOff(channel, note);
+        channel &= 0x0f;
+        note &= 0x7f;
+        velocity &= 0x7f;
+
+        uint8_t v      = FindVoice(channel, note);
+        bool    stolen = false;
+        if(v != kNone && voices_[v].state != State::FREE)
+        {
+            // the same key again, restart its voice
+            RemoveUsed(v);
+        }
+        else if(v != kNone && config_.steal_policy == StealPolicy::SAME_NOTE)
+        {
+            Remove(free_, age_links_, v);
+        }
+        else if(free_.head != kNone)
+        {
+            v = free_.head;
+            Remove(free_, age_links_, v);
+        }
+        else
+        {
+            v = FindVictim();
+            RemoveUsed(v);
+            stolen = true;
+        }
+
+        Voice& voice   = voices_[v];
+        voice.note     = note;
+        voice.channel  = channel;
+        voice.velocity = velocity;
+        voice.level    = velocity;
+        voice.state    = State::HELD;
+        AddUsed(v);
+        key_voice_[Key(channel, note)] = v;
+        channel_voice_[channel]        = v;
+        if(config_.start != nullptr)
+            config_.start(v, voice, stolen, config_.context);
+        return v;
+    }
+
+    /** Releases a note, or holds it while the sustain pedal is down
+     *  @return the voice, or kNoVoice if the note isn't held
+     */
+    int NoteOff(const NoteOffEvent& event)
+    {
+        return NoteOff(event.channel, event.note);
+    }
+
+    int NoteOff(uint8_t channel, uint8_t note)
+    {
+        channel &= 0x0f;
+        const uint8_t v = FindVoice(channel, note & 0x7f);
+        if(v == kNone || voices_[v].state != State::HELD)
+            return kNoVoice;
+        if(IsSustained(channel))
+        {
+            voices_[v].state = State::SUSTAINED;
+            PushBack(held_, held_links_, v);
+        }
+        else
+        {
+            Release(v);
+        }
+        return v;
+    }
+
+    /** Handles the sustain pedal (CC 64), ignores other controllers */
+    void ControlChange(const ControlChangeEvent& event)
+    {
+        if(event.control_number == 64)
+            SetSustain(event.channel, event.value >= 64);
+    }
+
+    /** Presses or lifts the sustain pedal of a channel (of all channels
+     *  for the MPE master channel) */
+    void SetSustain(uint8_t channel, bool down)
+    {
+        const uint16_t bit = uint16_t(1 << (channel & 0x0f));
+        if(down)
+        {
+            sustain_ |= bit;
+            return;
+        }
+        sustain_ &= ~bit;
+        uint8_t v = held_.head;
+        while(v != kNone)
+        {
+            const uint8_t next = held_links_[v].next;
+            if(!IsSustained(voices_[v].channel))
+                Release(v);
+            v = next;
+        }
+    }
+
+    /** Releases all notes of a channel (all channels for the MPE master
+     *  channel), also the sustained ones */
+    void ReleaseAll(uint8_t channel)
+    {
+        const bool all = config_.mpe && channel == config_.mpe_master_channel;
+        uint8_t    v   = used_.head;
+        while(v != kNone)
+        {
+            const uint8_t next = age_links_[v].next;
+            if(all || voices_[v].channel == channel)
+                Release(v);
+            v = next;
+        }
+    }
+
+    /** Sets the level of a voice for StealPolicy::QUIETEST, e.g. from its
+     *  envelope. It starts at the velocity. The voice counts as the newest
+     *  of its level step, also if the level doesn't change.
+     *  @param voice the voice
+     *  @param level 0 to 127, larger levels are taken as 127
+     */
+    void SetLevel(size_t voice, uint8_t level)
+    {
+        if(voice >= kNumVoices)
+            return;
+        if(level > 127)
+            level = 127;
+        const uint8_t v = uint8_t(voice);
+        if(voices_[v].state == State::FREE)
+        {
+            voices_[v].level = level;
+            return;
+        }
+        RemoveLevel(v);
+        voices_[v].level = level;
+        AddLevel(v);
+    }
+
+    /** Returns the voice of the last note started on a channel, if it's
+     *  still held or sustained, or kNoVoice. With MPE, this is the voice
+     *  for the channel's pitch bend, pressure and CC 74.
+     */
+    int GetChannelVoice(uint8_t channel) const
+    {
+        const uint8_t v = channel_voice_[channel & 0x0f];
+        if(v == kNone || voices_[v].state == State::FREE
+           || voices_[v].channel != (channel & 0x0f))
+            return kNoVoice;
+        return v;
+    }
+
+    /** Returns the note of a voice */
+    const Voice& GetVoice(size_t voice) const { return voices_[voice]; }
+
+    /** Returns the number of held and sustained voices */
+    size_t GetNumUsed() const { return num_used_; }
+
+  private:
+    static constexpr uint8_t kNone        = 0xff;
+    static constexpr size_t  kNumChannels = 16;
+    static constexpr size_t  kNumKeys     = kNumChannels * 128;
+    static constexpr size_t  kNumLevels   = 32; // 4 levels each
+
+    /** Links of a voice in a list */
+    struct Links
+    {
+        uint8_t prev;
+        uint8_t next;
+    };
+
+    /** A doubly linked list of voices, threaded through a Links array */
+    struct List
+    {
+        uint8_t head;
+        uint8_t tail;
+
+        List() : head(kNone), tail(kNone) {}
+    };
+
+    static void PushBack(List& list, Links* links, uint8_t v)
+    {
+        links[v].prev = list.tail;
+        links[v].next = kNone;
+        if(list.tail != kNone)
+            links[list.tail].next = v;
+        else
+            list.head = v;
+        list.tail = v;
+    }
+
+    static void Remove(List& list, Links* links, uint8_t v)
+    {
+        const Links l = links[v];
+        if(l.prev != kNone)
+            links[l.prev].next = l.next;
+        else
+            list.head = l.next;
+        if(l.next != kNone)
+            links[l.next].prev = l.prev;
+        else
+            list.tail = l.prev;
+    }
+
+    static size_t Key(uint8_t channel, uint8_t note)
+    {
+        return (size_t(channel) << 7) | note;
+    }
+
+    /** Returns the voice that played a note last, if it still plays it */
+    uint8_t FindVoice(uint8_t channel, uint8_t note) const
+    {
+        const uint8_t v = key_voice_[Key(channel, note)];
+        if(v == kNone || voices_[v].note != note
+           || voices_[v].channel != channel)
+            return kNone;
+        return v;
+    }
+
+    bool IsSustained(uint8_t channel) const
+    {
+        uint16_t mask = uint16_t(1 << channel);
+        if(config_.mpe)
+            mask |= uint16_t(1 << config_.mpe_master_channel);
+        return (sustain_ & mask) != 0;
+    }
+
+    uint8_t FindVictim() const
+    {
+        if(config_.steal_policy == StealPolicy::QUIETEST)
+            return levels_[__builtin_ctz(level_mask_)].head;
+        return used_.head;
+    }
+
+    void AddLevel(uint8_t v)
+    {
+        const size_t b = voices_[v].level >> 2;
+        PushBack(levels_[b], level_links_, v);
+        level_mask_ |= 1u << b;
+    }
+
+    void RemoveLevel(uint8_t v)
+    {
+        const size_t b = voices_[v].level >> 2;
+        Remove(levels_[b], level_links_, v);
+        if(levels_[b].head == kNone)
+            level_mask_ &= ~(1u << b);
+    }
+
+    /** Adds a voice to the used lists, as the newest */
+    void AddUsed(uint8_t v)
+    {
+        PushBack(used_, age_links_, v);
+        AddLevel(v);
+        num_used_++;
+    }
+
+    void RemoveUsed(uint8_t v)
+    {
+        Remove(used_, age_links_, v);
+        RemoveLevel(v);
+        if(voices_[v].state == State::SUSTAINED)
+            Remove(held_, held_links_, v);
+        num_used_--;
+    }
+
+    void Release(uint8_t v)
+    {
+        RemoveUsed(v);
+        voices_[v].state = State::FREE;
+        PushBack(free_, age_links_, v);
+        if(config_.release != nullptr)
+            config_.release(v, voices_[v], config_.context);
+    }
+
+    Config   config_;
+    Voice    voices_[kNumVoices];
+    Links    age_links_[kNumVoices];   // free_ or used_
+    Links    level_links_[kNumVoices]; // levels_, if used
+    Links    held_links_[kNumVoices];  // held_, if sustained
+    List     free_;                    // by release time, oldest first
+    List     used_;                    // by start time, oldest first
+    List     levels_[kNumLevels];      // per level / 4, by time added
+    List     held_;                    // sustained voices
+    uint32_t level_mask_;              // levels_ that aren't empty
+    uint16_t sustain_;                 // pedal down, per channel
+    size_t   num_used_;
+    uint8_t  key_voice_[kNumKeys];
+    uint8_t  channel_voice_[kNumChannels];
+};
+
+template <size_t kNumVoices>
+constexpr int VoiceAllocator<kNumVoices>::kNoVoice;
+
+} // namespace daisy
+
+#endif
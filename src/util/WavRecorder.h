@@ -0,0 +1,380 @@
+#pragma once
+#ifndef DSY_WAV_RECORDER_H
+#define DSY_WAV_RECORDER_H
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "fatfs.h"
+#include "sys/system.h"
+#include "util/wav_format.h"
+
+namespace daisy
+{
+/** @brief   Records audio to a WAV file on an SD Card, in the background
+ *  @details The audio callback encodes into a queue of kNumBlocks blocks,
+ *           and Write() in the main loop writes the full ones. While a
+ *           write takes long (e.g. the card is busy), the callback goes on
+ *           filling the other blocks, so the queue covers
+ *           (kNumBlocks - 1) * kBlockBytes of audio. Frames that arrive
+ *           while all blocks are full are dropped and counted.
+ *
+ *           FAT allocates clusters while a file grows, which can stall a
+ *           write for a long time. With Config::max_seconds the whole file
+ *           is allocated in one piece with f_expand() when it's opened, so
+ *           recording doesn't allocate, and the unused rest is cut off by
+ *           Close().
+ *
+ *           The header is padded to 512 bytes with a "JUNK" chunk, and the
+ *           blocks are multiples of 512 bytes where the frame size allows
+ *           it, so the writes are whole sectors that FatFS passes straight
+ *           to the card.
+ *
+ *           Formats are 16, 24 or 32-bit PCM or float, with any number of
+ *           channels. Close() writes what's left in the queue and the
+ *           final header.
+ *
+ *           Memory use is kNumBlocks * kBlockBytes. The object has to be in
+ *           a memory the SDMMC can reach (not the DTCM).
+ *
+ *  To use:
+ *  1. Create a WavRecorder<> and Init() it with a Config.
+ *  2. Open() a file.
+ *  3. Call Record() from the audio callback, and Write() from the main
+ *     loop.
+ *  4. Close() the file when done.
+ *
+ *  @tparam kBlockBytes size of the blocks written at once
+ *  @tparam kNumBlocks  number of blocks in the queue
+ */
+template <size_t kBlockBytes = 16384, size_t kNumBlocks = 4>
+class WavRecorder
+{
+  public:
+    /** Return values of the file functions */
+    enum class Result
+    {
+        OK,
+        ERR_FILE,
+        ERR_FORMAT,
+    };
+
+    struct Config
+    {
+        uint32_t        samplerate;
+        uint16_t        channels;
+        WavSampleFormat format;
+        /** length to allocate when a file is opened, in seconds, or 0 to
+         *  allocate while recording. A recording can be longer.
+         */
+        float max_seconds;
+
+        Config()
+        : samplerate(48000),
+          channels(2),
+          format(WavSampleFormat::PCM24),
+          max_seconds(0.f)
+        {
+        }
+    };
+
+    /** Statistics of the current recording */
+    struct Stats
+    {
+        /** blocks written to the file */
+        uint32_t blocks_written;
+        /** frames dropped because all blocks were full */
+        uint32_t dropped_frames;
+        /** longest write of a block */
+        uint32_t max_write_us;
+        /** most full blocks waiting to be written */
+        uint32_t max_queued;
+        /** true if the file was allocated when it was opened */
+        bool preallocated;
+    };
+
+    WavRecorder() {}
+    ~WavRecorder() {}
+
+    /** Sets the format of the following recordings
+     *  \return ERR_FORMAT if a frame doesn't fit in a block
+     */
+    Result Init(const Config& config)
+    {
+        config_     = config;
+        frame_size_ = config.channels * GetWavSampleSize(config.format);
+        recording_.store(false);
+        if(frame_size_ == 0 || frame_size_ > kBlockBytes)
+        {
+            frame_size_ = 0;
+            return Result::ERR_FORMAT;
+        }
+        // whole frames and whole sectors, or whole frames only
+        size_t unit = frame_size_;
+        while(unit % kSectorSize != 0)
+            unit += frame_size_;
+        if(unit > kBlockBytes)
+            unit = frame_size_;
+        block_size_ = kBlockBytes / unit * unit;
+        return Result::OK;
+    }
+
+    /** Creates a file, and starts recording into it */
+    Result Open(const char* path)
+    {
+        if(frame_size_ == 0)
+            return Result::ERR_FORMAT;
+        if(recording_.load())
+            Close();
+        if(f_open(&file_, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+            return Result::ERR_FILE;
+
+        stats_ = Stats();
+        if(config_.max_seconds > 0.f)
+        {
+            const uint64_t size
+                = kHeaderSize
+                  + uint64_t(config_.max_seconds * config_.samplerate)
+                        * frame_size_;
+            // without space in one piece, it's allocated while recording
+            stats_.preallocated
+                = size < UINT32_MAX && f_expand(&file_, size, 1) == FR_OK;
+        }
+
+        UINT bytes_written = 0;
+        WriteHeader(blocks_[0], 0);
+        if(f_write(&file_, blocks_[0], kHeaderSize, &bytes_written) != FR_OK
+           || bytes_written != kHeaderSize)
+        {
+            f_close(&file_);
+            return Result::ERR_FILE;
+        }
+        num_frames_  = 0;
+        write_block_ = 0;
+        write_pos_   = 0;
+        read_block_  = 0;
+        num_full_.store(0);
+        recording_.store(true);
+        return Result::OK;
+    }
+
+    /** Records a block of audio, from the audio callback
+     *  \param in Config::channels buffers
+     *  \param frames number of frames
+     */
+    void Record(const float* const* in, size_t frames)
+    {
+        if(!recording_.load(std::memory_order_relaxed))
+            return;
+        for(size_t done = 0; done < frames;)
+        {
+            uint8_t* dst;
+            size_t   num;
+            if(!GetSpace(frames - done, &dst, &num))
+            {
+                stats_.dropped_frames += frames - done;
+                return;
+            }
+            EncodeWavFrames(
+                config_.format, in, config_.channels, done, num, dst);
+            Commit(num);
+            done += num;
+        }
+    }
+
+    /** Records a block of interleaved audio, from the audio callback
+     *  \param in frames of Config::channels samples
+     *  \param frames number of frames
+     */
+    void RecordInterleaved(const float* in, size_t frames)
+    {
+        if(!recording_.load(std::memory_order_relaxed))
+            return;
+        for(size_t done = 0; done < frames;)
+        {
+            uint8_t* dst;
+            size_t   num;
+            if(!GetSpace(frames - done, &dst, &num))
+            {
+                stats_.dropped_frames += frames - done;
+                return;
+            }
+            EncodeWavSamples(config_.format,
+                             in + done * config_.channels,
+                             num * config_.channels,
+                             dst);
+            Commit(num);
+            done += num;
+        }
+    }
+
+    /** Writes the full blocks to the file, from the main loop */
+    Result Write()
+    {
+        while(num_full_.load(std::memory_order_acquire) > 0)
+        {
+            if(!WriteBlock(blocks_[read_block_], block_size_))
+                return Result::ERR_FILE;
+            read_block_ = (read_block_ + 1) % kNumBlocks;
+            num_full_.fetch_sub(1, std::memory_order_release);
+        }
+        return Result::OK;
+    }
+
+    /** Stops recording, writes the rest of the audio and the final header,
+     *  and closes the file. Record() must not be called at the same time
+     *  from another context, i.e. when the audio callback interrupts the
+     *  main loop, this is fine from the main loop.
+     */
+    Result Close()
+    {
+        if(!recording_.exchange(false))
+            return Result::OK;
+
+        // the full blocks, and the one that was being filled
+        bool ok = Write() == Result::OK;
+        if(ok && write_pos_ > 0)
+            ok = WriteBlock(blocks_[write_block_], write_pos_);
+
+        // cuts off the rest of the allocation
+        const FSIZE_t end = kHeaderSize + FSIZE_t(num_frames_) * frame_size_;
+        if(ok && f_size(&file_) > end)
+            ok = f_lseek(&file_, end) == FR_OK && f_truncate(&file_) == FR_OK;
+
+        UINT bytes_written = 0;
+        WriteHeader(blocks_[0], num_frames_ * frame_size_);
+        ok = ok && f_lseek(&file_, 0) == FR_OK
+             && f_write(&file_, blocks_[0], kHeaderSize, &bytes_written)
+                    == FR_OK
+             && bytes_written == kHeaderSize;
+        ok = f_close(&file_) == FR_OK && ok;
+        return ok ? Result::OK : Result::ERR_FILE;
+    }
+
+    /** \return true between Open() and Close() */
+    bool IsRecording() const { return recording_.load(); }
+
+    /** \return length of the recording in frames */
+    uint32_t GetLengthFrames() const { return num_frames_; }
+
+    /** \return length of the recording in seconds */
+    float GetLengthSeconds() const
+    {
+        return float(num_frames_) / float(config_.samplerate);
+    }
+
+    /** \return size of the blocks that are written, in bytes */
+    size_t GetBlockSize() const { return block_size_; }
+
+    /** \return the statistics of the current or last recording */
+    const Stats& GetStats() const { return stats_; }
+
+  private:
+    static constexpr size_t kSectorSize = 512;
+    static constexpr size_t kHeaderSize = 512;
+
+    /** Gets the free part of the block being filled
+     *  \return false if all blocks are full
+     */
+    bool GetSpace(size_t frames, uint8_t** dst, size_t* num)
+    {
+        if(num_full_.load(std::memory_order_acquire) == kNumBlocks)
+            return false;
+        const size_t space = (block_size_ - write_pos_) / frame_size_;
+        *dst               = blocks_[write_block_] + write_pos_;
+        *num               = frames < space ? frames : space;
+        return true;
+    }
+
+    /** Adds encoded frames, and queues the block when it's full */
+    void Commit(size_t frames)
+    {
+        num_frames_ += frames;
+        write_pos_ += frames * frame_size_;
+        if(write_pos_ < block_size_)
+            return;
+        write_pos_   = 0;
+        write_block_ = (write_block_ + 1) % kNumBlocks;
+        const uint32_t queued
+            = num_full_.fetch_add(1, std::memory_order_release) + 1;
+        if(queued > stats_.max_queued)
+            stats_.max_queued = queued;
+    }
+
+    bool WriteBlock(const uint8_t* data, size_t size)
+    {
+        UINT           bytes_written = 0;
+        const uint32_t start         = System::GetUs();
+        const bool     ok = f_write(&file_, data, size, &bytes_written) == FR_OK
+                        && bytes_written == size;
+        const uint32_t time = System::GetUs() - start;
+        if(time > stats_.max_write_us)
+            stats_.max_write_us = time;
+        stats_.blocks_written++;
+        return ok;
+    }
+
+    static void Put16(uint8_t* p, uint16_t x) { memcpy(p, &x, sizeof(x)); }
+    static void Put32(uint8_t* p, uint32_t x) { memcpy(p, &x, sizeof(x)); }
+
+    /** Builds the header, padded to kHeaderSize bytes */
+    void WriteHeader(uint8_t* p, uint32_t data_size) const
+    {
+        const uint16_t bits = GetWavSampleSize(config_.format) * 8;
+        const uint16_t code = config_.format == WavSampleFormat::FLOAT32
+                                  ? WAVE_FORMAT_IEEE_FLOAT
+                                  : WAVE_FORMAT_PCM;
+        // needed for more than 16 bits or 2 channels
+        const bool extensible
+            = config_.channels > 2
+              || (bits > 16 && config_.format != WavSampleFormat::FLOAT32);
+        const uint32_t fmt_size = extensible ? 40 : 16;
+
+        memset(p, 0, kHeaderSize);
+        Put32(p, kWavFileChunkId);
+        Put32(p + 4, kHeaderSize - 8 + data_size);
+        Put32(p + 8, kWavFileWaveId);
+        Put32(p + 12, kWavFileSubChunk1Id);
+        Put32(p + 16, fmt_size);
+        Put16(p + 20, extensible ? uint16_t(WAVE_FORMAT_EXTENSIBLE) : code);
+        Put16(p + 22, config_.channels);
+        Put32(p + 24, config_.samplerate);
+        Put32(p + 28, config_.samplerate * frame_size_);
+        Put16(p + 32, frame_size_);
+        Put16(p + 34, bits);
+        if(extensible)
+        {
+            // the rest of the sub format GUID
+            static const uint8_t kGuid[14] = {0x00, 0x00, 0x00, 0x00, 0x10,
+                                              0x00, 0x80, 0x00, 0x00, 0xaa,
+                                              0x00, 0x38, 0x9b, 0x71};
+            Put16(p + 36, 22);
+            Put16(p + 38, bits);
+            // speaker positions in order, unknown above 18 channels
+            Put32(p + 40,
+                  config_.channels <= 18 ? (1u << config_.channels) - 1 : 0);
+            Put16(p + 44, code);
+            memcpy(p + 46, kGuid, sizeof(kGuid));
+        }
+        const uint32_t junk = 20 + fmt_size;
+        Put32(p + junk, 0x4b4e554a); // "JUNK"
+        Put32(p + junk + 4, kHeaderSize - 8 - (junk + 8));
+        Put32(p + kHeaderSize - 8, kWavFileSubChunk2Id);
+        Put32(p + kHeaderSize - 4, data_size);
+    }
+
+    Config                config_;
+    size_t                frame_size_ = 0;
+    size_t                block_size_ = 0;
+    uint32_t              num_frames_ = 0;
+    size_t                write_block_, write_pos_, read_block_;
+    std::atomic<uint32_t> num_full_{0};
+    std::atomic<bool>     recording_{false};
+    Stats                 stats_ = Stats();
+    FIL                   file_;
+    alignas(32) uint8_t   blocks_[kNumBlocks][kBlockBytes];
+};
+
+} // namespace daisy
+
+#endif
@@ -11,8 +11,8 @@ namespace daisy
  ** Recordings are made with floating point input, and will be converted to the 
  ** specified bits per sample internally 
  **
- ** For now only 16-bit and 32-bit (signed int) formats are supported
- ** f32 and s24 formats will be added next
+ ** For now only 16-bit and 32-bit (signed int) formats are supported.
+ ** WavRecorder also records 24-bit and float, with a deeper buffer queue.
  **
  ** The transfer size determines the amount of internal memory used, and can have an
  ** effect on the performance of the streaming behavior of the WavWriter.
@@ -92,7 +92,7 @@ class WavWriter
      ** \param in should be a pointer to an array of samples */
     void Sample(const float *in)
     {
-        for(size_t i = 0; i < cfg_.channels; i++)
+        for(int32_t i = 0; i < cfg_.channels; i++)
         {
             switch(cfg_.bitspersample)
             {
@@ -142,9 +142,21 @@ class WavWriter
     void SaveFile()
     {
         unsigned int bw = 0;
-        recording_      = false;
-        // We _should_ flush whatever's left in the transfer buff
-        // TODO: that.
+        // the half that's waiting to be written, then the samples in the
+        // half that's being filled
+        Write();
+        recording_ = false;
+        const size_t cap_point
+            = cfg_.bitspersample == 16 ? kTransferSamps * 2 : kTransferSamps;
+        const size_t samp_bytes = cfg_.bitspersample / 8;
+        const size_t start      = wptr_ < cap_point ? 0 : cap_point;
+        if(wptr_ > start)
+        {
+            f_write(&fp_,
+                    (uint8_t *)transfer_buff + start * samp_bytes,
+                    (wptr_ - start) * samp_bytes,
+                    &bw);
+        }
         wavheader_.FileSize = CalcFileSize();
         f_lseek(&fp_, 0);
         f_write(&fp_, &wavheader_, sizeof(wavheader_), &bw);
@@ -161,6 +173,8 @@ class WavWriter
             {
                 recording_ = true;
                 num_samps_ = 0;
+                wptr_      = 0;
+                bstate_    = BufferState::IDLE;
             }
         }
     }
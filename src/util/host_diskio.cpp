@@ -0,0 +1,198 @@
+#include "util/host_diskio.h"
+#include "sys/system.h"
+
+using namespace daisy;
+
+namespace
+{
+const uint32_t kSectorSize = 512;
+
+/** 2020-01-01 00:00:00 */
+uint32_t fat_time = ((2020 - 1980) << 25) | (1 << 21) | (1 << 16);
+
+/** Time of a command transferring count sectors */
+uint32_t CommandUs(uint32_t latency_us, uint32_t bandwidth, UINT count)
+{
+    uint64_t us = latency_us;
+    if(bandwidth > 0)
+        us += (uint64_t(count) * kSectorSize * 1000000 + bandwidth - 1)
+              / bandwidth;
+    return us;
+}
+
+} // namespace
+
+/** Replaces the weak default of diskio.c, which returns 0 */
+extern "C" DWORD get_fattime(void)
+{
+    return fat_time;
+}
+
+const Diskio_drvTypeDef HostDiskio::driver_ = {
+    HostDiskio::Initialize,
+    HostDiskio::Status,
+    HostDiskio::Read,
+    HostDiskio::Write,
+    HostDiskio::Ioctl,
+};
+HostDiskio* HostDiskio::instance_ = nullptr;
+
+bool HostDiskio::CreateImage(const char* path, uint64_t size)
+{
+    FILE* image = fopen(path, "wb");
+    if(image == nullptr)
+        return false;
+    // writing the last byte leaves the rest unallocated and zeroed
+    bool ok = size >= kSectorSize && size % kSectorSize == 0
+              && fseek(image, long(size - 1), SEEK_SET) == 0
+              && fputc(0, image) == 0;
+    return fclose(image) == 0 && ok;
+}
+
+bool HostDiskio::Init(const char* path, const Config& config)
+{
+    DeInit();
+    if(instance_ != nullptr)
+        return false;
+    image_ = fopen(path, "r+b");
+    if(image_ == nullptr)
+        return false;
+    if(fseek(image_, 0, SEEK_END) != 0)
+    {
+        DeInit();
+        return false;
+    }
+    num_sectors_ = uint64_t(ftell(image_)) / kSectorSize;
+    config_      = config;
+    stats_       = Stats();
+    if(FATFS_LinkDriver(&driver_, path_) != 0)
+    {
+        DeInit();
+        return false;
+    }
+    linked_   = true;
+    instance_ = this;
+    // a blank image doesn't mount until it is formatted
+    f_mount(&fs_, path_, 1);
+    return true;
+}
+
+void HostDiskio::DeInit()
+{
+    if(linked_)
+    {
+        f_mount(nullptr, path_, 0);
+        FATFS_UnLinkDriver(path_);
+        linked_ = false;
+    }
+    if(instance_ == this)
+        instance_ = nullptr;
+    if(image_ != nullptr)
+    {
+        fclose(image_);
+        image_ = nullptr;
+    }
+}
+
+bool HostDiskio::Format()
+{
+    if(!linked_)
+        return false;
+    BYTE work[_MAX_SS];
+    f_mount(nullptr, path_, 0);
+    return f_mkfs(path_, FM_ANY, 0, work, sizeof(work)) == FR_OK
+           && f_mount(&fs_, path_, 1) == FR_OK;
+}
+
+void HostDiskio::SetTime(uint16_t fdate, uint16_t ftime)
+{
+    fat_time = (uint32_t(fdate) << 16) | ftime;
+}
+
+void HostDiskio::Spend(uint32_t us)
+{
+    stats_.busy_us += us;
+    if(us > stats_.max_command_us)
+        stats_.max_command_us = us;
+    System::SetUsForUnitTest(System::GetUs() + us);
+    if(callback_ != nullptr)
+        callback_(callback_context_);
+}
+
+DSTATUS HostDiskio::Initialize(BYTE lun)
+{
+    return Status(lun);
+}
+
+DSTATUS HostDiskio::Status(BYTE)
+{
+    return instance_ != nullptr && instance_->image_ != nullptr ? 0
+                                                                : STA_NOINIT;
+}
+
+DRESULT HostDiskio::Read(BYTE, BYTE* buff, DWORD sector, UINT count)
+{
+    HostDiskio* disk = instance_;
+    if(disk == nullptr || disk->image_ == nullptr)
+        return RES_NOTRDY;
+    if(uint64_t(sector) + count > disk->num_sectors_)
+        return RES_PARERR;
+    disk->stats_.read_commands++;
+    disk->stats_.sectors_read += count;
+    disk->Spend(CommandUs(disk->config_.read_latency_us,
+                          disk->config_.read_bandwidth,
+                          count));
+    if(fseek(disk->image_, long(sector) * kSectorSize, SEEK_SET) != 0
+       || fread(buff, kSectorSize, count, disk->image_) != count)
+        return RES_ERROR;
+    return RES_OK;
+}
+
+DRESULT HostDiskio::Write(BYTE, const BYTE* buff, DWORD sector, UINT count)
+{
+    HostDiskio* disk = instance_;
+    if(disk == nullptr || disk->image_ == nullptr)
+        return RES_NOTRDY;
+    if(uint64_t(sector) + count > disk->num_sectors_)
+        return RES_PARERR;
+    Stats&        stats  = disk->stats_;
+    const Config& config = disk->config_;
+    stats.write_commands++;
+    stats.sectors_written += count;
+    uint32_t us
+        = CommandUs(config.write_latency_us, config.write_bandwidth, count);
+    if(config.stall_interval > 0
+       && stats.write_commands % config.stall_interval == 0)
+    {
+        stats.stalls++;
+        us += config.stall_us;
+    }
+    disk->Spend(us);
+    if(fseek(disk->image_, long(sector) * kSectorSize, SEEK_SET) != 0
+       || fwrite(buff, kSectorSize, count, disk->image_) != count)
+        return RES_ERROR;
+    return RES_OK;
+}
+
+DRESULT HostDiskio::Ioctl(BYTE, BYTE cmd, void* buff)
+{
+    HostDiskio* disk = instance_;
+    if(disk == nullptr || disk->image_ == nullptr)
+        return RES_NOTRDY;
+    disk->stats_.ioctl_commands++;
+    switch(cmd)
+    {
+        case CTRL_SYNC:
+            return fflush(disk->image_) == 0 ? RES_OK : RES_ERROR;
+        case GET_SECTOR_COUNT:
+            *static_cast<DWORD*>(buff) = disk->num_sectors_;
+            return RES_OK;
+        case GET_SECTOR_SIZE:
+            *static_cast<WORD*>(buff) = kSectorSize;
+            return RES_OK;
+        case GET_BLOCK_SIZE:
+            *static_cast<DWORD*>(buff) = 1;
+            return RES_OK;
+        default: return RES_PARERR;
+    }
+}
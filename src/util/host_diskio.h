@@ -0,0 +1,179 @@
+#pragma once
+#ifndef DSY_HOST_DISKIO_H
+#define DSY_HOST_DISKIO_H
+
+#ifndef UNIT_TEST
+#error "The HostDiskio is only available in host builds with UNIT_TEST"
+#else
+
+#include <cstdint>
+#include <cstdio>
+#include "ff_gen_drv.h"
+
+namespace daisy
+{
+/** @brief FatFS disk driver for host builds, backed by an image file
+ *  @ingroup utility
+ *  @details Serves the sectors of a FAT image file, so that FatFS and the
+ *           code built on it (WavStreamer, WavRecorder, WavCatalog, ...)
+ *           run on the host.
+ *
+ *           Every command has a simulated duration, made of a fixed
+ *           latency and a transfer time at a limited bandwidth, and write
+ *           commands can stall now and then like an SD card does when it
+ *           erases. The duration advances the System time mock (GetUs()),
+ *           so code that times itself with it sees the simulated card, and
+ *           benchmarks are deterministic. Commands and sectors are counted.
+ *
+ *           Usage:
+ *           \code{.cpp}
+ *           HostDiskio::CreateImage("card.img", 64 << 20);
+ *           HostDiskio disk;
+ *           disk.Init("card.img");
+ *           disk.Format();
+ *           FIL file;
+ *           f_open(&file, "0:/test.wav", FA_WRITE | FA_CREATE_ALWAYS);
+ *           \endcode
+ *
+ *           Only one HostDiskio can be initialized at a time. Like the
+ *           other host mocks, this relies on the System time mock and must
+ *           be used from within a test.
+ */
+class HostDiskio
+{
+  public:
+    /** Timing of the simulated card */
+    struct Config
+    {
+        /** fixed time of a read command */
+        uint32_t read_latency_us;
+        /** fixed time of a write command */
+        uint32_t write_latency_us;
+        /** read transfer rate in bytes per second, 0 for no limit */
+        uint32_t read_bandwidth;
+        /** write transfer rate in bytes per second, 0 for no limit */
+        uint32_t write_bandwidth;
+        /** every this many write commands stall, 0 for none */
+        uint32_t stall_interval;
+        /** extra time of a stalled write command */
+        uint32_t stall_us;
+
+        /** No delays at all */
+        Config()
+        : read_latency_us(0),
+          write_latency_us(0),
+          read_bandwidth(0),
+          write_bandwidth(0),
+          stall_interval(0),
+          stall_us(0)
+        {
+        }
+
+        /** Roughly a class 10 SD card in 4 bit mode */
+        static Config SdCard()
+        {
+            Config config;
+            config.read_latency_us  = 150;
+            config.write_latency_us = 400;
+            config.read_bandwidth   = 20000000;
+            config.write_bandwidth  = 10000000;
+            config.stall_interval   = 256;
+            config.stall_us         = 50000;
+            return config;
+        }
+    };
+
+    /** Counters of the commands */
+    struct Stats
+    {
+        uint32_t read_commands;   /**< & */
+        uint32_t write_commands;  /**< & */
+        uint32_t ioctl_commands;  /**< & */
+        uint64_t sectors_read;    /**< & */
+        uint64_t sectors_written; /**< & */
+        uint32_t stalls;          /**< & */
+        uint32_t max_command_us;  /**< longest command */
+        uint64_t busy_us;         /**< simulated time of all commands */
+    };
+
+    /** See SetCommandCallback() */
+    using CommandCallback = void (*)(void* context);
+
+    HostDiskio() {}
+    ~HostDiskio() { DeInit(); }
+
+    /** Creates a zeroed image file, which is sparse where the file system
+     *  supports it.
+     *  \param path of the image file
+     *  \param size in bytes, a multiple of 512
+     */
+    static bool CreateImage(const char* path, uint64_t size);
+
+    /** Opens an image file, links the driver to FatFS and mounts the
+     *  volume if it has a file system.
+     */
+    bool Init(const char* path, const Config& config = Config());
+
+    /** Unmounts the volume, unlinks the driver and closes the image */
+    void DeInit();
+
+    /** Creates a new FAT file system on the image, and mounts it */
+    bool Format();
+
+    /** Returns the path of the volume, e.g. "0:/" */
+    const char* GetPath() const { return path_; }
+
+    /** Changes the timing of the following commands */
+    void SetConfig(const Config& config) { config_ = config; }
+
+    /** Returns the command counters */
+    const Stats& GetStats() const { return stats_; }
+
+    /** Clears the command counters */
+    void ResetStats() { stats_ = Stats(); }
+
+    /** Sets a function that is called during every command, after the time
+     *  was advanced by it, and before its data is transferred. This can run
+     *  the audio callbacks that were due, like the interrupts that run while
+     *  the card is busy. It must not use FatFS. nullptr removes it.
+     */
+    void SetCommandCallback(CommandCallback callback, void* context)
+    {
+        callback_         = callback;
+        callback_context_ = context;
+    }
+
+    /** Sets the timestamp of files that are written, in the FatFS format
+     *  (see get_fattime()).
+     */
+    static void SetTime(uint16_t fdate, uint16_t ftime);
+
+  private:
+    static DSTATUS Initialize(BYTE lun);
+    static DSTATUS Status(BYTE lun);
+    static DRESULT Read(BYTE lun, BYTE* buff, DWORD sector, UINT count);
+    static DRESULT
+    Write(BYTE lun, const BYTE* buff, DWORD sector, UINT count);
+    static DRESULT Ioctl(BYTE lun, BYTE cmd, void* buff);
+
+    /** Advances the time by the duration of a command */
+    void Spend(uint32_t us);
+
+    static const Diskio_drvTypeDef driver_;
+    static HostDiskio*             instance_;
+
+    Config          config_;
+    Stats           stats_            = Stats();
+    FILE*           image_            = nullptr;
+    uint64_t        num_sectors_      = 0;
+    char            path_[4]          = {};
+    bool            linked_           = false;
+    CommandCallback callback_         = nullptr;
+    void*           callback_context_ = nullptr;
+    FATFS           fs_;
+};
+
+} // namespace daisy
+
+#endif // ifndef UNIT_TEST
+#endif
@@ -13,11 +13,39 @@ namespace daisy
 /**
 Utility Ring Buffer \n 
 imported from pichenettes/stmlib
+
+When size is a power of two, the read and write positions wrap around with
+a bit mask, otherwise with a compare and subtract - there are no divisions.
+
+Besides single elements, the buffer can be accessed in contiguous spans,
+e.g. for a DMA transfer straight into the buffer:
+\code
+auto span = buffer.GetWriteSpan();
+StartDmaTransfer(span.data, span.count);
+// transfer complete:
+buffer.CommitWrite(span.count);
+\endcode
+and likewise GetReadSpan() / ConsumeRead() to parse data in place.
+The buffer holds up to size - 1 elements.
 */
 template <typename T, size_t size>
 class RingBuffer
 {
   public:
+    /** A contiguous region of elements that can be written */
+    struct WriteSpan
+    {
+        T*     data;
+        size_t count;
+    };
+
+    /** A contiguous region of elements that can be read */
+    struct ReadSpan
+    {
+        const T* data;
+        size_t   count;
+    };
+
     RingBuffer() {}
 
     /** Initializes the Ring Buffer */
@@ -27,13 +55,13 @@ class RingBuffer
     inline size_t capacity() const { return size; }
 
     /** \return the number of samples that can be written to ring buffer without overwriting unread data. */
-    inline size_t writable() const
-    {
-        return (read_ptr_ - write_ptr_ - 1) % size;
-    }
+    inline size_t writable() const { return size - 1 - readable(); }
 
     /** \return number of unread elements in ring buffer */
-    inline size_t readable() const { return (write_ptr_ - read_ptr_) % size; }
+    inline size_t readable() const
+    {
+        return Wrap(write_ptr_ + size - read_ptr_);
+    }
 
     /** \returns True, if the buffer is empty. */
     inline bool isEmpty() const { return write_ptr_ == read_ptr_; }
@@ -55,7 +83,7 @@ class RingBuffer
     {
         size_t w   = write_ptr_;
         buffer_[w] = v;
-        write_ptr_ = (w + 1) % size;
+        write_ptr_ = Wrap(w + 1);
     }
 
     /** Reads the first available element from the ring buffer
@@ -75,7 +103,7 @@ class RingBuffer
     {
         size_t r      = read_ptr_;
         T      result = buffer_[r];
-        read_ptr_     = (r + 1) % size;
+        read_ptr_     = Wrap(r + 1);
         return result;
     }
 
@@ -91,7 +119,10 @@ class RingBuffer
         {
             return;
         }
-        read_ptr_ = (write_ptr_ + 1 + n) % size;
+        // at most everything, which keeps the position for Wrap()
+        if(n >= size)
+            n = size - 1;
+        read_ptr_ = Wrap(write_ptr_ + 1 + n);
     }
 
     /** Reads a number of elements into a buffer immediately
@@ -113,7 +144,7 @@ class RingBuffer
             std::copy(
                 &buffer_[0], &buffer_[num_elements - read], destination + read);
         }
-        read_ptr_ = (r + num_elements) % size;
+        read_ptr_ = Wrap(r + num_elements);
     }
 
     /** Overwrites a number of elements using the source buffer as input. 
@@ -135,7 +166,7 @@ class RingBuffer
             std::copy(source + written, source + num_elements, &buffer_[0]);
         }
 
-        write_ptr_ = (w + num_elements) % size;
+        write_ptr_ = Wrap(w + num_elements);
     }
 
     /**Advances the write pointer, for when a peripheral is writing to the buffer. */
@@ -144,9 +175,89 @@ class RingBuffer
         size_t free;
         free         = this->writable();
         num_elements = num_elements < free ? num_elements : free;
-        write_ptr_   = write_ptr_ + num_elements;
-        if(write_ptr_ > size)
-            write_ptr_ = write_ptr_ - size;
+        write_ptr_   = Wrap(write_ptr_ + num_elements);
+    }
+
+    /** Writes as many elements as there is room for, without overwriting
+    unread data.
+    \param source Input buffer
+    \param num_elements Number of elements in source
+    \return number of elements written
+     */
+    inline size_t Write(const T* source, size_t num_elements)
+    {
+        size_t written = 0;
+        while(written < num_elements)
+        {
+            const WriteSpan span = GetWriteSpan();
+            if(span.count == 0)
+                break;
+            const size_t n = std::min(span.count, num_elements - written);
+            std::copy(source + written, source + written + n, span.data);
+            CommitWrite(n);
+            written += n;
+        }
+        return written;
+    }
+
+    /** Reads up to num_elements elements.
+    \param destination buffer to write to
+    \param num_elements maximum number of elements to read
+    \return number of elements read
+     */
+    inline size_t Read(T* destination, size_t num_elements)
+    {
+        size_t read = 0;
+        while(read < num_elements)
+        {
+            const ReadSpan span = GetReadSpan();
+            if(span.count == 0)
+                break;
+            const size_t n = std::min(span.count, num_elements - read);
+            std::copy(span.data, span.data + n, destination + read);
+            ConsumeRead(n);
+            read += n;
+        }
+        return read;
+    }
+
+    /** \return the contiguous free space after the write position. This may
+    be less than writable() when the free space wraps around the end of the
+    buffer - write this span, commit it and get the next one.
+     */
+    inline WriteSpan GetWriteSpan()
+    {
+        const size_t w   = write_ptr_;
+        const size_t r   = read_ptr_;
+        const size_t end = r > w ? r - 1 : (r == 0 ? size - 1 : size);
+        return {&buffer_[w], end - w};
+    }
+
+    /** Makes elements written to the span from GetWriteSpan() readable.
+    \param num_elements number of elements written
+     */
+    inline void CommitWrite(size_t num_elements) { Advance(num_elements); }
+
+    /** \return the contiguous unread elements after the read position. This
+    may be less than readable() when the data wraps around the end of the
+    buffer.
+     */
+    inline ReadSpan GetReadSpan() const
+    {
+        const size_t w = write_ptr_;
+        const size_t r = read_ptr_;
+        return {&buffer_[r], w >= r ? w - r : size - r};
+    }
+
+    /** Removes elements read from the span from GetReadSpan().
+    \param num_elements number of elements read
+     */
+    inline void ConsumeRead(size_t num_elements)
+    {
+        const size_t available = readable();
+        if(num_elements > available)
+            num_elements = available;
+        read_ptr_ = Wrap(read_ptr_ + num_elements);
     }
 
     /**Returns a pointer to the actual Ring Buffer
@@ -154,6 +265,16 @@ class RingBuffer
     inline T* GetMutableBuffer() { return buffer_; }
 
   private:
+    static constexpr bool kIsPowerOfTwo = (size & (size - 1)) == 0;
+
+    /** Wraps a position in 0..2*size-1 into the buffer */
+    static inline size_t Wrap(size_t idx)
+    {
+        if(kIsPowerOfTwo)
+            return idx & (size - 1);
+        return idx >= size ? idx - size : idx;
+    }
+
     T               buffer_[size];
     volatile size_t read_ptr_;
     volatile size_t write_ptr_;
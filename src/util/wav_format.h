@@ -2,7 +2,9 @@
 #ifndef DSY_WAV_FORMAT_H
 #define DSY_WAV_FORMAT_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 /** @addtogroup utility
     @{
@@ -52,6 +54,374 @@ typedef struct
     uint32_t SubCHunk2Size; /**< & */
 } WAV_FormatTypeDef;
 
+/** Sample encodings of WAV data that can be decoded */
+enum class WavSampleFormat : uint8_t
+{
+    INVALID,
+    PCM16,
+    PCM24,
+    PCM32,
+    FLOAT32,
+};
+
+/** Format of a WAV file, and where its sample data is */
+struct WavFormatInfo
+{
+    WavSampleFormat sample_format; /**< & */
+    uint16_t        channels;      /**< & */
+    uint32_t        samplerate;    /**< & */
+    uint16_t        block_align;   /**< bytes per frame */
+    uint32_t        data_offset;   /**< of the sample data in the file */
+    uint32_t        data_size;     /**< in bytes */
+};
+
+/** Loop points of a WAV file, from its "smpl" chunk */
+struct WavLoopInfo
+{
+    bool     valid;     /**< false if the file has no loop */
+    uint8_t  type;      /**< 0: forward, 1: ping-pong, 2: reverse */
+    uint8_t  root_note; /**< MIDI note of the unpitched sample */
+    uint32_t start;     /**< first frame of the loop */
+    uint32_t end;       /**< last frame of the loop */
+};
+
+const uint32_t kWavFileSampleChunkId = 0x6c706d73; /**< "smpl" */
+
+/** Walks the RIFF chunks of a WAV file, reading through a function, so it
+ *  works on a buffer as well as on a file. Chunks other than "fmt ",
+ *  "data" and "smpl" are skipped without being read.
+ *  \param read called as read(offset, dst, size), returns false unless
+ *              size bytes at offset in the file were copied to dst
+ *  \param size of the file, or the bytes that can be read
+ *  \param info receives the format, and the position of the sample data
+ *  \param loop receives the first loop, the chunks after the sample data
+ *              are only walked for it. Without a loop the root note is 60.
+ *              Can be nullptr.
+ *  \return false if the format is not supported, or there is no data chunk
+ */
+template <typename ReadFunction>
+bool ParseWavFile(ReadFunction   read,
+                  uint32_t       size,
+                  WavFormatInfo* info,
+                  WavLoopInfo*   loop = nullptr)
+{
+    uint32_t riff[3];
+    if(size < sizeof(riff) || !read(0, riff, sizeof(riff)))
+        return false;
+    if(riff[0] != kWavFileChunkId || riff[2] != kWavFileWaveId)
+        return false;
+
+    uint16_t format = 0, bits = 0;
+    bool     found_data = false;
+
+    info->sample_format = WavSampleFormat::INVALID;
+    if(loop != nullptr)
+    {
+        loop->valid     = false;
+        loop->type      = 0;
+        loop->root_note = 60;
+        loop->start     = 0;
+        loop->end       = 0;
+    }
+    for(uint32_t pos = sizeof(riff); pos <= size - 8;)
+    {
+        uint32_t chunk[2];
+        if(!read(pos, chunk, sizeof(chunk)))
+            return false;
+        pos += sizeof(chunk);
+        if(chunk[0] == kWavFileSubChunk1Id && chunk[1] >= 16)
+        {
+            uint8_t        fmt[26];
+            const uint32_t fmt_size = chunk[1] >= 26 ? 26 : 16;
+            if(!read(pos, fmt, fmt_size))
+                return false;
+            memcpy(&format, fmt, 2);
+            memcpy(&info->channels, fmt + 2, 2);
+            memcpy(&info->samplerate, fmt + 4, 4);
+            memcpy(&info->block_align, fmt + 12, 2);
+            memcpy(&bits, fmt + 14, 2);
+            // the actual format of extensible files is in the sub format
+            if(format == WAVE_FORMAT_EXTENSIBLE && fmt_size == 26)
+                memcpy(&format, fmt + 24, 2);
+        }
+        else if(chunk[0] == kWavFileSubChunk2Id)
+        {
+            info->data_offset = pos;
+            info->data_size   = chunk[1];
+            found_data        = true;
+            if(loop == nullptr)
+                break;
+        }
+        else if(chunk[0] == kWavFileSampleChunkId && loop != nullptr
+                && chunk[1] >= 36 + 24)
+        {
+            // the header, and the first of the loops
+            uint32_t smpl[15];
+            if(!read(pos, smpl, sizeof(smpl)))
+                return false;
+            loop->root_note = smpl[3] & 0x7f;
+            loop->valid     = smpl[7] > 0;
+            loop->type      = smpl[10];
+            loop->start     = smpl[11];
+            loop->end       = smpl[12];
+        }
+        // chunks are padded to even sizes
+        const uint32_t skip = chunk[1] + (chunk[1] & 1);
+        if(skip > size - pos || size - pos - skip < 8)
+            break;
+        pos += skip;
+    }
+
+    if(!found_data)
+        return false;
+    if(format == WAVE_FORMAT_PCM && bits == 16)
+        info->sample_format = WavSampleFormat::PCM16;
+    else if(format == WAVE_FORMAT_PCM && bits == 24)
+        info->sample_format = WavSampleFormat::PCM24;
+    else if(format == WAVE_FORMAT_PCM && bits == 32)
+        info->sample_format = WavSampleFormat::PCM32;
+    else if(format == WAVE_FORMAT_IEEE_FLOAT && bits == 32)
+        info->sample_format = WavSampleFormat::FLOAT32;
+    return info->sample_format != WavSampleFormat::INVALID
+           && info->channels > 0
+           && info->block_align == info->channels * (bits / 8);
+}
+
+/** Reads the format of a WAV file from its first bytes. The RIFF chunks
+ *  are walked, so chunks before the sample data (e.g. "LIST") are skipped
+ *  and the header doesn't have to be 44 bytes. The sample data doesn't
+ *  have to be in the buffer.
+ *  \param data the start of the file
+ *  \param size number of bytes of data
+ *  \param info receives the format
+ *  \return false if the format is not supported, or the data chunk doesn't
+ *          start within size bytes
+ */
+inline bool
+ParseWavHeader(const uint8_t* data, size_t size, WavFormatInfo* info)
+{
+    auto read = [data, size](uint32_t offset, void* dst, uint32_t n) {
+        if(offset > size || n > size - offset)
+            return false;
+        memcpy(dst, data + offset, n);
+        return true;
+    };
+    return ParseWavFile(read, size < UINT32_MAX ? size : UINT32_MAX, info);
+}
+
+/** Decodes one sample of a format to float */
+template <WavSampleFormat kFormat>
+float DecodeWavSample(const uint8_t* p);
+
+template <>
+inline float DecodeWavSample<WavSampleFormat::PCM16>(const uint8_t* p)
+{
+    int16_t x;
+    memcpy(&x, p, sizeof(x));
+    return x * (1.f / 32768.f);
+}
+
+template <>
+inline float DecodeWavSample<WavSampleFormat::PCM24>(const uint8_t* p)
+{
+    // left aligned in a 32-bit word
+    const int32_t x = int32_t(uint32_t(p[0]) << 8 | uint32_t(p[1]) << 16
+                              | uint32_t(p[2]) << 24);
+    return x * (1.f / 2147483648.f);
+}
+
+template <>
+inline float DecodeWavSample<WavSampleFormat::PCM32>(const uint8_t* p)
+{
+    int32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x * (1.f / 2147483648.f);
+}
+
+template <>
+inline float DecodeWavSample<WavSampleFormat::FLOAT32>(const uint8_t* p)
+{
+    float x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+/** Decodes interleaved frames, and adds them with a gain to separate
+ *  float buffers, starting at out[n][offset]. A mono file is added to all
+ *  outputs, otherwise channel n goes to output n.
+ */
+template <WavSampleFormat kFormat>
+void MixWavFrames(const uint8_t* src,
+                  size_t         channels,
+                  size_t         frames,
+                  float**        out,
+                  size_t         num_out,
+                  size_t         offset,
+                  float          gain)
+{
+    constexpr size_t kBytes = kFormat == WavSampleFormat::PCM16   ? 2
+                              : kFormat == WavSampleFormat::PCM24 ? 3
+                                                                  : 4;
+    const size_t stride = channels * kBytes;
+    for(size_t c = 0; c < num_out && (c < channels || channels == 1); c++)
+    {
+        const uint8_t* p = src + (channels == 1 ? 0 : c * kBytes);
+        float*         o = out[c] + offset;
+        for(size_t i = 0; i < frames; i++, p += stride)
+            o[i] += gain * DecodeWavSample<kFormat>(p);
+    }
+}
+
+/** MixWavFrames() for a format that's only known at runtime */
+inline void MixWavFrames(WavSampleFormat format,
+                         const uint8_t*  src,
+                         size_t          channels,
+                         size_t          frames,
+                         float**         out,
+                         size_t          num_out,
+                         size_t          offset,
+                         float           gain)
+{
+    switch(format)
+    {
+        case WavSampleFormat::PCM16:
+            MixWavFrames<WavSampleFormat::PCM16>(
+                src, channels, frames, out, num_out, offset, gain);
+            break;
+        case WavSampleFormat::PCM24:
+            MixWavFrames<WavSampleFormat::PCM24>(
+                src, channels, frames, out, num_out, offset, gain);
+            break;
+        case WavSampleFormat::PCM32:
+            MixWavFrames<WavSampleFormat::PCM32>(
+                src, channels, frames, out, num_out, offset, gain);
+            break;
+        case WavSampleFormat::FLOAT32:
+            MixWavFrames<WavSampleFormat::FLOAT32>(
+                src, channels, frames, out, num_out, offset, gain);
+            break;
+        default: break;
+    }
+}
+
+/** Encodes a float sample to a format. Samples out of -1 to 1 are
+ *  clipped.
+ */
+template <WavSampleFormat kFormat>
+void EncodeWavSample(float x, uint8_t* p);
+
+template <>
+inline void EncodeWavSample<WavSampleFormat::PCM16>(float x, uint8_t* p)
+{
+    x               = x < -1.f ? -1.f : (x > 1.f ? 1.f : x);
+    const int16_t s = int16_t(x * 32767.f);
+    memcpy(p, &s, sizeof(s));
+}
+
+template <>
+inline void EncodeWavSample<WavSampleFormat::PCM24>(float x, uint8_t* p)
+{
+    x               = x < -1.f ? -1.f : (x > 1.f ? 1.f : x);
+    const int32_t s = int32_t(x * 8388607.f);
+    p[0]            = uint8_t(s);
+    p[1]            = uint8_t(s >> 8);
+    p[2]            = uint8_t(s >> 16);
+}
+
+template <>
+inline void EncodeWavSample<WavSampleFormat::PCM32>(float x, uint8_t* p)
+{
+    // 2^31 - 1 isn't a float, full scale is clipped separately
+    const int32_t s = x >= 1.f    ? INT32_MAX
+                      : x <= -1.f ? INT32_MIN
+                                  : int32_t(x * 2147483648.f);
+    memcpy(p, &s, sizeof(s));
+}
+
+template <>
+inline void EncodeWavSample<WavSampleFormat::FLOAT32>(float x, uint8_t* p)
+{
+    memcpy(p, &x, sizeof(x));
+}
+
+/** \return number of bytes of a sample of a format */
+inline size_t GetWavSampleSize(WavSampleFormat format)
+{
+    switch(format)
+    {
+        case WavSampleFormat::PCM16: return 2;
+        case WavSampleFormat::PCM24: return 3;
+        case WavSampleFormat::PCM32:
+        case WavSampleFormat::FLOAT32: return 4;
+        default: return 0;
+    }
+}
+
+/** Encodes frames from separate float buffers, from in[n][offset], into
+ *  interleaved frames.
+ */
+template <WavSampleFormat kFormat>
+void EncodeWavFrames(const float* const* in,
+                     size_t              channels,
+                     size_t              offset,
+                     size_t              frames,
+                     uint8_t*            dst)
+{
+    constexpr size_t kBytes = kFormat == WavSampleFormat::PCM16   ? 2
+                              : kFormat == WavSampleFormat::PCM24 ? 3
+                                                                  : 4;
+    const size_t stride = channels * kBytes;
+    for(size_t c = 0; c < channels; c++)
+    {
+        const float* src = in[c] + offset;
+        uint8_t*     p   = dst + c * kBytes;
+        for(size_t i = 0; i < frames; i++, p += stride)
+            EncodeWavSample<kFormat>(src[i], p);
+    }
+}
+
+/** EncodeWavFrames() for a format that's only known at runtime */
+inline void EncodeWavFrames(WavSampleFormat     format,
+                            const float* const* in,
+                            size_t              channels,
+                            size_t              offset,
+                            size_t              frames,
+                            uint8_t*            dst)
+{
+    switch(format)
+    {
+        case WavSampleFormat::PCM16:
+            EncodeWavFrames<WavSampleFormat::PCM16>(
+                in, channels, offset, frames, dst);
+            break;
+        case WavSampleFormat::PCM24:
+            EncodeWavFrames<WavSampleFormat::PCM24>(
+                in, channels, offset, frames, dst);
+            break;
+        case WavSampleFormat::PCM32:
+            EncodeWavFrames<WavSampleFormat::PCM32>(
+                in, channels, offset, frames, dst);
+            break;
+        case WavSampleFormat::FLOAT32:
+            EncodeWavFrames<WavSampleFormat::FLOAT32>(
+                in, channels, offset, frames, dst);
+            break;
+        default: break;
+    }
+}
+
+/** Encodes interleaved float samples, i.e. frames of an interleaved
+ *  buffer, for a format that's only known at runtime.
+ */
+inline void EncodeWavSamples(WavSampleFormat format,
+                             const float*    in,
+                             size_t          num,
+                             uint8_t*        dst)
+{
+    // the same as a mono buffer
+    EncodeWavFrames(format, &in, 1, 0, num, dst);
+}
+
 } // namespace daisy
 
 #endif
@@ -0,0 +1,110 @@
+#include "util/AudioCallbackMonitor.h"
+#include <gtest/gtest.h>
+
+using namespace daisy;
+
+namespace
+{
+/** Runs one callback that starts at startTick and takes durationTicks */
+void RunCallback(AudioCallbackMonitor& monitor,
+                 uint32_t              startTick,
+                 uint32_t              durationTicks)
+{
+    System::SetTickForUnitTest(startTick);
+    monitor.OnCallbackStart();
+    System::SetTickForUnitTest(startTick + durationTicks);
+    monitor.OnCallbackEnd();
+}
+} // namespace
+
+TEST(util_AudioCallbackMonitor, a_stateAfterInit)
+{
+    System::SetTickFreqForUnitTest(1000000u); // 1us tick duration
+    AudioCallbackMonitor monitor;
+    monitor.Init(48000.0f, 48); // 1kHz block rate
+
+    EXPECT_EQ(monitor.GetTicksPerBlock(), 1000u);
+    EXPECT_EQ(monitor.GetNumCallbacks(), 0u);
+    EXPECT_EQ(monitor.GetNumMissedDeadlines(), 0u);
+    EXPECT_EQ(monitor.GetNumLateCallbacks(), 0u);
+    for(size_t i = 0; i < AudioCallbackMonitor::kNumBins; i++)
+    {
+        EXPECT_EQ(monitor.GetDurationHistogram(i), 0u);
+        EXPECT_EQ(monitor.GetJitterHistogram(i), 0u);
+    }
+}
+
+TEST(util_AudioCallbackMonitor, b_durationHistogram)
+{
+    System::SetTickFreqForUnitTest(1000000u);
+    AudioCallbackMonitor monitor;
+    monitor.Init(48000.0f, 48);
+
+    // 10%, 50% and 99% load, then 150% which also misses the deadline
+    RunCallback(monitor, 0, 100);
+    RunCallback(monitor, 1000, 500);
+    RunCallback(monitor, 2000, 990);
+    RunCallback(monitor, 3000, 1500);
+
+    EXPECT_EQ(monitor.GetNumCallbacks(), 4u);
+    EXPECT_EQ(monitor.GetDurationHistogram(1), 1u);  // 100 * 16 / 1000
+    EXPECT_EQ(monitor.GetDurationHistogram(8), 1u);  // 500 * 16 / 1000
+    EXPECT_EQ(monitor.GetDurationHistogram(15), 2u); // 99% and overflow
+    EXPECT_EQ(monitor.GetMaxDurationTicks(), 1500u);
+    EXPECT_EQ(monitor.GetNumMissedDeadlines(), 1u);
+}
+
+TEST(util_AudioCallbackMonitor, c_jitterAndLateCallbacks)
+{
+    System::SetTickFreqForUnitTest(1000000u);
+    AudioCallbackMonitor monitor;
+    monitor.Init(48000.0f, 48);
+
+    RunCallback(monitor, 0, 10);
+    RunCallback(monitor, 1000, 10); // on time
+    RunCallback(monitor, 2050, 10); // 50 ticks late
+    RunCallback(monitor, 3000, 10); // 50 ticks early
+    RunCallback(monitor, 4600, 10); // 600 ticks late
+
+    // no jitter measurement for the first callback
+    EXPECT_EQ(monitor.GetJitterHistogram(0), 1u);
+    EXPECT_EQ(monitor.GetJitterHistogram(1), 2u); // 50 * 32 / 1000
+    EXPECT_EQ(monitor.GetJitterHistogram(15), 1u);
+    EXPECT_EQ(monitor.GetMaxJitterTicks(), 600u);
+    EXPECT_EQ(monitor.GetNumLateCallbacks(), 1u);
+}
+
+TEST(util_AudioCallbackMonitor, d_deferredReset)
+{
+    System::SetTickFreqForUnitTest(1000000u);
+    AudioCallbackMonitor monitor;
+    monitor.Init(48000.0f, 48);
+
+    RunCallback(monitor, 0, 2000);
+    RunCallback(monitor, 3000, 2000);
+    EXPECT_EQ(monitor.GetNumMissedDeadlines(), 2u);
+
+    // cleared by the next callback, which is then the first one measured
+    monitor.Reset();
+    RunCallback(monitor, 10000, 100);
+    EXPECT_EQ(monitor.GetNumCallbacks(), 1u);
+    EXPECT_EQ(monitor.GetNumMissedDeadlines(), 0u);
+    EXPECT_EQ(monitor.GetNumLateCallbacks(), 0u);
+    EXPECT_EQ(monitor.GetMaxDurationTicks(), 100u);
+    EXPECT_EQ(monitor.GetDurationHistogram(15), 0u);
+}
+
+TEST(util_AudioCallbackMonitor, e_tolerateTickOverflow)
+{
+    System::SetTickFreqForUnitTest(1000000u);
+    AudioCallbackMonitor monitor;
+    monitor.Init(48000.0f, 48);
+
+    RunCallback(monitor, UINT32_MAX - 500, 100);
+    RunCallback(monitor, 499, 100); // tick counter wrapped in between
+    EXPECT_EQ(monitor.GetMaxJitterTicks(), 0u);
+    EXPECT_EQ(monitor.GetNumLateCallbacks(), 0u);
+
+    RunCallback(monitor, UINT32_MAX - 50, 200); // wraps during the callback
+    EXPECT_EQ(monitor.GetMaxDurationTicks(), 200u);
+}
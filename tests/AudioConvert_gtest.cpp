@@ -0,0 +1,459 @@
+#include <gtest/gtest.h>
+#include "hid/audio_convert.h"
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using BitDepth = SaiHandle::Config::BitDepth;
+
+/** The conversion loops as they were in AudioHandle::Impl::InternalCallback,
+ *  kept as reference for correctness and speed. */
+void ReferenceDeinterleave(BitDepth       bd,
+                           size_t         chns,
+                           const int32_t* in,
+                           const int32_t* in2,
+                           float**        fin,
+                           size_t         size,
+                           float          postgain_recip)
+{
+    switch(bd)
+    {
+        case BitDepth::SAI_16BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                fin[0][i / 2] = s162f(in[i]) * postgain_recip;
+                fin[1][i / 2] = s162f(in[i + 1]) * postgain_recip;
+                if(chns > 2)
+                {
+                    fin[2][i / 2] = s162f(in2[i]) * postgain_recip;
+                    fin[3][i / 2] = s162f(in2[i + 1]) * postgain_recip;
+                }
+            }
+            break;
+        case BitDepth::SAI_24BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                fin[0][i / 2] = s242f(in[i]) * postgain_recip;
+                fin[1][i / 2] = s242f(in[i + 1]) * postgain_recip;
+                if(chns > 2)
+                {
+                    fin[2][i / 2] = s242f(in2[i]) * postgain_recip;
+                    fin[3][i / 2] = s242f(in2[i + 1]) * postgain_recip;
+                }
+            }
+            break;
+        case BitDepth::SAI_32BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                fin[0][i / 2] = s322f(in[i]) * postgain_recip;
+                fin[1][i / 2] = s322f(in[i + 1]) * postgain_recip;
+                if(chns > 2)
+                {
+                    fin[2][i / 2] = s322f(in2[i]) * postgain_recip;
+                    fin[3][i / 2] = s322f(in2[i + 1]) * postgain_recip;
+                }
+            }
+            break;
+    }
+}
+
+void ReferenceInterleave(BitDepth bd,
+                         size_t   chns,
+                         float**  fout,
+                         int32_t* out,
+                         int32_t* out2,
+                         size_t   size,
+                         float    output_adjust)
+{
+    switch(bd)
+    {
+        case BitDepth::SAI_16BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                out[i]     = f2s16(fout[0][i / 2] * output_adjust);
+                out[i + 1] = f2s16(fout[1][i / 2] * output_adjust);
+                if(chns > 2)
+                {
+                    out2[i]     = f2s16(fout[2][i / 2] * output_adjust);
+                    out2[i + 1] = f2s16(fout[3][i / 2] * output_adjust);
+                }
+            }
+            break;
+        case BitDepth::SAI_24BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                out[i]     = f2s24(fout[0][i / 2] * output_adjust);
+                out[i + 1] = f2s24(fout[1][i / 2] * output_adjust);
+                if(chns > 2)
+                {
+                    out2[i]     = f2s24(fout[2][i / 2] * output_adjust);
+                    out2[i + 1] = f2s24(fout[3][i / 2] * output_adjust);
+                }
+            }
+            break;
+        case BitDepth::SAI_32BIT:
+            for(size_t i = 0; i < size; i += 2)
+            {
+                out[i]     = f2s32(fout[0][i / 2] * output_adjust);
+                out[i + 1] = f2s32(fout[1][i / 2] * output_adjust);
+                if(chns > 2)
+                {
+                    out2[i]     = f2s32(fout[2][i / 2] * output_adjust);
+                    out2[i + 1] = f2s32(fout[3][i / 2] * output_adjust);
+                }
+            }
+            break;
+    }
+}
+
+/** Random raw samples as the SAI would deliver them for a bit depth */
+std::vector<int32_t> MakeRawSamples(BitDepth bd, size_t size)
+{
+    std::mt19937                           rng(1234);
+    std::uniform_int_distribution<int32_t> dist;
+    std::vector<int32_t>                   result(size);
+    for(auto& s : result)
+    {
+        s = dist(rng);
+        if(bd == BitDepth::SAI_16BIT)
+            s &= 0xffff;
+        else if(bd == BitDepth::SAI_24BIT)
+            s &= 0xffffff;
+    }
+    return result;
+}
+
+/** Nanoseconds since start, for the benchmarks */
+long long ElapsedNs(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+/** A plain N-slot loop without specialization, as reference for TDM */
+void ReferenceTdmDeinterleave(BitDepth              bd,
+                              size_t                chns,
+                              size_t                slots,
+                              const int32_t* const* in,
+                              float**               out,
+                              size_t                frames,
+                              float                 gain)
+{
+    for(size_t c = 0; c < chns; c++)
+    {
+        const int32_t* src = in[c / slots];
+        for(size_t i = 0; i < frames; i++)
+        {
+            const int32_t x = src[i * slots + c % slots];
+            switch(bd)
+            {
+                case BitDepth::SAI_16BIT: out[c][i] = s162f(x) * gain; break;
+                case BitDepth::SAI_24BIT: out[c][i] = s242f(x) * gain; break;
+                case BitDepth::SAI_32BIT: out[c][i] = s322f(x) * gain; break;
+            }
+        }
+    }
+}
+
+void ReferenceTdmInterleave(BitDepth        bd,
+                            size_t          chns,
+                            size_t          slots,
+                            float**         in,
+                            int32_t* const* out,
+                            size_t          frames,
+                            float           gain)
+{
+    for(size_t c = 0; c < chns; c++)
+    {
+        int32_t* dst = out[c / slots];
+        for(size_t i = 0; i < frames; i++)
+        {
+            int32_t& x = dst[i * slots + c % slots];
+            switch(bd)
+            {
+                case BitDepth::SAI_16BIT: x = f2s16(in[c][i] * gain); break;
+                case BitDepth::SAI_24BIT: x = f2s24(in[c][i] * gain); break;
+                case BitDepth::SAI_32BIT: x = f2s32(in[c][i] * gain); break;
+            }
+        }
+    }
+}
+
+const BitDepth kBitDepths[]
+    = {BitDepth::SAI_16BIT, BitDepth::SAI_24BIT, BitDepth::SAI_32BIT};
+const size_t kBlockSize = 48; // frames
+
+} // namespace
+
+TEST(hid_AudioConvert, a_selectKernels)
+{
+    for(auto bd : kBitDepths)
+    {
+        auto k = GetAudioConversionKernels(bd, 2);
+        EXPECT_NE(k.to_float, nullptr);
+        EXPECT_NE(k.from_float, nullptr);
+        EXPECT_NE(k.deinterleave, nullptr);
+        EXPECT_NE(k.interleave, nullptr);
+        EXPECT_EQ(k.channels, 2u);
+        EXPECT_EQ(GetAudioConversionKernels(bd, 4).channels, 4u);
+
+        // unsupported channel count
+        auto none = GetAudioConversionKernels(bd, 0);
+        EXPECT_EQ(none.deinterleave, nullptr);
+        EXPECT_EQ(none.channels, 0u);
+    }
+}
+
+TEST(hid_AudioConvert, b_matchesReferenceConversion)
+{
+    const float  postgain_recip = 1.f / 0.8f;
+    const float  output_adjust  = 0.8f * 1.1f;
+    const size_t size           = kBlockSize * 2; // interleaved samples
+
+    for(auto bd : kBitDepths)
+    {
+        for(size_t chns : {2u, 4u})
+        {
+            const auto in  = MakeRawSamples(bd, size);
+            const auto in2 = MakeRawSamples(bd, size);
+
+            float  ref_buf[4][kBlockSize], new_buf[4][kBlockSize];
+            float* ref_fin[4] = {ref_buf[0], ref_buf[1], ref_buf[2], ref_buf[3]};
+            float* new_fin[4] = {new_buf[0], new_buf[1], new_buf[2], new_buf[3]};
+
+            ReferenceDeinterleave(
+                bd, chns, in.data(), in2.data(), ref_fin, size, postgain_recip);
+            auto           k     = GetAudioConversionKernels(bd, chns);
+            const int32_t* rx[2] = {in.data(), in2.data()};
+            k.deinterleave(rx, new_fin, kBlockSize, postgain_recip);
+
+            for(size_t c = 0; c < chns; c++)
+                for(size_t i = 0; i < kBlockSize; i++)
+                    ASSERT_EQ(ref_fin[c][i], new_fin[c][i]);
+
+            // use the converted input (which exceeds +-1.0 after the gain
+            // adjustment) to verify the clipping behaviour on the way out.
+            int32_t ref_out[2][kBlockSize * 2], new_out[2][kBlockSize * 2];
+            ReferenceInterleave(
+                bd, chns, ref_fin, ref_out[0], ref_out[1], size, output_adjust);
+            int32_t* tx[2] = {new_out[0], new_out[1]};
+            k.interleave(new_fin, tx, kBlockSize, output_adjust);
+
+            for(size_t s = 0; s < chns / 2; s++)
+                for(size_t i = 0; i < size; i++)
+                    ASSERT_EQ(ref_out[s][i], new_out[s][i]);
+        }
+    }
+}
+
+TEST(hid_AudioConvert, c_interleavedMatchesHelpers)
+{
+    const size_t size = kBlockSize * 2;
+    for(auto bd : kBitDepths)
+    {
+        const auto in = MakeRawSamples(bd, size);
+        auto       k  = GetAudioConversionKernels(bd, 2);
+        float      fin[size];
+        int32_t    out[size];
+        k.to_float(in.data(), fin, size, 1.f);
+        k.from_float(fin, out, size, 1.f);
+        for(size_t i = 0; i < size; i++)
+        {
+            switch(bd)
+            {
+                case BitDepth::SAI_16BIT:
+                    EXPECT_EQ(fin[i], s162f(in[i]));
+                    EXPECT_EQ(out[i], f2s16(fin[i]));
+                    break;
+                case BitDepth::SAI_24BIT:
+                    EXPECT_EQ(fin[i], s242f(in[i]));
+                    EXPECT_EQ(out[i], f2s24(fin[i]));
+                    break;
+                case BitDepth::SAI_32BIT:
+                    EXPECT_EQ(fin[i], s322f(in[i]));
+                    EXPECT_EQ(out[i], f2s32(fin[i]));
+                    break;
+            }
+        }
+    }
+}
+
+/** Host benchmark of the specialized kernels vs. the previous loops.
+ *  This doesn't assert on timing - it prints the results for comparison.
+ *  The test harness builds without optimization, so for meaningful numbers
+ *  add -O2 to COMPILE_FLAGS in the Makefile. */
+TEST(hid_AudioConvert, d_benchmarkAgainstReference)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const size_t   kIterations = 20000;
+    const size_t   size        = kBlockSize * 2;
+    const float    gain        = 0.9f;
+    volatile float sink        = 0.f;
+
+    for(auto bd : kBitDepths)
+    {
+        for(size_t chns : {2u, 4u})
+        {
+            const auto in  = MakeRawSamples(bd, size);
+            const auto in2 = MakeRawSamples(bd, size);
+            float      buf[4][kBlockSize];
+            float*     fin[4] = {buf[0], buf[1], buf[2], buf[3]};
+            int32_t    out[2][kBlockSize * 2];
+
+            auto start = Clock::now();
+            for(size_t n = 0; n < kIterations; n++)
+            {
+                ReferenceDeinterleave(
+                    bd, chns, in.data(), in2.data(), fin, size, gain);
+                ReferenceInterleave(bd, chns, fin, out[0], out[1], size, gain);
+                sink = sink + (float)out[0][n % size];
+            }
+            const auto ref_ns = ElapsedNs(start);
+
+            auto           k     = GetAudioConversionKernels(bd, chns);
+            const int32_t* rx[2] = {in.data(), in2.data()};
+            int32_t*       tx[2] = {out[0], out[1]};
+            start                = Clock::now();
+            for(size_t n = 0; n < kIterations; n++)
+            {
+                k.deinterleave(rx, fin, kBlockSize, gain);
+                k.interleave(fin, tx, kBlockSize, gain);
+                sink = sink + (float)out[0][n % size];
+            }
+            const auto new_ns = ElapsedNs(start);
+
+            printf("[ BENCH    ] %d-bit, %d ch, %d frames: reference %.1f ns/block, "
+                   "kernels %.1f ns/block\n",
+                   bd == BitDepth::SAI_16BIT   ? 16
+                   : bd == BitDepth::SAI_24BIT ? 24
+                                               : 32,
+                   (int)chns,
+                   (int)kBlockSize,
+                   (double)ref_ns / kIterations,
+                   (double)new_ns / kIterations);
+        }
+    }
+    (void)sink;
+}
+
+TEST(hid_AudioConvert, e_tdmMatchesReference)
+{
+    const float postgain_recip = 1.f / 0.8f;
+    const float output_adjust  = 0.8f * 1.1f;
+
+    for(auto bd : kBitDepths)
+    {
+        for(size_t slots : {2u, 4u, 8u, 16u})
+        {
+            for(size_t chns : {slots, slots * 2})
+            {
+                auto k = GetAudioConversionKernels(bd, chns, slots);
+                ASSERT_EQ(k.channels, chns);
+                ASSERT_EQ(k.slots, slots);
+
+                const size_t   size = kBlockSize * slots;
+                const auto     in   = MakeRawSamples(bd, size);
+                const auto     in2  = MakeRawSamples(bd, size);
+                const int32_t* rx[2] = {in.data(), in2.data()};
+
+                std::vector<float> ref_buf(32 * kBlockSize);
+                std::vector<float> new_buf(32 * kBlockSize);
+                float*             ref_fin[32];
+                float*             new_fin[32];
+                for(size_t c = 0; c < 32; c++)
+                {
+                    ref_fin[c] = &ref_buf[c * kBlockSize];
+                    new_fin[c] = &new_buf[c * kBlockSize];
+                }
+
+                ReferenceTdmDeinterleave(
+                    bd, chns, slots, rx, ref_fin, kBlockSize, postgain_recip);
+                k.deinterleave(rx, new_fin, kBlockSize, postgain_recip);
+                ASSERT_EQ(ref_buf, new_buf);
+
+                std::vector<int32_t> ref_out(2 * size), new_out(2 * size);
+                int32_t* ref_tx[2] = {&ref_out[0], &ref_out[size]};
+                int32_t* new_tx[2] = {&new_out[0], &new_out[size]};
+                ReferenceTdmInterleave(bd,
+                                       chns,
+                                       slots,
+                                       ref_fin,
+                                       ref_tx,
+                                       kBlockSize,
+                                       output_adjust);
+                k.interleave(new_fin, new_tx, kBlockSize, output_adjust);
+                ASSERT_EQ(ref_out, new_out);
+            }
+        }
+
+        // invalid slot layouts
+        EXPECT_EQ(GetAudioConversionKernels(bd, 8, 3).channels, 0u);
+        EXPECT_EQ(GetAudioConversionKernels(bd, 8, 0).channels, 0u);
+        EXPECT_EQ(GetAudioConversionKernels(bd, 12, 4).channels, 0u);
+    }
+}
+
+/** Host benchmark of the TDM kernels vs. a loop over a runtime slot count.
+ *  As above, this only prints the results. */
+TEST(hid_AudioConvert, f_benchmarkTdm)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const size_t   kIterations = 5000;
+    const float    gain        = 0.9f;
+    const BitDepth bd          = BitDepth::SAI_24BIT;
+    volatile float sink        = 0.f;
+
+    for(size_t slots : {4u, 8u, 16u})
+    {
+        for(size_t chns : {slots, slots * 2})
+        {
+            const size_t   size  = kBlockSize * slots;
+            const auto     in    = MakeRawSamples(bd, size);
+            const int32_t* rx[2] = {in.data(), in.data()};
+            std::vector<int32_t> out(2 * size);
+            int32_t*             tx[2] = {&out[0], &out[size]};
+            std::vector<float>   buf(32 * kBlockSize);
+            float*               fin[32];
+            for(size_t c = 0; c < 32; c++)
+                fin[c] = &buf[c * kBlockSize];
+
+            auto start = Clock::now();
+            for(size_t n = 0; n < kIterations; n++)
+            {
+                ReferenceTdmDeinterleave(
+                    bd, chns, slots, rx, fin, kBlockSize, gain);
+                ReferenceTdmInterleave(
+                    bd, chns, slots, fin, tx, kBlockSize, gain);
+                sink = sink + (float)out[n % size];
+            }
+            const auto ref_ns = ElapsedNs(start);
+
+            auto k = GetAudioConversionKernels(bd, chns, slots);
+            start  = Clock::now();
+            for(size_t n = 0; n < kIterations; n++)
+            {
+                k.deinterleave(rx, fin, kBlockSize, gain);
+                k.interleave(fin, tx, kBlockSize, gain);
+                sink = sink + (float)out[n % size];
+            }
+            const auto new_ns = ElapsedNs(start);
+
+            printf("[ BENCH    ] TDM %d slots, %d ch, %d frames: generic loop "
+                   "%.1f ns/block, kernels %.1f ns/block\n",
+                   (int)slots,
+                   (int)chns,
+                   (int)kBlockSize,
+                   (double)ref_ns / kIterations,
+                   (double)new_ns / kIterations);
+        }
+    }
+    (void)sink;
+}
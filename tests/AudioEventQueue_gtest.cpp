@@ -0,0 +1,204 @@
+#include <gtest/gtest.h>
+#include "util/AudioEventQueue.h"
+#include "hid/audio_simulator.h"
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using Queue = AudioEventQueue<int, 8>;
+
+std::vector<int> GetEvents(const Queue& q)
+{
+    std::vector<int> result;
+    for(size_t i = 0; i < q.GetNumEvents(); i++)
+        result.push_back(q.GetEvent(i));
+    return result;
+}
+
+std::vector<size_t> GetOffsets(const Queue& q)
+{
+    std::vector<size_t> result;
+    for(size_t i = 0; i < q.GetNumEvents(); i++)
+        result.push_back(q.GetOffset(i));
+    return result;
+}
+
+} // namespace
+
+TEST(util_AudioEventQueue, a_eventsAreSortedByTime)
+{
+    Queue q;
+    q.Init(0);
+    EXPECT_TRUE(q.Push(1, 30));
+    EXPECT_TRUE(q.Push(2, 10));
+    EXPECT_TRUE(q.Push(3, 20));
+    EXPECT_TRUE(q.Push(4, 10)); // same time as 2, stays after it
+
+    EXPECT_EQ(q.PrepareBlock(0, 48), 4u);
+    EXPECT_EQ(GetEvents(q), (std::vector<int>{2, 4, 3, 1}));
+    EXPECT_EQ(GetOffsets(q), (std::vector<size_t>{10, 10, 20, 30}));
+
+    // events are removed with the next block
+    EXPECT_EQ(q.PrepareBlock(48, 48), 0u);
+    EXPECT_EQ(q.GetNumPending(), 0u);
+}
+
+TEST(util_AudioEventQueue, b_latencyDelaysEventsByOneBlock)
+{
+    Queue q;
+    q.Init(48);
+
+    // captured while the block starting at 96 was playing
+    q.Push(1, 100);
+    q.Push(2, 143);
+    // not due yet
+    EXPECT_EQ(q.PrepareBlock(96, 48), 0u);
+    EXPECT_EQ(q.GetNumPending(), 2u);
+
+    // rendered in the next block, at the same position
+    EXPECT_EQ(q.PrepareBlock(144, 48), 2u);
+    EXPECT_EQ(GetOffsets(q), (std::vector<size_t>{4, 47}));
+
+    // an event that missed its block is rendered at the start
+    q.Push(3, 150);
+    EXPECT_EQ(q.PrepareBlock(240, 48), 1u);
+    EXPECT_EQ(q.GetOffset(0), 0u);
+
+    // events far in the future stay pending
+    q.Push(4, 1000);
+    q.Push(5, 260);
+    EXPECT_EQ(q.PrepareBlock(288, 48), 1u);
+    EXPECT_EQ(q.GetEvent(0), 5);
+    EXPECT_EQ(q.GetNumPending(), 2u);
+}
+
+TEST(util_AudioEventQueue, c_subBlocks)
+{
+    Queue q;
+    q.Init(0);
+    q.Push(1, 5);
+    q.Push(2, 5);
+    q.Push(3, 20);
+    q.Push(4, 0);
+    q.PrepareBlock(0, 32);
+
+    std::vector<std::pair<size_t, size_t>> sections;
+    std::vector<std::pair<int, size_t>>    events;
+    size_t                                 rendered = 0;
+    q.ProcessSubBlocks(
+        [&](const int& e) { events.push_back({e, rendered}); },
+        [&](size_t offset, size_t len) {
+            sections.push_back({offset, len});
+            rendered = offset + len;
+        });
+
+    using Sections = std::vector<std::pair<size_t, size_t>>;
+    using Events   = std::vector<std::pair<int, size_t>>;
+    EXPECT_EQ(sections, (Sections{{0, 5}, {5, 15}, {20, 12}}));
+    // each event is handled right before the section starting at its offset
+    EXPECT_EQ(events, (Events{{4, 0}, {1, 5}, {2, 5}, {3, 20}}));
+
+    // without events, the whole block is rendered at once
+    q.PrepareBlock(32, 32);
+    sections.clear();
+    q.ProcessSubBlocks([](const int&) {},
+                       [&](size_t offset, size_t len) {
+                           sections.push_back({offset, len});
+                       });
+    EXPECT_EQ(sections, (Sections{{0, 32}}));
+}
+
+TEST(util_AudioEventQueue, d_fullQueueDropsEvents)
+{
+    Queue q;
+    q.Init(0);
+    for(int i = 0; i < 8; i++)
+        EXPECT_TRUE(q.Push(i, 1000 + i));
+    EXPECT_FALSE(q.Push(8, 0));
+    EXPECT_EQ(q.GetNumDropped(), 1u);
+
+    // moving the events to the pending list frees the queue, but the
+    // pending list is full as well, so the next events wait in the queue.
+    EXPECT_EQ(q.PrepareBlock(0, 48), 0u);
+    for(int i = 0; i < 8; i++)
+        EXPECT_TRUE(q.Push(10 + i, i));
+    EXPECT_EQ(q.PrepareBlock(48, 48), 0u);
+    EXPECT_EQ(q.GetNumPending(), 8u);
+
+    EXPECT_EQ(q.PrepareBlock(1000, 48), 8u);
+    EXPECT_EQ(q.GetEvent(0), 0);
+    // the waiting events were late, and are placed at the block start
+    EXPECT_EQ(q.PrepareBlock(1048, 48), 8u);
+    EXPECT_EQ(q.GetEvent(0), 10);
+    EXPECT_EQ(q.GetOffset(7), 0u);
+}
+
+TEST(util_AudioEventQueue, e_sampleClockWrapsAround)
+{
+    Queue q;
+    q.Init(16);
+    q.Push(1, 5);           // after the wrap
+    q.Push(2, 0xfffffff0u); // before the wrap
+    EXPECT_EQ(q.PrepareBlock(0xfffffff8u, 32), 2u);
+    EXPECT_EQ(GetEvents(q), (std::vector<int>{2, 1}));
+    EXPECT_EQ(GetOffsets(q), (std::vector<size_t>{8, 29}));
+}
+
+namespace
+{
+AudioHandle* callback_audio;
+Queue        callback_queue;
+uint32_t     callback_clock;
+
+void ClockCallback(AudioHandle::InputBuffer  in,
+                   AudioHandle::OutputBuffer out,
+                   size_t                    size)
+{
+    (void)in;
+    (void)out;
+    callback_clock = callback_audio->GetSampleClock();
+    callback_queue.PrepareBlock(callback_clock, size);
+}
+} // namespace
+
+TEST(util_AudioEventQueue, f_audioHandleSampleClock)
+{
+    // 10 ticks per sample at 48kHz
+    System::SetTickFreqForUnitTest(480000);
+    System::SetTickForUnitTest(1000);
+
+    AudioSimulator         sim;
+    AudioSimulator::Config cfg;
+    ASSERT_EQ(sim.Init(cfg), AudioSimulator::Result::OK);
+    callback_audio = &sim.GetAudioHandle();
+    callback_queue.Init(48);
+    sim.GetAudioHandle().Start(ClockCallback);
+
+    std::vector<float> buf(48 * 2);
+    sim.Process(buf.data(), buf.data(), 48);
+    EXPECT_EQ(callback_clock, 0u);
+    EXPECT_EQ(sim.GetAudioHandle().GetSampleClock(), 0u);
+
+    // an event captured 20 samples into the first block..
+    System::SetTickForUnitTest(1000 + 20 * 10);
+    EXPECT_EQ(sim.GetAudioHandle().GetSampleTime(), 20u);
+    callback_queue.Push(7, sim.GetAudioHandle().GetSampleTime());
+
+    // ..is rendered 20 samples into the next block
+    System::SetTickForUnitTest(1000 + 48 * 10);
+    sim.Process(buf.data(), buf.data(), 48);
+    EXPECT_EQ(callback_clock, 48u);
+    ASSERT_EQ(callback_queue.GetNumEvents(), 1u);
+    EXPECT_EQ(callback_queue.GetEvent(0), 7);
+    EXPECT_EQ(callback_queue.GetOffset(0), 20u);
+
+    System::SetTickForUnitTest(1000 + 50 * 10);
+    EXPECT_EQ(sim.GetAudioHandle().GetSampleTime(), 50u);
+
+    // the clock restarts with the audio
+    sim.GetAudioHandle().Start(ClockCallback);
+    EXPECT_EQ(sim.GetAudioHandle().GetSampleClock(), 0u);
+    EXPECT_EQ(sim.GetAudioHandle().GetSampleTime(), 0u);
+}
@@ -0,0 +1,285 @@
+#include <gtest/gtest.h>
+#include "util/AudioGraph.h"
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+/** Multiplies its input by a constant and advances the tick counter */
+class GainNode : public AudioGraphNode
+{
+  public:
+    GainNode(float gain, uint32_t cost = 0) : gain_(gain), cost_(cost) {}
+
+    size_t GetNumInputs() const override { return 1; }
+    size_t GetNumOutputs() const override { return 1; }
+
+    void Process(const float* const* in, float* const* out, size_t size) override
+    {
+        for(size_t i = 0; i < size; i++)
+            out[0][i] = in[0][i] * gain_;
+        System::SetTickForUnitTest(System::GetTick() + cost_);
+        num_calls_++;
+    }
+
+    int num_calls_ = 0;
+
+  private:
+    float    gain_;
+    uint32_t cost_;
+};
+
+/** Adds its two inputs */
+class SumNode : public AudioGraphNode
+{
+  public:
+    size_t GetNumInputs() const override { return 2; }
+    size_t GetNumOutputs() const override { return 1; }
+
+    void Process(const float* const* in, float* const* out, size_t size) override
+    {
+        for(size_t i = 0; i < size; i++)
+            out[0][i] = in[0][i] + in[1][i];
+    }
+};
+
+/** Outputs a constant value on both outputs */
+class ConstNode : public AudioGraphNode
+{
+  public:
+    ConstNode(float value) : value_(value) {}
+
+    size_t GetNumInputs() const override { return 0; }
+    size_t GetNumOutputs() const override { return 2; }
+
+    void Process(const float* const*, float* const* out, size_t size) override
+    {
+        for(size_t i = 0; i < size; i++)
+            out[0][i] = out[1][i] = value_;
+    }
+
+  private:
+    float value_;
+};
+
+/** Synthetic stereo buffers for running the graph */
+struct TestBuffers
+{
+    TestBuffers(size_t size, float left, float right)
+    : in_l(size, left), in_r(size, right), out_l(size, -1.f), out_r(size, -1.f)
+    {
+        in[0]  = in_l.data();
+        in[1]  = in_r.data();
+        out[0] = out_l.data();
+        out[1] = out_r.data();
+    }
+    std::vector<float> in_l, in_r, out_l, out_r;
+    const float*       in[2];
+    float*             out[2];
+};
+
+using TestGraph = AudioGraph<16, 4, 16>;
+} // namespace
+
+TEST(util_AudioGraph, a_uncompiledGraphIsSilent)
+{
+    TestGraph   graph;
+    TestBuffers buffers(16, 1.f, 1.f);
+    graph.Process(buffers.in, buffers.out, 16);
+    for(size_t i = 0; i < 16; i++)
+    {
+        EXPECT_EQ(buffers.out_l[i], 0.f);
+        EXPECT_EQ(buffers.out_r[i], 0.f);
+    }
+}
+
+TEST(util_AudioGraph, b_processingOrderFollowsConnections)
+{
+    TestGraph graph;
+    GainNode  last(2.f), first(3.f), middle(5.f);
+    // added in reverse order
+    const int n_last   = graph.AddNode(last);
+    const int n_middle = graph.AddNode(middle);
+    const int n_first  = graph.AddNode(first);
+    ASSERT_EQ(graph.ConnectInput(0, n_first, 0), TestGraph::Result::OK);
+    ASSERT_EQ(graph.Connect(n_first, 0, n_middle, 0), TestGraph::Result::OK);
+    ASSERT_EQ(graph.Connect(n_middle, 0, n_last, 0), TestGraph::Result::OK);
+    ASSERT_EQ(graph.ConnectOutput(n_last, 0, 0), TestGraph::Result::OK);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+
+    EXPECT_EQ(graph.GetNodeAtPosition(0), n_first);
+    EXPECT_EQ(graph.GetNodeAtPosition(1), n_middle);
+    EXPECT_EQ(graph.GetNodeAtPosition(2), n_last);
+    EXPECT_EQ(graph.GetNodeAtPosition(3), -1);
+
+    TestBuffers buffers(16, 0.5f, 1.f);
+    graph.Process(buffers.in, buffers.out, 16);
+    for(size_t i = 0; i < 16; i++)
+    {
+        EXPECT_FLOAT_EQ(buffers.out_l[i], 0.5f * 3.f * 5.f * 2.f);
+        // unconnected output channel
+        EXPECT_EQ(buffers.out_r[i], 0.f);
+    }
+}
+
+TEST(util_AudioGraph, c_buffersAreReused)
+{
+    // a long chain only needs two buffers, regardless of its length
+    TestGraph graph;
+    GainNode  gains[12] = {1.f, 1.f, 1.f, 1.f, 1.f, 1.f,
+                           1.f, 1.f, 1.f, 1.f, 1.f, 2.f};
+    int       ids[12];
+    for(int i = 0; i < 12; i++)
+        ids[i] = graph.AddNode(gains[i]);
+    graph.ConnectInput(0, ids[0], 0);
+    for(int i = 1; i < 12; i++)
+        ASSERT_EQ(graph.Connect(ids[i - 1], 0, ids[i], 0),
+                  TestGraph::Result::OK);
+    graph.ConnectOutput(ids[11], 0, 0);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+    EXPECT_EQ(graph.GetNumBuffersUsed(), 2u);
+
+    TestBuffers buffers(16, 0.25f, 0.f);
+    graph.Process(buffers.in, buffers.out, 16);
+    for(size_t i = 0; i < 16; i++)
+        EXPECT_FLOAT_EQ(buffers.out_l[i], 0.5f);
+}
+
+TEST(util_AudioGraph, d_fanOutAndFanIn)
+{
+    // in0 -> a -> sum <- b <- in1, a -> out1, sum -> out0
+    TestGraph graph;
+    GainNode  a(2.f), b(3.f);
+    SumNode   sum;
+    const int n_sum = graph.AddNode(sum);
+    const int n_a   = graph.AddNode(a);
+    const int n_b   = graph.AddNode(b);
+    graph.ConnectInput(0, n_a, 0);
+    graph.ConnectInput(1, n_b, 0);
+    graph.Connect(n_a, 0, n_sum, 0);
+    graph.Connect(n_b, 0, n_sum, 1);
+    graph.ConnectOutput(n_sum, 0, 0);
+    graph.ConnectOutput(n_a, 0, 1);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+    // a writes directly to the output, b needs one buffer
+    EXPECT_EQ(graph.GetNumBuffersUsed(), 1u);
+
+    TestBuffers buffers(16, 1.f, 10.f);
+    graph.Process(buffers.in, buffers.out, 16);
+    for(size_t i = 0; i < 16; i++)
+    {
+        EXPECT_FLOAT_EQ(buffers.out_l[i], 2.f + 30.f);
+        EXPECT_FLOAT_EQ(buffers.out_r[i], 2.f);
+    }
+}
+
+TEST(util_AudioGraph, e_oneOutputToSeveralChannels)
+{
+    TestGraph graph;
+    ConstNode c(0.75f);
+    const int n = graph.AddNode(c);
+    graph.ConnectOutput(n, 1, 0);
+    graph.ConnectOutput(n, 1, 1);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+
+    TestBuffers buffers(16, 0.f, 0.f);
+    graph.Process(buffers.in, buffers.out, 16);
+    for(size_t i = 0; i < 16; i++)
+    {
+        EXPECT_EQ(buffers.out_l[i], 0.75f);
+        EXPECT_EQ(buffers.out_r[i], 0.75f);
+    }
+}
+
+TEST(util_AudioGraph, f_invalidConnections)
+{
+    TestGraph graph;
+    GainNode  a(1.f), b(1.f);
+    const int n_a = graph.AddNode(a);
+    const int n_b = graph.AddNode(b);
+    EXPECT_EQ(graph.Connect(n_a, 1, n_b, 0), TestGraph::Result::ERR_INVALID);
+    EXPECT_EQ(graph.Connect(n_a, 0, 5, 0), TestGraph::Result::ERR_INVALID);
+    EXPECT_EQ(graph.ConnectInput(2, n_a, 0), TestGraph::Result::ERR_INVALID);
+    EXPECT_EQ(graph.ConnectOutput(n_a, 0, 2), TestGraph::Result::ERR_INVALID);
+    EXPECT_EQ(graph.Connect(n_a, 0, n_b, 0), TestGraph::Result::OK);
+    EXPECT_EQ(graph.ConnectInput(0, n_b, 0), TestGraph::Result::ERR_CONNECTED);
+    EXPECT_EQ(graph.ConnectOutput(n_b, 0, 0), TestGraph::Result::OK);
+    EXPECT_EQ(graph.ConnectOutput(n_a, 0, 0), TestGraph::Result::ERR_CONNECTED);
+}
+
+TEST(util_AudioGraph, g_detectCycles)
+{
+    TestGraph graph;
+    GainNode  a(1.f), b(1.f);
+    const int n_a = graph.AddNode(a);
+    const int n_b = graph.AddNode(b);
+    graph.Connect(n_a, 0, n_b, 0);
+    graph.Connect(n_b, 0, n_a, 0);
+    EXPECT_EQ(graph.Compile(), TestGraph::Result::ERR_CYCLE);
+}
+
+TEST(util_AudioGraph, h_notEnoughBuffers)
+{
+    // two outputs that are summed up need two buffers
+    using SmallGraph = AudioGraph<8, 1, 16>;
+    SmallGraph graph;
+    ConstNode  c(1.f);
+    SumNode    sum;
+    const int  n_c   = graph.AddNode(c);
+    const int  n_sum = graph.AddNode(sum);
+    graph.Connect(n_c, 0, n_sum, 0);
+    graph.Connect(n_c, 1, n_sum, 1);
+    graph.ConnectOutput(n_sum, 0, 0);
+    EXPECT_EQ(graph.Compile(), SmallGraph::Result::ERR_BUFFERS);
+}
+
+TEST(util_AudioGraph, i_largeBlocksAreSplit)
+{
+    TestGraph graph;
+    GainNode  a(2.f);
+    const int n_a = graph.AddNode(a);
+    graph.ConnectInput(0, n_a, 0);
+    graph.ConnectOutput(n_a, 0, 0);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+
+    TestBuffers buffers(40, 1.f, 0.f);
+    for(size_t i = 0; i < 40; i++)
+        buffers.in_l[i] = float(i);
+    graph.Process(buffers.in, buffers.out, 40);
+    EXPECT_EQ(a.num_calls_, 3);
+    for(size_t i = 0; i < 40; i++)
+        EXPECT_FLOAT_EQ(buffers.out_l[i], 2.f * float(i));
+}
+
+TEST(util_AudioGraph, j_nodeTicks)
+{
+    TestGraph graph;
+    GainNode  cheap(1.f, 10), expensive(1.f, 100);
+    const int n_cheap     = graph.AddNode(cheap);
+    const int n_expensive = graph.AddNode(expensive);
+    graph.ConnectInput(0, n_cheap, 0);
+    graph.Connect(n_cheap, 0, n_expensive, 0);
+    graph.ConnectOutput(n_expensive, 0, 0);
+    ASSERT_EQ(graph.Compile(), TestGraph::Result::OK);
+
+    System::SetTickForUnitTest(1000);
+    TestBuffers buffers(16, 1.f, 0.f);
+    graph.Process(buffers.in, buffers.out, 16);
+
+    EXPECT_EQ(graph.GetNodeTicks(n_cheap), 10u);
+    EXPECT_EQ(graph.GetNodeTicks(n_expensive), 100u);
+    EXPECT_EQ(graph.GetMostExpensiveNode(), n_expensive);
+
+    // a block larger than the scratch buffers counts all of its sub-blocks
+    TestBuffers large(40, 1.f, 0.f);
+    graph.Process(large.in, large.out, 40);
+    EXPECT_EQ(graph.GetNodeTicks(n_cheap), 30u);
+    EXPECT_EQ(graph.GetNodeTicks(n_expensive), 300u);
+    graph.Process(buffers.in, buffers.out, 16);
+    EXPECT_EQ(graph.GetNodeTicks(n_expensive), 100u);
+    EXPECT_EQ(graph.GetNodeMaxTicks(n_expensive), 300u);
+
+    graph.ResetNodeTicks();
+    EXPECT_EQ(graph.GetNodeMaxTicks(n_expensive), 0u);
+}
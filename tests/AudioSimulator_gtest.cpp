@@ -0,0 +1,313 @@
+#include <gtest/gtest.h>
+#include "hid/audio_simulator.h"
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using BitDepth = SaiHandle::Config::BitDepth;
+
+// what the float callbacks received in the last block
+float  last_in[4];
+size_t last_size;
+
+void PassThrough(AudioHandle::InputBuffer  in,
+                 AudioHandle::OutputBuffer out,
+                 size_t                    size)
+{
+    for(size_t c = 0; c < 4; c++)
+        last_in[c] = in[c][size - 1];
+    last_size = size;
+    for(size_t i = 0; i < size; i++)
+    {
+        out[0][i] = in[0][i];
+        out[1][i] = in[1][i];
+    }
+}
+
+void PassThrough4(AudioHandle::InputBuffer  in,
+                  AudioHandle::OutputBuffer out,
+                  size_t                    size)
+{
+    // each channel is scaled differently, to verify the routing
+    for(size_t c = 0; c < 4; c++)
+        for(size_t i = 0; i < size; i++)
+            out[c][i] = in[c][i] * (0.25f * (c + 1));
+}
+
+void InterleavedPassThrough(AudioHandle::InterleavingInputBuffer  in,
+                            AudioHandle::InterleavingOutputBuffer out,
+                            size_t                                size)
+{
+    last_size = size;
+    for(size_t i = 0; i < size; i++)
+        out[i] = in[i];
+}
+
+float Ramp(size_t frame, size_t channel)
+{
+    return float(int(frame % 200) - 100) / 128.f * (channel % 2 ? -1.f : 1.f);
+}
+
+AudioSimulator::Config MakeConfig(BitDepth bd, size_t chns, size_t blocksize)
+{
+    AudioSimulator::Config cfg;
+    cfg.bit_depth       = bd;
+    cfg.channels        = chns;
+    cfg.audio.blocksize = blocksize;
+    return cfg;
+}
+
+} // namespace
+
+TEST(hid_AudioSimulator, a_passThroughAtAllBitDepths)
+{
+    const BitDepth bit_depths[]
+        = {BitDepth::SAI_16BIT, BitDepth::SAI_24BIT, BitDepth::SAI_32BIT};
+    const int bits[] = {16, 24, 32};
+    for(size_t b = 0; b < 3; b++)
+    {
+        AudioSimulator sim;
+        ASSERT_EQ(sim.Init(MakeConfig(bit_depths[b], 2, 48)),
+                  AudioSimulator::Result::OK);
+        sim.GetAudioHandle().Start(PassThrough);
+
+        const auto out = sim.ProcessSignal(Ramp, 1000);
+        ASSERT_EQ(out.size(), 2000u);
+        // Input and output are both quantized, and f2s16 scales by
+        // 2^15 - 1, so allow up to one LSB of error for each direction.
+        const float lsb = 1.f / float(1UL << (bits[b] - 1));
+        for(size_t i = 0; i < 1000; i++)
+        {
+            ASSERT_NEAR(out[i * 2], Ramp(i, 0), 2 * lsb);
+            ASSERT_NEAR(out[i * 2 + 1], Ramp(i, 1), 2 * lsb);
+        }
+    }
+}
+
+TEST(hid_AudioSimulator, b_blockSizeAndPartialBlocks)
+{
+    AudioSimulator sim;
+    ASSERT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 2, 32)),
+              AudioSimulator::Result::OK);
+    sim.GetAudioHandle().Start(PassThrough);
+
+    // 100 frames = 3 full blocks and one padded one
+    const auto out = sim.ProcessSignal(Ramp, 100);
+    EXPECT_EQ(last_size, 32u);
+    EXPECT_EQ(sim.GetNumBlocks(), 4u);
+    EXPECT_EQ(sim.GetNumFrames(), 100u);
+    EXPECT_EQ(out.size(), 200u);
+    EXPECT_NEAR(out[99 * 2], Ramp(99, 0), 1e-6f);
+    EXPECT_EQ(sim.GetAudioHandle().GetCallbackMonitor().GetNumCallbacks(), 4u);
+
+    // the interleaving callback receives all samples of a block
+    sim.GetAudioHandle().ChangeCallback(InterleavedPassThrough);
+    const auto out2 = sim.ProcessSignal(Ramp, 64);
+    EXPECT_EQ(last_size, 64u);
+    for(size_t i = 0; i < 64; i++)
+        EXPECT_NEAR(out2[i * 2 + 1], Ramp(i, 1), 1e-6f);
+
+    sim.ResetStats();
+    EXPECT_EQ(sim.GetNumBlocks(), 0u);
+}
+
+TEST(hid_AudioSimulator, c_postgainAndOutputCompensation)
+{
+    AudioSimulator::Config cfg    = MakeConfig(BitDepth::SAI_24BIT, 2, 48);
+    cfg.audio.postgain            = 0.5f;
+    cfg.audio.output_compensation = 1.5f;
+    AudioSimulator sim;
+    ASSERT_EQ(sim.Init(cfg), AudioSimulator::Result::OK);
+    sim.GetAudioHandle().Start(PassThrough);
+
+    const auto out
+        = sim.ProcessSignal([](size_t, size_t) { return 0.25f; }, 48);
+    // the callback sees the input divided by the postgain..
+    EXPECT_FLOAT_EQ(last_in[0], 0.5f);
+    // ..and the output is scaled by postgain * output_compensation
+    for(size_t i = 0; i < 96; i++)
+        EXPECT_FLOAT_EQ(out[i], 0.25f / 0.5f * 0.5f * 1.5f);
+
+    // changes at runtime take effect with the next block
+    sim.GetAudioHandle().SetPostGain(0.25f);
+    sim.GetAudioHandle().SetOutputCompensation(1.f);
+    const auto out2
+        = sim.ProcessSignal([](size_t, size_t) { return 0.125f; }, 48);
+    EXPECT_FLOAT_EQ(last_in[0], 0.5f);
+    EXPECT_FLOAT_EQ(out2[0], 0.125f);
+
+    // the output is clipped after scaling, like on the hardware
+    sim.GetAudioHandle().SetOutputCompensation(4.f);
+    const auto out3
+        = sim.ProcessSignal([](size_t, size_t) { return 0.5f; }, 48);
+    EXPECT_LT(out3[0], 1.f);
+    EXPECT_GT(out3[0], 0.999f);
+}
+
+TEST(hid_AudioSimulator, d_fourChannels)
+{
+    AudioSimulator sim;
+    EXPECT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 3, 48)),
+              AudioSimulator::Result::ERR);
+    ASSERT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 4, 48)),
+              AudioSimulator::Result::OK);
+    EXPECT_EQ(sim.GetAudioHandle().GetChannels(), 4u);
+    sim.GetAudioHandle().Start(PassThrough4);
+
+    const auto out = sim.ProcessSignal(
+        [](size_t i, size_t c) { return 0.5f - 0.1f * c + 0.001f * i; }, 200);
+    for(size_t i = 0; i < 200; i++)
+        for(size_t c = 0; c < 4; c++)
+            ASSERT_NEAR(out[i * 4 + c],
+                        (0.5f - 0.1f * c + 0.001f * i) * 0.25f * (c + 1),
+                        1e-6f);
+
+    // going back to stereo drops the second SAI
+    ASSERT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 2, 48)),
+              AudioSimulator::Result::OK);
+    EXPECT_EQ(sim.GetAudioHandle().GetChannels(), 2u);
+}
+
+namespace
+{
+size_t tdm_channels;
+
+void TdmCallback(AudioHandle::InputBuffer  in,
+                 AudioHandle::OutputBuffer out,
+                 size_t                    size)
+{
+    // reverse the channel order, scaled by the input channel
+    for(size_t c = 0; c < tdm_channels; c++)
+        for(size_t i = 0; i < size; i++)
+            out[tdm_channels - 1 - c][i] = in[c][i] * (1.f / (c + 1));
+}
+} // namespace
+
+TEST(hid_AudioSimulator, e_tdmChannels)
+{
+    using Slots = SaiHandle::Config::FrameSlots;
+    const Slots  slot_modes[] = {Slots::TDM_4, Slots::TDM_8, Slots::TDM_16};
+    const size_t num_slots[]  = {4, 8, 16};
+
+    for(size_t m = 0; m < 3; m++)
+    {
+        for(size_t num_sai = 1; num_sai <= 2; num_sai++)
+        {
+            const size_t chns = num_slots[m] * num_sai;
+            auto         cfg  = MakeConfig(BitDepth::SAI_24BIT, chns, 32);
+            cfg.slots         = slot_modes[m];
+            AudioSimulator sim;
+            ASSERT_EQ(sim.Init(cfg), AudioSimulator::Result::OK);
+            EXPECT_EQ(sim.GetAudioHandle().GetChannels(), chns);
+            tdm_channels = chns;
+            sim.GetAudioHandle().Start(TdmCallback);
+
+            auto signal = [](size_t i, size_t c) {
+                return 0.5f * ((i + c) % 3) - 0.5f;
+            };
+            const auto out = sim.ProcessSignal(signal, 100);
+            for(size_t i = 0; i < 100; i++)
+                for(size_t c = 0; c < chns; c++)
+                    ASSERT_NEAR(out[i * chns + chns - 1 - c],
+                                signal(i, c) / (c + 1),
+                                1e-6f);
+        }
+    }
+
+    // the block size is limited by the DMA buffer
+    auto cfg            = MakeConfig(BitDepth::SAI_24BIT, 16, 48);
+    cfg.slots           = Slots::TDM_16;
+    AudioSimulator sim;
+    EXPECT_EQ(sim.Init(cfg), AudioSimulator::Result::ERR);
+    cfg.audio.blocksize = 32;
+    ASSERT_EQ(sim.Init(cfg), AudioSimulator::Result::OK);
+    EXPECT_EQ(sim.GetAudioHandle().SetBlockSize(33), AudioHandle::Result::ERR);
+
+    // channel count doesn't match the slots
+    cfg.channels = 6;
+    EXPECT_EQ(sim.Init(cfg), AudioSimulator::Result::ERR);
+}
+
+TEST(hid_AudioSimulator, f_wavFileRoundTrip)
+{
+    const char* in_path  = "AudioSimulator_in.wav";
+    const char* out_path = "AudioSimulator_out.wav";
+
+    // 16-bit PCM stereo input file
+    const size_t frames = 300;
+    {
+        FILE* f = fopen(in_path, "wb");
+        ASSERT_NE(f, nullptr);
+        const uint32_t    data_size = frames * 2 * 2;
+        WAV_FormatTypeDef h;
+        h.ChunkId       = kWavFileChunkId;
+        h.FileSize      = sizeof(h) - 8 + data_size;
+        h.FileFormat    = kWavFileWaveId;
+        h.SubChunk1ID   = kWavFileSubChunk1Id;
+        h.SubChunk1Size = 16;
+        h.AudioFormat   = WAVE_FORMAT_PCM;
+        h.NbrChannels   = 2;
+        h.SampleRate    = 48000;
+        h.ByteRate      = 48000 * 4;
+        h.BlockAlign    = 4;
+        h.BitPerSample  = 16;
+        h.SubChunk2ID   = kWavFileSubChunk2Id;
+        h.SubCHunk2Size = data_size;
+        fwrite(&h, sizeof(h), 1, f);
+        for(size_t i = 0; i < frames * 2; i++)
+        {
+            const int16_t s = int16_t(i * 100 - 30000);
+            fwrite(&s, 2, 1, f);
+        }
+        fclose(f);
+    }
+
+    AudioSimulator sim;
+    ASSERT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 2, 48)),
+              AudioSimulator::Result::OK);
+    sim.GetAudioHandle().Start(PassThrough);
+    ASSERT_EQ(sim.ProcessWavFile(in_path, out_path),
+              AudioSimulator::Result::OK);
+    EXPECT_EQ(sim.GetNumFrames(), frames);
+
+    std::vector<float> result;
+    size_t             chns = 0;
+    uint32_t           sr   = 0;
+    ASSERT_TRUE(AudioSimulator::ReadWavFile(out_path, result, chns, sr));
+    EXPECT_EQ(chns, 2u);
+    EXPECT_EQ(sr, 48000u);
+    ASSERT_EQ(result.size(), frames * 2);
+    // 16-bit input passes through a 24-bit codec unchanged
+    for(size_t i = 0; i < frames * 2; i++)
+        ASSERT_EQ(result[i], float(int16_t(i * 100 - 30000)) / 32768.f);
+
+    EXPECT_EQ(sim.ProcessWavFile("does_not_exist.wav", out_path),
+              AudioSimulator::Result::ERR);
+    remove(in_path);
+    remove(out_path);
+}
+
+/** Prints how much faster than real time a simple callback runs.
+ *  This doesn't assert on timing. */
+TEST(hid_AudioSimulator, g_realtimeFactor)
+{
+    AudioSimulator sim;
+    ASSERT_EQ(sim.Init(MakeConfig(BitDepth::SAI_24BIT, 4, 48)),
+              AudioSimulator::Result::OK);
+    sim.GetAudioHandle().Start(PassThrough4);
+
+    const size_t       frames = 48000;
+    std::vector<float> in(frames * 4), out(frames * 4);
+    for(size_t i = 0; i < in.size(); i++)
+        in[i] = std::sin(i * 0.01f) * 0.5f;
+    sim.Process(in.data(), out.data(), frames);
+
+    EXPECT_EQ(sim.GetNumBlocks(), frames / 48);
+    EXPECT_GT(sim.GetElapsedSeconds(), 0.0);
+    printf("[ BENCH    ] 4 ch, 48 frames: %.1fx real time\n",
+           sim.GetRealtimeFactor());
+}
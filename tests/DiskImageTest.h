@@ -0,0 +1,101 @@
+#pragma once
+#include <gtest/gtest.h>
+#include "util/host_diskio.h"
+#include "util/wav_format.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/** A test with a disk image file of its own in the temp directory, which
+ *  is removed after the test. The HostDiskio that uses it is up to the
+ *  test.
+ */
+class DiskImageTest : public ::testing::Test
+{
+  protected:
+    DiskImageTest()
+    {
+        const ::testing::TestInfo* test
+            = ::testing::UnitTest::GetInstance()->current_test_info();
+        image_path_ = ::testing::TempDir() + test->test_suite_name() + "."
+                      + test->name() + ".img";
+    }
+
+    void TearDown() override { std::remove(image_path_.c_str()); }
+
+    const char* GetImagePath() const { return image_path_.c_str(); }
+
+  private:
+    std::string image_path_;
+};
+
+/** A test on a formatted 64 MB image, which is mounted as "0:/" */
+class FormattedDiskTest : public DiskImageTest
+{
+  protected:
+    void SetUp() override
+    {
+        ASSERT_TRUE(daisy::HostDiskio::CreateImage(GetImagePath(), 64 << 20));
+        ASSERT_TRUE(disk_.Init(GetImagePath()));
+        ASSERT_TRUE(disk_.Format());
+    }
+
+    void TearDown() override
+    {
+        disk_.DeInit();
+        DiskImageTest::TearDown();
+    }
+
+    daisy::HostDiskio disk_;
+};
+
+/** Appends a little endian 16-bit value */
+inline void Add16(std::vector<uint8_t>& bytes, uint16_t x)
+{
+    bytes.push_back(x & 0xff);
+    bytes.push_back(x >> 8);
+}
+
+/** Appends a little endian 32-bit value */
+inline void Add32(std::vector<uint8_t>& bytes, uint32_t x)
+{
+    Add16(bytes, x & 0xffff);
+    Add16(bytes, x >> 16);
+}
+
+/** Appends the 44 byte header of a PCM file
+ *  \param chunks_size bytes of the chunks after the sample data
+ */
+inline void AddWavHeader(std::vector<uint8_t>& bytes,
+                         uint16_t              channels,
+                         uint16_t              bits,
+                         uint32_t              samplerate,
+                         uint32_t              data_size,
+                         uint32_t              chunks_size = 0)
+{
+    Add32(bytes, daisy::kWavFileChunkId);
+    Add32(bytes, 36 + data_size + chunks_size);
+    Add32(bytes, daisy::kWavFileWaveId);
+    Add32(bytes, daisy::kWavFileSubChunk1Id);
+    Add32(bytes, 16);
+    Add16(bytes, daisy::WAVE_FORMAT_PCM);
+    Add16(bytes, channels);
+    Add32(bytes, samplerate);
+    Add32(bytes, samplerate * channels * bits / 8);
+    Add16(bytes, channels * bits / 8);
+    Add16(bytes, bits);
+    Add32(bytes, daisy::kWavFileSubChunk2Id);
+    Add32(bytes, data_size);
+}
+
+/** Writes a file on the mounted disk */
+inline void WriteDiskFile(const char* path, const std::vector<uint8_t>& bytes)
+{
+    FIL file;
+    ASSERT_EQ(f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE), FR_OK);
+    UINT bytes_written = 0;
+    ASSERT_EQ(f_write(&file, bytes.data(), bytes.size(), &bytes_written),
+              FR_OK);
+    ASSERT_EQ(bytes_written, bytes.size());
+    ASSERT_EQ(f_close(&file), FR_OK);
+}
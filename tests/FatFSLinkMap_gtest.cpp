@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+#include "sys/fatfs.h"
+#include "DiskImageTest.h"
+#include "sys/system.h"
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+uint32_t ClusterBytes()
+{
+    DWORD  free_clusters = 0;
+    FATFS* fs            = nullptr;
+    f_getfree("0:/", &free_clusters, &fs);
+    return fs != nullptr ? fs->csize * 512 : 0;
+}
+
+uint8_t Byte(uint32_t position, size_t seed)
+{
+    return uint8_t((position >> 8) * 31 + position + seed * 7);
+}
+
+/** Writes files a cluster at a time in turns, so that every cluster is a
+ *  fragment of its file
+ */
+void WriteInterleaved(const char* const* paths,
+                      size_t             num_files,
+                      uint32_t           num_clusters)
+{
+    const uint32_t       cluster = ClusterBytes();
+    std::vector<FIL>     files(num_files);
+    std::vector<uint8_t> data(cluster);
+    for(size_t f = 0; f < num_files; f++)
+        ASSERT_EQ(f_open(&files[f], paths[f], FA_CREATE_ALWAYS | FA_WRITE),
+                  FR_OK);
+    for(uint32_t n = 0; n < num_clusters; n++)
+    {
+        for(size_t f = 0; f < num_files; f++)
+        {
+            for(uint32_t i = 0; i < cluster; i++)
+                data[i] = Byte(n * cluster + i, f);
+            UINT bytes_written = 0;
+            ASSERT_EQ(f_write(&files[f], data.data(), cluster, &bytes_written),
+                      FR_OK);
+        }
+    }
+    for(FIL& file : files)
+        ASSERT_EQ(f_close(&file), FR_OK);
+}
+
+/** Reads a few bytes at positions all over a file, and checks them */
+void CheckRandomReads(FatFSLinkMapPool& pool, FIL* file, size_t seed)
+{
+    const uint32_t size     = f_size(file);
+    uint32_t       position = 12345;
+    for(int n = 0; n < 200; n++)
+    {
+        position = (position * 1103515245u + 12345u) % size;
+        ASSERT_EQ(pool.Seek(file, position), FR_OK);
+        uint8_t data[16];
+        UINT    bytes_read = 0;
+        ASSERT_EQ(f_read(file, data, sizeof(data), &bytes_read), FR_OK);
+        for(UINT i = 0; i < bytes_read; i++)
+            ASSERT_EQ(data[i], Byte(position + i, seed))
+                << "at byte " << position + i;
+    }
+}
+
+class sys_FatFSLinkMapPool : public FormattedDiskTest
+{
+};
+
+} // namespace
+
+TEST_F(sys_FatFSLinkMapPool, a_mapsAFragmentedFile)
+{
+    const char* const paths[] = {"0:/a.bin", "0:/b.bin"};
+    WriteInterleaved(paths, 2, 50);
+
+    DWORD            words[256];
+    FatFSLinkMapPool pool;
+    pool.Init(words, 256);
+    FIL a, b;
+    ASSERT_EQ(pool.Open(&a, "0:/a.bin"), FR_OK);
+    ASSERT_EQ(pool.Open(&b, "0:/b.bin"), FR_OK);
+    EXPECT_TRUE(pool.HasLinkMap(&a));
+    EXPECT_TRUE(pool.HasLinkMap(&b));
+    // 2 words per fragment, and 2
+    EXPECT_EQ(pool.GetFreeWords(), 256u - 2 * (2 * 50 + 2));
+
+    // the map replaces the FAT, each read takes at most the two data
+    // sectors it spans
+    disk_.ResetStats();
+    CheckRandomReads(pool, &a, 0);
+    CheckRandomReads(pool, &b, 1);
+    EXPECT_LE(disk_.GetStats().sectors_read, 2u * 2 * 200);
+    EXPECT_EQ(pool.GetSeekStats().count, 400u);
+
+    EXPECT_EQ(pool.Close(&a), FR_OK);
+    EXPECT_EQ(pool.GetFreeWords(), 256u - (2 * 50 + 2));
+    EXPECT_EQ(pool.Close(&b), FR_OK);
+    EXPECT_EQ(pool.GetFreeWords(), 256u);
+}
+
+TEST_F(sys_FatFSLinkMapPool, b_fallsBackWithoutRoom)
+{
+    const char* const paths[] = {"0:/a.bin", "0:/b.bin"};
+    WriteInterleaved(paths, 2, 50);
+    const char* const contiguous[] = {"0:/c.bin"};
+    WriteInterleaved(contiguous, 1, 50);
+
+    DWORD            words[64];
+    FatFSLinkMapPool pool;
+    pool.Init(words, 64);
+    FIL a, c;
+    ASSERT_EQ(pool.Open(&a, "0:/a.bin"), FR_OK);
+    EXPECT_FALSE(pool.HasLinkMap(&a));
+    EXPECT_FALSE(pool.HasLinkMap(nullptr));
+    EXPECT_EQ(pool.Attach(&a), FR_NOT_ENOUGH_CORE);
+    EXPECT_EQ(pool.GetFreeWords(), 64u);
+    CheckRandomReads(pool, &a, 0);
+
+    // a file in one piece takes 4 words
+    ASSERT_EQ(pool.Open(&c, "0:/c.bin"), FR_OK);
+    EXPECT_TRUE(pool.HasLinkMap(&c));
+    EXPECT_EQ(pool.GetFreeWords(), 60u);
+    CheckRandomReads(pool, &c, 0);
+    pool.Close(&a);
+    pool.Close(&c);
+}
+
+TEST_F(sys_FatFSLinkMapPool, c_reusesFreedMemory)
+{
+    const char* const paths[] = {"0:/a.bin", "0:/b.bin"};
+    WriteInterleaved(paths, 2, 10);
+    const char* const contiguous[] = {"0:/c.bin"};
+    WriteInterleaved(contiguous, 1, 2);
+
+    // as many files as there are slots
+    DWORD            words[80];
+    FatFSLinkMapPool pool;
+    pool.Init(words, 80);
+    FIL files[FatFSLinkMapPool::kMaxFiles + 1];
+    for(FIL& file : files)
+        ASSERT_EQ(pool.Open(&file, "0:/c.bin"), FR_OK);
+    for(size_t i = 0; i < FatFSLinkMapPool::kMaxFiles; i++)
+        EXPECT_TRUE(pool.HasLinkMap(&files[i]));
+    EXPECT_FALSE(pool.HasLinkMap(&files[FatFSLinkMapPool::kMaxFiles]));
+    EXPECT_EQ(pool.GetFreeWords(), 80u - 4 * FatFSLinkMapPool::kMaxFiles);
+
+    // a fragmented file only fits into the gap of the closed files
+    for(size_t i = 4; i < 12; i++)
+        pool.Close(&files[i]);
+    FIL a;
+    ASSERT_EQ(pool.Open(&a, "0:/a.bin"), FR_OK);
+    EXPECT_TRUE(pool.HasLinkMap(&a));
+    EXPECT_EQ(pool.GetFreeWords(), 80u - 4 * 8 - (2 * 10 + 2));
+    CheckRandomReads(pool, &a, 0);
+    for(size_t i = 0; i < 4; i++)
+        CheckRandomReads(pool, &files[i], 0);
+    for(size_t i = 12; i < FatFSLinkMapPool::kMaxFiles; i++)
+        CheckRandomReads(pool, &files[i], 0);
+
+    pool.Close(&a);
+    for(FIL& file : files)
+        pool.Close(&file);
+    EXPECT_EQ(pool.GetFreeWords(), 80u);
+}
+
+/** Seeks from the start of a file of 2000 fragments on a simulated SD card,
+ *  with and without a link map. Without one, the seek reads the FAT up to
+ *  the position. Both read the data sector at the position.
+ */
+TEST_F(sys_FatFSLinkMapPool, d_benchmarkSeekTime)
+{
+    const char* const paths[] = {"0:/a.bin", "0:/b.bin"};
+    WriteInterleaved(paths, 2, 2000);
+    disk_.SetConfig(HostDiskio::Config::SdCard());
+
+    std::vector<DWORD> words(4096);
+    FatFSLinkMapPool   pool;
+    pool.Init(words.data(), words.size());
+    FIL file;
+    ASSERT_EQ(f_open(&file, "0:/a.bin", FA_READ), FR_OK);
+    const uint32_t size = f_size(&file);
+    printf("[ BENCH    ] seek in 2000 fragments, position:");
+    for(int tenth = 1; tenth <= 10; tenth++)
+        printf(" %5d%%", tenth * 10);
+    for(int mapped = 0; mapped < 2; mapped++)
+    {
+        if(mapped)
+        {
+            ASSERT_EQ(pool.Attach(&file), FR_OK);
+        }
+        printf("\n[ BENCH    ] %s, us:          ",
+               mapped ? "link map" : "FAT     ");
+        for(int tenth = 1; tenth <= 10; tenth++)
+        {
+            // from the start of the file
+            ASSERT_EQ(pool.Seek(&file, 0), FR_OK);
+            pool.ResetSeekStats();
+            ASSERT_EQ(pool.Seek(&file, uint64_t(size) * tenth / 10 - 1000),
+                      FR_OK);
+            printf(" %6d", int(pool.GetSeekStats().max_us));
+        }
+    }
+    printf("\n");
+    pool.Close(&file);
+    disk_.SetConfig(HostDiskio::Config());
+}
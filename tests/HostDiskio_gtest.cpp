@@ -0,0 +1,247 @@
+#include <gtest/gtest.h>
+#include "DiskImageTest.h"
+#include "daisy_core.h"
+#include "util/wav_format.h"
+#include "util/WavWriter.h"
+#include "sys/system.h"
+#include <memory>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+const uint64_t kImageSize = 8 << 20;
+
+void WritePattern(const char* path, size_t size, uint8_t seed)
+{
+    FIL file;
+    ASSERT_EQ(f_open(&file, path, FA_CREATE_ALWAYS | FA_WRITE), FR_OK);
+    std::vector<uint8_t> data(size);
+    for(size_t i = 0; i < size; i++)
+        data[i] = uint8_t(i * 7 + seed);
+    UINT bytes_written = 0;
+    EXPECT_EQ(f_write(&file, data.data(), size, &bytes_written), FR_OK);
+    EXPECT_EQ(bytes_written, size);
+    EXPECT_EQ(f_close(&file), FR_OK);
+}
+
+class util_HostDiskio : public DiskImageTest
+{
+};
+
+} // namespace
+
+TEST_F(util_HostDiskio, a_formatsAndMounts)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    EXPECT_STREQ(disk.GetPath(), "0:/");
+
+    // a blank image has no file system yet
+    DIR dir;
+    EXPECT_NE(f_opendir(&dir, "0:/"), FR_OK);
+
+    ASSERT_TRUE(disk.Format());
+    DWORD  free_clusters = 0;
+    FATFS* fs            = nullptr;
+    ASSERT_EQ(f_getfree("0:/", &free_clusters, &fs), FR_OK);
+    EXPECT_GT(uint64_t(free_clusters) * fs->csize * 512, kImageSize * 9 / 10);
+    EXPECT_LE(uint64_t(free_clusters) * fs->csize * 512, kImageSize);
+}
+
+TEST_F(util_HostDiskio, b_keepsFilesInTheImage)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    {
+        HostDiskio disk;
+        ASSERT_TRUE(disk.Init(GetImagePath()));
+        ASSERT_TRUE(disk.Format());
+        WritePattern("0:/first.bin", 100000, 1);
+        WritePattern("0:/A long file name.bin", 1000, 2);
+    }
+
+    // mounted again from the image file
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    FIL file;
+    ASSERT_EQ(f_open(&file, "0:/first.bin", FA_READ), FR_OK);
+    EXPECT_EQ(f_size(&file), 100000u);
+    std::vector<uint8_t> data(100000);
+    UINT                 bytes_read = 0;
+    EXPECT_EQ(f_read(&file, data.data(), data.size(), &bytes_read), FR_OK);
+    EXPECT_EQ(bytes_read, data.size());
+    for(size_t i = 0; i < data.size(); i++)
+        ASSERT_EQ(data[i], uint8_t(i * 7 + 1)) << "at byte " << i;
+    EXPECT_EQ(f_close(&file), FR_OK);
+
+    // names are kept with their case, and found without it
+    FILINFO info;
+    ASSERT_EQ(f_stat("0:/a long file NAME.bin", &info), FR_OK);
+    EXPECT_EQ(info.fsize, 1000u);
+    DIR dir;
+    ASSERT_EQ(f_opendir(&dir, "0:/"), FR_OK);
+    ASSERT_EQ(f_readdir(&dir, &info), FR_OK);
+    EXPECT_STREQ(info.fname, "first.bin");
+    ASSERT_EQ(f_readdir(&dir, &info), FR_OK);
+    EXPECT_STREQ(info.fname, "A long file name.bin");
+    EXPECT_EQ(f_closedir(&dir), FR_OK);
+}
+
+TEST_F(util_HostDiskio, c_countsCommandsAndSectors)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    ASSERT_TRUE(disk.Format());
+    WritePattern("0:/data.bin", 64 * 512, 0);
+
+    // a sector aligned read is a multi sector command per cluster, and the
+    // FAT sector of the chain is read once
+    FIL file;
+    ASSERT_EQ(f_open(&file, "0:/data.bin", FA_READ), FR_OK);
+    const UINT cluster = file.obj.fs->csize;
+    disk.ResetStats();
+    std::vector<uint8_t> data(32 * 512);
+    UINT                 bytes_read = 0;
+    ASSERT_EQ(f_read(&file, data.data(), data.size(), &bytes_read), FR_OK);
+    EXPECT_EQ(disk.GetStats().read_commands, 32 / cluster + 1);
+    EXPECT_EQ(disk.GetStats().sectors_read, 32u + 1);
+    EXPECT_EQ(disk.GetStats().write_commands, 0u);
+
+    // an unaligned small read goes through the sector buffer of the file
+    ASSERT_EQ(f_lseek(&file, 40 * 512 + 3), FR_OK);
+    ASSERT_EQ(f_read(&file, data.data(), 10, &bytes_read), FR_OK);
+    EXPECT_EQ(disk.GetStats().read_commands, 32 / cluster + 2);
+    EXPECT_EQ(disk.GetStats().sectors_read, 32u + 2);
+    EXPECT_EQ(f_close(&file), FR_OK);
+
+    ASSERT_EQ(f_open(&file, "0:/data.bin", FA_WRITE), FR_OK);
+    UINT bytes_written = 0;
+    ASSERT_EQ(f_write(&file, data.data(), 8 * 512, &bytes_written), FR_OK);
+    EXPECT_EQ(disk.GetStats().sectors_written, 8u);
+    EXPECT_EQ(f_close(&file), FR_OK);
+    EXPECT_GT(disk.GetStats().ioctl_commands, 0u);
+}
+
+TEST_F(util_HostDiskio, d_advancesTheTimeOfEachCommand)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    ASSERT_TRUE(disk.Format());
+
+    HostDiskio::Config config;
+    config.read_latency_us  = 100;
+    config.read_bandwidth   = 512000; // 1 ms per sector
+    config.write_latency_us = 300;
+    config.write_bandwidth  = 256000; // 2 ms per sector
+    config.stall_interval   = 3;
+    config.stall_us         = 10000;
+    disk.SetConfig(config);
+    disk.ResetStats();
+    System::SetUsForUnitTest(1000);
+
+    BYTE buffer[4 * 512] = {};
+    EXPECT_EQ(disk_read(0, buffer, 100, 4), RES_OK);
+    EXPECT_EQ(System::GetUs(), 1000u + 100 + 4000);
+    EXPECT_EQ(disk_read(0, buffer, 100, 1), RES_OK);
+    EXPECT_EQ(System::GetUs(), 5100u + 100 + 1000);
+
+    // the third write stalls
+    System::SetUsForUnitTest(0);
+    EXPECT_EQ(disk_write(0, buffer, 200, 1), RES_OK);
+    EXPECT_EQ(disk_write(0, buffer, 201, 1), RES_OK);
+    EXPECT_EQ(System::GetUs(), 2u * 2300);
+    EXPECT_EQ(disk_write(0, buffer, 202, 2), RES_OK);
+    EXPECT_EQ(System::GetUs(), 2u * 2300 + 4300 + 10000);
+
+    const HostDiskio::Stats& stats = disk.GetStats();
+    EXPECT_EQ(stats.stalls, 1u);
+    EXPECT_EQ(stats.max_command_us, 14300u);
+    EXPECT_EQ(stats.busy_us, 4100u + 1100 + 2 * 2300 + 14300);
+}
+
+TEST_F(util_HostDiskio, e_rejectsSectorsOutsideTheImage)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+
+    DWORD sectors = 0;
+    EXPECT_EQ(disk_ioctl(0, GET_SECTOR_COUNT, &sectors), RES_OK);
+    EXPECT_EQ(sectors, kImageSize / 512);
+    BYTE buffer[2 * 512];
+    EXPECT_EQ(disk_read(0, buffer, sectors - 2, 2), RES_OK);
+    EXPECT_EQ(disk_read(0, buffer, sectors - 1, 2), RES_PARERR);
+    EXPECT_EQ(disk_write(0, buffer, sectors, 1), RES_PARERR);
+
+    // only one image at a time
+    HostDiskio other;
+    EXPECT_FALSE(other.Init(GetImagePath()));
+    disk.DeInit();
+    EXPECT_TRUE(other.Init(GetImagePath()));
+}
+
+TEST_F(util_HostDiskio, f_stampsFilesWithTheSetTime)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    ASSERT_TRUE(disk.Format());
+
+    const uint16_t fdate = ((2024 - 1980) << 9) | (5 << 5) | 17;
+    const uint16_t ftime = (13 << 11) | (37 << 5) | (42 / 2);
+    HostDiskio::SetTime(fdate, ftime);
+    WritePattern("0:/stamped.bin", 10, 0);
+    FILINFO info;
+    ASSERT_EQ(f_stat("0:/stamped.bin", &info), FR_OK);
+    EXPECT_EQ(info.fdate, fdate);
+    EXPECT_EQ(info.ftime, ftime);
+    HostDiskio::SetTime((2020 - 1980) << 9 | (1 << 5) | 1, 0);
+}
+
+TEST_F(util_HostDiskio, g_runsWavWriter)
+{
+    ASSERT_TRUE(HostDiskio::CreateImage(GetImagePath(), kImageSize));
+    HostDiskio disk;
+    ASSERT_TRUE(disk.Init(GetImagePath()));
+    ASSERT_TRUE(disk.Format());
+
+    // more samples than fit into the two halves of the buffer
+    using Writer = WavWriter<4096>;
+    std::unique_ptr<Writer> writer(new Writer);
+    Writer::Config          config;
+    config.samplerate    = 48000.f;
+    config.channels      = 2;
+    config.bitspersample = 16;
+    writer->Init(config);
+    writer->OpenFile("0:/writer.wav");
+    ASSERT_TRUE(writer->IsRecording());
+    const uint32_t kFrames = 5000;
+    for(uint32_t i = 0; i < kFrames; i++)
+    {
+        const float in[2] = {(i % 100) / 128.f, -(i % 50) / 128.f};
+        writer->Sample(in);
+        writer->Write();
+    }
+    writer->SaveFile();
+    EXPECT_EQ(writer->GetLengthSamps(), kFrames);
+
+    FIL file;
+    ASSERT_EQ(f_open(&file, "0:/writer.wav", FA_READ), FR_OK);
+    ASSERT_EQ(f_size(&file), 44u + kFrames * 4);
+    std::vector<int16_t> samples(2 * kFrames);
+    UINT                 bytes_read = 0;
+    ASSERT_EQ(f_lseek(&file, 44), FR_OK);
+    ASSERT_EQ(f_read(&file, samples.data(), kFrames * 4, &bytes_read), FR_OK);
+    ASSERT_EQ(bytes_read, kFrames * 4);
+    f_close(&file);
+    for(uint32_t i = 0; i < kFrames; i++)
+    {
+        ASSERT_EQ(samples[2 * i], f2s16((i % 100) / 128.f)) << "at " << i;
+        ASSERT_EQ(samples[2 * i + 1], f2s16(-(i % 50) / 128.f)) << "at " << i;
+    }
+    EXPECT_GT(disk.GetStats().sectors_written, kFrames * 4 / 512);
+}
@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+#include "hid/midi.h"
+#include <cmath>
+#include <cstdio>
+
+using namespace daisy;
+
+namespace
+{
+/** Tick period in us for a tempo */
+double Period(double bpm)
+{
+    return 60e6 / (bpm * 24.);
+}
+
+/** Generates clock tick times with uniform jitter */
+class TickSource
+{
+  public:
+    TickSource(double bpm, double jitter_us, double start_us = 1000.)
+    : period_(Period(bpm)), jitter_(jitter_us), time_(start_us), seed_(1)
+    {
+    }
+
+    /** Ideal time of the next tick */
+    double GetIdealTime() const { return time_; }
+
+    /** Returns the jittered time of the next tick, and advances */
+    uint32_t Next()
+    {
+        seed_            = seed_ * 1664525u + 1013904223u;
+        const double r   = double(seed_ >> 8) / double(1 << 24) * 2. - 1.;
+        const double out = time_ + r * jitter_;
+        time_ += period_;
+        return uint32_t(std::lround(out));
+    }
+
+    void SetBpm(double bpm) { period_ = Period(bpm); }
+
+  private:
+    double   period_;
+    double   jitter_;
+    double   time_;
+    uint32_t seed_;
+};
+
+/** Receive only transport, the bytes are fed in with Parse() */
+class StubTransport
+{
+  public:
+    typedef void (*MidiRxParseCallback)(uint8_t* data,
+                                        size_t   size,
+                                        void*    context);
+    struct Config
+    {
+    };
+
+    void Init(Config) {}
+    void StartRx(MidiRxParseCallback, void*) {}
+    bool RxActive() { return true; }
+    void FlushRx() {}
+    void FlushTx() {}
+    void Tx(uint8_t*, size_t) {}
+};
+
+} // namespace
+
+TEST(hid_MidiClockTracker, a_steadyClock)
+{
+    MidiClockTracker clock;
+    EXPECT_FALSE(clock.IsLocked(0));
+    EXPECT_EQ(clock.GetBpm(0), 0.f);
+
+    TickSource src(120., 0.);
+    clock.Start();
+    for(int i = 0; i < 96; i++)
+        clock.Tick(src.Next());
+    // 96 ticks since Start, the last one is at position 95
+    const uint32_t last = uint32_t(src.GetIdealTime() - Period(120.));
+    EXPECT_TRUE(clock.IsLocked(last));
+    EXPECT_TRUE(clock.IsRunning());
+    EXPECT_NEAR(clock.GetBpm(last), 120.f, 0.01f);
+    EXPECT_NEAR(clock.GetTicksPerSecond(last), 48.f, 0.01f);
+    EXPECT_NEAR(clock.GetTickPosition(last), 95.f, 0.01f);
+    EXPECT_NEAR(clock.GetTickPosition(last + 10417), 95.5f, 0.01f);
+    EXPECT_NEAR(clock.GetBeatPhase(last + 10417), 23.5f / 24.f, 0.001f);
+    // never more than one tick ahead of the last tick
+    EXPECT_NEAR(clock.GetTickPosition(last + 99000), 96.f, 0.001f);
+}
+
+TEST(hid_MidiClockTracker, b_jitteredClock)
+{
+    // +-1ms, e.g. a USB clock polled once per frame
+    MidiClockTracker clock;
+    TickSource       src(120., 1000.);
+    clock.Start();
+
+    double   max_bpm_err = 0, max_raw_err = 0, max_phase_err = 0;
+    uint32_t prev = 0;
+    for(int i = 0; i < 24 * 64; i++)
+    {
+        const double   ideal = src.GetIdealTime();
+        const uint32_t t     = src.Next();
+        clock.Tick(t);
+        if(i >= 24 * 4)
+        {
+            const double raw_bpm = 60e6 / (24. * (t - prev));
+            max_raw_err = std::max(max_raw_err, std::fabs(raw_bpm - 120.));
+            max_bpm_err
+                = std::max(max_bpm_err, std::fabs(clock.GetBpm(t) - 120.));
+            // half a tick later, compared to the ideal clock
+            const double pos = clock.GetTickPosition(t + 10000);
+            const double ref = i + (t + 10000 - ideal) / Period(120.);
+            max_phase_err = std::max(max_phase_err, std::fabs(pos - ref));
+        }
+        prev = t;
+    }
+    printf("[ BENCH    ] +-1ms jitter at 120 BPM: raw %.2f BPM, "
+           "tracked %.3f BPM, phase %.3f ticks max error\n",
+           max_raw_err,
+           max_bpm_err,
+           max_phase_err);
+    EXPECT_GT(max_raw_err, 10.);
+    EXPECT_LT(max_bpm_err, 1.);
+    EXPECT_LT(max_phase_err, 0.05);
+}
+
+TEST(hid_MidiClockTracker, c_tempoChangeAndDropouts)
+{
+    MidiClockTracker clock;
+    TickSource       src(120., 500.);
+    for(int i = 0; i < 24 * 8; i++)
+        clock.Tick(src.Next());
+    EXPECT_NEAR(clock.GetBpm(src.GetIdealTime()), 120.f, 0.5f);
+
+    // a single missing tick doesn't disturb the tempo
+    src.Next();
+    for(int i = 0; i < 4; i++)
+        clock.Tick(src.Next());
+    EXPECT_NEAR(clock.GetBpm(src.GetIdealTime()), 120.f, 0.5f);
+
+    // a jump to 140 BPM is picked up within three beats
+    src.SetBpm(140.);
+    for(int i = 0; i < 72; i++)
+        clock.Tick(src.Next());
+    EXPECT_NEAR(clock.GetBpm(src.GetIdealTime()), 140.f, 1.f);
+
+    // and a gradual change is followed
+    for(int i = 0; i < 24 * 16; i++)
+    {
+        src.SetBpm(140. - i * 0.05);
+        clock.Tick(src.Next());
+    }
+    EXPECT_NEAR(clock.GetBpm(src.GetIdealTime()), 140. - 24 * 16 * 0.05, 1.f);
+
+    // after a pause longer than the timeout, the tempo is measured anew
+    TickSource slow(90., 0., src.GetIdealTime() + 2e6);
+    clock.Tick(slow.Next());
+    clock.Tick(slow.Next());
+    EXPECT_NEAR(clock.GetBpm(slow.GetIdealTime()), 90.f, 0.01f);
+}
+
+TEST(hid_MidiClockTracker, d_transport)
+{
+    MidiClockTracker clock;
+    TickSource       src(120., 0.);
+
+    // ticks without Start give a tempo, but no position
+    for(int i = 0; i < 10; i++)
+        clock.Tick(src.Next());
+    EXPECT_FALSE(clock.IsRunning());
+    EXPECT_EQ(clock.GetTickPosition(0), 0.f);
+
+    // waits at 0 until the first tick after Start
+    clock.Start();
+    const uint32_t t = uint32_t(src.GetIdealTime());
+    EXPECT_EQ(clock.GetTickPosition(t + 5000), 0.f);
+    for(int i = 0; i < 30; i++)
+        clock.Tick(src.Next());
+    EXPECT_NEAR(clock.GetTickPosition(t + 29 * Period(120.)), 29.f, 0.01f);
+
+    // the position stays while stopped, also with ticks
+    clock.Stop();
+    clock.Tick(src.Next());
+    EXPECT_FALSE(clock.IsRunning());
+    EXPECT_EQ(clock.GetTickPosition(src.GetIdealTime()), 29.f);
+
+    // Continue resumes with the next tick
+    clock.Continue();
+    EXPECT_EQ(clock.GetTickPosition(0), 30.f);
+    clock.Tick(src.Next());
+    clock.Tick(src.Next());
+    EXPECT_NEAR(clock.GetTickPosition(uint32_t(src.GetIdealTime())),
+                32.f,
+                0.01f);
+
+    // Song Position Pointer, in 16ths
+    clock.Stop();
+    clock.SetSongPosition(8);
+    EXPECT_EQ(clock.GetTickPosition(0), 48.f);
+    clock.Continue();
+    clock.Tick(src.Next());
+    EXPECT_EQ(clock.GetBeatPhase(src.GetIdealTime() - Period(120.)), 0.f);
+    EXPECT_NEAR(clock.GetTickPosition(src.GetIdealTime() - Period(120.)),
+                48.f,
+                0.01f);
+}
+
+TEST(hid_MidiClockTracker, e_handlerTimestampsEvents)
+{
+    static MidiHandler<StubTransport> midi;
+    MidiClockTracker                  clock;
+    midi.Init(MidiHandler<StubTransport>::Config());
+    midi.SetClockTracker(&clock);
+
+    // Start, then clock bytes 20833us apart, SPP while stopped
+    uint8_t start = 0xFA, tick = 0xF8;
+    System::SetUsForUnitTest(1000);
+    midi.ParseBuffer(&start, 1);
+    for(int i = 0; i < 48; i++)
+    {
+        System::SetUsForUnitTest(1000 + uint32_t(i * Period(120.)));
+        midi.Parse(tick);
+    }
+    EXPECT_NEAR(clock.GetBpm(System::GetUs()), 120.f, 0.01f);
+    EXPECT_TRUE(clock.IsRunning());
+
+    uint8_t stop_spp[] = {0xFC, 0xF2, 0x10, 0x00};
+    midi.ParseBuffer(stop_spp, sizeof(stop_spp));
+    EXPECT_FALSE(clock.IsRunning());
+    EXPECT_EQ(clock.GetTickPosition(0), 96.f);
+
+    // the events are queued as well
+    EXPECT_EQ(midi.PopEvent().srt_type, SystemRealTimeType::Start);
+}
+
+TEST(hid_MidiClockTracker, f_clockStops)
+{
+    MidiClockTracker::Config config;
+    config.timeout_us = 100000;
+    MidiClockTracker clock;
+    clock.Init(config);
+    TickSource src(120., 0.);
+    for(int i = 0; i < 48; i++)
+        clock.Tick(src.Next());
+
+    // the master stops sending, no further tick arrives
+    const uint32_t last = uint32_t(src.GetIdealTime() - Period(120.));
+    EXPECT_TRUE(clock.IsLocked(last + 99000));
+    EXPECT_NEAR(clock.GetBpm(last + 99000), 120.f, 0.01f);
+    EXPECT_FALSE(clock.IsLocked(last + 101000));
+    EXPECT_EQ(clock.GetBpm(last + 101000), 0.f);
+    EXPECT_EQ(clock.GetTicksPerSecond(last + 5000000), 0.f);
+
+    // a reader time slightly before the last tick isn't a timeout
+    EXPECT_TRUE(clock.IsLocked(last - 10));
+}
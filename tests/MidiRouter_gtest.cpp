@@ -0,0 +1,367 @@
+#include <gtest/gtest.h>
+#include "hid/midi_router.h"
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using Bytes = std::vector<uint8_t>;
+
+typedef void (*MidiRxParseCallback)(uint8_t* data,
+                                    size_t   size,
+                                    void*    context);
+
+/** Transport that sends with Tx(), like MidiUsbTransport */
+class BlockingTransport
+{
+  public:
+    struct Config
+    {
+    };
+
+    void Init(Config) { sent.clear(); }
+    void StartRx(MidiRxParseCallback, void*) {}
+    bool RxActive() { return true; }
+    void FlushRx() {}
+    void FlushTx() {}
+    void Tx(uint8_t* buff, size_t size)
+    {
+        sent.push_back(Bytes(buff, buff + size));
+    }
+
+    std::vector<Bytes> sent;
+};
+
+/** Transport with DMA transmit, like MidiUartTransport. Transfers are
+ *  completed by the test with CompleteTx(). */
+class DmaTransport
+{
+  public:
+    typedef void (*TxCompleteCallback)(void* context);
+
+    struct Config
+    {
+    };
+
+    void Init(Config)
+    {
+        sent.clear();
+        callback_ = nullptr;
+        num_tx_   = 0;
+    }
+    void StartRx(MidiRxParseCallback, void*) {}
+    bool RxActive() { return true; }
+    void FlushRx() {}
+    void FlushTx() {}
+    void Tx(uint8_t*, size_t) { ADD_FAILURE() << "blocking send"; }
+
+    uint8_t* GetTxBuffer() { return buffer_; }
+    size_t   GetTxBufferSize() const { return sizeof(buffer_); }
+
+    bool TxDma(size_t size, TxCompleteCallback callback, void* context)
+    {
+        EXPECT_EQ(callback_, nullptr) << "transfer already running";
+        sent.insert(sent.end(), buffer_, buffer_ + size);
+        callback_ = callback;
+        context_  = context;
+        num_tx_++;
+        return true;
+    }
+
+    void CompleteAll()
+    {
+        while(callback_ != nullptr)
+        {
+            TxCompleteCallback callback = callback_;
+            callback_                   = nullptr;
+            callback(context_);
+        }
+    }
+
+    size_t GetNumTransfers() const { return num_tx_; }
+
+    Bytes sent;
+
+  private:
+    uint8_t            buffer_[16];
+    TxCompleteCallback callback_;
+    void*              context_;
+    size_t             num_tx_;
+};
+
+using Router = MidiRouter<DmaTransport, BlockingTransport>;
+
+static_assert(MidiTransportHasTxDma<DmaTransport>::value, "");
+static_assert(!MidiTransportHasTxDma<BlockingTransport>::value, "");
+
+template <typename R>
+void Receive(R& router, uint8_t port, uint32_t time, const Bytes& bytes)
+{
+    System::SetUsForUnitTest(time);
+    router.ParseBuffer(port, bytes.data(), bytes.size());
+}
+
+template <typename R>
+std::vector<RoutedMidiEvent> PopAll(R& router)
+{
+    std::vector<RoutedMidiEvent> events;
+    RoutedMidiEvent              event;
+    while(router.PopEvent(event))
+        events.push_back(event);
+    return events;
+}
+
+} // namespace
+
+TEST(hid_MidiRouter, a_filter)
+{
+    MidiEvent note = MidiEvent(), clock = MidiEvent(), spp = MidiEvent();
+    note.type      = NoteOn;
+    note.channel   = 3;
+    clock.type     = SystemRealTime;
+    clock.srt_type = TimingClock;
+    spp.type       = SystemCommon;
+    spp.sc_type    = SongPositionPointer;
+
+    MidiFilter filter;
+    EXPECT_TRUE(filter.Passes(note));
+    EXPECT_TRUE(filter.Passes(clock));
+
+    filter.channels = 1 << 2;
+    EXPECT_FALSE(filter.Passes(note));
+    note.channel = 2;
+    EXPECT_TRUE(filter.Passes(note));
+    // the channel mask doesn't apply to system messages
+    EXPECT_TRUE(filter.Passes(clock));
+
+    filter.realtime &= ~(1 << TimingClock);
+    EXPECT_FALSE(filter.Passes(clock));
+    EXPECT_TRUE(filter.Passes(spp));
+
+    filter.types &= ~(1 << SystemCommon | 1 << NoteOn);
+    EXPECT_FALSE(filter.Passes(spp));
+    EXPECT_FALSE(filter.Passes(note));
+}
+
+TEST(hid_MidiRouter, b_mergesInTimeOrder)
+{
+    static Router router;
+    router.Init(DmaTransport::Config(), BlockingTransport::Config());
+
+    // both ports received a buffer before the main loop got to them
+    Receive(router, 1, 200, {0x91, 1, 1, 0x91, 2, 2});
+    Receive(router, 0, 100, {0x80, 3, 0});
+    Receive(router, 0, 300, {0xF8});
+    Receive(router, 1, 250, {0x91, 4, 4});
+
+    const auto events = PopAll(router);
+    ASSERT_EQ(events.size(), 5u);
+    const uint32_t times[] = {100, 200, 200, 250, 300};
+    const uint8_t  ports[] = {0, 1, 1, 1, 0};
+    for(size_t i = 0; i < events.size(); i++)
+    {
+        EXPECT_EQ(events[i].time_us, times[i]);
+        EXPECT_EQ(events[i].port, ports[i]);
+    }
+    EXPECT_EQ(events[0].event.type, NoteOff);
+    EXPECT_EQ(events[2].event.data[0], 2);
+    EXPECT_EQ(events[4].event.srt_type, TimingClock);
+
+    // with the input filter closed, events of a port are skipped
+    MidiFilter none;
+    none.types = 0;
+    router.SetInputFilter(0, none);
+    Receive(router, 0, 400, {0x90, 5, 5});
+    Receive(router, 1, 500, {0x90, 6, 6});
+    const auto filtered = PopAll(router);
+    ASSERT_EQ(filtered.size(), 1u);
+    EXPECT_EQ(filtered[0].port, 1);
+    EXPECT_EQ(router.GetNumDropped(0), 0u);
+}
+
+TEST(hid_MidiRouter, c_thru)
+{
+    static Router router;
+    router.Init(DmaTransport::Config(), BlockingTransport::Config());
+    DmaTransport&      uart = router.GetPort<0>().GetTransport();
+    BlockingTransport& usb  = router.GetPort<1>().GetTransport();
+
+    // everything from USB to UART, only channel 1 notes back
+    MidiFilter notes;
+    notes.types    = 1 << NoteOn | 1 << NoteOff;
+    notes.channels = 1 << 0;
+    EXPECT_TRUE(router.AddThru(1, 0));
+    EXPECT_TRUE(router.AddThru(0, 1, notes));
+    EXPECT_FALSE(router.AddThru(0, 2));
+
+    Receive(router, 1, 10, {0x90, 60, 100, 0x90, 62, 100, 0xF8});
+    Receive(router, 1, 20, {0xC2, 5, 0xE0, 0, 64, 0xF2, 8, 0});
+    Receive(router, 0, 30, {0x90, 1, 1, 0x91, 2, 2, 0xB0, 7, 100});
+    const auto events = PopAll(router);
+    EXPECT_EQ(events.size(), 9u);
+
+    // the UART sends in the background, with running status
+    EXPECT_EQ(uart.GetNumTransfers(), 1u);
+    uart.CompleteAll();
+    EXPECT_EQ(uart.sent,
+              Bytes({0x90, 60, 100, 62, 100, 0xF8, 0xC2, 5, 0xE0, 0, 64,
+                     0xF2, 8, 0}));
+
+    // the blocking transport gets one message at a time
+    ASSERT_EQ(usb.sent.size(), 1u);
+    EXPECT_EQ(usb.sent[0], Bytes({0x90, 1, 1}));
+
+    // the input filters don't affect thru
+    MidiFilter none;
+    none.types = 0;
+    router.SetInputFilter(1, none);
+    Receive(router, 1, 40, {0xB5, 123, 0});
+    EXPECT_TRUE(PopAll(router).empty());
+    uart.CompleteAll();
+    EXPECT_EQ(Bytes(uart.sent.end() - 3, uart.sent.end()),
+              Bytes({0xB5, 123, 0}));
+
+    router.ClearThru();
+    Receive(router, 1, 50, {0x90, 1, 1});
+    PopAll(router);
+    EXPECT_EQ(uart.GetNumTransfers(), 3u);
+}
+
+TEST(hid_MidiRouter, d_sysExThru)
+{
+    static Router router;
+    router.Init(DmaTransport::Config(), BlockingTransport::Config());
+    BlockingTransport& usb = router.GetPort<1>().GetTransport();
+    EXPECT_TRUE(router.AddThru(0, 1));
+
+    // longer than a chunk, so it's forwarded in two parts
+    Bytes sysex = {0xF0};
+    for(int i = 0; i < SYSEX_BUFFER_LEN + 10; i++)
+        sysex.push_back(i & 0x7f);
+    sysex.push_back(0xF7);
+    Receive(router, 0, 10, sysex);
+
+    RoutedMidiEvent event;
+    ASSERT_TRUE(router.PopEvent(event));
+    SystemExclusiveEvent first
+        = event.event.AsSystemExclusive(router.GetSysExArena(0));
+    EXPECT_TRUE(first.begin);
+    EXPECT_EQ(first.length, SYSEX_BUFFER_LEN);
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_FALSE(router.PopEvent(event));
+
+    ASSERT_EQ(usb.sent.size(), 2u);
+    Bytes forwarded = usb.sent[0];
+    forwarded.insert(forwarded.end(), usb.sent[1].begin(), usb.sent[1].end());
+    EXPECT_EQ(forwarded, sysex);
+    EXPECT_EQ(router.GetSysExArena(0).GetNumUsed(), 0u);
+}
+
+TEST(hid_MidiRouter, e_sysExThruFromTwoPorts)
+{
+    // from two ports into one
+    using Router3
+        = MidiRouter<DmaTransport, BlockingTransport, BlockingTransport>;
+    static Router3 router;
+    router.Init(DmaTransport::Config(),
+                BlockingTransport::Config(),
+                BlockingTransport::Config());
+    DmaTransport& uart = router.GetPort<0>().GetTransport();
+    EXPECT_TRUE(router.AddThru(1, 0));
+    EXPECT_TRUE(router.AddThru(2, 0));
+
+    // the first chunk of a SysEx arrives, then a clock and a note from the
+    // other port
+    Bytes sysex = {0xF0};
+    for(int i = 0; i < SYSEX_BUFFER_LEN + 10; i++)
+        sysex.push_back(i & 0x7f);
+    sysex.push_back(0xF7);
+    // a chunk is passed on with the first byte that doesn't fit
+    const size_t chunk = 1 + SYSEX_BUFFER_LEN;
+    Receive(router, 1, 10, Bytes(sysex.begin(), sysex.begin() + chunk + 1));
+    Receive(router, 2, 15, {0xF8});
+    const Bytes note = {0x90, 60, 100};
+    Receive(router, 2, 20, note);
+
+    // all events are popped, but only the realtime message is sent within
+    // the SysEx, the note waits for its end
+    RoutedMidiEvent event;
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_EQ(event.port, 1);
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_EQ(event.event.type, SystemRealTime);
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_EQ(event.event.type, NoteOn);
+    EXPECT_FALSE(router.PopEvent(event));
+    uart.CompleteAll();
+    EXPECT_EQ(uart.sent.size(), chunk + 1);
+
+    Receive(router, 1, 30, Bytes(sysex.begin() + chunk + 1, sysex.end()));
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_EQ(event.port, 1);
+    EXPECT_FALSE(router.PopEvent(event));
+
+    uart.CompleteAll();
+    Bytes expected(sysex.begin(), sysex.begin() + chunk);
+    expected.push_back(0xF8);
+    expected.insert(expected.end(), sysex.begin() + chunk, sysex.end());
+    expected.insert(expected.end(), note.begin(), note.end());
+    EXPECT_EQ(uart.sent, expected);
+}
+
+TEST(hid_MidiRouter, f_sysExThruWithoutEnd)
+{
+    using Router3
+        = MidiRouter<DmaTransport, BlockingTransport, BlockingTransport>;
+    static Router3 router;
+    router.Init(DmaTransport::Config(),
+                BlockingTransport::Config(),
+                BlockingTransport::Config());
+    DmaTransport& uart = router.GetPort<0>().GetTransport();
+    EXPECT_TRUE(router.AddThru(1, 0));
+    EXPECT_TRUE(router.AddThru(2, 0));
+
+    // a SysEx whose end never comes, e.g. the cable was pulled
+    Bytes sysex = {0xF0};
+    for(int i = 0; i < SYSEX_BUFFER_LEN + 1; i++)
+        sysex.push_back(i & 0x7f);
+    Receive(router, 1, 1000, sysex);
+    RoutedMidiEvent event;
+    ASSERT_TRUE(router.PopEvent(event));
+    EXPECT_FALSE(router.PopEvent(event));
+
+    // the other port keeps going, and its events are all popped
+    size_t popped = 0;
+    for(int i = 0; i < 200; i++)
+    {
+        Receive(router, 2, 2000 + i * 5000, {0x90, uint8_t(i & 0x7f), 100});
+        while(router.PopEvent(event))
+        {
+            EXPECT_EQ(event.port, 2);
+            popped++;
+        }
+    }
+    EXPECT_EQ(popped, 200u);
+    EXPECT_EQ(router.GetNumDropped(2), 0u);
+
+    // the notes waited until the SysEx timed out, which ended it, and
+    // then went on being forwarded. Some didn't fit while they waited.
+    uart.CompleteAll();
+    ASSERT_GT(uart.sent.size(), size_t(SYSEX_BUFFER_LEN + 2));
+    EXPECT_EQ(uart.sent[SYSEX_BUFFER_LEN + 1], 0xF7);
+    EXPECT_EQ(uart.sent[SYSEX_BUFFER_LEN + 2], 0x90);
+    EXPECT_EQ(uart.sent.back(), 100);
+    EXPECT_GT(router.GetNumDropped(0), 0u);
+    const size_t sent_notes
+        = (uart.sent.size() - (SYSEX_BUFFER_LEN + 2) - 1) / 2;
+    EXPECT_EQ(sent_notes + router.GetNumDropped(0), 200u);
+
+    // the rest of the SysEx isn't forwarded, what comes after it is
+    const size_t size = uart.sent.size();
+    Receive(router, 1, 2000000, {1, 2, 3, 0xF7, 0xB0, 7, 64});
+    PopAll(router);
+    uart.CompleteAll();
+    EXPECT_EQ(Bytes(uart.sent.begin() + size, uart.sent.end()),
+              Bytes({0xB0, 7, 64}));
+}
@@ -0,0 +1,211 @@
+#include <gtest/gtest.h>
+#include "hid/midi.h"
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using Bytes = std::vector<uint8_t>;
+
+template <typename Queue>
+Bytes ReadAll(Queue& queue, size_t batch = 1000)
+{
+    Bytes out;
+    while(!queue.IsEmpty())
+    {
+        std::vector<uint8_t> buf(batch);
+        buf.resize(queue.Read(buf.data(), buf.size()));
+        out.insert(out.end(), buf.begin(), buf.end());
+    }
+    return out;
+}
+
+template <typename Queue>
+bool Write(Queue& queue, const Bytes& bytes)
+{
+    return queue.Write(bytes.data(), bytes.size());
+}
+
+/** Transport that records the DMA transfers, which are completed by the
+ *  test with CompleteTx() */
+class MockDmaTransport
+{
+  public:
+    typedef void (*MidiRxParseCallback)(uint8_t* data,
+                                        size_t   size,
+                                        void*    context);
+    typedef void (*TxCompleteCallback)(void* context);
+
+    struct Config
+    {
+    };
+
+    void Init(Config) {}
+    void StartRx(MidiRxParseCallback, void*) {}
+    bool RxActive() { return true; }
+    void FlushRx() {}
+    void FlushTx() {}
+    void Tx(uint8_t* buff, size_t size)
+    {
+        blocking.insert(blocking.end(), buff, buff + size);
+    }
+
+    uint8_t* GetTxBuffer() { return buffer; }
+    size_t   GetTxBufferSize() const { return sizeof(buffer); }
+
+    bool TxDma(size_t size, TxCompleteCallback callback, void* context)
+    {
+        EXPECT_EQ(pending_callback, nullptr) << "transfer already running";
+        EXPECT_LE(size, sizeof(buffer));
+        transfers.push_back(Bytes(buffer, buffer + size));
+        pending_callback = callback;
+        pending_context  = context;
+        return true;
+    }
+
+    /** Finishes the running transfer, like the DMA interrupt */
+    static bool CompleteTx()
+    {
+        if(pending_callback == nullptr)
+            return false;
+        auto callback    = pending_callback;
+        pending_callback = nullptr;
+        callback(pending_context);
+        return true;
+    }
+
+    static Bytes              blocking;
+    static std::vector<Bytes> transfers;
+    static TxCompleteCallback pending_callback;
+    static void*              pending_context;
+
+  private:
+    uint8_t buffer[8];
+};
+
+Bytes                                MockDmaTransport::blocking;
+std::vector<Bytes>                   MockDmaTransport::transfers;
+MockDmaTransport::TxCompleteCallback MockDmaTransport::pending_callback;
+void*                                MockDmaTransport::pending_context;
+
+} // namespace
+
+TEST(hid_MidiTxQueue, a_runningStatus)
+{
+    MidiTxQueue<> queue;
+
+    // repeated status bytes are left out, also across messages
+    EXPECT_TRUE(Write(queue, {0x90, 60, 100, 0x90, 64, 100}));
+    EXPECT_TRUE(Write(queue, {0x90, 67, 100}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0x90, 60, 100, 64, 100, 67, 100}));
+
+    // a new channel or type needs the status byte
+    EXPECT_TRUE(Write(queue, {0x91, 60, 100, 0x80, 60, 0, 0x80, 61, 0}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0x91, 60, 100, 0x80, 60, 0, 61, 0}));
+
+    // realtime bytes don't change running status, system common does
+    EXPECT_TRUE(Write(queue, {0xF8, 0x80, 62, 0, 0xF2, 0, 0, 0x80, 63, 0}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0xF8, 62, 0, 0xF2, 0, 0, 0x80, 63, 0}));
+
+    // e.g. after a while, to resync receivers
+    queue.ResetRunningStatus();
+    EXPECT_TRUE(Write(queue, {0x80, 64, 0}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0x80, 64, 0}));
+
+    // disabled
+    queue.Init(false);
+    EXPECT_TRUE(Write(queue, {0xB0, 1, 2, 0xB0, 1, 3}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0xB0, 1, 2, 0xB0, 1, 3}));
+}
+
+TEST(hid_MidiTxQueue, b_messagesAreAllOrNothing)
+{
+    MidiTxQueue<8, 4> queue;
+    EXPECT_TRUE(Write(queue, {0x90, 1, 1, 0x90, 2, 2}));
+    // 5 bytes with running status don't fit into the remaining 3
+    EXPECT_FALSE(Write(queue, {0x91, 3, 3, 0x91, 4, 4}));
+    EXPECT_EQ(queue.GetNumDropped(), 1u);
+    EXPECT_EQ(queue.GetNumPending(), 5u);
+    // 2 bytes do, the dropped message didn't change the running status
+    EXPECT_TRUE(Write(queue, {0x90, 5, 5}));
+    EXPECT_EQ(ReadAll(queue), Bytes({0x90, 1, 1, 2, 2, 5, 5}));
+
+    // the realtime lane has its own room
+    for(int i = 0; i < 4; i++)
+        EXPECT_TRUE(queue.WriteRealtime(0xF8));
+    EXPECT_FALSE(queue.WriteRealtime(0xF8));
+    EXPECT_EQ(queue.GetNumDropped(), 2u);
+}
+
+TEST(hid_MidiTxQueue, c_realtimeFirst)
+{
+    MidiTxQueue<> queue;
+    EXPECT_TRUE(Write(queue, {0x90, 60, 100, 0x90, 61, 100}));
+    EXPECT_TRUE(queue.WriteRealtime(0xF8));
+    EXPECT_TRUE(queue.WriteRealtime(0xFA));
+
+    uint8_t buf[3];
+    ASSERT_EQ(queue.Read(buf, 3), 3u);
+    EXPECT_EQ(Bytes(buf, buf + 3), Bytes({0xF8, 0xFA, 0x90}));
+
+    // a clock between two batches goes ahead of the rest of a message
+    EXPECT_TRUE(queue.WriteRealtime(0xF8));
+    EXPECT_EQ(ReadAll(queue), Bytes({0xF8, 60, 100, 61, 100}));
+}
+
+TEST(hid_MidiTxQueue, d_handlerChainsDmaTransfers)
+{
+    MockDmaTransport::transfers.clear();
+    MockDmaTransport::blocking.clear();
+    MockDmaTransport::pending_callback = nullptr;
+
+    static MidiHandler<MockDmaTransport> midi;
+    MidiHandler<MockDmaTransport>::Config config;
+    midi.Init(config);
+    EXPECT_FALSE(midi.IsSending());
+
+    // the first message starts a transfer right away
+    uint8_t note[] = {0x90, 60, 100};
+    EXPECT_TRUE(midi.QueueMessage(note, 3));
+    ASSERT_EQ(MockDmaTransport::transfers.size(), 1u);
+    EXPECT_EQ(MockDmaTransport::transfers[0], Bytes({0x90, 60, 100}));
+
+    // the next ones are batched while it runs
+    Bytes expected;
+    for(uint8_t n = 0; n < 10; n++)
+    {
+        uint8_t msg[] = {0x90, n, 100};
+        EXPECT_TRUE(midi.QueueMessage(msg, 3));
+        expected.insert(expected.end(), {n, 100});
+    }
+    EXPECT_TRUE(midi.QueueRealtime(0xF8));
+    EXPECT_EQ(MockDmaTransport::transfers.size(), 1u);
+    EXPECT_TRUE(midi.IsSending());
+
+    // each completion starts the next transfer of up to 8 bytes
+    while(MockDmaTransport::CompleteTx()) {}
+    EXPECT_FALSE(midi.IsSending());
+    ASSERT_EQ(MockDmaTransport::transfers.size(), 4u);
+    Bytes sent;
+    for(size_t i = 1; i < 4; i++)
+        sent.insert(sent.end(),
+                    MockDmaTransport::transfers[i].begin(),
+                    MockDmaTransport::transfers[i].end());
+    EXPECT_EQ(MockDmaTransport::transfers[1][0], 0xF8); // clock goes first
+    expected.insert(expected.begin(), 0xF8);
+    EXPECT_EQ(sent, expected);
+
+    // idle again, the next message starts a new transfer
+    EXPECT_TRUE(midi.QueueMessage(note, 3));
+    ASSERT_EQ(MockDmaTransport::transfers.size(), 5u);
+    EXPECT_EQ(MockDmaTransport::transfers[4], Bytes({60, 100}));
+    EXPECT_TRUE(MockDmaTransport::CompleteTx());
+
+    // blocking sends reset the running status
+    midi.SendMessage(note, 3);
+    EXPECT_TRUE(midi.QueueMessage(note, 3));
+    EXPECT_EQ(MockDmaTransport::transfers.back(), Bytes({0x90, 60, 100}));
+    EXPECT_TRUE(MockDmaTransport::CompleteTx());
+    EXPECT_EQ(midi.GetNumTxDropped(), 0u);
+}
@@ -0,0 +1,514 @@
+#include <gtest/gtest.h>
+#include "hid/midi_ump.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using Bytes = std::vector<uint8_t>;
+using Words = std::vector<uint32_t>;
+
+/** Collects what's pushed */
+template <typename T>
+struct VectorSink
+{
+    std::vector<T> items;
+    void           Push(const T& item) { items.push_back(item); }
+};
+
+/** Returns the MIDI 1.0 bytes of an event (not SysEx) */
+Bytes ToBytes(const MidiEvent& e)
+{
+    switch(e.type)
+    {
+        case SystemRealTime: return {uint8_t(0xf8 | e.srt_type)};
+        case SystemCommon:
+        {
+            const uint8_t status = 0xf0 | e.sc_type;
+            if(e.sc_type == SongPositionPointer)
+                return {status, e.data[0], e.data[1]};
+            if(e.sc_type == MTCQuarterFrame || e.sc_type == SongSelect)
+                return {status, e.data[0]};
+            return {status};
+        }
+        case ChannelMode:
+            return {uint8_t(0xb0 | e.channel), e.data[0], e.data[1]};
+        case ProgramChange:
+        case ChannelPressure:
+            return {uint8_t((e.type | 8) << 4 | e.channel), e.data[0]};
+        default:
+            return {uint8_t((e.type | 8) << 4 | e.channel),
+                    e.data[0],
+                    e.data[1]};
+    }
+}
+
+Bytes ToBytes(const std::vector<MidiEvent>& events)
+{
+    Bytes bytes;
+    for(const MidiEvent& e : events)
+    {
+        const Bytes b = ToBytes(e);
+        bytes.insert(bytes.end(), b.begin(), b.end());
+    }
+    return bytes;
+}
+
+/** Returns the words of the packets */
+Words ToWords(const std::vector<UmpEvent>& packets)
+{
+    Words words;
+    for(const UmpEvent& p : packets)
+        words.insert(words.end(), p.words, p.words + p.GetNumWords());
+    return words;
+}
+
+/** A packet, and the MIDI 1.0 bytes it translates to */
+struct CorpusEntry
+{
+    const char* name;
+    Words       words;
+    Bytes       midi;
+};
+
+// clang-format off
+const std::vector<CorpusEntry> kCorpus = {
+    // MIDI 1.0 channel voice and system messages
+    {"m1 note on",        {0x20933c64},             {0x93, 60, 100}},
+    {"m1 note on vel 0",  {0x20903c00},             {0x80, 60, 0}},
+    {"m1 group 5",        {0x25903c64},             {0x90, 60, 100}},
+    {"m1 program",        {0x20c10500},             {0xc1, 5}},
+    {"m1 all notes off",  {0x20b57b00},             {0xb5, 123, 0}},
+    {"clock",             {0x10f80000},             {0xf8}},
+    {"song position",     {0x10f20102},             {0xf2, 1, 2}},
+    {"quarter frame",     {0x10f11200},             {0xf1, 0x12}},
+    {"tune request",      {0x10f60000},             {0xf6}},
+    // MIDI 2.0 channel voice messages, scaled down
+    {"m2 note on",        {0x40913c00, 0xffff0000}, {0x91, 60, 127}},
+    {"m2 note on vel 0",  {0x40913c00, 0x01000000}, {0x91, 60, 1}},
+    {"m2 note off",       {0x40823c00, 0x80000000}, {0x82, 60, 64}},
+    {"m2 note attribute", {0x40903c03, 0x8000f000}, {0x90, 60, 64}},
+    {"m2 poly pressure",  {0x40a13c00, 0xffffffff}, {0xa1, 60, 127}},
+    {"m2 cc",             {0x40b00700, 0x80000000}, {0xb0, 7, 64}},
+    {"m2 all sound off",  {0x40b27800, 0x00000000}, {0xb2, 120, 0}},
+    {"m2 program",        {0x40c50000, 0x05000203}, {0xc5, 5}},
+    {"m2 program bank",   {0x40c50001, 0x05000203},
+                          {0xb5, 0, 2, 0xb5, 32, 3, 0xc5, 5}},
+    {"m2 pressure",       {0x40d40000, 0x40000000}, {0xd4, 32}},
+    {"m2 pitch bend",     {0x40e00000, 0x80000000}, {0xe0, 0, 64}},
+    {"m2 pitch bend max", {0x40e00000, 0xffffffff}, {0xe0, 127, 127}},
+    {"m2 rpn",            {0x40220000, 0x80000000},
+                          {0xb2, 101, 0, 0xb2, 100, 0, 0xb2, 6, 64,
+                           0xb2, 38, 0}},
+    {"m2 nrpn",           {0x40330102, 0xffffffff},
+                          {0xb3, 99, 1, 0xb3, 98, 2, 0xb3, 6, 127,
+                           0xb3, 38, 127}},
+    // no MIDI 1.0 version
+    {"m2 relative rpn",   {0x40420000, 0x00000010}, {}},
+    {"m2 per note bend",  {0x40603c00, 0x80000000}, {}},
+    {"m2 per note cc",    {0x40103c01, 0x80000000}, {}},
+    {"noop",              {0x00000000},             {}},
+    {"jr timestamp",      {0x00201234},             {}},
+    {"sysex 8",           {0x50000000, 0, 0, 0},    {}},
+    {"flex data",         {0xd0100000, 0, 0, 0},    {}},
+    {"stream",            {0xf0000000, 0, 0, 0},    {}},
+};
+// clang-format on
+
+Words CorpusWords()
+{
+    Words words;
+    for(const CorpusEntry& entry : kCorpus)
+        words.insert(words.end(), entry.words.begin(), entry.words.end());
+    return words;
+}
+
+} // namespace
+
+TEST(hid_MidiUmp, a_packetSizes)
+{
+    const size_t sizes[16] = {1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 4, 4};
+    for(uint32_t type = 0; type < 16; type++)
+        EXPECT_EQ(UmpEvent::GetNumWords(type << 28 | 0x0fffffff), sizes[type]);
+
+    const UmpEvent note = UmpEvent::MakeMidi2(3, 0x95, 60, 0, 0x12340000);
+    EXPECT_EQ(note.words[0], 0x43953c00u);
+    EXPECT_EQ(note.GetMessageType(), UmpMessageType::Midi2ChannelVoice);
+    EXPECT_EQ(note.GetGroup(), 3);
+    EXPECT_EQ(note.GetChannel(), 5);
+    EXPECT_EQ(note.GetMidi2Status(), Midi2Status::NoteOn);
+    EXPECT_EQ(note.AsNote().velocity, 0x1234);
+
+    UmpEvent program = UmpEvent::MakeMidi2(0, 0xc0, 0, 1, 0x05000203);
+    EXPECT_TRUE(program.AsProgramChange().bank_valid);
+    EXPECT_EQ(program.AsProgramChange().program, 5);
+    EXPECT_EQ(program.AsProgramChange().bank, 2 << 7 | 3);
+
+    const Midi2ControllerEvent rpn
+        = UmpEvent::MakeMidi2(0, 0x21, 4, 5, 6).AsController();
+    EXPECT_EQ(rpn.bank, 4);
+    EXPECT_EQ(rpn.index, 5);
+    const Midi2ControllerEvent cc
+        = UmpEvent::MakeMidi2(0, 0xb1, 74, 0, 7).AsController();
+    EXPECT_EQ(cc.index, 74);
+    EXPECT_EQ(cc.value, 7u);
+}
+
+TEST(hid_MidiUmp, b_parser)
+{
+    const Words words = CorpusWords();
+
+    // whole buffer
+    VectorSink<UmpEvent> whole;
+    UmpParser            parser;
+    parser.ParseBuffer(words.data(), words.size(), whole);
+    ASSERT_EQ(whole.items.size(), kCorpus.size());
+    for(size_t i = 0; i < kCorpus.size(); i++)
+        EXPECT_EQ(ToWords({whole.items[i]}), kCorpus[i].words)
+            << kCorpus[i].name;
+
+    // split between buffers anywhere gives the same packets
+    for(size_t split = 1; split < words.size(); split += 3)
+    {
+        VectorSink<UmpEvent> sink;
+        parser.ParseBuffer(words.data(), split, sink);
+        parser.ParseBuffer(words.data() + split, words.size() - split, sink);
+        EXPECT_EQ(ToWords(sink.items), words) << "split at " << split;
+    }
+
+    // bytes, little endian, split in the middle of a word
+    Bytes bytes;
+    for(uint32_t w : words)
+        for(int i = 0; i < 4; i++)
+            bytes.push_back(w >> (8 * i));
+    VectorSink<UmpEvent> from_bytes;
+    parser.ParseBytes(bytes.data(), 7, from_bytes);
+    parser.ParseBytes(bytes.data() + 7, bytes.size() - 7, from_bytes);
+    EXPECT_EQ(ToWords(from_bytes.items), words);
+
+    // an incomplete packet is dropped by Reset()
+    UmpEvent event;
+    EXPECT_FALSE(parser.Parse(0xf0000000, &event));
+    parser.Reset();
+    EXPECT_TRUE(parser.Parse(0x10f80000, &event));
+    EXPECT_EQ(event.words[0], 0x10f80000u);
+    EXPECT_EQ(event.words[1], 0u);
+}
+
+TEST(hid_MidiUmp, c_toMidiEvents)
+{
+    UmpTranslator translator;
+    translator.Init(UmpTranslator::Config());
+    Bytes expected;
+    for(const CorpusEntry& entry : kCorpus)
+    {
+        UmpEvent ump = UmpEvent();
+        std::copy(entry.words.begin(), entry.words.end(), ump.words);
+        VectorSink<MidiEvent> sink;
+        translator.ToMidiEvents(ump, sink);
+        EXPECT_EQ(ToBytes(sink.items), entry.midi) << entry.name;
+        expected.insert(expected.end(), entry.midi.begin(), entry.midi.end());
+    }
+
+    // the events are the ones the MidiParser makes from the bytes
+    MidiParser            midi_parser;
+    VectorSink<MidiEvent> parsed;
+    midi_parser.Init();
+    midi_parser.ParseBuffer(expected.data(), expected.size(), parsed);
+
+    VectorSink<UmpEvent>  packets;
+    VectorSink<MidiEvent> translated;
+    UmpParser             parser;
+    const Words           words = CorpusWords();
+    parser.ParseBuffer(words.data(), words.size(), packets);
+    for(const UmpEvent& ump : packets.items)
+        translator.ToMidiEvents(ump, translated);
+    ASSERT_EQ(translated.items.size(), parsed.items.size());
+    for(size_t i = 0; i < parsed.items.size(); i++)
+    {
+        const MidiEvent &a = translated.items[i], &b = parsed.items[i];
+        EXPECT_EQ(a.type, b.type) << i;
+        // the parser doesn't clear the other fields of system messages
+        if(a.type == SystemRealTime)
+        {
+            EXPECT_EQ(a.srt_type, b.srt_type) << i;
+            continue;
+        }
+        if(a.type == SystemCommon)
+        {
+            EXPECT_EQ(a.sc_type, b.sc_type) << i;
+            EXPECT_EQ(ToBytes(a), ToBytes(b)) << i;
+            continue;
+        }
+        EXPECT_EQ(a.channel, b.channel) << i;
+        EXPECT_EQ(a.data[0], b.data[0]) << i;
+        if(a.type != ProgramChange && a.type != ChannelPressure)
+        {
+            EXPECT_EQ(a.data[1], b.data[1]) << i;
+        }
+        if(a.type == ChannelMode)
+        {
+            EXPECT_EQ(a.cm_type, b.cm_type) << i;
+        }
+    }
+}
+
+TEST(hid_MidiUmp, d_fromMidiEvents)
+{
+    // min-center-max scaling, and back
+    EXPECT_EQ(UmpTranslator::Upscale(0, 7, 32), 0u);
+    EXPECT_EQ(UmpTranslator::Upscale(64, 7, 32), 0x80000000u);
+    EXPECT_EQ(UmpTranslator::Upscale(127, 7, 32), 0xffffffffu);
+    EXPECT_EQ(UmpTranslator::Upscale(127, 7, 16), 0xffffu);
+    EXPECT_EQ(UmpTranslator::Upscale(100, 7, 16), 0xc924u);
+    EXPECT_EQ(UmpTranslator::Upscale(0x3fff, 14, 32), 0xffffffffu);
+    for(uint32_t v = 0; v < 128; v++)
+    {
+        EXPECT_EQ(UmpTranslator::Downscale(
+                      UmpTranslator::Upscale(v, 7, 16), 16, 7),
+                  v);
+        EXPECT_EQ(UmpTranslator::Downscale(
+                      UmpTranslator::Upscale(v, 7, 32), 32, 7),
+                  v);
+    }
+    for(uint32_t v = 0; v < 0x4000; v++)
+        ASSERT_EQ(UmpTranslator::Downscale(
+                      UmpTranslator::Upscale(v, 14, 32), 32, 14),
+                  v);
+
+    const Bytes midi = {0x93, 60,  100, // note on
+                        0xb1, 99,  1,   // NRPN 1/2 = 0x2000, then 0x2001
+                        98,   2,   6,   64, 38, 1,
+                        0xb2, 0,   2,   // bank 2/3, program 5
+                        32,   3,   0xc2, 5,
+                        0xe0, 0,   64,   // pitch bend center
+                        0xb0, 7,   127, // volume
+                        0xf8};
+    MidiParser            midi_parser;
+    VectorSink<MidiEvent> events;
+    midi_parser.Init();
+    midi_parser.ParseBuffer(midi.data(), midi.size(), events);
+
+    UmpTranslator         translator;
+    UmpTranslator::Config config;
+    config.group = 1;
+    translator.Init(config);
+    VectorSink<UmpEvent> midi2;
+    for(const MidiEvent& e : events.items)
+        translator.FromMidiEvent(e, midi2);
+    EXPECT_EQ(ToWords(midi2.items),
+              Words({0x41933c00, 0xc9240000, // note on
+                     0x41310102, 0x80000000, // NRPN after CC 6
+                     0x41310102, 0x80040020, // and after CC 38
+                     0x41c20001, 0x05000203, // program with bank
+                     0x41e00000, 0x80000000, // pitch bend
+                     0x41b00700, 0xffffffff, // volume
+                     0x11f80000}));
+
+    // and back, the data entry is repeated
+    Bytes back;
+    for(const UmpEvent& ump : midi2.items)
+    {
+        VectorSink<MidiEvent> sink;
+        translator.ToMidiEvents(ump, sink);
+        const Bytes b = ToBytes(sink.items);
+        back.insert(back.end(), b.begin(), b.end());
+    }
+    EXPECT_EQ(back,
+              Bytes({0x93, 60, 100, 0xb1, 99, 1, 0xb1, 98, 2, 0xb1, 6, 64,
+                     0xb1, 38, 0, 0xb1, 99, 1, 0xb1, 98, 2, 0xb1, 6, 64,
+                     0xb1, 38, 1, 0xb2, 0,   2, 0xb2, 32, 3, 0xc2, 5,
+                     0xe0, 0,  64, 0xb0, 7, 127, 0xf8}));
+
+    // MIDI 1.0 in UMP is copied
+    config.protocol = UmpTranslator::Protocol::MIDI1;
+    translator.Init(config);
+    VectorSink<UmpEvent> midi1;
+    for(size_t i = 0; i < 8; i++)
+        translator.FromMidiEvent(events.items[i], midi1);
+    EXPECT_EQ(ToWords(midi1.items),
+              Words({0x21933c64,
+                     0x21b16301,
+                     0x21b16202,
+                     0x21b10640,
+                     0x21b12601,
+                     0x21b20002,
+                     0x21b22003,
+                     0x21c20500}));
+}
+
+TEST(hid_MidiUmp, e_sysEx)
+{
+    MidiSysExArena::Chunk chunks[4];
+    MidiSysExArena        arena_in, arena_out;
+    MidiSysExArena::Chunk chunks_out[4];
+    arena_in.Init(chunks, 4);
+    arena_out.Init(chunks_out, 4);
+    MidiParser midi_parser;
+    midi_parser.Init(&arena_in);
+
+    UmpTranslator         translator;
+    UmpTranslator::Config config;
+    config.sysex_arena = &arena_out;
+    translator.Init(config);
+
+    // a short message is one packet
+    const Bytes           one = {0xf0, 1, 2, 3, 0xf7};
+    VectorSink<MidiEvent> events;
+    midi_parser.ParseBuffer(one.data(), one.size(), events);
+    VectorSink<UmpEvent> packets;
+    translator.FromMidiEvent(events.items[0], packets, &arena_in);
+    EXPECT_EQ(ToWords(packets.items), Words({0x30030102, 0x03000000}));
+    arena_in.Release(events.items[0].sysex_chunk);
+
+    // longer than a chunk: 6 bytes per packet, start/continue/end
+    Bytes message = {0xf0};
+    for(int i = 0; i < SYSEX_BUFFER_LEN + 20; i++)
+        message.push_back(i & 0x7f);
+    message.push_back(0xf7);
+    events.items.clear();
+    packets.items.clear();
+    midi_parser.ParseBuffer(message.data(), message.size(), events);
+    ASSERT_EQ(events.items.size(), 2u);
+    for(const MidiEvent& e : events.items)
+        translator.FromMidiEvent(e, packets, &arena_in);
+    // 128 bytes in 22 packets, then 20 in 4
+    ASSERT_EQ(packets.items.size(), 26u);
+    EXPECT_EQ(packets.items[0].AsSysEx().status, UmpSysExStatus::Start);
+    EXPECT_EQ(packets.items[21].AsSysEx().size, 2);
+    EXPECT_EQ(packets.items[21].AsSysEx().status, UmpSysExStatus::Continue);
+    EXPECT_EQ(packets.items[25].AsSysEx().status, UmpSysExStatus::End);
+
+    // back into the other arena
+    VectorSink<MidiEvent> back;
+    for(const UmpEvent& ump : packets.items)
+        translator.ToMidiEvents(ump, back);
+    ASSERT_EQ(back.items.size(), 2u);
+    Bytes data = {0xf0};
+    for(const MidiEvent& e : back.items)
+    {
+        EXPECT_EQ(e.sc_type, SystemExclusive);
+        const SystemExclusiveEvent sysex = e.AsSystemExclusive(arena_out);
+        ASSERT_NE(sysex.data, nullptr);
+        data.insert(data.end(), sysex.data, sysex.data + sysex.length);
+        if(sysex.end)
+            data.push_back(0xf7);
+    }
+    EXPECT_EQ(data, message);
+}
+
+TEST(hid_MidiUmp, f_highResolutionControllers)
+{
+    // 14 bit controller updates on one channel: MIDI 1.0 NRPN (with
+    // running status) parsed bytewise and assembled from 4 CCs, versus
+    // MIDI 2.0 NRPN packets
+    constexpr int kUpdates = 20000;
+    Bytes         midi;
+    Words         ump;
+    for(int i = 0; i < kUpdates; i++)
+    {
+        const uint16_t value = (i * 37) & 0x3fff;
+        if(i == 0)
+            midi.push_back(0xb0);
+        const uint8_t nrpn[] = {99, 1, 98, 2, 6, uint8_t(value >> 7),
+                                38, uint8_t(value & 0x7f)};
+        midi.insert(midi.end(), nrpn, nrpn + sizeof(nrpn));
+        ump.push_back(0x40300102);
+        ump.push_back(UmpTranslator::Upscale(value, 14, 32));
+    }
+
+    struct NrpnSink
+    {
+        uint8_t  param[2] = {127, 127};
+        uint8_t  msb      = 0;
+        uint32_t sum      = 0;
+        void     Push(const MidiEvent& e)
+        {
+            switch(e.data[0])
+            {
+                case 99: param[0] = e.data[1]; break;
+                case 98: param[1] = e.data[1]; break;
+                case 6: msb = e.data[1]; break;
+                case 38:
+                    if(param[0] == 1 && param[1] == 2)
+                        sum += msb << 7 | e.data[1];
+                    break;
+            }
+        }
+    };
+    struct UmpSink
+    {
+        uint32_t sum = 0;
+        void     Push(const UmpEvent& e)
+        {
+            const Midi2ControllerEvent c = e.AsController();
+            if(c.bank == 1 && c.index == 2)
+                sum += UmpTranslator::Downscale(c.value, 32, 14);
+        }
+    };
+
+    using Clock = std::chrono::steady_clock;
+    double   best_midi = 1e9, best_ump = 1e9;
+    uint32_t sum_midi = 0, sum_ump = 0;
+    for(int run = 0; run < 5; run++)
+    {
+        MidiParser parser;
+        NrpnSink   nrpn;
+        parser.Init();
+        auto start = Clock::now();
+        parser.ParseBuffer(midi.data(), midi.size(), nrpn);
+        std::chrono::duration<double, std::nano> t = Clock::now() - start;
+        best_midi = std::min(best_midi, t.count() / kUpdates);
+        sum_midi  = nrpn.sum;
+
+        UmpParser ump_parser;
+        UmpSink   sink;
+        start = Clock::now();
+        ump_parser.ParseBuffer(ump.data(), ump.size(), sink);
+        t        = Clock::now() - start;
+        best_ump = std::min(best_ump, t.count() / kUpdates);
+        sum_ump  = sink.sum;
+    }
+    EXPECT_EQ(sum_midi, sum_ump);
+    printf("[ BENCH    ] 14 bit controller update: MIDI 1.0 NRPN %zu bytes "
+           "%.1f ns, UMP %zu bytes %.1f ns\n",
+           midi.size() / kUpdates,
+           best_midi,
+           ump.size() * 4 / kUpdates,
+           best_ump);
+}
+
+TEST(hid_MidiUmp, g_orphanSysExPackets)
+{
+    MidiSysExArena::Chunk chunks[4];
+    MidiSysExArena        arena_out;
+    arena_out.Init(chunks, 4);
+    UmpTranslator         translator;
+    UmpTranslator::Config config;
+    config.sysex_arena = &arena_out;
+    translator.Init(config);
+    VectorSink<MidiEvent> back;
+
+    // the rest of a message without its start is dropped
+    const uint8_t orphan[6] = {0x10, 0x20, 0x30, 0x40, 0x50, 0x60};
+    translator.ToMidiEvents(
+        UmpEvent::MakeSysEx(0, UmpSysExStatus::Continue, orphan, 6), back);
+    translator.ToMidiEvents(
+        UmpEvent::MakeSysEx(0, UmpSysExStatus::End, orphan, 6), back);
+    EXPECT_TRUE(back.items.empty());
+
+    // and doesn't get in the way of the next message
+    translator.ToMidiEvents(
+        UmpEvent::MakeSysEx(0, UmpSysExStatus::Complete, orphan, 3), back);
+    ASSERT_EQ(back.items.size(), 1u);
+    const SystemExclusiveEvent sysex
+        = back.items[0].AsSystemExclusive(arena_out);
+    ASSERT_EQ(sysex.length, 3);
+    EXPECT_EQ(sysex.data[0], 0x10);
+    EXPECT_EQ(sysex.data[2], 0x30);
+    EXPECT_TRUE(sysex.end);
+}
@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 #include "hid/midi.h"
 #include "sys/system.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
 
 //get rid of compiler errors over unused args in stubs
 #define UNUSED(x) (void)x
@@ -515,15 +518,18 @@ TEST_F(MidiTest, systemExclusive)
     {
         msgs[i] = (uint8_t)i;
     }
+    const MidiSysExArena& arena = midi.GetSysExArena();
 
     // short message
     int                  size       = 6;
     MidiEvent            event      = ParseAndPopSysex(msgs, size);
-    SystemExclusiveEvent sysexEvent = event.AsSystemExclusive();
+    SystemExclusiveEvent sysexEvent = event.AsSystemExclusive(arena);
     EXPECT_EQ(event.type, SystemCommon);
     EXPECT_EQ(event.sc_type, SystemExclusive);
 
     EXPECT_EQ(sysexEvent.length, size);
+    EXPECT_TRUE(sysexEvent.begin);
+    EXPECT_TRUE(sysexEvent.end);
 
     for(int i = 0; i < size; i++)
     {
@@ -535,11 +541,13 @@ TEST_F(MidiTest, systemExclusive)
     // full length message
     size       = 128;
     event      = ParseAndPopSysex(msgs, size);
-    sysexEvent = event.AsSystemExclusive();
+    sysexEvent = event.AsSystemExclusive(arena);
     EXPECT_EQ(event.type, SystemCommon);
     EXPECT_EQ(event.sc_type, SystemExclusive);
 
     EXPECT_EQ(sysexEvent.length, size);
+    EXPECT_TRUE(sysexEvent.begin);
+    EXPECT_TRUE(sysexEvent.end);
 
     for(int i = 0; i < size; i++)
     {
@@ -548,22 +556,138 @@ TEST_F(MidiTest, systemExclusive)
 
     EXPECT_FALSE(midi.HasEvents());
 
-    //max len is 128, let's go past that
+    // past the max len of 128, the rest arrives in a second event
     size       = 135;
     event      = ParseAndPopSysex(msgs, size);
-    sysexEvent = event.AsSystemExclusive();
+    sysexEvent = event.AsSystemExclusive(arena);
     EXPECT_EQ(event.type, SystemCommon);
     EXPECT_EQ(event.sc_type, SystemExclusive);
 
-    //max len
     EXPECT_EQ(sysexEvent.length, 128);
+    EXPECT_TRUE(sysexEvent.begin);
+    EXPECT_FALSE(sysexEvent.end);
 
     for(int i = 0; i < 128; i++)
     {
         EXPECT_EQ(sysexEvent.data[i], msgs[i]);
     }
 
+    event      = midi.PopEvent();
+    sysexEvent = event.AsSystemExclusive(arena);
+    EXPECT_EQ(event.sc_type, SystemExclusive);
+    EXPECT_EQ(sysexEvent.length, 7);
+    EXPECT_FALSE(sysexEvent.begin);
+    EXPECT_TRUE(sysexEvent.end);
+
+    for(int i = 0; i < 7; i++)
+    {
+        EXPECT_EQ(sysexEvent.data[i], msgs[128 + i]);
+    }
+
+    EXPECT_FALSE(midi.HasEvents());
+}
+
+TEST_F(MidiTest, systemExclusiveStreaming)
+{
+    // a dump much larger than all chunks together, popped while parsing
+    std::vector<uint8_t> dump(10000), received;
+    for(size_t i = 0; i < dump.size(); i++)
+        dump[i] = uint8_t((i * 13) & 0x7f);
+
+    int num_events = 0, num_ends = 0;
+    midi.Parse(0xf0);
+    for(size_t i = 0; i <= dump.size(); i++)
+    {
+        midi.Parse(i < dump.size() ? dump[i] : 0xf7);
+        while(midi.HasEvents())
+        {
+            const MidiEvent event = midi.PopEvent();
+            ASSERT_EQ(event.sc_type, SystemExclusive);
+            const auto sysex = event.AsSystemExclusive(midi.GetSysExArena());
+            ASSERT_NE(sysex.data, nullptr);
+            EXPECT_EQ(sysex.begin, num_events == 0);
+            received.insert(
+                received.end(), sysex.data, sysex.data + sysex.length);
+            num_events++;
+            num_ends += sysex.end;
+        }
+    }
+    EXPECT_EQ(num_events, int(dump.size() + 127) / 128);
+    EXPECT_EQ(num_ends, 1);
+    EXPECT_EQ(received, dump);
+
+    // the chunks are still usable afterwards
+    uint8_t msg[] = {1, 2, 3};
+    auto    sysex = ParseAndPopSysex(msg, 3).AsSystemExclusive(
+        midi.GetSysExArena());
+    EXPECT_EQ(sysex.length, 3);
+    EXPECT_TRUE(sysex.begin && sysex.end);
+}
+
+TEST_F(MidiTest, systemExclusiveArenaFull)
+{
+    // nothing is popped, so the 8 chunks of the handler run out
+    std::vector<uint8_t> dump(8 * 128 + 10, 0x55);
+    midi.Parse(0xf0);
+    Parse(dump.data(), dump.size());
+    midi.Parse(0xf7);
+
+    // and the next message doesn't get any data either
+    uint8_t msg[] = {0xf0, 1, 2, 3, 0xf7, 0x90, 0x40, 0x7f};
+    Parse(msg, sizeof(msg));
+
+    const MidiSysExArena& arena = midi.GetSysExArena();
+    for(int i = 0; i < 8; i++)
+    {
+        const auto sysex = midi.PopEvent().AsSystemExclusive(arena);
+        EXPECT_EQ(sysex.length, 128);
+        EXPECT_FALSE(sysex.end);
+    }
+    // there's no chunk left for the end of the dump
+    MidiEvent event = midi.PopEvent();
+    EXPECT_EQ(event.sc_type, SystemExclusive);
+    EXPECT_EQ(event.sysex_chunk, MidiSysExArena::kInvalidHandle);
+    auto sysex = event.AsSystemExclusive(arena);
+    EXPECT_EQ(sysex.data, nullptr);
+    EXPECT_TRUE(sysex.end);
+
+    event = midi.PopEvent();
+    EXPECT_EQ(event.sc_type, SystemExclusive);
+    EXPECT_EQ(event.AsSystemExclusive(arena).data, nullptr);
+    EXPECT_EQ(midi.PopEvent().type, NoteOn);
     EXPECT_FALSE(midi.HasEvents());
+
+    // chunks are free again once the events are popped
+    EXPECT_EQ(arena.GetNumUsed(), 0u);
+    sysex = ParseAndPopSysex(&msg[1], 3).AsSystemExclusive(arena);
+    EXPECT_EQ(sysex.length, 3);
+}
+
+TEST_F(MidiTest, compactEvents)
+{
+    EXPECT_LE(sizeof(MidiEvent), 8u);
+
+    // handles stay valid while the chunk indices wrap around
+    MidiSysExArena::Chunk chunks[4];
+    MidiSysExArena        arena;
+    EXPECT_FALSE(arena.Init(chunks, 3));
+    ASSERT_TRUE(arena.Init(chunks, 4));
+    for(int i = 0; i < 1000; i++)
+    {
+        ASSERT_TRUE(arena.Open());
+        arena.Append(uint8_t(i & 0x7f));
+        const uint8_t a = arena.Commit(MidiSysExArena::FLAG_BEGIN);
+        ASSERT_TRUE(arena.Open());
+        const uint8_t b = arena.Commit(MidiSysExArena::FLAG_END);
+        ASSERT_NE(a, MidiSysExArena::kInvalidHandle);
+        ASSERT_NE(arena.Get(a), nullptr);
+        EXPECT_EQ(arena.Get(a)->data[0], i & 0x7f);
+        EXPECT_EQ(arena.Get(b)->size, 0);
+        // releasing b releases a as well
+        arena.Release(b);
+        ASSERT_EQ(arena.Get(a), nullptr);
+        ASSERT_EQ(arena.GetNumUsed(), 0u);
+    }
 }
 
 // ================ Running Status ================
@@ -781,4 +905,220 @@ TEST_F(MidiTest, singleByteRunningStatusTest)
     }
 
     EXPECT_FALSE(midi.HasEvents());
-}
\ No newline at end of file
+}
+// ================ ParseBuffer ================
+
+namespace
+{
+/** An event, with a copy of its SysEx data */
+struct RecordedEvent
+{
+    MidiEvent            event;
+    std::vector<uint8_t> sysex;
+};
+
+/** Collects the events from a parser, and releases their SysEx data */
+struct EventSink
+{
+    MidiSysExArena::Chunk      chunks[4];
+    MidiSysExArena             arena;
+    std::vector<RecordedEvent> events;
+
+    EventSink() { arena.Init(chunks, 4); }
+
+    void Push(const MidiEvent& e)
+    {
+        const auto sysex = e.AsSystemExclusive(arena);
+        events.push_back({e, {}});
+        if(e.type == SystemCommon && e.sc_type == SystemExclusive)
+        {
+            if(sysex.data != nullptr)
+                events.back().sysex.assign(sysex.data,
+                                           sysex.data + sysex.length);
+            arena.Release(e.sysex_chunk);
+        }
+    }
+};
+
+void ExpectSameEvent(const RecordedEvent& ra,
+                     const RecordedEvent& rb,
+                     size_t               idx)
+{
+    const MidiEvent& a = ra.event;
+    const MidiEvent& b = rb.event;
+    ASSERT_EQ(a.type, b.type) << "event " << idx;
+    EXPECT_EQ(a.channel, b.channel) << "event " << idx;
+    switch(a.type)
+    {
+        case SystemCommon:
+            EXPECT_EQ(a.sc_type, b.sc_type) << "event " << idx;
+            EXPECT_EQ(ra.sysex, rb.sysex) << "event " << idx;
+            break;
+        case SystemRealTime:
+            EXPECT_EQ(a.srt_type, b.srt_type) << "event " << idx;
+            break;
+        case ChannelMode:
+            EXPECT_EQ(a.cm_type, b.cm_type) << "event " << idx;
+            // fall through
+        default:
+            EXPECT_EQ(a.data[0], b.data[0]) << "event " << idx;
+            EXPECT_EQ(a.data[1], b.data[1]) << "event " << idx;
+            break;
+    }
+}
+
+/** Messages from the tests above plus a dense MPE controller stream */
+std::vector<uint8_t> MakeCorpus()
+{
+    std::vector<uint8_t> c;
+    for(uint8_t chn = 0; chn < 16; chn++)
+    {
+        for(uint8_t note = 0; note < 128; note += 8)
+        {
+            c.insert(c.end(), {uint8_t(0x90 | chn), note, 100});
+            c.insert(c.end(), {uint8_t(0x80 | chn), note, 0});
+        }
+    }
+    c.insert(c.end(), {0x90, 0x10, 0x0f, 1, 1, 2, 2, 3, 3, 0x40, 0});
+    c.insert(c.end(), {0xB3, 0x10, 0x0f, 4, 4, 5, 5});
+    c.insert(c.end(), {0xB3, 121, 0, 0xB3, 123, 0});
+    c.insert(c.end(), {0x90, 0x24, 0x40, 0xf8, 0xf8, 0xf8, 0x24, 0x00});
+    c.insert(c.end(), {0xD3, 1, 2, 3, 0xC3, 4, 5, 6});
+    c.insert(c.end(), {0xF1, 0x12, 0xF2, 0x10, 0x20, 0xF3, 0x05, 0xF6});
+    c.insert(c.end(), {0xf0, 1, 2, 3, 4, 0xf7, 0xFA, 0xFC});
+    // MPE: per note pitch bend, timbre (CC74) and pressure on 15 channels
+    for(int n = 0; n < 64; n++)
+    {
+        for(uint8_t chn = 1; chn < 16; chn++)
+        {
+            const uint8_t v = uint8_t((n * 7 + chn) & 0x7f);
+            c.insert(c.end(), {uint8_t(0xE0 | chn), v, 0x40});
+            c.insert(c.end(), {uint8_t(0xB0 | chn), 74, v, 74, uint8_t(v ^ 1)});
+            c.insert(c.end(), {uint8_t(0xD0 | chn), v, uint8_t(v ^ 2)});
+        }
+    }
+    return c;
+}
+
+/** Runs the same bytes through Parse() and ParseBuffer() (in chunks) */
+void ExpectParseBufferMatchesParse(const std::vector<uint8_t>& bytes,
+                                   size_t                      chunk)
+{
+    // static, so both start out with the same (zeroed) state
+    static MidiParser byte_parser, buffer_parser;
+    EventSink         expected, sink;
+    byte_parser.Init(&expected.arena);
+    buffer_parser.Init(&sink.arena);
+
+    MidiEvent e;
+    for(auto b : bytes)
+        if(byte_parser.Parse(b, &e))
+            expected.Push(e);
+
+    for(size_t pos = 0; pos < bytes.size(); pos += chunk)
+        buffer_parser.ParseBuffer(
+            &bytes[pos], std::min(chunk, bytes.size() - pos), sink);
+
+    ASSERT_EQ(sink.events.size(), expected.events.size())
+        << "chunk " << chunk;
+    for(size_t i = 0; i < expected.events.size(); i++)
+        ExpectSameEvent(expected.events[i], sink.events[i], i);
+}
+
+} // namespace
+
+TEST_F(MidiTest, parseBufferMatchesParse)
+{
+    const auto corpus = MakeCorpus();
+    for(size_t chunk : {1, 2, 3, 7, 64, 100000})
+        ExpectParseBufferMatchesParse(corpus, chunk);
+
+    // random bytes, to cover all the odd cases of the byte parser
+    std::vector<uint8_t> noise(20000);
+    uint32_t             seed = 12345;
+    for(auto& b : noise)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        b    = uint8_t(seed >> 24);
+        // mostly data bytes and channel messages, some system messages
+        if((seed & 0x300) != 0 && b >= 0xF0)
+            b &= 0x7f;
+    }
+    for(size_t chunk : {1, 5, 256})
+        ExpectParseBufferMatchesParse(noise, chunk);
+}
+
+TEST_F(MidiTest, parseBufferHandler)
+{
+    uint8_t msgs[] = {0x90, 0x40, 100, 0x41, 0, 0xf8, 0xB0, 1, 64};
+    midi.Parse(msgs[0]); // status arrives in a previous buffer
+    midi.ParseBuffer(&msgs[1], sizeof(msgs) - 1);
+
+    EXPECT_EQ(midi.PopEvent().type, NoteOn);
+    EXPECT_EQ(midi.PopEvent().type, NoteOff);
+    EXPECT_EQ(midi.PopEvent().type, SystemRealTime);
+    MidiEvent cc = midi.PopEvent();
+    EXPECT_EQ(cc.type, ControlChange);
+    EXPECT_EQ(cc.data[1], 64);
+    EXPECT_FALSE(midi.HasEvents());
+}
+
+/** Host benchmark of ParseBuffer() against byte-wise parsing into the
+ *  handler's queue. This doesn't assert on timing - the harness builds
+ *  without optimization, so for meaningful numbers add -O2 to
+ *  COMPILE_FLAGS in the Makefile. */
+TEST_F(MidiTest, parseBufferBenchmark)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const auto   corpus      = MakeCorpus();
+    const size_t kIterations = 200;
+    const size_t kChunk      = 64;
+
+    static MidiParser                parser;
+    static SpscQueue<MidiEvent, 256> queue;
+    MidiEvent                        e;
+    size_t                           num_events = 0;
+
+    parser.Init();
+    auto start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        for(size_t pos = 0; pos < corpus.size(); pos += kChunk)
+        {
+            const size_t end = std::min(pos + kChunk, corpus.size());
+            for(size_t i = pos; i < end; i++)
+            {
+                MidiEvent event;
+                if(parser.Parse(corpus[i], &event))
+                    queue.Push(event);
+            }
+            while(queue.Pop(e))
+                num_events++;
+        }
+    }
+    const double byte_sec
+        = std::chrono::duration<double>(Clock::now() - start).count();
+
+    parser.Init();
+    start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        for(size_t pos = 0; pos < corpus.size(); pos += kChunk)
+        {
+            const size_t len = std::min(kChunk, corpus.size() - pos);
+            parser.ParseBuffer(&corpus[pos], len, queue);
+            while(queue.Pop(e))
+                num_events--;
+        }
+    }
+    const double buffer_sec
+        = std::chrono::duration<double>(Clock::now() - start).count();
+    EXPECT_EQ(num_events, 0u);
+
+    const double mb = double(kIterations * corpus.size()) / 1e6;
+    printf("[ BENCH    ] MIDI corpus: Parse() %.1f MB/s, ParseBuffer() "
+           "%.1f MB/s\n",
+           mb / byte_sec,
+           mb / buffer_sec);
+}
@@ -0,0 +1,185 @@
+#include <gtest/gtest.h>
+#include "util/Profiler.h"
+#include <cstdarg>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using TestProfiler = Profiler<4, 3>;
+
+/** Collects the lines printed by Profiler::Dump() */
+struct FakeLogger
+{
+    static std::vector<std::string> lines;
+
+    static void PrintLine(const char* format, ...)
+    {
+        char    buf[128];
+        va_list va;
+        va_start(va, format);
+        vsnprintf(buf, sizeof(buf), format, va);
+        va_end(va);
+        lines.push_back(buf);
+    }
+};
+std::vector<std::string> FakeLogger::lines;
+
+/** Advances the mocked system tick */
+void Advance(uint32_t ticks)
+{
+    System::SetTickForUnitTest(System::GetTick() + ticks);
+}
+
+} // namespace
+
+TEST(util_Profiler, a_registry)
+{
+    TestProfiler profiler;
+    EXPECT_EQ(profiler.GetNumZones(), 0u);
+
+    const size_t a = profiler.AddZone("a");
+    const size_t b = profiler.AddZone("b");
+    EXPECT_EQ(a, 0u);
+    EXPECT_EQ(b, 1u);
+
+    // same name (even from a different string) gives the same zone
+    const char name[] = "a";
+    EXPECT_EQ(profiler.AddZone(name), a);
+    EXPECT_EQ(profiler.FindZone("b"), b);
+    EXPECT_EQ(profiler.FindZone("c"), TestProfiler::kInvalidZone);
+
+    // the registry is full after 4 zones
+    EXPECT_EQ(profiler.AddZone("c"), 2u);
+    EXPECT_EQ(profiler.AddZone("d"), 3u);
+    EXPECT_EQ(profiler.AddZone("e"), TestProfiler::kInvalidZone);
+    EXPECT_EQ(profiler.GetNumZones(), 4u);
+    EXPECT_STREQ(profiler.GetStats(3).name, "d");
+    EXPECT_EQ(profiler.GetStats(4).name, nullptr);
+
+    // timing an invalid zone is harmless
+    {
+        TestProfiler::Scope s(profiler, TestProfiler::kInvalidZone);
+        Advance(10);
+    }
+}
+
+TEST(util_Profiler, b_minAvgMax)
+{
+    System::SetTickForUnitTest(1000);
+    TestProfiler profiler;
+    const size_t zone = profiler.AddZone("zone");
+
+    for(uint32_t ticks : {30u, 10u, 20u})
+    {
+        TestProfiler::Scope s(profiler, zone);
+        Advance(ticks);
+    }
+
+    const auto stats = profiler.GetStats(zone);
+    EXPECT_EQ(stats.count, 3u);
+    EXPECT_EQ(stats.min_ticks, 10u);
+    EXPECT_EQ(stats.max_ticks, 30u);
+    EXPECT_EQ(stats.avg_ticks, 20u);
+    EXPECT_EQ(stats.avg_self_ticks, 20u);
+
+    // tick counter wraps around
+    System::SetTickForUnitTest(0xfffffff0);
+    profiler.Begin(zone);
+    Advance(0x40);
+    profiler.End();
+    EXPECT_EQ(profiler.GetStats(zone).max_ticks, 0x40u);
+}
+
+TEST(util_Profiler, c_nestedZones)
+{
+    TestProfiler profiler;
+    const size_t callback = profiler.AddZone("callback");
+    const size_t osc      = profiler.AddZone("osc");
+    const size_t filter   = profiler.AddZone("filter");
+
+    for(int block = 0; block < 2; block++)
+    {
+        TestProfiler::Scope s(profiler, callback);
+        Advance(5);
+        {
+            TestProfiler::Scope s_osc(profiler, osc);
+            Advance(100);
+        }
+        {
+            TestProfiler::Scope s_filter(profiler, filter);
+            Advance(50);
+            {
+                // same zone, nested
+                TestProfiler::Scope s_osc(profiler, osc);
+                Advance(20);
+            }
+        }
+        Advance(5);
+    }
+
+    const auto cb = profiler.GetStats(callback);
+    EXPECT_EQ(cb.count, 2u);
+    EXPECT_EQ(cb.avg_ticks, 180u);
+    EXPECT_EQ(cb.avg_self_ticks, 10u);
+
+    const auto o = profiler.GetStats(osc);
+    EXPECT_EQ(o.count, 4u);
+    EXPECT_EQ(o.min_ticks, 20u);
+    EXPECT_EQ(o.max_ticks, 100u);
+    EXPECT_EQ(o.avg_ticks, 60u);
+
+    const auto f = profiler.GetStats(filter);
+    EXPECT_EQ(f.avg_ticks, 70u);
+    EXPECT_EQ(f.avg_self_ticks, 50u);
+}
+
+TEST(util_Profiler, d_depthOverflowAndReset)
+{
+    TestProfiler profiler;
+    const size_t zone = profiler.AddZone("zone");
+
+    // 4 levels deep with a maximum of 3
+    for(int i = 0; i < 4; i++)
+        profiler.Begin(zone);
+    Advance(10);
+    for(int i = 0; i < 4; i++)
+        profiler.End();
+    EXPECT_EQ(profiler.GetNumOverflows(), 1u);
+    EXPECT_EQ(profiler.GetStats(zone).count, 3u);
+
+    // unbalanced End() is ignored
+    profiler.End();
+
+    // readings are cleared when the next zone begins
+    profiler.Reset();
+    EXPECT_EQ(profiler.GetStats(zone).count, 3u);
+    {
+        TestProfiler::Scope s(profiler, zone);
+        Advance(7);
+    }
+    EXPECT_EQ(profiler.GetNumOverflows(), 0u);
+    EXPECT_EQ(profiler.GetStats(zone).count, 1u);
+    EXPECT_EQ(profiler.GetStats(zone).max_ticks, 7u);
+}
+
+TEST(util_Profiler, e_dump)
+{
+    System::SetTickFreqForUnitTest(1000000); // 1 tick = 1us
+    TestProfiler profiler;
+    const size_t zone = profiler.AddZone("reverb");
+    for(uint32_t ticks : {100u, 300u})
+    {
+        TestProfiler::Scope s(profiler, zone);
+        Advance(ticks);
+    }
+
+    FakeLogger::lines.clear();
+    profiler.Dump<FakeLogger>();
+    ASSERT_EQ(FakeLogger::lines.size(), 2u);
+    EXPECT_EQ(FakeLogger::lines[1],
+              "reverb                2      100      200      300      200");
+}
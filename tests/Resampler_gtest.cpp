@@ -0,0 +1,248 @@
+#include <gtest/gtest.h>
+#include "util/Resampler.h"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+const double kPi = 3.14159265358979323846;
+
+struct Rates
+{
+    uint32_t in;
+    uint32_t out;
+};
+
+const Rates kRates[] = {{44100, 48000}, {48000, 96000}, {48000, 44100}};
+
+/** Resamples a whole signal in one go */
+template <typename ResamplerType>
+std::vector<float> ResampleAll(ResamplerType&            r,
+                               const std::vector<float>& in)
+{
+    std::vector<float> out(r.GetMaxOutputSize(in.size()));
+    const float*       src[] = {in.data()};
+    float*             dst[] = {out.data()};
+    const auto         count = r.Process(src, in.size(), dst, out.size());
+    EXPECT_EQ(count.in, in.size());
+    out.resize(count.out);
+    return out;
+}
+
+std::vector<float> MakeSine(double freq, double rate, size_t size)
+{
+    std::vector<float> x(size);
+    for(size_t i = 0; i < size; i++)
+        x[i] = float(std::sin(2 * kPi * freq * i / rate));
+    return x;
+}
+
+/** Fits a sine of the given frequency to y[start..start+len) and returns
+ *  the amplitude, and the RMS of the remainder in residual.
+ */
+double FitSine(const std::vector<float>& y,
+               double                    freq,
+               double                    rate,
+               size_t                    start,
+               size_t                    len,
+               double&                   residual)
+{
+    double a = 0, b = 0;
+    for(size_t i = start; i < start + len; i++)
+    {
+        a += y[i] * std::sin(2 * kPi * freq * i / rate);
+        b += y[i] * std::cos(2 * kPi * freq * i / rate);
+    }
+    a *= 2.0 / len;
+    b *= 2.0 / len;
+    double err = 0;
+    for(size_t i = start; i < start + len; i++)
+    {
+        const double fit = a * std::sin(2 * kPi * freq * i / rate)
+                           + b * std::cos(2 * kPi * freq * i / rate);
+        err += (y[i] - fit) * (y[i] - fit);
+    }
+    residual = std::sqrt(err / len);
+    return std::sqrt(a * a + b * b);
+}
+
+} // namespace
+
+TEST(util_Resampler, a_init)
+{
+    Resampler<1> r;
+    EXPECT_EQ(r.Init(0, 48000), Resampler<1>::Result::ERR);
+    EXPECT_EQ(r.Init(48000, 0), Resampler<1>::Result::ERR);
+
+    ASSERT_EQ(r.Init(44100, 48000), Resampler<1>::Result::OK);
+    EXPECT_EQ(r.GetUpFactor(), 160u);
+    EXPECT_EQ(r.GetDownFactor(), 147u);
+    ASSERT_EQ(r.Init(48000, 96000), Resampler<1>::Result::OK);
+    EXPECT_EQ(r.GetUpFactor(), 2u);
+    EXPECT_EQ(r.GetDownFactor(), 1u);
+
+    // 22.05kHz to 48kHz needs 320 phases
+    EXPECT_EQ(r.Init(22050, 48000), Resampler<1>::Result::ERR);
+    Resampler<1, 16, 320> big;
+    EXPECT_EQ(big.Init(22050, 48000), (Resampler<1, 16, 320>::Result::OK));
+}
+
+TEST(util_Resampler, b_outputSizeAndDcGain)
+{
+    for(auto rates : kRates)
+    {
+        Resampler<1> r;
+        ASSERT_EQ(r.Init(rates.in, rates.out), Resampler<1>::Result::OK);
+
+        const std::vector<float> in(rates.in / 10, 1.f);
+        const auto               out = ResampleAll(r, in);
+
+        // 100ms of input gives 100ms of output
+        EXPECT_NEAR(out.size(), rates.out / 10, 1);
+        EXPECT_LE(out.size(), r.GetMaxOutputSize(in.size()));
+
+        // unity gain after the filter has settled
+        for(size_t i = 2 * 32 * rates.out / rates.in; i < out.size(); i++)
+            ASSERT_NEAR(out[i], 1.f, 1e-5f) << i;
+    }
+}
+
+TEST(util_Resampler, c_sineIsPreserved)
+{
+    for(auto rates : kRates)
+    {
+        Resampler<1> r;
+        ASSERT_EQ(r.Init(rates.in, rates.out), Resampler<1>::Result::OK);
+        const auto in  = MakeSine(1000., rates.in, rates.in / 5);
+        const auto out = ResampleAll(r, in);
+
+        // 10 periods of 1kHz are a whole number of samples at all rates
+        double residual;
+        const double amp
+            = FitSine(out, 1000., rates.out, 200, rates.out / 100, residual);
+        EXPECT_NEAR(amp, 1.0, 1e-3);
+        EXPECT_LT(residual, 1e-3) << rates.in << " -> " << rates.out;
+    }
+}
+
+TEST(util_Resampler, d_aliasesAreFiltered)
+{
+    // 23kHz can't be represented at 44.1kHz and has to be removed
+    Resampler<1> r;
+    ASSERT_EQ(r.Init(48000, 44100), Resampler<1>::Result::OK);
+    const auto in  = MakeSine(23000., 48000, 9600);
+    const auto out = ResampleAll(r, in);
+
+    double rms = 0;
+    for(size_t i = 200; i < out.size(); i++)
+        rms += out[i] * out[i];
+    rms = std::sqrt(rms / (out.size() - 200));
+    EXPECT_LT(rms, 0.01); // -37dB below the 0.707 input
+}
+
+TEST(util_Resampler, e_streamingMatchesOneShot)
+{
+    Resampler<2> one_shot, chunked, pulled;
+    ASSERT_EQ(one_shot.Init(44100, 48000), Resampler<2>::Result::OK);
+    ASSERT_EQ(chunked.Init(44100, 48000), Resampler<2>::Result::OK);
+    ASSERT_EQ(pulled.Init(44100, 48000), Resampler<2>::Result::OK);
+
+    const size_t             size = 4410;
+    const std::vector<float> left = MakeSine(440., 44100, size);
+    std::vector<float>       right(size);
+    for(size_t i = 0; i < size; i++)
+        right[i] = float(i % 100) / 100.f;
+    const float* in[] = {left.data(), right.data()};
+
+    // reference, all at once
+    const size_t       max_out = one_shot.GetMaxOutputSize(size);
+    std::vector<float> ref_l(max_out), ref_r(max_out);
+    float*             ref[]     = {ref_l.data(), ref_r.data()};
+    const auto         ref_count = one_shot.Process(in, size, ref, max_out);
+    ASSERT_EQ(ref_count.in, size);
+
+    // odd sized input chunks into a small output buffer
+    std::vector<float> out_l, out_r;
+    size_t             pos = 0;
+    while(pos < size)
+    {
+        const size_t chunk = std::min<size_t>(37, size - pos);
+        const float* src[] = {in[0] + pos, in[1] + pos};
+        float        buf_l[16], buf_r[16];
+        float*       dst[] = {buf_l, buf_r};
+        const auto   count = chunked.Process(src, chunk, dst, 16);
+        pos += count.in;
+        out_l.insert(out_l.end(), buf_l, buf_l + count.out);
+        out_r.insert(out_r.end(), buf_r, buf_r + count.out);
+    }
+    ASSERT_EQ(out_l.size(), ref_count.out);
+    for(size_t i = 0; i < ref_count.out; i++)
+    {
+        ASSERT_EQ(out_l[i], ref_l[i]);
+        ASSERT_EQ(out_r[i], ref_r[i]);
+    }
+
+    // pulled in blocks of 48, as from the audio callback
+    size_t read = 0;
+    for(size_t block = 0; (block + 1) * 48 <= ref_count.out; block++)
+    {
+        float  buf_l[48], buf_r[48];
+        float* dst[] = {buf_l, buf_r};
+        pulled.Render(dst, 48, [&](float* frame) {
+            frame[0] = left[read];
+            frame[1] = right[read];
+            read++;
+        });
+        for(size_t i = 0; i < 48; i++)
+        {
+            ASSERT_EQ(buf_l[i], ref_l[block * 48 + i]);
+            ASSERT_EQ(buf_r[i], ref_r[block * 48 + i]);
+        }
+    }
+    EXPECT_LE(read, size);
+}
+
+/** Host benchmark in samples per second and channel. This doesn't assert
+ *  on timing - the harness builds without optimization, so for meaningful
+ *  numbers add -O2 to COMPILE_FLAGS in the Makefile. */
+TEST(util_Resampler, f_benchmark)
+{
+    using Clock = std::chrono::steady_clock;
+
+    for(auto rates : kRates)
+    {
+        Resampler<2> r;
+        ASSERT_EQ(r.Init(rates.in, rates.out), Resampler<2>::Result::OK);
+
+        const size_t       kBlock = 48;
+        std::vector<float> in(kBlock * 4, 0.5f);
+        std::vector<float> out_l(kBlock), out_r(kBlock);
+        float*             out[] = {out_l.data(), out_r.data()};
+        size_t             pos   = 0;
+        volatile float     sink  = 0.f;
+
+        const size_t kBlocks = 2000;
+        const auto   start   = Clock::now();
+        for(size_t n = 0; n < kBlocks; n++)
+        {
+            r.Render(out, kBlock, [&](float* frame) {
+                frame[0] = frame[1] = in[pos];
+                pos                 = pos + 1 < in.size() ? pos + 1 : 0;
+            });
+            sink = sink + out_l[0];
+        }
+        const double sec = std::chrono::duration<double>(Clock::now() - start)
+                               .count();
+
+        printf("[ BENCH    ] %u -> %u Hz: %.2f M output samples/s per "
+               "channel\n",
+               (unsigned)rates.in,
+               (unsigned)rates.out,
+               kBlocks * kBlock / sec / 1e6);
+        (void)sink;
+    }
+}
@@ -0,0 +1,182 @@
+#include <gtest/gtest.h>
+#include "util/ringbuffer.h"
+#include <chrono>
+#include <cstdio>
+#include <vector>
+
+using namespace daisy;
+
+TEST(util_RingBuffer, a_readableAndWritable)
+{
+    // the old modulo arithmetic was only correct for powers of two
+    RingBuffer<int, 10> buffer;
+    buffer.Init();
+    EXPECT_EQ(buffer.readable(), 0u);
+    EXPECT_EQ(buffer.writable(), 9u);
+
+    for(int i = 0; i < 5; i++)
+        buffer.Write(i);
+    EXPECT_EQ(buffer.readable(), 5u);
+    EXPECT_EQ(buffer.writable(), 4u);
+
+    // wrap around several times
+    for(int i = 5; i < 100; i++)
+    {
+        buffer.Write(i);
+        ASSERT_EQ(buffer.Read(), i - 5);
+        ASSERT_EQ(buffer.readable(), 5u);
+        ASSERT_EQ(buffer.writable(), 4u);
+    }
+
+    RingBuffer<int, 16> pow2;
+    pow2.Init();
+    for(int i = 0; i < 15; i++)
+        pow2.Write(i);
+    EXPECT_EQ(pow2.readable(), 15u);
+    EXPECT_EQ(pow2.writable(), 0u);
+}
+
+TEST(util_RingBuffer, b_spans)
+{
+    RingBuffer<uint8_t, 8> buffer;
+    buffer.Init();
+
+    // empty: contiguous space up to the last slot
+    auto ws = buffer.GetWriteSpan();
+    EXPECT_EQ(ws.count, 7u);
+    EXPECT_EQ(buffer.GetReadSpan().count, 0u);
+    for(uint8_t i = 0; i < 5; i++)
+        ws.data[i] = i;
+    buffer.CommitWrite(5);
+    EXPECT_EQ(buffer.readable(), 5u);
+
+    auto rs = buffer.GetReadSpan();
+    ASSERT_EQ(rs.count, 5u);
+    EXPECT_EQ(rs.data[4], 4);
+    buffer.ConsumeRead(4);
+    EXPECT_EQ(buffer.readable(), 1u);
+
+    // free space wraps: first span runs to the end of the buffer
+    ws = buffer.GetWriteSpan();
+    EXPECT_EQ(ws.count, 3u);
+    ws.data[0] = ws.data[1] = ws.data[2] = 10;
+    buffer.CommitWrite(3);
+    ws = buffer.GetWriteSpan();
+    EXPECT_EQ(ws.count, 3u); // up to one before the read position
+    EXPECT_EQ(buffer.writable(), 3u);
+
+    // data wraps: read span stops at the end of the buffer
+    rs = buffer.GetReadSpan();
+    EXPECT_EQ(rs.count, 4u);
+    buffer.ConsumeRead(4);
+    EXPECT_EQ(buffer.readable(), 0u);
+
+    // committing or consuming too much is clamped
+    buffer.CommitWrite(100);
+    EXPECT_EQ(buffer.readable(), 7u);
+    buffer.ConsumeRead(100);
+    EXPECT_EQ(buffer.readable(), 0u);
+}
+
+TEST(util_RingBuffer, c_bulkReadWrite)
+{
+    RingBuffer<int, 12> buffer;
+    buffer.Init();
+    std::vector<int> in(100), out(100);
+    for(size_t i = 0; i < in.size(); i++)
+        in[i] = int(i);
+
+    size_t written = 0, read = 0;
+    while(read < in.size())
+    {
+        const size_t n = std::min<size_t>(7, in.size() - written);
+        written += buffer.Write(&in[written], n);
+        read += buffer.Read(&out[read], 5);
+    }
+    EXPECT_EQ(in, out);
+
+    // no overwriting when full
+    EXPECT_EQ(buffer.Write(in.data(), 20), 11u);
+    EXPECT_EQ(buffer.Read(out.data(), 20), 11u);
+    for(size_t i = 0; i < 11; i++)
+        EXPECT_EQ(out[i], int(i));
+}
+
+/** Host benchmark of element-wise vs. span access. This doesn't assert on
+ *  timing - the harness builds without optimization, so for meaningful
+ *  numbers add -O2 to COMPILE_FLAGS in the Makefile. */
+TEST(util_RingBuffer, d_benchmark)
+{
+    using Clock = std::chrono::steady_clock;
+
+    static RingBuffer<uint8_t, 1024> buffer;
+    buffer.Init();
+    const size_t     kChunk       = 64;
+    const size_t     kIterations  = 100000;
+    uint8_t          data[kChunk] = {};
+    volatile uint8_t sink         = 0;
+
+    auto start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        for(size_t i = 0; i < kChunk; i++)
+            buffer.Overwrite(data[i]);
+        while(!buffer.isEmpty())
+            sink = sink + buffer.ImmediateRead();
+    }
+    const double single
+        = std::chrono::duration<double>(Clock::now() - start).count();
+
+    start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        buffer.Write(data, kChunk);
+        // parse in place
+        auto span = buffer.GetReadSpan();
+        while(span.count > 0)
+        {
+            for(size_t i = 0; i < span.count; i++)
+                sink = sink + span.data[i];
+            buffer.ConsumeRead(span.count);
+            span = buffer.GetReadSpan();
+        }
+    }
+    const double spans
+        = std::chrono::duration<double>(Clock::now() - start).count();
+
+    const double mb = double(kIterations * kChunk) / 1e6;
+    printf("[ BENCH    ] byte-wise %.1f MB/s, spans %.1f MB/s\n",
+           mb / single,
+           mb / spans);
+}
+
+TEST(util_RingBuffer, e_swallow)
+{
+    RingBuffer<int, 10> buffer;
+    buffer.Init();
+    for(int i = 0; i < 9; i++)
+        buffer.Write(i);
+    ASSERT_EQ(buffer.writable(), 0u);
+
+    // the oldest elements make room
+    buffer.Swallow(3);
+    EXPECT_EQ(buffer.writable(), 3u);
+    EXPECT_EQ(buffer.Read(), 3);
+
+    // more than the buffer holds empties it
+    buffer.Swallow(25);
+    EXPECT_EQ(buffer.readable(), 0u);
+    EXPECT_EQ(buffer.writable(), 9u);
+
+    RingBuffer<int, 16> pow2;
+    pow2.Init();
+    for(int i = 0; i < 20; i++)
+    {
+        pow2.Swallow(1);
+        pow2.Write(i);
+    }
+    EXPECT_EQ(pow2.readable(), 15u);
+    EXPECT_EQ(pow2.Read(), 5);
+    pow2.Swallow(16);
+    EXPECT_EQ(pow2.readable(), 0u);
+}
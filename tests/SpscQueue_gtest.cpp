@@ -0,0 +1,168 @@
+#include <gtest/gtest.h>
+#include "util/SpscQueue.h"
+#include "util/FIFO.h"
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <thread>
+
+using namespace daisy;
+
+TEST(util_SpscQueue, a_pushAndPop)
+{
+    SpscQueue<int, 4> queue;
+    EXPECT_TRUE(queue.IsEmpty());
+    EXPECT_EQ(queue.GetCapacity(), 4u);
+    EXPECT_EQ(queue.Peek(), nullptr);
+
+    int value = -1;
+    EXPECT_FALSE(queue.Pop(value));
+    EXPECT_EQ(value, -1);
+
+    // all 4 slots can be used
+    for(int i = 0; i < 4; i++)
+        EXPECT_TRUE(queue.Push(i));
+    EXPECT_TRUE(queue.IsFull());
+    EXPECT_FALSE(queue.Push(4));
+    EXPECT_EQ(queue.GetNumElements(), 4u);
+
+    ASSERT_NE(queue.Peek(), nullptr);
+    EXPECT_EQ(*queue.Peek(), 0);
+    for(int i = 0; i < 4; i++)
+    {
+        EXPECT_TRUE(queue.Pop(value));
+        EXPECT_EQ(value, i);
+    }
+    EXPECT_TRUE(queue.IsEmpty());
+    EXPECT_FALSE(queue.Pop(value));
+}
+
+TEST(util_SpscQueue, b_wrapAroundAndClear)
+{
+    SpscQueue<int, 8> queue;
+    int               next_push = 0, next_pop = 0, value;
+    // push 3, pop 2 - the indices wrap around many times
+    for(int n = 0; n < 100; n++)
+    {
+        for(int i = 0; i < 3; i++)
+            if(queue.Push(next_push))
+                next_push++;
+        for(int i = 0; i < 2; i++)
+        {
+            ASSERT_TRUE(queue.Pop(value));
+            ASSERT_EQ(value, next_pop++);
+        }
+        ASSERT_EQ(queue.GetNumElements(), size_t(next_push - next_pop));
+    }
+    while(queue.Push(next_push))
+        next_push++;
+    EXPECT_TRUE(queue.IsFull());
+    EXPECT_EQ(queue.GetNumElements(), 8u);
+
+    queue.Clear();
+    EXPECT_TRUE(queue.IsEmpty());
+    EXPECT_FALSE(queue.Pop(value));
+    EXPECT_TRUE(queue.Push(42));
+    EXPECT_TRUE(queue.Pop(value));
+    EXPECT_EQ(value, 42);
+}
+
+TEST(util_SpscQueue, c_indicesOnSeparateCacheLines)
+{
+    using Queue = SpscQueue<uint8_t, 16>;
+    EXPECT_GE(sizeof(Queue), 2 * Queue::kCacheLineSize + 16);
+    // must not be over-aligned, so it can be allocated with new
+    EXPECT_LE(alignof(Queue), alignof(std::max_align_t));
+}
+
+namespace
+{
+/** An element that's only valid if both halves match */
+struct Element
+{
+    uint32_t seq;
+    uint32_t check;
+};
+} // namespace
+
+TEST(util_SpscQueue, d_threadedStressTest)
+{
+    static SpscQueue<Element, 64> queue;
+    const uint32_t                kNumElements = 1000000;
+
+    std::thread producer([&]() {
+        for(uint32_t i = 0; i < kNumElements;)
+        {
+            if(queue.Push({i, ~i}))
+                i++;
+            else
+                std::this_thread::yield();
+        }
+    });
+
+    uint32_t expected = 0;
+    bool     ok       = true;
+    while(expected < kNumElements && ok)
+    {
+        Element e;
+        if(queue.Pop(e))
+        {
+            ok = e.seq == expected && e.check == ~expected;
+            expected++;
+        }
+        else
+            std::this_thread::yield();
+    }
+    producer.join();
+
+    EXPECT_TRUE(ok) << "corrupt or out of order element at " << expected;
+    EXPECT_EQ(expected, kNumElements);
+    EXPECT_TRUE(queue.IsEmpty());
+}
+
+/** Host benchmark against FIFO. This doesn't assert on timing - the
+ *  harness builds without optimization, so for meaningful numbers add -O2
+ *  to COMPILE_FLAGS in the Makefile. */
+TEST(util_SpscQueue, e_benchmarkAgainstFifo)
+{
+    using Clock = std::chrono::steady_clock;
+
+    const size_t    kIterations = 200000;
+    const size_t    kBurst      = 16;
+    volatile size_t sink        = 0;
+
+    static FIFO<size_t, 256> fifo;
+    auto                     start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        for(size_t i = 0; i < kBurst; i++)
+            fifo.PushBack(i);
+        for(size_t i = 0; i < kBurst; i++)
+            sink = sink + fifo.PopFront();
+    }
+    const double fifo_sec
+        = std::chrono::duration<double>(Clock::now() - start).count();
+
+    static SpscQueue<size_t, 256> queue;
+    start = Clock::now();
+    for(size_t n = 0; n < kIterations; n++)
+    {
+        for(size_t i = 0; i < kBurst; i++)
+            queue.Push(i);
+        size_t value;
+        for(size_t i = 0; i < kBurst; i++)
+        {
+            queue.Pop(value);
+            sink = sink + value;
+        }
+    }
+    const double spsc_sec
+        = std::chrono::duration<double>(Clock::now() - start).count();
+
+    const double elements = double(kIterations * kBurst);
+    printf("[ BENCH    ] push+pop, single thread: FIFO %.1f ns, "
+           "SpscQueue %.1f ns\n",
+           fifo_sec * 1e9 / elements,
+           spsc_sec * 1e9 / elements);
+    (void)sink;
+}
@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+#include "util/TripleBuffer.h"
+#include <atomic>
+#include <thread>
+
+using namespace daisy;
+
+namespace
+{
+/** A snapshot that is only consistent if all values match the sequence */
+struct Snapshot
+{
+    uint32_t seq;
+    float    values[31];
+};
+
+void Fill(Snapshot& s, uint32_t seq)
+{
+    s.seq = seq;
+    for(auto& v : s.values)
+        v = float(seq);
+}
+
+bool IsConsistent(const Snapshot& s)
+{
+    for(auto v : s.values)
+        if(v != float(s.seq))
+            return false;
+    return true;
+}
+
+} // namespace
+
+TEST(util_TripleBuffer, a_initialState)
+{
+    TripleBuffer<int> buffer;
+    buffer.Init(42);
+    EXPECT_FALSE(buffer.HasNewData());
+    EXPECT_FALSE(buffer.Update());
+    EXPECT_EQ(buffer.Read(), 42);
+}
+
+TEST(util_TripleBuffer, b_readerSeesLatestSnapshot)
+{
+    TripleBuffer<int> buffer;
+    buffer.Init(0);
+
+    buffer.Write(1);
+    EXPECT_TRUE(buffer.HasNewData());
+    EXPECT_EQ(buffer.Read(), 1);
+    EXPECT_FALSE(buffer.HasNewData());
+
+    // intermediate snapshots are skipped
+    buffer.Write(2);
+    buffer.Write(3);
+    buffer.Write(4);
+    EXPECT_TRUE(buffer.Update());
+    EXPECT_EQ(buffer.GetReadBuffer(), 4);
+    EXPECT_FALSE(buffer.Update());
+    EXPECT_EQ(buffer.GetReadBuffer(), 4);
+
+    // the read buffer stays valid while the writer continues
+    const int& current = buffer.GetReadBuffer();
+    buffer.Write(5);
+    buffer.Write(6);
+    EXPECT_EQ(current, 4);
+    EXPECT_EQ(buffer.Read(), 6);
+}
+
+TEST(util_TripleBuffer, c_writeInPlace)
+{
+    TripleBuffer<Snapshot> buffer;
+    Snapshot               initial;
+    Fill(initial, 0);
+    buffer.Init(initial);
+
+    for(uint32_t i = 1; i < 10; i++)
+    {
+        Fill(buffer.GetWriteBuffer(), i);
+        buffer.Publish();
+        const auto& s = buffer.Read();
+        EXPECT_EQ(s.seq, i);
+        EXPECT_TRUE(IsConsistent(s));
+    }
+}
+
+/** The writer publishes snapshots as fast as possible, while the reader
+ *  checks that every snapshot is complete and that they never go back
+ *  in time. */
+TEST(util_TripleBuffer, d_concurrentReadAndWrite)
+{
+    TripleBuffer<Snapshot> buffer;
+    Snapshot               initial;
+    Fill(initial, 0);
+    buffer.Init(initial);
+
+    const uint32_t    kNumWrites = 200000;
+    std::atomic<bool> done(false);
+
+    std::thread writer([&]() {
+        for(uint32_t i = 1; i <= kNumWrites; i++)
+        {
+            Fill(buffer.GetWriteBuffer(), i);
+            buffer.Publish();
+        }
+        done = true;
+    });
+
+    uint32_t last_seq    = 0;
+    uint32_t num_updates = 0;
+    bool     consistent  = true;
+    bool     monotonic   = true;
+    bool     writer_done = false;
+    while(!writer_done)
+    {
+        writer_done = done;
+        if(buffer.Update())
+        {
+            const auto& s = buffer.GetReadBuffer();
+            consistent    = consistent && IsConsistent(s);
+            monotonic     = monotonic && s.seq > last_seq;
+            last_seq      = s.seq;
+            num_updates++;
+        }
+    }
+    writer.join();
+    buffer.Update();
+
+    EXPECT_TRUE(consistent);
+    EXPECT_TRUE(monotonic);
+    EXPECT_GT(num_updates, 0u);
+    EXPECT_EQ(buffer.GetReadBuffer().seq, kNumWrites);
+}
@@ -0,0 +1,154 @@
+#include <gtest/gtest.h>
+#include "hid/usb_midi_packetizer.h"
+#include <cstdio>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+using Bytes = std::vector<uint8_t>;
+
+/** Records the transfers, and plays a USB driver that is busy until
+ *  Complete() */
+struct MockUsb
+{
+    std::vector<Bytes> transfers;
+    bool               busy      = false;
+    uint8_t*           in_flight = nullptr;
+
+    static bool Transmit(uint8_t* buff, size_t size, void* context)
+    {
+        MockUsb* usb = static_cast<MockUsb*>(context);
+        if(usb->busy)
+            return false;
+        EXPECT_NE(buff, usb->in_flight) << "buffer of the last transfer";
+        usb->transfers.push_back(Bytes(buff, buff + size));
+        usb->busy      = true;
+        usb->in_flight = buff;
+        return true;
+    }
+
+    void Complete() { busy = false; }
+};
+
+/** Packetizes the bytes with an idle USB, returns the packets */
+Bytes Packetize(const Bytes& bytes)
+{
+    MockUsb           usb;
+    UsbMidiPacketizer packetizer;
+    packetizer.Init(MockUsb::Transmit, &usb);
+    EXPECT_EQ(packetizer.Write(bytes.data(), bytes.size()), bytes.size());
+    packetizer.Flush();
+    Bytes packets;
+    for(const Bytes& t : usb.transfers)
+        packets.insert(packets.end(), t.begin(), t.end());
+    return packets;
+}
+
+} // namespace
+
+TEST(hid_UsbMidiPacketizer, a_channelMessages)
+{
+    // running status is expanded, the CIN is the message type
+    const Bytes expected = {0x09, 0x93, 60, 100, 0x09, 0x93, 62, 0, 0x0C, 0xC1,
+                            5,    0,    0x0C, 0xC1, 6, 0, 0x0E, 0xE0, 0, 64};
+    EXPECT_EQ(Packetize({0x93, 60, 100, 62, 0, 0xC1, 5, 6, 0xE0, 0, 64}),
+              expected);
+
+    // realtime bytes go in between, stray data bytes are ignored
+    EXPECT_EQ(Packetize({1, 2, 0xB0, 7, 0xF8, 100}),
+              Bytes({0x0F, 0xF8, 0, 0, 0x0B, 0xB0, 7, 100}));
+}
+
+TEST(hid_UsbMidiPacketizer, b_systemMessages)
+{
+    // MTC quarter frame, song position, song select, tune request, and
+    // data after a system common message doesn't use running status
+    const Bytes expected = {0x02, 0xF1, 0x12, 0, 0x03, 0xF2, 8, 0,
+                            0x02, 0xF3, 2,    0, 0x05, 0xF6, 0, 0};
+    EXPECT_EQ(Packetize({0xF1, 0x12, 0xF2, 8, 0, 0xF3, 2, 0xF6, 5}), expected);
+
+    // SysEx in packets of 3, the CIN of the last one gives its size
+    EXPECT_EQ(Packetize({0xF0, 0xF7}), Bytes({0x06, 0xF0, 0xF7, 0}));
+    EXPECT_EQ(Packetize({0xF0, 1, 2, 3, 0xF7}),
+              Bytes({0x04, 0xF0, 1, 2, 0x06, 3, 0xF7, 0}));
+    EXPECT_EQ(Packetize({0xF0, 1, 0xF8, 2, 0xF7}),
+              Bytes({0x0F, 0xF8, 0, 0, 0x04, 0xF0, 1, 2, 0x05, 0xF7, 0, 0}));
+}
+
+TEST(hid_UsbMidiPacketizer, c_doubleBuffered)
+{
+    MockUsb           usb;
+    UsbMidiPacketizer packetizer;
+    packetizer.Init(MockUsb::Transmit, &usb, 1);
+
+    // the first message goes out right away, with cable 1
+    const uint8_t cc[] = {0xB0, 1, 64};
+    EXPECT_EQ(packetizer.Write(cc, 3), 3u);
+    EXPECT_TRUE(packetizer.Flush());
+    ASSERT_EQ(usb.transfers.size(), 1u);
+    EXPECT_EQ(usb.transfers[0], Bytes({0x1B, 0xB0, 1, 64}));
+
+    // while it's sent, the next ones fill the other buffer
+    for(int i = 0; i < 16; i++)
+    {
+        EXPECT_EQ(packetizer.Write(cc, 3), 3u);
+        EXPECT_FALSE(packetizer.Flush());
+    }
+    EXPECT_EQ(packetizer.GetNumPending(), 64u);
+    EXPECT_EQ(packetizer.Write(cc, 3), 0u);
+
+    // which is sent as one transfer once the first is done
+    usb.Complete();
+    EXPECT_TRUE(packetizer.Flush());
+    ASSERT_EQ(usb.transfers.size(), 2u);
+    EXPECT_EQ(usb.transfers[1].size(), 64u);
+    EXPECT_EQ(packetizer.GetNumPending(), 0u);
+    EXPECT_EQ(packetizer.Write(cc, 3), 3u);
+    EXPECT_FALSE(packetizer.Flush());
+}
+
+TEST(hid_UsbMidiPacketizer, d_unpackInPlace)
+{
+    Bytes midi    = {0x90, 60, 100, 0xF8, 0xC0, 3, 0xF0, 1, 2, 3, 4, 0xF7};
+    Bytes packets = Packetize(midi);
+    // reserved CINs are skipped
+    packets.insert(packets.begin(), {0x00, 0x90, 1, 2, 0x01, 0x90, 3, 4});
+    const size_t size = UsbMidiPacketizer::Unpack(packets.data(),
+                                                  packets.size());
+    EXPECT_EQ(Bytes(packets.begin(), packets.begin() + size), midi);
+}
+
+TEST(hid_UsbMidiPacketizer, e_denseControllers)
+{
+    // 1000 controller messages with running status, sent while the USB
+    // finishes one transfer per frame (every 8 messages here)
+    MockUsb           usb;
+    UsbMidiPacketizer packetizer;
+    packetizer.Init(MockUsb::Transmit, &usb);
+    Bytes sent;
+    for(int i = 0; i < 1000; i++)
+    {
+        const uint8_t  msg[] = {0xB0, uint8_t(i & 0x7f), 1};
+        const size_t   size  = i == 0 ? 3 : 2;
+        const uint8_t* data  = i == 0 ? msg : msg + 1;
+        ASSERT_EQ(packetizer.Write(data, size), size);
+        packetizer.Flush();
+        if(i % 8 == 7)
+            usb.Complete();
+    }
+    while(packetizer.GetNumPending() > 0)
+    {
+        usb.Complete();
+        packetizer.Flush();
+    }
+    for(const Bytes& t : usb.transfers)
+        sent.insert(sent.end(), t.begin(), t.end());
+    ASSERT_EQ(sent.size(), 4000u);
+    EXPECT_EQ(Bytes(sent.end() - 4, sent.end()), Bytes({0x0B, 0xB0, 103, 1}));
+    printf("[ BENCH    ] 1000 CCs: %d transfers (was 1000), %.1f msgs each\n",
+           int(usb.transfers.size()),
+           1000. / usb.transfers.size());
+    EXPECT_LE(usb.transfers.size(), 130u);
+}
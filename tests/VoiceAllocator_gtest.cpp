@@ -0,0 +1,359 @@
+#include <gtest/gtest.h>
+#include "util/VoiceAllocator.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+/** Records the callbacks */
+template <size_t N>
+struct Recorder
+{
+    using Allocator = VoiceAllocator<N>;
+
+    struct Call
+    {
+        bool    start;
+        size_t  voice;
+        uint8_t note;
+        bool    stolen;
+    };
+
+    std::vector<Call> calls;
+
+    typename Allocator::Config GetConfig()
+    {
+        typename Allocator::Config config;
+        config.start   = Start;
+        config.release = Release;
+        config.context = this;
+        return config;
+    }
+
+    static void Start(size_t                          voice,
+                      const typename Allocator::Voice& note,
+                      bool                             stolen,
+                      void*                            context)
+    {
+        static_cast<Recorder*>(context)->calls.push_back(
+            {true, voice, note.note, stolen});
+    }
+
+    static void Release(size_t                          voice,
+                        const typename Allocator::Voice& note,
+                        void*                            context)
+    {
+        static_cast<Recorder*>(context)->calls.push_back(
+            {false, voice, note.note, false});
+    }
+
+    /** Returns the notes released since the last call */
+    std::vector<uint8_t> TakeReleased()
+    {
+        std::vector<uint8_t> notes;
+        for(const Call& c : calls)
+            if(!c.start)
+                notes.push_back(c.note);
+        calls.clear();
+        return notes;
+    }
+};
+
+MidiEvent MakeEvent(MidiMessageType type, uint8_t ch, uint8_t d0, uint8_t d1)
+{
+    MidiEvent event = MidiEvent();
+    event.type      = type;
+    event.channel   = ch;
+    event.data[0]   = d0;
+    event.data[1]   = d1;
+    return event;
+}
+
+/** The usual linear scan allocator, for the benchmark */
+template <size_t N>
+class LinearAllocator
+{
+  public:
+    int NoteOn(uint8_t channel, uint8_t note)
+    {
+        int best = 0;
+        for(size_t v = 0; v < N; v++)
+        {
+            if(!voices_[v].on)
+            {
+                best = v;
+                break;
+            }
+            if(voices_[v].time < voices_[best].time)
+                best = v;
+        }
+        voices_[best] = {channel, note, true, ++time_};
+        return best;
+    }
+
+    int NoteOff(uint8_t channel, uint8_t note)
+    {
+        for(size_t v = 0; v < N; v++)
+            if(voices_[v].on && voices_[v].note == note
+               && voices_[v].channel == channel)
+            {
+                voices_[v].on = false;
+                return v;
+            }
+        return -1;
+    }
+
+  private:
+    struct Voice
+    {
+        uint8_t  channel;
+        uint8_t  note;
+        bool     on;
+        uint32_t time;
+    };
+    Voice    voices_[N] = {};
+    uint32_t time_      = 0;
+};
+
+} // namespace
+
+TEST(util_VoiceAllocator, a_freeVoicesFirst)
+{
+    Recorder<4>       rec;
+    VoiceAllocator<4> alloc;
+    alloc.Init(rec.GetConfig());
+
+    EXPECT_EQ(alloc.NoteOn(0, 60, 100), 0);
+    EXPECT_EQ(alloc.NoteOn(0, 62, 100), 1);
+    EXPECT_EQ(alloc.NoteOn(0, 64, 100), 2);
+    EXPECT_EQ(alloc.GetNumUsed(), 3u);
+
+    // the voice released longest ago is reused first
+    EXPECT_EQ(alloc.NoteOff(0, 62), 1);
+    EXPECT_EQ(alloc.NoteOff(0, 60), 0);
+    EXPECT_EQ(alloc.NoteOn(0, 65, 100), 3); // never used
+    EXPECT_EQ(alloc.NoteOn(0, 67, 100), 1);
+    EXPECT_EQ(alloc.NoteOn(0, 69, 100), 0);
+
+    // unknown notes, and notes on another channel, are ignored
+    EXPECT_EQ(alloc.NoteOff(0, 60), VoiceAllocator<4>::kNoVoice);
+    EXPECT_EQ(alloc.NoteOff(1, 64), VoiceAllocator<4>::kNoVoice);
+
+    // velocity 0, and events from the parser
+    EXPECT_EQ(alloc.NoteOn(0, 64, 0), 2);
+    alloc.ProcessEvent(MakeEvent(NoteOff, 0, 65, 0));
+    EXPECT_EQ(alloc.GetNumUsed(), 2u);
+    rec.calls.clear();
+    alloc.ProcessEvent(MakeEvent(NoteOn, 0, 70, 90));
+    ASSERT_EQ(rec.calls.size(), 1u);
+    EXPECT_TRUE(rec.calls[0].start);
+    EXPECT_EQ(alloc.GetVoice(rec.calls[0].voice).velocity, 90);
+    EXPECT_FALSE(rec.calls[0].stolen);
+}
+
+TEST(util_VoiceAllocator, b_stealing)
+{
+    Recorder<3> rec;
+    auto        config = rec.GetConfig();
+
+    VoiceAllocator<3> oldest;
+    oldest.Init(config);
+    oldest.NoteOn(0, 60, 100);
+    oldest.NoteOn(0, 62, 100);
+    oldest.NoteOn(0, 64, 100);
+    oldest.NoteOn(0, 60, 50); // the same key restarts its voice
+    EXPECT_EQ(oldest.NoteOn(0, 65, 100), 1);
+    EXPECT_TRUE(rec.calls.back().stolen);
+    EXPECT_EQ(oldest.NoteOn(0, 67, 100), 2);
+    EXPECT_EQ(oldest.NoteOn(0, 69, 100), 0);
+    // the stolen note's note off is ignored
+    EXPECT_EQ(oldest.NoteOff(0, 62), VoiceAllocator<3>::kNoVoice);
+
+    config.steal_policy = VoiceAllocator<3>::StealPolicy::QUIETEST;
+    VoiceAllocator<3> quietest;
+    quietest.Init(config);
+    quietest.NoteOn(0, 60, 100);
+    quietest.NoteOn(0, 62, 30);
+    quietest.NoteOn(0, 64, 80);
+    EXPECT_EQ(quietest.NoteOn(0, 65, 100), 1);
+    // e.g. the envelope of voice 0 decayed
+    quietest.SetLevel(0, 10);
+    EXPECT_EQ(quietest.NoteOn(0, 67, 100), 0);
+    EXPECT_EQ(quietest.NoteOn(0, 69, 100), 2);
+
+    config.steal_policy = VoiceAllocator<3>::StealPolicy::SAME_NOTE;
+    VoiceAllocator<3> same;
+    same.Init(config);
+    same.NoteOn(0, 60, 100);
+    same.NoteOn(0, 62, 100);
+    same.NoteOff(0, 60);
+    same.NoteOff(0, 62);
+    // 60 is still in its release phase on voice 0, and restarts there
+    EXPECT_EQ(same.NoteOn(0, 60, 100), 0);
+    EXPECT_FALSE(rec.calls.back().stolen);
+    EXPECT_EQ(same.NoteOn(0, 64, 100), 2);
+}
+
+TEST(util_VoiceAllocator, c_sustain)
+{
+    Recorder<4>       rec;
+    VoiceAllocator<4> alloc;
+    alloc.Init(rec.GetConfig());
+
+    alloc.ProcessEvent(MakeEvent(NoteOn, 0, 60, 100));
+    alloc.ProcessEvent(MakeEvent(ControlChange, 0, 64, 127));
+    alloc.NoteOn(0, 62, 100);
+    alloc.NoteOn(1, 64, 100);
+    alloc.NoteOff(0, 60);
+    alloc.NoteOff(1, 64); // no pedal on channel 2
+    EXPECT_EQ(rec.TakeReleased(), std::vector<uint8_t>({64}));
+    EXPECT_EQ(alloc.GetVoice(0).state,
+              VoiceAllocator<4>::State::SUSTAINED);
+
+    // a sustained key pressed again keeps its voice, and is held
+    EXPECT_EQ(alloc.NoteOn(0, 60, 100), 0);
+    alloc.NoteOff(0, 62);
+    EXPECT_EQ(alloc.GetNumUsed(), 2u);
+
+    alloc.ProcessEvent(MakeEvent(ControlChange, 0, 64, 0));
+    EXPECT_EQ(rec.TakeReleased(), std::vector<uint8_t>({62}));
+    alloc.NoteOff(0, 60);
+    EXPECT_EQ(rec.TakeReleased(), std::vector<uint8_t>({60}));
+    EXPECT_EQ(alloc.GetNumUsed(), 0u);
+
+    // All Notes Off also releases the sustained notes
+    alloc.SetSustain(0, true);
+    alloc.NoteOn(0, 60, 100);
+    alloc.NoteOn(0, 62, 100);
+    alloc.NoteOff(0, 60);
+    MidiEvent all_off = MakeEvent(ChannelMode, 0, 123, 0);
+    all_off.cm_type   = AllNotesOff;
+    alloc.ProcessEvent(all_off);
+    EXPECT_EQ(rec.TakeReleased(), std::vector<uint8_t>({60, 62}));
+    EXPECT_EQ(alloc.GetNumUsed(), 0u);
+}
+
+TEST(util_VoiceAllocator, d_mpe)
+{
+    Recorder<4> rec;
+    auto        config = rec.GetConfig();
+    config.mpe         = true;
+    VoiceAllocator<4> alloc;
+    alloc.Init(config);
+
+    // the same note on two member channels gets two voices
+    EXPECT_EQ(alloc.NoteOn(1, 60, 100), 0);
+    EXPECT_EQ(alloc.NoteOn(2, 60, 100), 1);
+    EXPECT_EQ(alloc.NoteOn(3, 67, 100), 2);
+    EXPECT_EQ(alloc.GetChannelVoice(2), 1);
+    EXPECT_EQ(alloc.GetChannelVoice(4), VoiceAllocator<4>::kNoVoice);
+
+    // the master channel's pedal holds all channels
+    alloc.SetSustain(0, true);
+    alloc.NoteOff(2, 60);
+    EXPECT_TRUE(rec.TakeReleased().empty());
+    EXPECT_EQ(alloc.GetChannelVoice(2), 1);
+    alloc.SetSustain(0, false);
+    EXPECT_EQ(rec.TakeReleased(), std::vector<uint8_t>({60}));
+    EXPECT_EQ(alloc.GetChannelVoice(2), VoiceAllocator<4>::kNoVoice);
+
+    // and its All Notes Off releases all of them
+    alloc.ReleaseAll(0);
+    EXPECT_EQ(alloc.GetNumUsed(), 0u);
+}
+
+TEST(util_VoiceAllocator, e_worstCase64Voices)
+{
+    // The slowest paths, with all 64 voices in use:
+    //  - note on of a new key, which steals a voice
+    //  - note off and on of the key on the last voice the linear scan
+    //    looks at
+    // Timed over many calls, the best of a few runs.
+    constexpr size_t kVoices = 64;
+    constexpr int    kCalls  = 20000;
+    using Clock              = std::chrono::steady_clock;
+    auto ns_per_call         = [](std::function<void(int)> f) {
+        double best = 1e9;
+        for(int run = 0; run < 5; run++)
+        {
+            const auto start = Clock::now();
+            for(int i = 0; i < kCalls; i++)
+                f(i);
+            const std::chrono::duration<double, std::nano> t
+                = Clock::now() - start;
+            best = std::min(best, t.count() / kCalls);
+        }
+        return best;
+    };
+
+    static VoiceAllocator<kVoices> alloc;
+    LinearAllocator<kVoices>       linear;
+    VoiceAllocator<kVoices>::Config config;
+    config.steal_policy = VoiceAllocator<kVoices>::StealPolicy::QUIETEST;
+    alloc.Init(config);
+    for(uint8_t n = 0; n < kVoices; n++)
+    {
+        alloc.NoteOn(0, n, 1 + n);
+        linear.NoteOn(0, n);
+    }
+
+    // new keys: 16 channels x 128 notes, far more than voices
+    int        sink  = 0;
+    const auto steal = ns_per_call([&](int i) {
+        sink += alloc.NoteOn((i >> 7) & 15, i & 127, 1 + (i % 127));
+    });
+    const auto steal_linear = ns_per_call(
+        [&](int i) { sink += linear.NoteOn((i >> 7) & 15, i & 127); });
+    EXPECT_EQ(alloc.GetNumUsed(), kVoices);
+
+    // refill in order, so key 63 is on the last voice
+    for(uint8_t n = 0; n < kVoices; n++)
+    {
+        alloc.NoteOn(0, n, 100);
+        linear.NoteOn(0, n);
+    }
+    const auto retrigger = ns_per_call([&](int) {
+        sink += alloc.NoteOff(0, 63);
+        sink += alloc.NoteOn(0, 63, 100);
+    });
+    const auto retrigger_linear = ns_per_call([&](int) {
+        sink += linear.NoteOff(0, 63);
+        sink += linear.NoteOn(0, 63);
+    });
+    EXPECT_NE(sink, 0);
+
+    printf("[ BENCH    ] 64 voices, ns per call: steal %.1f (linear scan "
+           "%.1f), note off + on %.1f (linear scan %.1f)\n",
+           steal,
+           steal_linear,
+           retrigger,
+           retrigger_linear);
+}
+
+TEST(util_VoiceAllocator, f_levelsOutOfRange)
+{
+    Recorder<3> rec;
+    auto        config  = rec.GetConfig();
+    config.steal_policy = VoiceAllocator<3>::StealPolicy::QUIETEST;
+    VoiceAllocator<3> alloc;
+    alloc.Init(config);
+
+    // velocities are 7 bit, like the channel and note
+    EXPECT_EQ(alloc.NoteOn(0, 60, 200), 0);
+    EXPECT_EQ(alloc.GetVoice(0).velocity, 200 & 0x7f);
+    EXPECT_EQ(alloc.GetVoice(0).level, 200 & 0x7f);
+    alloc.NoteOn(0, 62, 100);
+    alloc.NoteOn(0, 64, 90);
+    alloc.SetLevel(0, 255);
+    EXPECT_EQ(alloc.GetVoice(0).level, 127);
+    alloc.SetLevel(1, 128);
+    EXPECT_EQ(alloc.GetVoice(1).level, 127);
+
+    // the quietest voice is still found
+    EXPECT_EQ(alloc.NoteOn(0, 65, 100), 2);
+}
@@ -0,0 +1,272 @@
+#include <gtest/gtest.h>
+#include "hid/wav_catalog.h"
+#include "hid/wav_streamer.h"
+#include "DiskImageTest.h"
+#include "sys/system.h"
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+/** Writes a PCM file, with a "smpl" chunk after the sample data if it has
+ *  a loop. Sample n of the data is n.
+ */
+void WriteWav(const char* path,
+              uint16_t    channels,
+              uint16_t    bits,
+              uint32_t    frames,
+              uint32_t    loop_start = 0,
+              uint32_t    loop_end   = 0)
+{
+    const bool           loop      = loop_end > 0;
+    const uint32_t       data_size = frames * channels * bits / 8;
+    std::vector<uint8_t> bytes;
+    AddWavHeader(bytes, channels, bits, 44100, data_size, loop ? 8 + 60 : 0);
+    for(uint32_t i = 0; i < data_size / (bits / 8); i++)
+    {
+        Add16(bytes, i);
+        if(bits == 24)
+            bytes.push_back(0);
+    }
+    if(loop)
+    {
+        const uint32_t smpl[15] = {
+            0, 0, 0, 48, 0, 0, 0, 1, 0, 0, 0, loop_start, loop_end, 0, 0};
+        Add32(bytes, kWavFileSampleChunkId);
+        Add32(bytes, sizeof(smpl));
+        for(uint32_t x : smpl)
+            Add32(bytes, x);
+    }
+    WriteDiskFile(path, bytes);
+}
+
+/** Formatted image with a sample directory, and an index buffer */
+class hid_WavCatalog : public FormattedDiskTest
+{
+  protected:
+    void SetUp() override
+    {
+        FormattedDiskTest::SetUp();
+        if(HasFatalFailure())
+            return;
+        ASSERT_EQ(f_mkdir("0:/samples"), FR_OK);
+        WriteWav("0:/samples/Kick.wav", 1, 16, 1000);
+        WriteWav("0:/samples/snare.WAV", 2, 24, 2000);
+        WriteWav("0:/samples/pad.wav", 2, 16, 3000, 100, 2900);
+        WriteWav("0:/samples/notes.txt", 1, 16, 10);
+        WriteWav("0:/kick2.wav", 1, 16, 10);
+
+        config_.dir         = "0:/samples";
+        config_.buffer      = buffer_;
+        config_.buffer_size = sizeof(buffer_);
+    }
+
+    WavCatalog::Config config_;
+    uint32_t           buffer_[1024];
+};
+
+} // namespace
+
+TEST_F(hid_WavCatalog, a_scansThenLoadsTheIndex)
+{
+    WavCatalog catalog;
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    FILINFO info;
+    ASSERT_EQ(f_stat("0:/samples/WAVINDEX.BIN", &info), FR_OK);
+    EXPECT_EQ(info.fsize, catalog.GetIndexSize());
+
+    for(int pass = 0; pass < 2; pass++)
+    {
+        // sorted without case
+        ASSERT_EQ(catalog.GetNumEntries(), 3u);
+        EXPECT_STREQ(catalog.GetName(catalog.GetEntry(0)), "Kick.wav");
+        EXPECT_STREQ(catalog.GetName(catalog.GetEntry(1)), "pad.wav");
+        EXPECT_STREQ(catalog.GetName(catalog.GetEntry(2)), "snare.WAV");
+
+        const WavCatalogEntry& kick = catalog.GetEntry(0);
+        EXPECT_EQ(kick.channels, 1u);
+        EXPECT_EQ(kick.sample_format, WavSampleFormat::PCM16);
+        EXPECT_EQ(kick.samplerate, 44100u);
+        EXPECT_EQ(kick.data_offset, 44u);
+        EXPECT_EQ(kick.GetNumFrames(), 1000u);
+        EXPECT_FALSE(kick.has_loop);
+        EXPECT_EQ(kick.root_note, 60u);
+
+        const WavCatalogEntry& pad = catalog.GetEntry(1);
+        EXPECT_TRUE(pad.has_loop);
+        EXPECT_EQ(pad.loop_start, 100u);
+        EXPECT_EQ(pad.loop_end, 2900u);
+        EXPECT_EQ(pad.root_note, 48u);
+
+        const WavCatalogEntry& snare = catalog.GetEntry(2);
+        EXPECT_EQ(snare.sample_format, WavSampleFormat::PCM24);
+        EXPECT_EQ(snare.block_align, 6u);
+        EXPECT_EQ(snare.GetNumFrames(), 2000u);
+
+        // again from the index, without opening the files
+        std::fill(std::begin(buffer_), std::end(buffer_), 0);
+        ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+        EXPECT_TRUE(catalog.WasLoaded());
+    }
+}
+
+TEST_F(hid_WavCatalog, b_scansAgainWhenFilesChange)
+{
+    WavCatalog catalog;
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+
+    // a new file
+    WriteWav("0:/samples/hat.wav", 1, 16, 500);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    EXPECT_EQ(catalog.GetNumEntries(), 4u);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_TRUE(catalog.WasLoaded());
+
+    // a file with another length
+    WriteWav("0:/samples/hat.wav", 1, 16, 600);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    EXPECT_EQ(catalog.Find("hat.wav")->GetNumFrames(), 600u);
+
+    // the same length, written at another time
+    HostDiskio::SetTime(((2030 - 1980) << 9) | (1 << 5) | 1, 0);
+    WriteWav("0:/samples/hat.wav", 2, 16, 300);
+    HostDiskio::SetTime(((2020 - 1980) << 9) | (1 << 5) | 1, 0);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    EXPECT_EQ(catalog.Find("hat.wav")->channels, 2u);
+
+    // a removed file
+    ASSERT_EQ(f_unlink("0:/samples/hat.wav"), FR_OK);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    EXPECT_EQ(catalog.GetNumEntries(), 3u);
+    EXPECT_EQ(catalog.Find("hat.wav"), nullptr);
+}
+
+TEST_F(hid_WavCatalog, c_ignoresADamagedIndex)
+{
+    WavCatalog catalog;
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+
+    FIL file;
+    ASSERT_EQ(f_open(&file, "0:/samples/WAVINDEX.BIN", FA_WRITE), FR_OK);
+    ASSERT_EQ(f_lseek(&file, catalog.GetIndexSize() - 3), FR_OK);
+    UINT bytes_written = 0;
+    ASSERT_EQ(f_write(&file, "X", 1, &bytes_written), FR_OK);
+    ASSERT_EQ(f_close(&file), FR_OK);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    EXPECT_STREQ(catalog.GetName(catalog.GetEntry(1)), "pad.wav");
+
+    // a partly written index
+    ASSERT_EQ(f_open(&file, "0:/samples/WAVINDEX.BIN", FA_WRITE), FR_OK);
+    ASSERT_EQ(f_lseek(&file, 40), FR_OK);
+    ASSERT_EQ(f_truncate(&file), FR_OK);
+    ASSERT_EQ(f_close(&file), FR_OK);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_FALSE(catalog.WasLoaded());
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    EXPECT_TRUE(catalog.WasLoaded());
+}
+
+TEST_F(hid_WavCatalog, d_findsAndStreamsAFile)
+{
+    WavCatalog catalog;
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+    ASSERT_TRUE(catalog.WasLoaded());
+
+    EXPECT_EQ(catalog.Find("kick.WAV"), &catalog.GetEntry(0));
+    EXPECT_EQ(catalog.Find("SNARE.wav"), &catalog.GetEntry(2));
+    EXPECT_EQ(catalog.Find("notes.txt"), nullptr);
+    EXPECT_EQ(catalog.Find("kick2.wav"), nullptr);
+
+    // opened without reading the header again
+    const WavCatalogEntry* pad = catalog.Find("PAD.WAV");
+    ASSERT_NE(pad, nullptr);
+    char path[32];
+    ASSERT_TRUE(catalog.GetPath(*pad, path, sizeof(path)));
+    EXPECT_STREQ(path, "0:/samples/pad.wav");
+    EXPECT_FALSE(catalog.GetPath(*pad, path, 18));
+
+    using Streamer = WavStreamer<1, 4096>;
+    std::unique_ptr<Streamer> streamer(new Streamer);
+    streamer->Init();
+    ASSERT_EQ(streamer->Open(0, path, pad->GetFormat()), Streamer::Result::OK);
+    streamer->Play(0);
+    float  left[4], right[4];
+    float* out[2] = {left, right};
+    streamer->Stream(out, 4);
+    for(size_t i = 0; i < 4; i++)
+    {
+        EXPECT_EQ(left[i], (2 * i) / 32768.f);
+        EXPECT_EQ(right[i], (2 * i + 1) / 32768.f);
+    }
+}
+
+TEST_F(hid_WavCatalog, e_reportsAFullBuffer)
+{
+    ASSERT_EQ(f_unlink("0:/samples/WAVINDEX.BIN"), FR_NO_FILE);
+    WavCatalog catalog;
+    config_.buffer_size = 100;
+    EXPECT_EQ(catalog.Init(config_), WavCatalog::Result::ERR_FULL);
+    EXPECT_EQ(catalog.GetNumEntries(), 1u);
+    FILINFO info;
+    EXPECT_EQ(f_stat("0:/samples/WAVINDEX.BIN", &info), FR_NO_FILE);
+
+    config_.dir = "0:/nothing";
+    EXPECT_EQ(catalog.Init(config_), WavCatalog::Result::ERR_DIR);
+}
+
+/** Boot time of a directory of 500 files on a simulated SD card: scanning
+ *  all files, against listing the directory and loading the index.
+ */
+TEST_F(hid_WavCatalog, f_benchmarkScanAgainstIndex)
+{
+    const size_t kFiles = 500;
+    ASSERT_EQ(f_mkdir("0:/many"), FR_OK);
+    char path[48];
+    for(size_t i = 0; i < kFiles; i++)
+    {
+        snprintf(path, sizeof(path), "0:/many/Sample number %03d.wav", int(i));
+        WriteWav(path, 2, 16, 100 + i, 10, 50);
+    }
+
+    std::vector<uint8_t> buffer(64 * 1024);
+    config_.dir         = "0:/many";
+    config_.buffer      = buffer.data();
+    config_.buffer_size = buffer.size();
+    disk_.SetConfig(HostDiskio::Config::SdCard());
+
+    uint32_t          us[2];
+    HostDiskio::Stats stats[2];
+    for(int pass = 0; pass < 2; pass++)
+    {
+        WavCatalog catalog;
+        disk_.ResetStats();
+        const uint32_t start = System::GetUs();
+        ASSERT_EQ(catalog.Init(config_), WavCatalog::Result::OK);
+        us[pass]    = System::GetUs() - start;
+        stats[pass] = disk_.GetStats();
+        EXPECT_EQ(catalog.WasLoaded(), pass == 1);
+        ASSERT_EQ(catalog.GetNumEntries(), kFiles);
+        EXPECT_EQ(catalog.GetEntry(123).GetNumFrames(), 100u + 123);
+    }
+    printf("[ BENCH    ] %d files: scan %.1f ms in %d reads and %d writes, "
+           "index %.1f ms in %d reads of %d sectors\n",
+           int(kFiles),
+           us[0] / 1000.,
+           int(stats[0].read_commands),
+           int(stats[0].write_commands),
+           us[1] / 1000.,
+           int(stats[1].read_commands),
+           int(stats[1].sectors_read));
+    EXPECT_LT(stats[1].read_commands, stats[0].read_commands / 10);
+    disk_.SetConfig(HostDiskio::Config());
+}
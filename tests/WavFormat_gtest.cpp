@@ -0,0 +1,340 @@
+#include <gtest/gtest.h>
+#include "util/wav_format.h"
+#include <algorithm>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+/** Builds the bytes of a WAV file chunk by chunk */
+struct WavBuilder
+{
+    std::vector<uint8_t> bytes;
+
+    WavBuilder()
+    {
+        Add32(kWavFileChunkId);
+        Add32(0);
+        Add32(kWavFileWaveId);
+    }
+
+    void Add16(uint16_t x)
+    {
+        bytes.push_back(x & 0xff);
+        bytes.push_back(x >> 8);
+    }
+
+    void Add32(uint32_t x)
+    {
+        Add16(x & 0xffff);
+        Add16(x >> 16);
+    }
+
+    void AddChunk(uint32_t id, const std::vector<uint8_t>& data)
+    {
+        Add32(id);
+        Add32(data.size());
+        bytes.insert(bytes.end(), data.begin(), data.end());
+        if(data.size() & 1)
+            bytes.push_back(0);
+    }
+
+    void AddFormat(uint16_t format,
+                   uint16_t channels,
+                   uint16_t bits,
+                   bool     extensible = false)
+    {
+        Add32(kWavFileSubChunk1Id);
+        Add32(extensible ? 40 : 16);
+        Add16(extensible ? uint16_t(WAVE_FORMAT_EXTENSIBLE) : format);
+        Add16(channels);
+        Add32(48000);
+        Add32(48000 * channels * bits / 8);
+        Add16(channels * bits / 8);
+        Add16(bits);
+        if(extensible)
+        {
+            Add16(22);
+            Add16(bits);
+            Add32(0x3);
+            // sub format GUID, its first two bytes are the format
+            Add16(format);
+            for(int i = 0; i < 14; i++)
+                bytes.push_back(0);
+        }
+    }
+
+    void AddData(const std::vector<uint8_t>& data)
+    {
+        AddChunk(kWavFileSubChunk2Id, data);
+    }
+};
+
+} // namespace
+
+TEST(util_WavFormat, a_plainHeader)
+{
+    WavBuilder wav;
+    wav.AddFormat(WAVE_FORMAT_PCM, 2, 16);
+    wav.AddData(std::vector<uint8_t>(400));
+
+    WavFormatInfo info;
+    ASSERT_TRUE(ParseWavHeader(wav.bytes.data(), wav.bytes.size(), &info));
+    EXPECT_EQ(info.sample_format, WavSampleFormat::PCM16);
+    EXPECT_EQ(info.channels, 2);
+    EXPECT_EQ(info.samplerate, 48000u);
+    EXPECT_EQ(info.block_align, 4);
+    EXPECT_EQ(info.data_offset, 44u);
+    EXPECT_EQ(info.data_size, 400u);
+
+    // only the header has to be in the buffer
+    EXPECT_TRUE(ParseWavHeader(wav.bytes.data(), 44, &info));
+    EXPECT_FALSE(ParseWavHeader(wav.bytes.data(), 43, &info));
+}
+
+TEST(util_WavFormat, b_chunksBeforeData)
+{
+    // an odd sized chunk is padded, the sample data starts after it
+    WavBuilder wav;
+    wav.AddChunk(0x5453494c, std::vector<uint8_t>(27, 'x')); // "LIST"
+    wav.AddFormat(WAVE_FORMAT_PCM, 1, 24);
+    wav.AddChunk(0x74636166, std::vector<uint8_t>(4)); // "fact"
+    wav.AddData(std::vector<uint8_t>(30));
+
+    WavFormatInfo info;
+    ASSERT_TRUE(ParseWavHeader(wav.bytes.data(), wav.bytes.size(), &info));
+    EXPECT_EQ(info.sample_format, WavSampleFormat::PCM24);
+    EXPECT_EQ(info.block_align, 3);
+    EXPECT_EQ(info.data_offset, 12u + 8 + 28 + 24 + 12 + 8);
+    EXPECT_EQ(info.data_size, 30u);
+}
+
+TEST(util_WavFormat, c_formats)
+{
+    struct Case
+    {
+        uint16_t        format;
+        uint16_t        bits;
+        bool            extensible;
+        WavSampleFormat expected;
+    };
+    const Case cases[] = {
+        {WAVE_FORMAT_PCM, 16, true, WavSampleFormat::PCM16},
+        {WAVE_FORMAT_PCM, 24, true, WavSampleFormat::PCM24},
+        {WAVE_FORMAT_PCM, 32, false, WavSampleFormat::PCM32},
+        {WAVE_FORMAT_IEEE_FLOAT, 32, false, WavSampleFormat::FLOAT32},
+        {WAVE_FORMAT_IEEE_FLOAT, 32, true, WavSampleFormat::FLOAT32},
+        {WAVE_FORMAT_PCM, 8, false, WavSampleFormat::INVALID},
+        {WAVE_FORMAT_IEEE_FLOAT, 64, false, WavSampleFormat::INVALID},
+        {WAVE_FORMAT_ULAW, 8, false, WavSampleFormat::INVALID},
+    };
+    for(const Case& c : cases)
+    {
+        WavBuilder wav;
+        wav.AddFormat(c.format, 6, c.bits, c.extensible);
+        wav.AddData(std::vector<uint8_t>(48));
+        WavFormatInfo info;
+        const bool    ok
+            = ParseWavHeader(wav.bytes.data(), wav.bytes.size(), &info);
+        EXPECT_EQ(ok, c.expected != WavSampleFormat::INVALID);
+        EXPECT_EQ(info.sample_format, c.expected);
+        if(ok)
+        {
+            EXPECT_EQ(info.channels, 6);
+        }
+    }
+}
+
+TEST(util_WavFormat, d_invalidHeaders)
+{
+    WavFormatInfo info;
+    // not RIFF/WAVE
+    WavBuilder wav;
+    wav.AddFormat(WAVE_FORMAT_PCM, 2, 16);
+    wav.AddData(std::vector<uint8_t>(8));
+    std::vector<uint8_t> bytes = wav.bytes;
+    bytes[8]                   = 'X';
+    EXPECT_FALSE(ParseWavHeader(bytes.data(), bytes.size(), &info));
+
+    // no format before the data
+    WavBuilder no_format;
+    no_format.AddData(std::vector<uint8_t>(8));
+    EXPECT_FALSE(ParseWavHeader(
+        no_format.bytes.data(), no_format.bytes.size(), &info));
+
+    // block align doesn't match the channels
+    bytes     = wav.bytes;
+    bytes[32] = 3;
+    EXPECT_FALSE(ParseWavHeader(bytes.data(), bytes.size(), &info));
+}
+
+TEST(util_WavFormat, e_decode)
+{
+    const int16_t  pcm16[] = {-32768, 16384};
+    const uint8_t  pcm24[] = {0x00, 0x00, 0x80, 0x00, 0x00, 0x40};
+    const int32_t  pcm32[] = {INT32_MIN, 0x40000000};
+    const float    f32[]   = {-1.f, 0.5f};
+    const uint8_t* p16     = reinterpret_cast<const uint8_t*>(pcm16);
+    const uint8_t* p32     = reinterpret_cast<const uint8_t*>(pcm32);
+    const uint8_t* pf      = reinterpret_cast<const uint8_t*>(f32);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM16>(p16), -1.f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM16>(p16 + 2), 0.5f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM24>(pcm24), -1.f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM24>(pcm24 + 3),
+                    0.5f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM32>(p32), -1.f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::PCM32>(p32 + 4), 0.5f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::FLOAT32>(pf), -1.f);
+    EXPECT_FLOAT_EQ(DecodeWavSample<WavSampleFormat::FLOAT32>(pf + 4), 0.5f);
+}
+
+TEST(util_WavFormat, f_mixFrames)
+{
+    float  left[4]  = {1.f, 1.f, 1.f, 1.f};
+    float  right[4] = {};
+    float* out[]    = {left, right};
+
+    // mono goes to both outputs, added with the gain at the offset
+    const int16_t mono[] = {16384, -16384};
+    MixWavFrames(WavSampleFormat::PCM16,
+                 reinterpret_cast<const uint8_t*>(mono),
+                 1,
+                 2,
+                 out,
+                 2,
+                 1,
+                 0.5f);
+    EXPECT_FLOAT_EQ(left[0], 1.f);
+    EXPECT_FLOAT_EQ(left[1], 1.25f);
+    EXPECT_FLOAT_EQ(left[2], 0.75f);
+    EXPECT_FLOAT_EQ(left[3], 1.f);
+    EXPECT_FLOAT_EQ(right[1], 0.25f);
+    EXPECT_FLOAT_EQ(right[2], -0.25f);
+
+    // the channels of a file with more channels than outputs are dropped
+    const float quad[] = {0.1f, 0.2f, 0.3f, 0.4f, 0.5f, 0.6f, 0.7f, 0.8f};
+    float       a[2]   = {}, b[2] = {};
+    float*      two[]  = {a, b};
+    MixWavFrames(WavSampleFormat::FLOAT32,
+                 reinterpret_cast<const uint8_t*>(quad),
+                 4,
+                 2,
+                 two,
+                 2,
+                 0,
+                 1.f);
+    EXPECT_FLOAT_EQ(a[0], 0.1f);
+    EXPECT_FLOAT_EQ(b[0], 0.2f);
+    EXPECT_FLOAT_EQ(a[1], 0.5f);
+    EXPECT_FLOAT_EQ(b[1], 0.6f);
+
+    // a stereo file to one output only uses its first channel
+    const uint8_t stereo24[] = {0, 0, 0x40, 0, 0, 0x20};
+    float         c[1]       = {};
+    float*        one[]      = {c};
+    MixWavFrames(WavSampleFormat::PCM24, stereo24, 2, 1, one, 1, 0, 1.f);
+    EXPECT_FLOAT_EQ(c[0], 0.5f);
+
+    // unknown formats are ignored
+    MixWavFrames(WavSampleFormat::INVALID, stereo24, 2, 1, one, 1, 0, 1.f);
+    EXPECT_FLOAT_EQ(c[0], 0.5f);
+}
+
+TEST(util_WavFormat, g_loopPoints)
+{
+    // the "smpl" chunk usually comes after the sample data
+    WavBuilder wav;
+    wav.AddFormat(WAVE_FORMAT_PCM, 2, 16);
+    wav.AddData(std::vector<uint8_t>(4000));
+    const size_t smpl_start = wav.bytes.size();
+    wav.Add32(kWavFileSampleChunkId);
+    wav.Add32(36 + 24);
+    const uint32_t smpl[] = {0, 0, 20833, 64, 0, 0, 0, 1, 0,
+                             0, 1, 100, 899, 0, 0};
+    for(uint32_t x : smpl)
+        wav.Add32(x);
+
+    // only the chunk headers, "fmt " and "smpl" are read
+    size_t bytes_read = 0;
+    auto   read = [&](uint32_t offset, void* dst, uint32_t size) {
+        if(offset + size > wav.bytes.size())
+            return false;
+        memcpy(dst, wav.bytes.data() + offset, size);
+        bytes_read += size;
+        return true;
+    };
+    WavFormatInfo info;
+    WavLoopInfo   loop;
+    ASSERT_TRUE(ParseWavFile(read, wav.bytes.size(), &info, &loop));
+    EXPECT_EQ(bytes_read, 12u + 8 + 16 + 8 + 8 + 60);
+    EXPECT_EQ(info.data_offset, 44u);
+    EXPECT_EQ(info.data_size, 4000u);
+    EXPECT_TRUE(loop.valid);
+    EXPECT_EQ(loop.type, 1);
+    EXPECT_EQ(loop.root_note, 64);
+    EXPECT_EQ(loop.start, 100u);
+    EXPECT_EQ(loop.end, 899u);
+
+    // without loops in the chunk, or without the chunk
+    std::vector<uint8_t> bytes = wav.bytes;
+    bytes[smpl_start + 8 + 28] = 0;
+    auto read_bytes = [&](uint32_t offset, void* dst, uint32_t size) {
+        if(offset + size > bytes.size())
+            return false;
+        memcpy(dst, bytes.data() + offset, size);
+        return true;
+    };
+    ASSERT_TRUE(ParseWavFile(read_bytes, bytes.size(), &info, &loop));
+    EXPECT_FALSE(loop.valid);
+    EXPECT_EQ(loop.root_note, 64);
+    ASSERT_TRUE(ParseWavFile(read_bytes, smpl_start, &info, &loop));
+    EXPECT_FALSE(loop.valid);
+    EXPECT_EQ(loop.root_note, 60);
+
+    // a data chunk that claims to be longer than the file ends the walk
+    bytes = wav.bytes;
+    bytes[43] = 0x7f;
+    ASSERT_TRUE(ParseWavFile(read_bytes, bytes.size(), &info, &loop));
+    EXPECT_FALSE(loop.valid);
+}
+
+TEST(util_WavFormat, h_encode)
+{
+    const WavSampleFormat formats[] = {WavSampleFormat::PCM16,
+                                       WavSampleFormat::PCM24,
+                                       WavSampleFormat::PCM32,
+                                       WavSampleFormat::FLOAT32};
+    const float  left[]  = {0.f, 0.5f, -0.25f, 1.5f};
+    const float  right[] = {-1.f, 0.125f, 0.75f, -2.f};
+    const float* in[]    = {left, right};
+    for(WavSampleFormat format : formats)
+    {
+        const size_t         bytes = GetWavSampleSize(format);
+        std::vector<uint8_t> frames(4 * 2 * bytes);
+        // in two parts, from an offset in the buffers
+        EncodeWavFrames(format, in, 2, 0, 1, frames.data());
+        EncodeWavFrames(format, in, 2, 1, 3, frames.data() + 2 * bytes);
+
+        float  l[4]  = {}, r[4] = {};
+        float* out[] = {l, r};
+        MixWavFrames(format, frames.data(), 2, 4, out, 2, 0, 1.f);
+        const float tolerance = format == WavSampleFormat::PCM16 ? 1e-4f
+                                                                  : 1e-6f;
+        for(size_t i = 0; i < 3; i++)
+        {
+            EXPECT_NEAR(l[i], left[i], tolerance);
+            EXPECT_NEAR(r[i], right[i], tolerance);
+        }
+        // PCM is clipped, float isn't
+        const bool pcm = format != WavSampleFormat::FLOAT32;
+        EXPECT_NEAR(l[3], pcm ? 1.f : 1.5f, tolerance);
+        EXPECT_NEAR(r[3], pcm ? -1.f : -2.f, tolerance);
+
+        // interleaved samples encode the same
+        const float          interleaved[] = {0.f, -1.f, 0.5f, 0.125f};
+        std::vector<uint8_t> same(2 * 2 * bytes);
+        EncodeWavSamples(format, interleaved, 4, same.data());
+        EXPECT_TRUE(std::equal(same.begin(), same.end(), frames.begin()));
+    }
+}
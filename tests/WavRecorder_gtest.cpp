@@ -0,0 +1,281 @@
+#include <gtest/gtest.h>
+#include "util/WavRecorder.h"
+#include "DiskImageTest.h"
+#include "sys/system.h"
+#include <algorithm>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+const size_t kBlockSize = 48;
+const size_t kBlockUs   = 1000;
+
+float Input(size_t frame, size_t channel)
+{
+    return float(int((frame * 37 + channel * 1001) % 2000) - 1000) / 1024.f;
+}
+
+/** Reads a whole file */
+std::vector<uint8_t> ReadFile(const char* path)
+{
+    std::vector<uint8_t> bytes;
+    FIL                  file;
+    if(f_open(&file, path, FA_READ) != FR_OK)
+        return bytes;
+    bytes.resize(f_size(&file));
+    UINT bytes_read = 0;
+    if(f_read(&file, bytes.data(), bytes.size(), &bytes_read) != FR_OK)
+        bytes.clear();
+    f_close(&file);
+    return bytes;
+}
+
+class util_WavRecorder : public FormattedDiskTest
+{
+};
+
+} // namespace
+
+TEST_F(util_WavRecorder, a_recordsEveryFormat)
+{
+    const WavSampleFormat formats[] = {WavSampleFormat::PCM16,
+                                       WavSampleFormat::PCM24,
+                                       WavSampleFormat::PCM32,
+                                       WavSampleFormat::FLOAT32};
+    const uint16_t        channels[] = {1, 2, 6};
+    const size_t          kFrames    = 10000;
+
+    // aligned blocks, which aren't for the heap before C++17
+    using Recorder = WavRecorder<4096, 3>;
+    static Recorder recorder_object;
+    Recorder* const recorder = &recorder_object;
+    for(WavSampleFormat format : formats)
+    {
+        for(uint16_t num_channels : channels)
+        {
+            Recorder::Config config;
+            config.format   = format;
+            config.channels = num_channels;
+            ASSERT_EQ(recorder->Init(config), Recorder::Result::OK);
+            ASSERT_EQ(recorder->Open("0:/rec.wav"), Recorder::Result::OK);
+
+            // odd sized blocks, which don't fill the blocks evenly
+            std::vector<float>        samples(num_channels * 37);
+            std::vector<const float*> in(num_channels);
+            for(size_t c = 0; c < num_channels; c++)
+                in[c] = &samples[c * 37];
+            for(size_t frame = 0; frame < kFrames; frame += 37)
+            {
+                const size_t num = std::min<size_t>(37, kFrames - frame);
+                for(size_t c = 0; c < num_channels; c++)
+                    for(size_t i = 0; i < num; i++)
+                        samples[c * 37 + i] = Input(frame + i, c);
+                recorder->Record(in.data(), num);
+                ASSERT_EQ(recorder->Write(), Recorder::Result::OK);
+            }
+            EXPECT_EQ(recorder->GetLengthFrames(), kFrames);
+            ASSERT_EQ(recorder->Close(), Recorder::Result::OK);
+            EXPECT_EQ(recorder->GetStats().dropped_frames, 0u);
+
+            const std::vector<uint8_t> bytes = ReadFile("0:/rec.wav");
+            const size_t frame_size = num_channels * GetWavSampleSize(format);
+            ASSERT_EQ(bytes.size(), 512 + kFrames * frame_size);
+            WavFormatInfo info;
+            ASSERT_TRUE(ParseWavHeader(bytes.data(), bytes.size(), &info));
+            EXPECT_EQ(info.sample_format, format);
+            EXPECT_EQ(info.channels, num_channels);
+            EXPECT_EQ(info.samplerate, 48000u);
+            EXPECT_EQ(info.data_offset, 512u);
+            EXPECT_EQ(info.data_size, kFrames * frame_size);
+
+            std::vector<float>  decoded(num_channels * kFrames, 0.f);
+            std::vector<float*> out(num_channels);
+            for(size_t c = 0; c < num_channels; c++)
+                out[c] = &decoded[c * kFrames];
+            MixWavFrames(format,
+                         bytes.data() + 512,
+                         num_channels,
+                         kFrames,
+                         out.data(),
+                         num_channels,
+                         0,
+                         1.f);
+            const float tolerance
+                = format == WavSampleFormat::PCM16 ? 1e-4f : 1e-6f;
+            for(size_t c = 0; c < num_channels; c++)
+                for(size_t i = 0; i < kFrames; i++)
+                    ASSERT_NEAR(
+                        decoded[c * kFrames + i], Input(i, c), tolerance)
+                        << "at frame " << i << " of channel " << c;
+        }
+    }
+}
+
+TEST_F(util_WavRecorder, b_recordsInterleaved)
+{
+    using Recorder = WavRecorder<4096, 2>;
+    static Recorder  recorder;
+    Recorder::Config config;
+    config.format = WavSampleFormat::PCM16;
+    ASSERT_EQ(recorder.Init(config), Recorder::Result::OK);
+    ASSERT_EQ(recorder.Open("0:/inter.wav"), Recorder::Result::OK);
+    float frames[2 * kBlockSize];
+    for(size_t b = 0; b < 100; b++)
+    {
+        for(size_t i = 0; i < kBlockSize; i++)
+        {
+            frames[2 * i]     = Input(b * kBlockSize + i, 0);
+            frames[2 * i + 1] = Input(b * kBlockSize + i, 1);
+        }
+        recorder.RecordInterleaved(frames, kBlockSize);
+        recorder.Write();
+    }
+    ASSERT_EQ(recorder.Close(), Recorder::Result::OK);
+
+    const std::vector<uint8_t> bytes = ReadFile("0:/inter.wav");
+    ASSERT_EQ(bytes.size(), 512 + 100 * kBlockSize * 4);
+    for(size_t i = 0; i < 100 * kBlockSize; i++)
+    {
+        const uint8_t* p = bytes.data() + 512 + i * 4;
+        ASSERT_NEAR(DecodeWavSample<WavSampleFormat::PCM16>(p),
+                    Input(i, 0),
+                    1e-4f);
+        ASSERT_NEAR(DecodeWavSample<WavSampleFormat::PCM16>(p + 2),
+                    Input(i, 1),
+                    1e-4f);
+    }
+}
+
+/** Ten seconds of 24-bit stereo on a simulated SD card, in a file that
+ *  grows while recording, and in a preallocated file. Reports the write
+ *  commands, and the longest block write.
+ */
+TEST_F(util_WavRecorder, c_benchmarkPreallocation)
+{
+    using Recorder = WavRecorder<16384, 4>;
+    static Recorder           recorder_object;
+    Recorder* const           recorder = &recorder_object;
+    HostDiskio::Config        card = HostDiskio::Config::SdCard();
+    card.stall_interval            = 0;
+    disk_.SetConfig(card);
+
+    float        left[kBlockSize] = {}, right[kBlockSize] = {};
+    const float* in[2]            = {left, right};
+    uint32_t     write_commands[2];
+    for(int preallocate = 0; preallocate < 2; preallocate++)
+    {
+        Recorder::Config config;
+        config.max_seconds = preallocate ? 20.f : 0.f;
+        ASSERT_EQ(recorder->Init(config), Recorder::Result::OK);
+        ASSERT_EQ(recorder->Open(preallocate ? "0:/pre.wav" : "0:/grow.wav"),
+                  Recorder::Result::OK);
+        EXPECT_EQ(recorder->GetStats().preallocated, preallocate == 1);
+
+        disk_.ResetStats();
+        for(size_t b = 0; b < 10000; b++)
+        {
+            recorder->Record(in, kBlockSize);
+            ASSERT_EQ(recorder->Write(), Recorder::Result::OK);
+        }
+        const uint32_t data_sectors
+            = recorder->GetStats().blocks_written * recorder->GetBlockSize()
+              / 512;
+        write_commands[preallocate] = disk_.GetStats().write_commands;
+        printf("[ BENCH    ] 10 s 24-bit stereo, %s: %d write commands "
+               "(%d sectors of audio in %d sectors), longest block write "
+               "%.2f ms\n",
+               preallocate ? "preallocated" : "growing     ",
+               int(disk_.GetStats().write_commands),
+               int(data_sectors),
+               int(disk_.GetStats().sectors_written),
+               recorder->GetStats().max_write_us / 1000.);
+        ASSERT_EQ(recorder->Close(), Recorder::Result::OK);
+    }
+    EXPECT_LE(write_commands[1], write_commands[0]);
+
+    // the allocation was cut to the recording
+    FILINFO info;
+    ASSERT_EQ(f_stat("0:/pre.wav", &info), FR_OK);
+    EXPECT_EQ(info.fsize, 512u + 10000 * kBlockSize * 6);
+    disk_.SetConfig(HostDiskio::Config());
+}
+
+namespace
+{
+/** Audio callbacks of a recorder that are run on time */
+template <typename Recorder>
+struct RecordingClock
+{
+    Recorder* recorder;
+    size_t    blocks;
+    size_t    num_blocks;
+
+    /** Records the blocks that were due by now */
+    static void Run(void* context)
+    {
+        RecordingClock& clock = *static_cast<RecordingClock*>(context);
+        float           silence[kBlockSize] = {};
+        const float*    in[2]               = {silence, silence};
+        while(clock.blocks < clock.num_blocks
+              && clock.blocks * kBlockUs <= System::GetUs())
+        {
+            clock.recorder->Record(in, kBlockSize);
+            clock.blocks++;
+        }
+    }
+};
+
+/** Recording while the card stalls now and then, like it does when it
+ *  erases. The audio callback runs every 1ms of simulated time, also
+ *  during the commands of the card, and the main loop calls Write() in
+ *  between. Reports the frames dropped with queues of different depths.
+ */
+template <size_t kBlockBytes, size_t kNumBlocks>
+uint32_t RecordWithStalls(HostDiskio& disk, const char* path)
+{
+    using Recorder = WavRecorder<kBlockBytes, kNumBlocks>;
+    static Recorder           recorder;
+    typename Recorder::Config config;
+    config.max_seconds = 10.f;
+    recorder.Init(config);
+    EXPECT_EQ(recorder.Open(path), Recorder::Result::OK);
+
+    // five seconds
+    RecordingClock<Recorder> clock = {&recorder, 0, 5000};
+    disk.SetConfig(HostDiskio::Config::SdCard());
+    disk.SetCommandCallback(RecordingClock<Recorder>::Run, &clock);
+    System::SetUsForUnitTest(0);
+    while(clock.blocks < clock.num_blocks)
+    {
+        RecordingClock<Recorder>::Run(&clock);
+        const uint32_t written = recorder.GetStats().blocks_written;
+        recorder.Write();
+        if(recorder.GetStats().blocks_written == written)
+            System::SetUsForUnitTest(clock.blocks * kBlockUs);
+    }
+    disk.SetCommandCallback(nullptr, nullptr);
+    disk.SetConfig(HostDiskio::Config());
+    recorder.Close();
+
+    const typename Recorder::Stats& stats = recorder.GetStats();
+    printf("[ BENCH    ] %d x %5d byte queue (%.0f ms): %d frames dropped, "
+           "longest block write %.1f ms, %d blocks queued at most\n",
+           int(kNumBlocks),
+           int(recorder.GetBlockSize()),
+           (kNumBlocks - 1) * recorder.GetBlockSize() / 6 / 48.,
+           int(stats.dropped_frames),
+           stats.max_write_us / 1000.,
+           int(stats.max_queued));
+    return stats.dropped_frames;
+}
+
+} // namespace
+
+TEST_F(util_WavRecorder, d_benchmarkQueueDepthAgainstStalls)
+{
+    EXPECT_GT((RecordWithStalls<4096, 2>(disk_, "0:/shallow.wav")), 0u);
+    RecordWithStalls<16384, 2>(disk_, "0:/medium.wav");
+    EXPECT_EQ((RecordWithStalls<16384, 4>(disk_, "0:/deep.wav")), 0u);
+}
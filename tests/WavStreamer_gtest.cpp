@@ -0,0 +1,287 @@
+#include <gtest/gtest.h>
+#include "hid/wav_streamer.h"
+#include "DiskImageTest.h"
+#include "sys/system.h"
+#include <chrono>
+#include <memory>
+#include <vector>
+
+using namespace daisy;
+
+namespace
+{
+const size_t kBlockSize = 48;
+const size_t kBlockUs   = 1000;
+
+using Streamer = WavStreamer<1, 8192>;
+
+int16_t Sample(uint32_t frame, size_t channel, uint32_t seed)
+{
+    return int16_t(frame * 7 + channel * 12345 + seed * 1000);
+}
+
+/** Writes a 16-bit file with a 44 byte header, so that the sample data
+ *  doesn't start on a sector
+ */
+void WriteWav(const char* path, size_t channels, uint32_t frames, uint32_t seed)
+{
+    std::vector<uint8_t> bytes;
+    AddWavHeader(bytes, channels, 16, 48000, frames * channels * 2);
+    for(uint32_t i = 0; i < frames; i++)
+        for(size_t c = 0; c < channels; c++)
+            Add16(bytes, Sample(i, c, seed));
+    WriteDiskFile(path, bytes);
+}
+
+class hid_WavStreamer : public FormattedDiskTest
+{
+  protected:
+    /** Streams blocks, with a Prepare() before each, and checks them
+     *  against the file with the given seed, from a frame on. Past the end
+     *  of the file, a looping voice starts over, and the others are silent.
+     *  \return position in the file after the blocks
+     */
+    template <typename Streamer>
+    uint32_t StreamAndCheck(Streamer& streamer,
+                            uint32_t  start,
+                            uint32_t  file_frames,
+                            uint32_t  seed,
+                            bool      looping,
+                            size_t    num_blocks)
+    {
+        float    left[kBlockSize], right[kBlockSize];
+        float*   out[2] = {left, right};
+        uint32_t frame  = start;
+        for(size_t b = 0; b < num_blocks; b++)
+        {
+            streamer.Prepare();
+            streamer.Stream(out, kBlockSize);
+            for(size_t i = 0; i < kBlockSize; i++)
+            {
+                const bool  end = frame >= file_frames;
+                const float l   = end ? 0.f : Sample(frame, 0, seed);
+                const float r   = end ? 0.f : Sample(frame, 1, seed);
+                EXPECT_EQ(left[i], l / 32768.f) << "at frame " << frame;
+                EXPECT_EQ(right[i], r / 32768.f) << "at frame " << frame;
+                if(++frame == file_frames && looping)
+                    frame = 0;
+            }
+        }
+        return frame;
+    }
+};
+
+} // namespace
+
+TEST_F(hid_WavStreamer, a_streamsAFileToTheEnd)
+{
+    const uint32_t kFrames = 20000;
+    WriteWav("0:/a.wav", 2, kFrames, 0);
+
+    std::unique_ptr<Streamer> streamer(new Streamer);
+    streamer->Init();
+    ASSERT_EQ(streamer->Open(0, "0:/a.wav"), Streamer::Result::OK);
+    EXPECT_EQ(streamer->GetFormat(0).channels, 2u);
+    EXPECT_EQ(streamer->GetBufferedFrames(0), 8192u / 4);
+    streamer->Play(0);
+
+    float  left[kBlockSize], right[kBlockSize];
+    float* out[2]    = {left, right};
+    size_t streamed  = 0;
+    while(streamer->IsPlaying(0))
+    {
+        streamer->Prepare();
+        streamer->Stream(out, kBlockSize);
+        for(size_t i = 0; i < kBlockSize; i++, streamed++)
+        {
+            const float l = streamed < kFrames ? Sample(streamed, 0, 0) : 0;
+            const float r = streamed < kFrames ? Sample(streamed, 1, 0) : 0;
+            ASSERT_EQ(left[i], l / 32768.f) << "at frame " << streamed;
+            ASSERT_EQ(right[i], r / 32768.f) << "at frame " << streamed;
+        }
+    }
+    EXPECT_GE(streamed, kFrames);
+    EXPECT_LT(streamed, kFrames + kBlockSize);
+    EXPECT_EQ(streamer->GetStats(0).underruns, 0u);
+    EXPECT_EQ(streamer->GetStats(0).bytes_read, kFrames * 4);
+}
+
+TEST_F(hid_WavStreamer, b_loopsAndSeeks)
+{
+    const uint32_t kFrames = 5000;
+    WriteWav("0:/b.wav", 2, kFrames, 1);
+
+    std::unique_ptr<Streamer> streamer(new Streamer);
+    streamer->Init();
+    ASSERT_EQ(streamer->Open(0, "0:/b.wav"), Streamer::Result::OK);
+    streamer->SetLooping(0, true);
+    streamer->Play(0);
+
+    // two and a half times through the file
+    const uint32_t end = StreamAndCheck(*streamer, 0, kFrames, 1, true, 260);
+    EXPECT_EQ(end, 260 * kBlockSize % kFrames);
+    EXPECT_TRUE(streamer->IsPlaying(0));
+
+    ASSERT_EQ(streamer->Seek(0, 3333), Streamer::Result::OK);
+    EXPECT_TRUE(streamer->IsPlaying(0));
+    StreamAndCheck(*streamer, 3333, kFrames, 1, true, 100);
+    EXPECT_EQ(streamer->GetStats(0).underruns, 0u);
+}
+
+TEST_F(hid_WavStreamer, c_seeksWithLinkMaps)
+{
+    const uint32_t kFrames = 60000;
+    WriteWav("0:/c.wav", 2, kFrames, 2);
+
+    DWORD            pool[256];
+    FatFSLinkMapPool link_maps;
+    link_maps.Init(pool, 256);
+    std::unique_ptr<Streamer> streamer(new Streamer);
+    Streamer::Config          config;
+    config.link_maps = &link_maps;
+    streamer->Init(config);
+    ASSERT_EQ(streamer->Open(0, "0:/c.wav"), Streamer::Result::OK);
+    EXPECT_LT(link_maps.GetFreeWords(), 256u);
+
+    // the first seek plays to the end, which stops the voice
+    const uint32_t positions[] = {59000, 10, 31234, 0, 45678};
+    for(uint32_t position : positions)
+    {
+        ASSERT_EQ(streamer->Seek(0, position), Streamer::Result::OK);
+        streamer->Play(0);
+        StreamAndCheck(*streamer, position, kFrames, 2, false, 30);
+    }
+    // and one when the file was opened
+    EXPECT_EQ(link_maps.GetSeekStats().count, 6u);
+    streamer->Close(0);
+    EXPECT_EQ(link_maps.GetFreeWords(), 256u);
+}
+
+namespace
+{
+using Clock = std::chrono::steady_clock;
+
+/** Audio callbacks of a streamer that are run on time */
+template <typename Streamer>
+struct StreamingClock
+{
+    Streamer* streamer;
+    size_t    blocks;
+    size_t    num_blocks;
+    double    stream_sec;
+
+    /** Streams the blocks that were due by now */
+    static void Run(void* context)
+    {
+        StreamingClock& clock = *static_cast<StreamingClock*>(context);
+        float           left[kBlockSize], right[kBlockSize];
+        float*          out[2] = {left, right};
+        while(clock.blocks < clock.num_blocks
+              && clock.blocks * kBlockUs <= System::GetUs())
+        {
+            const auto start = Clock::now();
+            clock.streamer->Stream(out, kBlockSize);
+            clock.stream_sec
+                += std::chrono::duration<double>(Clock::now() - start).count();
+            clock.blocks++;
+        }
+    }
+};
+
+} // namespace
+
+/** Eight stereo voices on a simulated SD card. The audio callback runs
+ *  every 1ms of simulated time, also during the commands of the card, and
+ *  the main loop calls Prepare() in between. Reports the underruns, the
+ *  lowest buffer level, how busy the card is, and the CPU time per block
+ *  on the host, for a few read sizes.
+ */
+TEST_F(hid_WavStreamer, d_benchmarkEightVoices)
+{
+    const size_t   kVoices = 8;
+    const uint32_t kFrames = 48000;
+    char           path[16];
+    for(size_t v = 0; v < kVoices; v++)
+    {
+        snprintf(path, sizeof(path), "0:/v%d.wav", int(v));
+        WriteWav(path, 2, kFrames, v);
+    }
+
+    using Streamer8           = WavStreamer<kVoices, 16384>;
+    const size_t read_sizes[] = {512, 2048, 4096, 8192};
+    for(size_t read_size : read_sizes)
+    {
+        std::unique_ptr<Streamer8> streamer(new Streamer8);
+        Streamer8::Config          config;
+        config.read_size = read_size;
+        streamer->Init(config);
+        for(size_t v = 0; v < kVoices; v++)
+        {
+            snprintf(path, sizeof(path), "0:/v%d.wav", int(v));
+            ASSERT_EQ(streamer->Open(v, path), Streamer8::Result::OK);
+            streamer->SetLooping(v, true);
+            streamer->SetGain(v, 1.f / kVoices);
+            streamer->Play(v);
+        }
+
+        // two seconds
+        StreamingClock<Streamer8> clock = {streamer.get(), 0, 2000, 0.};
+        disk_.SetConfig(HostDiskio::Config::SdCard());
+        disk_.SetCommandCallback(StreamingClock<Streamer8>::Run, &clock);
+        disk_.ResetStats();
+        System::SetUsForUnitTest(0);
+        double prepare_sec = 0;
+        while(clock.blocks < clock.num_blocks)
+        {
+            StreamingClock<Streamer8>::Run(&clock);
+            const double stream_sec = clock.stream_sec;
+            const auto   start      = Clock::now();
+            const size_t bytes      = streamer->Prepare();
+            prepare_sec
+                += std::chrono::duration<double>(Clock::now() - start).count()
+                   - (clock.stream_sec - stream_sec);
+            if(bytes == 0) // idle until the next callback
+                System::SetUsForUnitTest(clock.blocks * kBlockUs);
+        }
+        disk_.SetCommandCallback(nullptr, nullptr);
+        disk_.SetConfig(HostDiskio::Config());
+
+        uint32_t underruns = 0, min_frames = UINT32_MAX;
+        for(size_t v = 0; v < kVoices; v++)
+        {
+            underruns += streamer->GetStats(v).underruns;
+            if(streamer->GetStats(v).min_frames < min_frames)
+                min_frames = streamer->GetStats(v).min_frames;
+        }
+        const HostDiskio::Stats& stats = disk_.GetStats();
+        printf("[ BENCH    ] 8 voices, %5d byte reads: %d underruns, "
+               "min %d frames buffered, card busy %.1f%% in %d commands, "
+               "Stream() %.2f us/block, Prepare() %.2f us/block\n",
+               int(read_size),
+               int(underruns),
+               int(min_frames),
+               100. * stats.busy_us / System::GetUs(),
+               int(stats.read_commands),
+               1e6 * clock.stream_sec / clock.blocks,
+               1e6 * prepare_sec / clock.blocks);
+        if(read_size >= 4096)
+        {
+            EXPECT_EQ(underruns, 0u);
+        }
+    }
+}
+
+TEST_F(hid_WavStreamer, e_readsAsLargeAsTheBuffer)
+{
+    const uint32_t kFrames = 20000;
+    WriteWav("0:/e.wav", 2, kFrames, 4);
+
+    // the default read size fills the whole ring
+    using SmallStreamer = WavStreamer<1, 4096>;
+    std::unique_ptr<SmallStreamer> streamer(new SmallStreamer);
+    streamer->Init();
+    ASSERT_EQ(streamer->Open(0, "0:/e.wav"), SmallStreamer::Result::OK);
+    streamer->Play(0);
+    StreamAndCheck(*streamer, 0, kFrames, 4, false, kFrames / kBlockSize);
+    EXPECT_EQ(streamer->GetStats(0).underruns, 0u);
+}
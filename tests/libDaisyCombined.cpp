@@ -5,3 +5,9 @@
 #include "util/oled_fonts.c"
 #include "per/qspi.cpp"
 #include "hid/midi_parser.cpp"
+#include "hid/midi_ump.cpp"
+#include "per/sai.cpp"
+#include "hid/audio.cpp"
+#include "sys/fatfs_linkmap.cpp"
+#include "hid/wav_catalog.cpp"
+#include "util/host_diskio.cpp"